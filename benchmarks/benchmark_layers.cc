@@ -0,0 +1,2386 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <functional>
+#include <getopt.h>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <string>
+#include <thread>
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <vector>
+
+#include "../examples/device_ptr.h"
+#include "haste.h"
+#include "perf_counters.h"
+
+using std::string;
+using std::vector;
+
+using Tensor1 = Eigen::Tensor<float, 1>;
+using Tensor2 = Eigen::Tensor<float, 2>;
+using Tensor3 = Eigen::Tensor<float, 3>;
+using Array = Eigen::ArrayXXf;
+using Matrix = Eigen::MatrixXf;
+using MatrixMap = Eigen::Map<Matrix>;
+using ConstMatrixMap = Eigen::Map<const Matrix>;
+using ConstVectorMap = Eigen::Map<const Eigen::VectorXf>;
+
+static constexpr int DEFAULT_SAMPLE_SIZE = 10;
+static constexpr int DEFAULT_TIME_STEPS = 50;
+static constexpr int DEFAULT_THREADS = 1;
+
+static cublasHandle_t g_blas_handle;
+
+// When set, host performance counters are read around every timed loop and the counts
+// per iteration of the most recent loop are left in `g_perf_values`.
+static PerfCounters* g_perf_counters;
+static PerfCounters::Values g_perf_values;
+
+float TimeLoop(std::function<void()> fn, int iterations) {
+  cudaEvent_t start, stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
+  if (g_perf_counters)
+    g_perf_counters->Start();
+  cudaEventRecord(start);
+  for (int i = 0; i < iterations; ++i)
+    fn();
+  float elapsed_ms;
+  cudaEventRecord(stop);
+  cudaEventSynchronize(stop);
+  if (g_perf_counters)
+    g_perf_values = g_perf_counters->Stop(iterations);
+  cudaEventElapsedTime(&elapsed_ms, start, stop);
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+  return elapsed_ms / iterations;
+}
+
+float TimeHostLoop(std::function<void()> fn, int iterations) {
+  if (g_perf_counters)
+    g_perf_counters->Start();
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    fn();
+  const auto stop = std::chrono::steady_clock::now();
+  if (g_perf_counters)
+    g_perf_values = g_perf_counters->Stop(iterations);
+  return std::chrono::duration<float, std::milli>(stop - start).count() / iterations;
+}
+
+// Transposes the row-major [rows,cols] device matrix `in` into the row-major [cols,rows]
+// device matrix `out`. The backward passes need `x`, `W`, and `R` in this layout so the
+// transposes are part of every training step we measure.
+void Transpose(int rows, int cols, const float* in, float* out) {
+  static const float alpha = 1.0f;
+  static const float beta = 0.0f;
+  cublasSgeam(
+      g_blas_handle,
+      CUBLAS_OP_T, CUBLAS_OP_N,
+      rows, cols,
+      &alpha,
+      in, cols,
+      &beta,
+      in, rows,
+      out, rows);
+}
+
+template<int Rank>
+void Randomize(Eigen::Tensor<float, Rank>& t, float scale) {
+  t.setRandom();
+  t = (t * 2.0f - 1.0f) * scale;
+}
+
+// The reference implementation below computes each layer's forward pass on the host
+// one time step at a time, exactly as written in the papers: no fused kernels, no
+// precomputed input projections, and no overlapping of independent work. Its matrix
+// products go through Eigen, which uses `--threads` host threads when built with OpenMP.
+
+Array Sigmoid(const Array& a) {
+  return (1.0f + (-a).exp()).inverse();
+}
+
+// Matches `layer_norm::ForwardPass`: each column of `m` is normalized independently.
+void LayerNormColumns(Matrix& m, const float* gamma, const float* beta) {
+  for (int j = 0; j < m.cols(); ++j) {
+    const float mean = m.col(j).mean();
+    const float var = (m.col(j).array() - mean).square().mean();
+    const float invstd = 1.0f / std::sqrt(var + 1e-5f);
+    for (int i = 0; i < m.rows(); ++i)
+      m(i, j) = (m(i, j) - mean) * invstd * gamma[i] + (beta ? beta[i] : 0.0f);
+  }
+}
+
+ConstMatrixMap AsMatrix(const Tensor2& t) {
+  return ConstMatrixMap(t.data(), t.dimension(0), t.dimension(1));
+}
+
+ConstVectorMap AsVector(const float* data, int size) {
+  return ConstVectorMap(data, size);
+}
+
+// Returns time step `step` of a [T,N,X] tensor as an [X,N] column-major matrix.
+ConstMatrixMap Step(const Tensor3& t, int step) {
+  const int rows = t.dimension(0);
+  const int cols = t.dimension(1);
+  return ConstMatrixMap(t.data() + step * rows * cols, rows, cols);
+}
+
+MatrixMap Step(Tensor3& t, int step) {
+  const int rows = t.dimension(0);
+  const int cols = t.dimension(1);
+  return MatrixMap(t.data() + step * rows * cols, rows, cols);
+}
+
+// One layer type at one problem size. Weights and inputs are generated on the host in
+// exactly the layout the Haste engines consume, so both implementations see the same
+// numbers. `x` is [T,N,C] and the layer output `y` is [T+1,N,H] (or [T,N,H] for
+// layer_norm), all stored as column-major Eigen tensors.
+class LayerBenchmark {
+  public:
+    LayerBenchmark(
+        int batch_size,
+        int input_size,
+        int hidden_size,
+        int time_steps,
+        int output_steps)
+        : N(batch_size),
+          C(input_size),
+          H(hidden_size),
+          T(time_steps),
+          x(input_size, batch_size, time_steps),
+          dy(hidden_size, batch_size, output_steps) {
+      Randomize(x, 1.0f);
+      Randomize(dy, 1.0f);
+    }
+
+    virtual ~LayerBenchmark() {}
+
+    Tensor3 NewOutput() const {
+      return Tensor3(dy.dimensions());
+    }
+
+    // Average time of a Haste forward pass in inference mode. The output of the last
+    // run is copied to `y`.
+    virtual float HasteInference(int sample_size, Tensor3& y) = 0;
+
+    // Average time of a Haste forward pass in training mode followed by a full backward
+    // pass, including the transposes the backward pass needs.
+    virtual float HasteTrain(int sample_size) = 0;
+
+    // Computes the forward pass with the naive host implementation.
+    virtual void ReferenceInference(Tensor3& y) const = 0;
+
+  protected:
+    // Weights are initialized uniformly in [-1/sqrt(H), 1/sqrt(H)] so that the
+    // activations stay out of saturation and the error check is meaningful.
+    float InitScale() const {
+      return 1.0f / std::sqrt(static_cast<float>(H));
+    }
+
+    const int N;
+    const int C;
+    const int H;
+    const int T;
+    Tensor3 x;
+    Tensor3 dy;
+};
+
+class LstmBenchmark : public LayerBenchmark {
+  public:
+    LstmBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size * 4, input_size),
+          R(hidden_size * 4, hidden_size),
+          b(hidden_size * 4) {
+      Randomize(W, InitScale());
+      Randomize(R, InitScale());
+      Randomize(b, InitScale());
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> c_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 4);
+
+      h_dev.zero();
+      c_dev.zero();
+
+      haste::v0::lstm::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            c_dev.data,
+            v_dev.data,
+            tmp_Rh_dev.data,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> c_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 4);
+
+      device_ptr<Tensor2> W_t_dev(C * H * 4);
+      device_ptr<Tensor2> R_t_dev(H * H * 4);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dc_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H * 4);
+      device_ptr<Tensor2> dR_dev(H * H * 4);
+      device_ptr<Tensor1> db_dev(H * 4);
+      device_ptr<Tensor2> dh_dev(N * H);
+      device_ptr<Tensor2> dc_dev(N * H);
+
+      h_dev.zero();
+      c_dev.zero();
+      dW_dev.zero();
+      dR_dev.zero();
+      db_dev.zero();
+      dh_dev.zero();
+      dc_dev.zero();
+
+      haste::v0::lstm::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::lstm::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            c_dev.data,
+            v_dev.data,
+            tmp_Rh_dev.data,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H * 4, W_dev.data, W_t_dev.data);
+        Transpose(H, H * 4, R_dev.data, R_t_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            R_t_dev.data,
+            b_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            c_dev.data,
+            dh_new_dev.data,
+            dc_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            dR_dev.data,
+            db_dev.data,
+            dh_dev.data,
+            dc_dev.data,
+            v_dev.data,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Array c = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix v = AsMatrix(W) * Step(x, t) + AsMatrix(R) * h.matrix();
+        v.colwise() += AsVector(b.data(), H * 4);
+        const Array i = Sigmoid(v.middleRows(0 * H, H).array());
+        const Array g = v.middleRows(1 * H, H).array().tanh();
+        const Array f = Sigmoid(v.middleRows(2 * H, H).array());
+        const Array o = Sigmoid(v.middleRows(3 * H, H).array());
+        c = f * c + i * g;
+        h = o * c.tanh();
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor2 R;
+    Tensor1 b;
+};
+
+class GruBenchmark : public LayerBenchmark {
+  public:
+    GruBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size * 3, input_size),
+          R(hidden_size * 3, hidden_size),
+          bx(hidden_size * 3),
+          br(hidden_size * 3) {
+      Randomize(W, InitScale());
+      Randomize(R, InitScale());
+      Randomize(bx, InitScale());
+      Randomize(br, InitScale());
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> bx_dev(bx);
+      device_ptr<Tensor1> br_dev(br);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor3> tmp_Wx_dev(T * N * H * 3);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 3);
+
+      h_dev.zero();
+
+      haste::v0::gru::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_dev.data,
+            h_dev.data,
+            v_dev.data,
+            tmp_Wx_dev.data,
+            tmp_Rh_dev.data,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> bx_dev(bx);
+      device_ptr<Tensor1> br_dev(br);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor3> tmp_Wx_dev(T * N * H * 3);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 3);
+
+      device_ptr<Tensor2> W_t_dev(C * H * 3);
+      device_ptr<Tensor2> R_t_dev(H * H * 3);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H * 3);
+      device_ptr<Tensor2> dR_dev(H * H * 3);
+      device_ptr<Tensor1> dbx_dev(H * 3);
+      device_ptr<Tensor1> dbr_dev(H * 3);
+      device_ptr<Tensor2> dh_dev(N * H);
+      device_ptr<Tensor3> dp_dev(T * N * H * 3);
+      device_ptr<Tensor3> dq_dev(T * N * H * 3);
+
+      h_dev.zero();
+      dW_dev.zero();
+      dR_dev.zero();
+      dbx_dev.zero();
+      dbr_dev.zero();
+      dh_dev.zero();
+
+      haste::v0::gru::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::gru::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_dev.data,
+            h_dev.data,
+            v_dev.data,
+            tmp_Wx_dev.data,
+            tmp_Rh_dev.data,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H * 3, W_dev.data, W_t_dev.data);
+        Transpose(H, H * 3, R_dev.data, R_t_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            R_t_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            v_dev.data,
+            dh_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            dR_dev.data,
+            dbx_dev.data,
+            dbr_dev.data,
+            dh_dev.data,
+            dp_dev.data,
+            dq_dev.data,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix Wx = AsMatrix(W) * Step(x, t);
+        Matrix Rh = AsMatrix(R) * h.matrix();
+        Wx.colwise() += AsVector(bx.data(), H * 3);
+        Rh.colwise() += AsVector(br.data(), H * 3);
+        const Array z = Sigmoid(Wx.middleRows(0 * H, H).array() + Rh.middleRows(0 * H, H).array());
+        const Array r = Sigmoid(Wx.middleRows(1 * H, H).array() + Rh.middleRows(1 * H, H).array());
+        const Array g = (Wx.middleRows(2 * H, H).array() + r * Rh.middleRows(2 * H, H).array()).tanh();
+        h = z * h + (1.0f - z) * g;
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor2 R;
+    Tensor1 bx;
+    Tensor1 br;
+};
+
+class IndrnnBenchmark : public LayerBenchmark {
+  public:
+    IndrnnBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size, input_size),
+          u(hidden_size),
+          b(hidden_size) {
+      Randomize(W, InitScale());
+      Randomize(u, 1.0f);
+      Randomize(b, InitScale());
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor1> u_dev(u);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> workspace_dev(T * N * H);
+
+      h_dev.zero();
+
+      haste::v0::indrnn::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            workspace_dev.data,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor1> u_dev(u);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> workspace_dev(T * N * H);
+
+      device_ptr<Tensor2> W_t_dev(C * H);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H);
+      device_ptr<Tensor1> du_dev(H);
+      device_ptr<Tensor1> db_dev(H);
+      device_ptr<Tensor2> dh_dev(N * H);
+
+      h_dev.zero();
+      dW_dev.zero();
+      du_dev.zero();
+      db_dev.zero();
+      dh_dev.zero();
+
+      haste::v0::indrnn::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::indrnn::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        forward.Run(
+            T,
+            W_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            workspace_dev.data,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H, W_dev.data, W_t_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            dh_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            du_dev.data,
+            db_dev.data,
+            dh_dev.data,
+            workspace_dev.data,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix a = AsMatrix(W) * Step(x, t);
+        a.colwise() += AsVector(b.data(), H);
+        h = (a.array() + h.colwise() * AsVector(u.data(), H).array()).tanh();
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor1 u;
+    Tensor1 b;
+};
+
+// Layer normalization on its own. There is no input projection so the input size is
+// the hidden size, and `x` and `y` are both [T,N,H].
+class LayerNormBenchmark : public LayerBenchmark {
+  public:
+    LayerNormBenchmark(int batch_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, hidden_size, hidden_size, time_steps, time_steps),
+          gamma(hidden_size),
+          beta(hidden_size) {
+      Randomize(gamma, 1.0f);
+      Randomize(beta, 1.0f);
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor1> gamma_dev(gamma);
+      device_ptr<Tensor1> beta_dev(beta);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> y_dev(T * N * H);
+      device_ptr<Tensor2> cache_dev(T * N * 2);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> forward(
+            T * N,
+            H,
+            gamma_dev.data,
+            beta_dev.data,
+            cache_dev.data);
+
+        forward.Run(0, x_dev.data, y_dev.data);
+      }, sample_size);
+      y_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor1> gamma_dev(gamma);
+      device_ptr<Tensor1> beta_dev(beta);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> y_dev(T * N * H);
+      device_ptr<Tensor2> cache_dev(T * N * 2);
+
+      device_ptr<Tensor3> dy_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * H);
+      device_ptr<Tensor1> dgamma_dev(H);
+      device_ptr<Tensor1> dbeta_dev(H);
+
+      dgamma_dev.zero();
+      dbeta_dev.zero();
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> forward(
+            T * N,
+            H,
+            gamma_dev.data,
+            beta_dev.data,
+            cache_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> backward(
+            T * N,
+            H,
+            gamma_dev.data,
+            beta_dev.data,
+            x_dev.data,
+            dgamma_dev.data,
+            dbeta_dev.data,
+            cache_dev.data);
+
+        forward.Run(0, x_dev.data, y_dev.data);
+        backward.Run(0, dy_dev.data, dx_dev.data);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      for (int t = 0; t < T; ++t) {
+        Matrix step = Step(x, t);
+        LayerNormColumns(step, gamma.data(), beta.data());
+        Step(y, t) = step;
+      }
+    }
+
+  private:
+    Tensor1 gamma;
+    Tensor1 beta;
+};
+
+class LayerNormLstmBenchmark : public LayerBenchmark {
+  public:
+    LayerNormLstmBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size * 4, input_size),
+          R(hidden_size * 4, hidden_size),
+          b(hidden_size * 4),
+          gamma(hidden_size * 4, 2),
+          gamma_h(hidden_size),
+          beta_h(hidden_size) {
+      Randomize(W, InitScale());
+      Randomize(R, InitScale());
+      Randomize(b, InitScale());
+      Randomize(gamma, 1.0f);
+      Randomize(gamma_h, 1.0f);
+      Randomize(beta_h, 1.0f);
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor1> gamma_h_dev(gamma_h);
+      device_ptr<Tensor1> beta_h_dev(beta_h);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> c_dev((T + 1) * N * H);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_norm_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_Rh_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Rh_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_c_norm_dev(T * N * H);
+      device_ptr<Tensor3> act_c_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 4);
+
+      h_dev.zero();
+      c_dev.zero();
+
+      haste::v0::layer_norm_lstm::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H * 4,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm2(
+            T * N,
+            H * 4,
+            gamma_dev.data + H * 4,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm3(
+            T * N,
+            H,
+            gamma_h_dev.data,
+            beta_h_dev.data,
+            act_c_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            c_dev.data,
+            act_Wx_dev.data,
+            tmp_Rh_dev.data,
+            layer_norm1,
+            act_Wx_norm_dev.data,
+            act_Rh_dev.data,
+            layer_norm2,
+            layer_norm3,
+            act_c_norm_dev.data,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor1> gamma_h_dev(gamma_h);
+      device_ptr<Tensor1> beta_h_dev(beta_h);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> c_dev((T + 1) * N * H);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_norm_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_Rh_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Rh_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_c_norm_dev(T * N * H);
+      device_ptr<Tensor3> act_c_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor2> tmp_Rh_dev(N * H * 4);
+
+      device_ptr<Tensor2> W_t_dev(C * H * 4);
+      device_ptr<Tensor2> R_t_dev(H * H * 4);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dc_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H * 4);
+      device_ptr<Tensor2> dR_dev(H * H * 4);
+      device_ptr<Tensor1> db_dev(H * 4);
+      device_ptr<Tensor2> dgamma_dev(H * 4 * 2);
+      device_ptr<Tensor1> dgamma_h_dev(H);
+      device_ptr<Tensor1> dbeta_h_dev(H);
+      device_ptr<Tensor2> dh_dev(N * H);
+      device_ptr<Tensor2> dc_dev(N * H);
+
+      h_dev.zero();
+      c_dev.zero();
+      dW_dev.zero();
+      dR_dev.zero();
+      db_dev.zero();
+      dgamma_dev.zero();
+      dgamma_h_dev.zero();
+      dbeta_h_dev.zero();
+      dh_dev.zero();
+      dc_dev.zero();
+
+      haste::v0::layer_norm_lstm::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::layer_norm_lstm::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H * 4,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm2(
+            T * N,
+            H * 4,
+            gamma_dev.data + H * 4,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm3(
+            T * N,
+            H,
+            gamma_h_dev.data,
+            beta_h_dev.data,
+            act_c_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            c_dev.data,
+            act_Wx_dev.data,
+            tmp_Rh_dev.data,
+            layer_norm1,
+            act_Wx_norm_dev.data,
+            act_Rh_dev.data,
+            layer_norm2,
+            layer_norm3,
+            act_c_norm_dev.data,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H * 4, W_dev.data, W_t_dev.data);
+        Transpose(H, H * 4, R_dev.data, R_t_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm1_grad(
+            T * N,
+            H * 4,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_dev.data,
+            dgamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm2_grad(
+            T * N,
+            H * 4,
+            gamma_dev.data + H * 4,
+            nullptr,
+            act_Rh_dev.data,
+            dgamma_dev.data + H * 4,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm3_grad(
+            T * N,
+            H,
+            gamma_h_dev.data,
+            beta_h_dev.data,
+            c_dev.data + N * H,
+            dgamma_h_dev.data,
+            dbeta_h_dev.data,
+            act_c_norm_cache_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            R_t_dev.data,
+            b_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            c_dev.data,
+            dh_new_dev.data,
+            dc_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            dR_dev.data,
+            db_dev.data,
+            dh_dev.data,
+            dc_dev.data,
+            act_Wx_dev.data,
+            layer_norm1_grad,
+            act_Wx_norm_dev.data,
+            act_Rh_dev.data,
+            layer_norm2_grad,
+            layer_norm3_grad,
+            act_c_norm_dev.data,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Array c = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix Wx = AsMatrix(W) * Step(x, t);
+        Matrix Rh = AsMatrix(R) * h.matrix();
+        LayerNormColumns(Wx, gamma.data(), nullptr);
+        LayerNormColumns(Rh, gamma.data() + H * 4, nullptr);
+        Matrix v = Wx + Rh;
+        v.colwise() += AsVector(b.data(), H * 4);
+        const Array i = Sigmoid(v.middleRows(0 * H, H).array());
+        const Array g = v.middleRows(1 * H, H).array().tanh();
+        const Array f = Sigmoid(v.middleRows(2 * H, H).array());
+        const Array o = Sigmoid(v.middleRows(3 * H, H).array());
+        c = f * c + i * g;
+        Matrix c_norm = c.matrix();
+        LayerNormColumns(c_norm, gamma_h.data(), beta_h.data());
+        h = o * c_norm.array().tanh();
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor2 R;
+    Tensor1 b;
+    Tensor2 gamma;
+    Tensor1 gamma_h;
+    Tensor1 beta_h;
+};
+
+class LayerNormGruBenchmark : public LayerBenchmark {
+  public:
+    LayerNormGruBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size * 3, input_size),
+          R(hidden_size * 3, hidden_size),
+          bx(hidden_size * 3),
+          br(hidden_size * 3),
+          gamma(hidden_size * 3, 2) {
+      Randomize(W, InitScale());
+      Randomize(R, InitScale());
+      Randomize(bx, InitScale());
+      Randomize(br, InitScale());
+      Randomize(gamma, 1.0f);
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> bx_dev(bx);
+      device_ptr<Tensor1> br_dev(br);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H * 3);
+      device_ptr<Tensor3> tmp_Wx_norm_dev(T * N * H * 3);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_Rh_dev(T * N * H * 3);
+      device_ptr<Tensor2> tmp_Rh_norm_dev(N * H * 3);
+      device_ptr<Tensor3> act_Rh_norm_cache_dev(T * N * 2);
+
+      h_dev.zero();
+
+      haste::v0::layer_norm_gru::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H * 3,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm2(
+            T * N,
+            H * 3,
+            gamma_dev.data + H * 3,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_dev.data,
+            h_dev.data,
+            v_dev.data,
+            act_Wx_dev.data,
+            layer_norm1,
+            tmp_Wx_norm_dev.data,
+            act_Rh_dev.data,
+            layer_norm2,
+            tmp_Rh_norm_dev.data,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor2> R_dev(R);
+      device_ptr<Tensor1> bx_dev(bx);
+      device_ptr<Tensor1> br_dev(br);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> v_dev(T * N * H * 4);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H * 3);
+      device_ptr<Tensor3> tmp_Wx_norm_dev(T * N * H * 3);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+      device_ptr<Tensor3> act_Rh_dev(T * N * H * 3);
+      device_ptr<Tensor2> tmp_Rh_norm_dev(N * H * 3);
+      device_ptr<Tensor3> act_Rh_norm_cache_dev(T * N * 2);
+
+      device_ptr<Tensor2> W_t_dev(C * H * 3);
+      device_ptr<Tensor2> R_t_dev(H * H * 3);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H * 3);
+      device_ptr<Tensor2> dR_dev(H * H * 3);
+      device_ptr<Tensor1> dbx_dev(H * 3);
+      device_ptr<Tensor1> dbr_dev(H * 3);
+      device_ptr<Tensor2> dgamma_dev(H * 3 * 2);
+      device_ptr<Tensor2> dh_dev(N * H);
+      device_ptr<Tensor3> dp_dev(T * N * H * 3);
+      device_ptr<Tensor3> dq_dev(T * N * H * 3);
+
+      h_dev.zero();
+      dW_dev.zero();
+      dR_dev.zero();
+      dbx_dev.zero();
+      dbr_dev.zero();
+      dgamma_dev.zero();
+      dh_dev.zero();
+
+      haste::v0::layer_norm_gru::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::layer_norm_gru::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H * 3,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::ForwardPass<float> layer_norm2(
+            T * N,
+            H * 3,
+            gamma_dev.data + H * 3,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            R_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_dev.data,
+            h_dev.data,
+            v_dev.data,
+            act_Wx_dev.data,
+            layer_norm1,
+            tmp_Wx_norm_dev.data,
+            act_Rh_dev.data,
+            layer_norm2,
+            tmp_Rh_norm_dev.data,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H * 3, W_dev.data, W_t_dev.data);
+        Transpose(H, H * 3, R_dev.data, R_t_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm1_grad(
+            T * N,
+            H * 3,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_dev.data,
+            dgamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm2_grad(
+            T * N,
+            H * 3,
+            gamma_dev.data + H * 3,
+            nullptr,
+            act_Rh_dev.data,
+            dgamma_dev.data + H * 3,
+            nullptr,
+            act_Rh_norm_cache_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            R_t_dev.data,
+            bx_dev.data,
+            br_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            v_dev.data,
+            dh_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            dR_dev.data,
+            dbx_dev.data,
+            dbr_dev.data,
+            dh_dev.data,
+            dp_dev.data,
+            dq_dev.data,
+            layer_norm1_grad,
+            layer_norm2_grad,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix Wx = AsMatrix(W) * Step(x, t);
+        Matrix Rh = AsMatrix(R) * h.matrix();
+        LayerNormColumns(Wx, gamma.data(), nullptr);
+        LayerNormColumns(Rh, gamma.data() + H * 3, nullptr);
+        Wx.colwise() += AsVector(bx.data(), H * 3);
+        Rh.colwise() += AsVector(br.data(), H * 3);
+        const Array z = Sigmoid(Wx.middleRows(0 * H, H).array() + Rh.middleRows(0 * H, H).array());
+        const Array r = Sigmoid(Wx.middleRows(1 * H, H).array() + Rh.middleRows(1 * H, H).array());
+        const Array g = (Wx.middleRows(2 * H, H).array() + r * Rh.middleRows(2 * H, H).array()).tanh();
+        h = z * h + (1.0f - z) * g;
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor2 R;
+    Tensor1 bx;
+    Tensor1 br;
+    Tensor2 gamma;
+};
+
+class LayerNormIndrnnBenchmark : public LayerBenchmark {
+  public:
+    LayerNormIndrnnBenchmark(int batch_size, int input_size, int hidden_size, int time_steps)
+        : LayerBenchmark(batch_size, input_size, hidden_size, time_steps, time_steps + 1),
+          W(hidden_size, input_size),
+          u(hidden_size),
+          b(hidden_size),
+          gamma(hidden_size, 2) {
+      Randomize(W, InitScale());
+      Randomize(u, 1.0f);
+      Randomize(b, InitScale());
+      Randomize(gamma, 1.0f);
+    }
+
+    float HasteInference(int sample_size, Tensor3& y) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor1> u_dev(u);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> workspace_dev(T * N * H);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+
+      h_dev.zero();
+
+      haste::v0::layer_norm_indrnn::ForwardPass<float> forward(false, N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      float ms = TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            workspace_dev.data,
+            act_Wx_dev.data,
+            layer_norm1,
+            0.0f,
+            nullptr);
+      }, sample_size);
+      h_dev.ToHost(y);
+      return ms;
+    }
+
+    float HasteTrain(int sample_size) override {
+      device_ptr<Tensor2> W_dev(W);
+      device_ptr<Tensor1> u_dev(u);
+      device_ptr<Tensor1> b_dev(b);
+      device_ptr<Tensor2> gamma_dev(gamma);
+      device_ptr<Tensor3> x_dev(x);
+      device_ptr<Tensor3> h_dev((T + 1) * N * H);
+      device_ptr<Tensor3> workspace_dev(T * N * H);
+      device_ptr<Tensor3> act_Wx_dev(T * N * H);
+      device_ptr<Tensor3> act_Wx_norm_cache_dev(T * N * 2);
+
+      device_ptr<Tensor2> W_t_dev(C * H);
+      device_ptr<Tensor3> x_t_dev(T * N * C);
+      device_ptr<Tensor3> dh_new_dev(dy);
+      device_ptr<Tensor3> dx_dev(T * N * C);
+      device_ptr<Tensor2> dW_dev(C * H);
+      device_ptr<Tensor1> du_dev(H);
+      device_ptr<Tensor1> db_dev(H);
+      device_ptr<Tensor2> dgamma_dev(H * 2);
+      device_ptr<Tensor2> dh_dev(N * H);
+
+      h_dev.zero();
+      dW_dev.zero();
+      du_dev.zero();
+      db_dev.zero();
+      dgamma_dev.zero();
+      dh_dev.zero();
+
+      haste::v0::layer_norm_indrnn::ForwardPass<float> forward(true, N, C, H, g_blas_handle);
+      haste::v0::layer_norm_indrnn::BackwardPass<float> backward(N, C, H, g_blas_handle);
+
+      cudaDeviceSynchronize();
+      return TimeLoop([&]() {
+        haste::v0::layer_norm::ForwardPass<float> layer_norm1(
+            T * N,
+            H,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        forward.Run(
+            T,
+            W_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_dev.data,
+            h_dev.data,
+            workspace_dev.data,
+            act_Wx_dev.data,
+            layer_norm1,
+            0.0f,
+            nullptr);
+
+        Transpose(T * N, C, x_dev.data, x_t_dev.data);
+        Transpose(C, H, W_dev.data, W_t_dev.data);
+
+        haste::v0::layer_norm::BackwardPass<float> layer_norm1_grad(
+            T * N,
+            H,
+            gamma_dev.data,
+            nullptr,
+            act_Wx_dev.data,
+            dgamma_dev.data,
+            nullptr,
+            act_Wx_norm_cache_dev.data);
+
+        backward.Run(
+            T,
+            W_t_dev.data,
+            u_dev.data,
+            b_dev.data,
+            x_t_dev.data,
+            h_dev.data,
+            dh_new_dev.data,
+            dx_dev.data,
+            dW_dev.data,
+            du_dev.data,
+            db_dev.data,
+            dh_dev.data,
+            workspace_dev.data,
+            layer_norm1_grad,
+            nullptr);
+      }, sample_size);
+    }
+
+    void ReferenceInference(Tensor3& y) const override {
+      Array h = Array::Zero(H, N);
+      Step(y, 0) = h.matrix();
+      for (int t = 0; t < T; ++t) {
+        Matrix a = AsMatrix(W) * Step(x, t);
+        LayerNormColumns(a, gamma.data(), nullptr);
+        a.colwise() += AsVector(b.data(), H);
+        h = (a.array() + h.colwise() * AsVector(u.data(), H).array()).tanh();
+        Step(y, t + 1) = h.matrix();
+      }
+    }
+
+  private:
+    Tensor2 W;
+    Tensor1 u;
+    Tensor1 b;
+    Tensor2 gamma;
+};
+
+// Roofline analysis. Every layer is broken into the phases below, each with an analytic
+// FLOP and byte count (fp32, first-order: every operand is read from and written to
+// device memory once per use). GEMM phases and transposes are timed in isolation with
+// cuBLAS at exactly the shapes the engines use. The pointwise phases, which include
+// layer normalization and the bias / gamma reductions of the backward pass, are
+// whatever remains of the measured end-to-end time. The engines overlap some of their
+// GEMMs on separate streams, so the remainder is a lower bound.
+//
+//   input_gemm           Wx for all time steps in a single GEMM
+//   recurrent_gemm       Rh, one small GEMM per time step
+//   pointwise            activations, state update, and layer normalization
+//   transpose            x, W, and R transposed for the backward pass
+//   pointwise_grad       activation gradients, bias and gamma reductions
+//   recurrent_gemm_grad  dh through R, one small GEMM per time step
+//   weight_gemm_grad     dW and dR, each in a single GEMM over all time steps
+//   input_gemm_grad      dx for all time steps in a single GEMM
+
+struct Machine {
+  double gflops;  // peak fp32 GEMM throughput
+  double gbps;    // STREAM triad bandwidth
+};
+
+struct Phase {
+  string name;
+  double flops;
+  double bytes;
+  float ms;
+};
+
+// Shape of a layer as far as the cost model is concerned.
+struct LayerCost {
+  int gates;            // gate pre-activations per hidden unit (H*gates wide projections)
+  bool recurrent_gemm;  // whether the recurrence is a matrix product (vs. elementwise)
+  bool has_cell;        // whether there is a cell state alongside `h`
+  int norm_width;       // elements layer normalized per time step and batch entry, in units of H
+};
+
+LayerCost CostOf(const string& layer) {
+  if (layer == "lstm")
+    return { 4, true, true, 0 };
+  if (layer == "gru")
+    return { 3, true, false, 0 };
+  if (layer == "indrnn")
+    return { 1, false, false, 0 };
+  if (layer == "layer_norm")
+    return { 0, false, false, 1 };
+  if (layer == "layer_norm_lstm")
+    return { 4, true, true, 4 + 4 + 1 };
+  if (layer == "layer_norm_gru")
+    return { 3, true, false, 3 + 3 };
+  return { 1, false, false, 1 };  // layer_norm_indrnn
+}
+
+// Average time of `count` back-to-back column-major [m,k]x[k,n] products.
+float TimeGemm(int sample_size, int m, int n, int k, int count = 1) {
+  static const float alpha = 1.0f;
+  static const float beta = 0.0f;
+
+  device_ptr<Tensor1> A(static_cast<size_t>(m) * k);
+  device_ptr<Tensor1> B(static_cast<size_t>(k) * n);
+  device_ptr<Tensor1> C(static_cast<size_t>(m) * n);
+  A.zero();
+  B.zero();
+
+  auto fn = [&]() {
+    for (int i = 0; i < count; ++i)
+      cublasSgemm(
+          g_blas_handle,
+          CUBLAS_OP_N, CUBLAS_OP_N,
+          m, n, k,
+          &alpha,
+          A.data, m,
+          B.data, k,
+          &beta,
+          C.data, m);
+  };
+
+  // Keep cuBLAS initialization and kernel selection out of the measurement.
+  fn();
+  cudaDeviceSynchronize();
+  return TimeLoop(fn, sample_size);
+}
+
+float TimeTranspose(int sample_size, int rows, int cols) {
+  device_ptr<Tensor1> in(static_cast<size_t>(rows) * cols);
+  device_ptr<Tensor1> out(static_cast<size_t>(rows) * cols);
+  in.zero();
+
+  auto fn = [&]() { Transpose(rows, cols, in.data, out.data); };
+  fn();
+  cudaDeviceSynchronize();
+  return TimeLoop(fn, sample_size);
+}
+
+Machine MeasureMachine(int sample_size) {
+  static const float alpha = 1.0f;
+  static constexpr int kGemmSize = 4096;
+  static constexpr int kStreamSize = 64 << 20;
+
+  const float gemm_ms = TimeGemm(sample_size, kGemmSize, kGemmSize, kGemmSize);
+
+  // STREAM triad: y = alpha * x + y reads two words and writes one per element.
+  device_ptr<Tensor1> x(kStreamSize);
+  device_ptr<Tensor1> y(kStreamSize);
+  x.zero();
+  y.zero();
+  auto triad = [&]() { cublasSaxpy(g_blas_handle, kStreamSize, &alpha, x.data, 1, y.data, 1); };
+  triad();
+  cudaDeviceSynchronize();
+  const float triad_ms = TimeLoop(triad, sample_size);
+
+  Machine machine;
+  machine.gflops = 2.0 * kGemmSize * kGemmSize * kGemmSize / gemm_ms / 1e6;
+  machine.gbps = 3.0 * sizeof(float) * kStreamSize / triad_ms / 1e6;
+  return machine;
+}
+
+Phase GemmPhase(const string& name, int sample_size, int m, int n, int k, int count = 1) {
+  const double flops = 2.0 * m * n * k * count;
+  const double bytes = 4.0 * (static_cast<double>(m) * k + static_cast<double>(k) * n + static_cast<double>(m) * n) * count;
+  return { name, flops, bytes, TimeGemm(sample_size, m, n, k, count) };
+}
+
+// Breaks the end-to-end times measured by `LayerBenchmark` into phases. `forward_ms` is
+// an inference-mode forward pass and `train_ms` (training only) is a forward and backward
+// pass.
+vector<Phase> MeasurePhases(
+    const string& layer,
+    bool training,
+    int sample_size,
+    int N,
+    int C,
+    int H,
+    int T,
+    float forward_ms,
+    float train_ms) {
+  const LayerCost cost = CostOf(layer);
+  const int G = cost.gates;
+  const double rows = static_cast<double>(T) * N;
+  const double state = cost.has_cell ? 2.0 : 1.0;
+  const double norm = static_cast<double>(cost.norm_width) * H;
+  vector<Phase> phases;
+
+  float gemm_ms = 0.0f;
+  if (G) {
+    phases.push_back(GemmPhase("input_gemm", sample_size, H * G, T * N, C));
+    gemm_ms += phases.back().ms;
+  }
+  if (cost.recurrent_gemm) {
+    phases.push_back(GemmPhase("recurrent_gemm", sample_size, H * G, N, H, T));
+    gemm_ms += phases.back().ms;
+  }
+
+  // Reads Wx (and Rh), bias, and the previous state; writes the new state. Layer norm
+  // reads and writes each normalized element and does ~8 flops on it.
+  Phase pointwise;
+  pointwise.name = G ? "pointwise" : "layer_norm";
+  pointwise.flops = G ? rows * (G * H * 4.0 + H * 4.0 * state) : 0.0;
+  pointwise.bytes = G ? 4.0 * rows * (G * H * (cost.recurrent_gemm ? 2.0 : 1.0) + H * 2.0 * state) : 0.0;
+  pointwise.flops += rows * norm * 8.0;
+  pointwise.bytes += 4.0 * rows * norm * 2.0;
+  pointwise.ms = std::max(forward_ms - gemm_ms, 0.0f);
+  phases.push_back(pointwise);
+
+  if (!training)
+    return phases;
+
+  float backward_ms = 0.0f;
+  if (G) {
+    Phase transpose;
+    transpose.name = "transpose";
+    transpose.flops = 0.0;
+    transpose.ms = TimeTranspose(sample_size, T * N, C) + TimeTranspose(sample_size, C, H * G);
+    transpose.bytes = 8.0 * (rows * C + static_cast<double>(C) * H * G);
+    if (cost.recurrent_gemm) {
+      transpose.ms += TimeTranspose(sample_size, H, H * G);
+      transpose.bytes += 8.0 * H * H * G;
+    }
+    phases.push_back(transpose);
+    backward_ms += transpose.ms;
+  }
+  if (cost.recurrent_gemm) {
+    phases.push_back(GemmPhase("recurrent_gemm_grad", sample_size, H, N, H * G, T));
+    backward_ms += phases.back().ms;
+  }
+  if (G) {
+    Phase weight = GemmPhase("weight_gemm_grad", sample_size, H * G, C, T * N);
+    if (cost.recurrent_gemm) {
+      const Phase dR = GemmPhase("", sample_size, H * G, H, T * N);
+      weight.flops += dR.flops;
+      weight.bytes += dR.bytes;
+      weight.ms += dR.ms;
+    }
+    phases.push_back(weight);
+    backward_ms += weight.ms;
+
+    phases.push_back(GemmPhase("input_gemm_grad", sample_size, C, T * N, H * G));
+    backward_ms += phases.back().ms;
+  }
+
+  // Reads the cached activations and incoming gradients, writes the pre-activation
+  // gradients, and reduces them over the batch into the bias (and gamma) gradients.
+  Phase pointwise_grad;
+  pointwise_grad.name = G ? "pointwise_grad" : "layer_norm_grad";
+  pointwise_grad.flops = G ? rows * (G * H * 6.0 + H * 6.0 * state) : 0.0;
+  pointwise_grad.bytes = G ? 4.0 * rows * (G * H * 2.0 + H * 3.0 * state) : 0.0;
+  pointwise_grad.flops += rows * norm * 12.0;
+  pointwise_grad.bytes += 4.0 * rows * norm * 3.0;
+  pointwise_grad.ms = std::max(train_ms - forward_ms - backward_ms, 0.0f);
+  phases.push_back(pointwise_grad);
+
+  return phases;
+}
+
+void WriteRoofline(
+    FILE* fp,
+    const Machine& machine,
+    const string& layer,
+    bool training,
+    int N,
+    int C,
+    int H,
+    int T,
+    const vector<Phase>& phases) {
+  const double ridge = machine.gflops / machine.gbps;
+  for (const auto& phase : phases) {
+    const double seconds = phase.ms * 1e-3;
+    const double intensity = phase.bytes > 0.0 ? phase.flops / phase.bytes : 0.0;
+    const double attainable = std::min(machine.gflops, machine.gbps * intensity);
+    fprintf(fp, "%s,%s,%d,%d,%d,%d,%s,%g,%g,%f,%g,%g,%g,%g,%s\n",
+        layer.c_str(),
+        training ? "training" : "inference",
+        N, H, C, T,
+        phase.name.c_str(),
+        phase.flops,
+        phase.bytes,
+        phase.ms,
+        seconds > 0.0 ? phase.flops / seconds / 1e9 : 0.0,
+        seconds > 0.0 ? phase.bytes / seconds / 1e9 : 0.0,
+        intensity,
+        attainable,
+        intensity < ridge ? "memory" : "compute");
+  }
+  fflush(fp);
+}
+
+// One buffer in the analytic memory model. Sizes are in elements so the model can be
+// evaluated at any precision.
+struct Buffer {
+  const char* category;
+  string name;
+  double elements;
+};
+
+// Every device buffer a forward pass (and, when `training`, the matching backward pass)
+// needs, with the same shapes the framework ops and `LayerBenchmark` allocate. Buffers
+// that are only kept alive for the backward pass are "cache"; in inference the same
+// buffers are "scratch". `packed_weights` are the transposed copies the backward pass
+// consumes.
+vector<Buffer> MemoryModel(
+    const string& layer,
+    bool training,
+    bool zoneout,
+    int N, int C, int H, int T) {
+  const double TN = static_cast<double>(T) * N;
+  const bool lstm = layer == "lstm" || layer == "layer_norm_lstm";
+  const bool gru = layer == "gru" || layer == "layer_norm_gru";
+  const bool norm = layer.compare(0, 10, "layer_norm") == 0;
+  const int G = lstm ? 4 : gru ? 3 : 1;
+  const char* cache = training ? "cache" : "scratch";
+
+  vector<Buffer> buffers;
+  vector<Buffer> weights;
+  auto add = [&](const char* category, const string& name, double elements) {
+    buffers.push_back({ category, name, elements });
+  };
+  auto weight = [&](const string& name, double elements) {
+    weights.push_back({ "weights", name, elements });
+  };
+
+  if (layer == "layer_norm") {
+    weight("gamma", H);
+    weight("beta", H);
+    add("inputs", "x", TN * H);
+    add("outputs", "y", TN * H);
+    add(cache, "cache", TN * 2);
+  } else {
+    weight("W", static_cast<double>(C) * H * G);
+    if (G == 1) {
+      weight("u", H);
+      weight("b", H);
+    } else {
+      weight("R", static_cast<double>(H) * H * G);
+      if (gru) {
+        weight("bx", H * G);
+        weight("br", H * G);
+      } else {
+        weight("b", H * G);
+      }
+    }
+    if (norm)
+      weight("gamma", H * G * 2);
+    if (layer == "layer_norm_lstm") {
+      weight("gamma_h", H);
+      weight("beta_h", H);
+    }
+
+    add("inputs", "x", TN * C);
+    add("outputs", "h", (T + 1.0) * N * H);
+    if (lstm)
+      add("outputs", "c", (T + 1.0) * N * H);
+
+    if (G == 1) {
+      add("scratch", "workspace", TN * H);
+      if (norm) {
+        add(cache, "act_Wx", TN * H);
+        add(cache, "act_Wx_norm_cache", TN * 2);
+      }
+    } else if (lstm && norm) {
+      add(cache, "act_Wx", TN * H * 4);
+      add(cache, "act_Wx_norm", TN * H * 4);
+      add(cache, "act_Wx_norm_cache", TN * 2);
+      add(cache, "act_Rh", TN * H * 4);
+      add(cache, "act_Rh_norm_cache", TN * 2);
+      add(cache, "act_c_norm", TN * H);
+      add(cache, "act_c_norm_cache", TN * 2);
+      add("scratch", "tmp_Rh", static_cast<double>(N) * H * 4);
+    } else if (lstm) {
+      add(cache, "v", TN * H * 4);
+      add("scratch", "tmp_Rh", static_cast<double>(N) * H * 4);
+    } else if (norm) {
+      add(cache, "v", TN * H * 4);
+      add(cache, "act_Wx", TN * H * 3);
+      add("scratch", "tmp_Wx_norm", TN * H * 3);
+      add(cache, "act_Wx_norm_cache", TN * 2);
+      add(cache, "act_Rh", TN * H * 3);
+      add("scratch", "tmp_Rh_norm", static_cast<double>(N) * H * 3);
+      add(cache, "act_Rh_norm_cache", TN * 2);
+    } else {
+      add(cache, "v", TN * H * 4);
+      add("scratch", "tmp_Wx", TN * H * 3);
+      add("scratch", "tmp_Rh", static_cast<double>(N) * H * 3);
+    }
+    if (zoneout)
+      add(cache, "zoneout_mask", TN * H);
+  }
+  buffers.insert(buffers.begin(), weights.begin(), weights.end());
+
+  if (!training)
+    return buffers;
+
+  if (layer != "layer_norm") {
+    add("packed_weights", "W_t", static_cast<double>(C) * H * G);
+    if (G > 1)
+      add("packed_weights", "R_t", static_cast<double>(H) * H * G);
+    add("packed_weights", "x_t", TN * C);
+  }
+  for (const Buffer& w : weights)
+    add("gradients", "d" + w.name, w.elements);
+  if (layer == "layer_norm") {
+    add("gradients", "dy", TN * H);
+    add("gradients", "dx", TN * H);
+  } else {
+    add("gradients", "dh_new", (T + 1.0) * N * H);
+    if (lstm)
+      add("gradients", "dc_new", (T + 1.0) * N * H);
+    add("gradients", "dx", TN * C);
+    add("gradients", "dh", static_cast<double>(N) * H);
+    if (lstm)
+      add("gradients", "dc", static_cast<double>(N) * H);
+    if (gru) {
+      add("scratch", "dp", TN * H * 3);
+      add("scratch", "dq", TN * H * 3);
+    }
+  }
+  return buffers;
+}
+
+// Writes the analytic footprint of one configuration, per buffer and per category, with
+// `cache_bytes` per element for cached activations and `bytes` for everything else,
+// followed by what an actual fp32 run allocated.
+void WriteMemory(
+    FILE* fp,
+    LayerBenchmark& benchmark,
+    const string& layer,
+    bool training,
+    bool zoneout,
+    int bytes,
+    int cache_bytes,
+    int N, int C, int H, int T) {
+  const vector<Buffer> buffers = MemoryModel(layer, training, zoneout, N, C, H, T);
+  auto row = [&](const char* category, const string& name, double value) {
+    fprintf(fp, "%s,%s,%d,%d,%d,%d,%s,%s,%.0f\n",
+        layer.c_str(),
+        training ? "training" : "inference",
+        N, H, C, T,
+        category,
+        name.c_str(),
+        value);
+  };
+
+  std::map<string, double> totals;
+  double total = 0.0;
+  for (const Buffer& buffer : buffers) {
+    const double size = buffer.elements * (string(buffer.category) == "cache" ? cache_bytes : bytes);
+    row(buffer.category, buffer.name, size);
+    totals[buffer.category] += size;
+    total += size;
+  }
+  for (const auto& category : totals)
+    row(category.first.c_str(), "total", category.second);
+  row("all", "total", total);
+
+  // Measured from `device_ptr`, which every device buffer in the benchmark goes through.
+  auto& allocations = device_allocations::get();
+  allocations.count = 0;
+  allocations.peak_bytes = allocations.bytes;
+  const size_t baseline = allocations.bytes;
+  if (training) {
+    benchmark.HasteTrain(1);
+  } else {
+    Tensor3 y = benchmark.NewOutput();
+    benchmark.HasteInference(1, y);
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  row("measured", "peak_device_bytes", allocations.peak_bytes - baseline);
+  row("measured", "device_allocations", allocations.count);
+  row("measured", "peak_rss_bytes", usage.ru_maxrss * 1024.0);
+  fflush(fp);
+}
+
+static const char* const kLayers[] = {
+  "lstm",
+  "gru",
+  "indrnn",
+  "layer_norm",
+  "layer_norm_lstm",
+  "layer_norm_gru",
+  "layer_norm_indrnn",
+};
+
+std::unique_ptr<LayerBenchmark> NewBenchmark(const string& layer, int N, int C, int H, int T) {
+  if (layer == "lstm")
+    return std::unique_ptr<LayerBenchmark>(new LstmBenchmark(N, C, H, T));
+  if (layer == "gru")
+    return std::unique_ptr<LayerBenchmark>(new GruBenchmark(N, C, H, T));
+  if (layer == "indrnn")
+    return std::unique_ptr<LayerBenchmark>(new IndrnnBenchmark(N, C, H, T));
+  if (layer == "layer_norm")
+    return std::unique_ptr<LayerBenchmark>(new LayerNormBenchmark(N, H, T));
+  if (layer == "layer_norm_lstm")
+    return std::unique_ptr<LayerBenchmark>(new LayerNormLstmBenchmark(N, C, H, T));
+  if (layer == "layer_norm_gru")
+    return std::unique_ptr<LayerBenchmark>(new LayerNormGruBenchmark(N, C, H, T));
+  if (layer == "layer_norm_indrnn")
+    return std::unique_ptr<LayerBenchmark>(new LayerNormIndrnnBenchmark(N, C, H, T));
+  return nullptr;
+}
+
+// CPUs of each NUMA node on the host, from sysfs. Falls back to a single node with every
+// CPU if the topology is unavailable.
+vector<vector<int>> HostTopology() {
+  vector<vector<int>> nodes;
+  for (int node = 0; ; ++node) {
+    const string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp)
+      break;
+    vector<int> cpus;
+    int first, last;
+    while (fscanf(fp, "%d", &first) == 1) {
+      last = first;
+      if (fscanf(fp, "-%d", &last) != 1)
+        last = first;
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+      if (fgetc(fp) != ',')
+        break;
+    }
+    fclose(fp);
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < static_cast<int>(std::thread::hardware_concurrency()); ++cpu)
+      nodes.back().push_back(cpu);
+  }
+  return nodes;
+}
+
+// Picks `count` CPUs either filling one NUMA node before moving to the next (compact) or
+// alternating between nodes (spread).
+vector<int> PlaceThreads(const vector<vector<int>>& nodes, int count, bool spread) {
+  vector<int> cpus;
+  if (spread) {
+    for (size_t i = 0; static_cast<int>(cpus.size()) < count; ++i) {
+      bool any = false;
+      for (const auto& node : nodes) {
+        if (i < node.size() && static_cast<int>(cpus.size()) < count) {
+          cpus.push_back(node[i]);
+          any = true;
+        }
+      }
+      if (!any)
+        break;
+    }
+  } else {
+    for (const auto& node : nodes)
+      for (const int cpu : node)
+        if (static_cast<int>(cpus.size()) < count)
+          cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+int NodesUsed(const vector<vector<int>>& nodes, const vector<int>& cpus) {
+  int used = 0;
+  for (const auto& node : nodes)
+    used += std::any_of(cpus.begin(), cpus.end(), [&](int cpu) {
+      return std::find(node.begin(), node.end(), cpu) != node.end();
+    });
+  return used;
+}
+
+// 1, 2, 4, ... up to and including `max_threads`.
+vector<int> ThreadCounts(int max_threads) {
+  vector<int> counts;
+  for (int count = 1; count < max_threads; count *= 2)
+    counts.push_back(count);
+  counts.push_back(max_threads);
+  return counts;
+}
+
+// Average wall time of the reference forward pass with the batch split into one shard
+// per CPU in `cpus`, each shard running single-threaded on a worker pinned to its CPU.
+float TimeBatchSharded(
+    const string& layer,
+    int sample_size,
+    int N, int C, int H, int T,
+    const vector<int>& cpus) {
+  const int count = cpus.size();
+  vector<std::unique_ptr<LayerBenchmark>> shards;
+  vector<Tensor3> outputs;
+  for (int i = 0; i < count; ++i) {
+    const int shard_size = N / count + (i < N % count);
+    shards.push_back(NewBenchmark(layer, shard_size, C, H, T));
+    outputs.push_back(shards.back()->NewOutput());
+  }
+
+  const int saved_threads = Eigen::nbThreads();
+  Eigen::setNbThreads(1);
+
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  vector<std::thread> workers;
+  for (int i = 0; i < count; ++i) {
+    workers.emplace_back([&, i]() {
+      ++ready;
+      while (!go)
+        std::this_thread::yield();
+      for (int j = 0; j < sample_size; ++j)
+        shards[i]->ReferenceInference(outputs[i]);
+    });
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i], &set);
+    pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+  }
+  while (ready < count)
+    std::this_thread::yield();
+
+  const auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& worker : workers)
+    worker.join();
+  const auto stop = std::chrono::steady_clock::now();
+
+  Eigen::setNbThreads(saved_threads);
+  return std::chrono::duration<float, std::milli>(stop - start).count() / sample_size;
+}
+
+// Average time of the reference forward pass with Eigen splitting each GEMM across
+// `threads` OpenMP threads, which partitions the gate rows (hidden units) between them.
+// Thread placement follows OMP_PLACES and OMP_PROC_BIND.
+float TimeHiddenPartitioned(
+    const string& layer,
+    int sample_size,
+    int N, int C, int H, int T,
+    int threads) {
+  auto benchmark = NewBenchmark(layer, N, C, H, T);
+  Tensor3 y = benchmark->NewOutput();
+  const int saved_threads = Eigen::nbThreads();
+  Eigen::setNbThreads(threads);
+  const float ms = TimeHostLoop([&]() { benchmark->ReferenceInference(y); }, sample_size);
+  Eigen::setNbThreads(saved_threads);
+  return ms;
+}
+
+// Strong scaling of the reference implementation for one problem size: time, speedup,
+// and parallel efficiency at each thread count for both ways of splitting the work. The
+// knee is the last thread count after which doubling buys less than half the ideal gain.
+// Hidden partitioning doesn't control placement so it is only run with `spread` unset.
+void WriteScaling(
+    FILE* fp,
+    const vector<vector<int>>& nodes,
+    bool spread,
+    const string& layer,
+    int sample_size,
+    int max_threads,
+    int N, int C, int H, int T) {
+  for (const char* strategy : { "batch", "hidden" }) {
+    const bool batch = strategy[0] == 'b';
+    if (!batch && spread)
+      continue;
+
+    vector<int> counts;
+    vector<float> times;
+    for (const int count : ThreadCounts(max_threads)) {
+      if (batch && count > N)
+        break;
+      const vector<int> cpus = PlaceThreads(nodes, count, spread);
+      const float ms = batch
+          ? TimeBatchSharded(layer, sample_size, N, C, H, T, cpus)
+          : TimeHiddenPartitioned(layer, sample_size, N, C, H, T, count);
+      counts.push_back(count);
+      times.push_back(ms);
+
+      const float speedup = times.front() / ms;
+      fprintf(fp, "%s,%s,%s,%d,%d,%d,%d,%d,%d,%f,%f,%f\n",
+          layer.c_str(),
+          strategy,
+          batch ? (spread ? "spread" : "compact") : "omp",
+          N, H, C, T,
+          count,
+          batch ? NodesUsed(nodes, cpus) : 0,
+          ms,
+          speedup,
+          speedup / count);
+    }
+
+    int knee = counts.back();
+    for (size_t i = 0; i + 1 < counts.size(); ++i) {
+      const float gain = times[i] / times[i + 1] - 1.0f;
+      const float ideal = static_cast<float>(counts[i + 1]) / counts[i] - 1.0f;
+      if (gain < 0.5f * ideal) {
+        knee = counts[i];
+        break;
+      }
+    }
+    fprintf(fp, "# %s,%s,%s,%d,%d,%d,%d knee: %d\n",
+        layer.c_str(),
+        strategy,
+        batch ? (spread ? "spread" : "compact") : "omp",
+        N, H, C, T,
+        knee);
+    fflush(fp);
+  }
+}
+
+// Parses a comma-separated list of positive integers, e.g. "1,16,32".
+vector<int> ParseList(const char* str) {
+  vector<int> values;
+  char* end;
+  for (const char* p = str; *p; p = end) {
+    const long value = strtol(p, &end, 10);
+    if (end == p || value <= 0)
+      return {};
+    values.push_back(static_cast<int>(value));
+    if (*end == ',')
+      ++end;
+  }
+  return values;
+}
+
+string FormatList(const vector<int>& values) {
+  string result;
+  for (size_t i = 0; i < values.size(); ++i)
+    result += (i ? "," : "") + std::to_string(values[i]);
+  return result;
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [OPTION]...\n", name);
+  printf("  -h, --help\n");
+  printf("  -l, --layer LAYER         <lstm|gru|indrnn|layer_norm|layer_norm_lstm|\n");
+  printf("                             layer_norm_gru|layer_norm_indrnn> (default: lstm)\n");
+  printf("  -i, --implementation IMPL <haste|reference> (default: haste)\n");
+  printf("  -m, --mode MODE           <inference|training> (default: training)\n");
+  printf("  -R, --repeat NUM          rows to print per configuration, each averaged over\n");
+  printf("                            sample_size runs (default: 1)\n");
+  printf("  -s, --sample_size NUM     number of runs to average over (default: %d)\n",
+      DEFAULT_SAMPLE_SIZE);
+  printf("  -t, --time_steps LIST     time steps to sweep over (default: %d)\n",
+      DEFAULT_TIME_STEPS);
+  printf("  -N, --batch_size LIST     batch sizes to sweep over\n");
+  printf("  -C, --input_size LIST     input sizes to sweep over (ignored for layer_norm)\n");
+  printf("  -H, --hidden_size LIST    hidden sizes to sweep over\n");
+  printf("  -j, --threads NUM         host threads for the reference implementation (default: %d)\n",
+      DEFAULT_THREADS);
+  printf("  -v, --verify              check Haste output against the reference implementation\n");
+  printf("  -r, --roofline FILE       write a per-phase roofline breakdown as CSV to FILE\n");
+  printf("  -p, --perf_counters FILE  write host hardware counters per run as CSV to FILE\n");
+  printf("  -M, --memory FILE         write the analytic and measured memory footprint as CSV to FILE\n");
+  printf("  -z, --zoneout             include zoneout masks in the memory model\n");
+  printf("  -P, --cache_precision P   <float|half> element type of cached activations in the\n");
+  printf("                            memory model (default: float)\n");
+  printf("  -S, --scaling FILE        write reference thread/NUMA scaling up to -j threads\n");
+  printf("                            (default: all CPUs) as CSV to FILE\n");
+}
+
+int main(int argc, char* const* argv) {
+  srand(time(0));
+
+  cublasCreate(&g_blas_handle);
+
+  static struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "layer", required_argument, 0, 'l' },
+    { "implementation", required_argument, 0, 'i' },
+    { "mode", required_argument, 0, 'm' },
+    { "sample_size", required_argument, 0, 's' },
+    { "repeat", required_argument, 0, 'R' },
+    { "time_steps", required_argument, 0, 't' },
+    { "batch_size", required_argument, 0, 'N' },
+    { "input_size", required_argument, 0, 'C' },
+    { "hidden_size", required_argument, 0, 'H' },
+    { "threads", required_argument, 0, 'j' },
+    { "verify", no_argument, 0, 'v' },
+    { "roofline", required_argument, 0, 'r' },
+    { "perf_counters", required_argument, 0, 'p' },
+    { "scaling", required_argument, 0, 'S' },
+    { "memory", required_argument, 0, 'M' },
+    { "zoneout", no_argument, 0, 'z' },
+    { "cache_precision", required_argument, 0, 'P' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  int opt_index;
+  string layer = "lstm";
+  bool inference_flag = false;
+  bool haste_flag = true;
+  bool verify_flag = false;
+  string roofline_path;
+  string perf_path;
+  string scaling_path;
+  string memory_path;
+  bool zoneout_flag = false;
+  int cache_bytes = sizeof(float);
+  int sample_size = DEFAULT_SAMPLE_SIZE;
+  int repeat = 1;
+  int threads = DEFAULT_THREADS;
+  bool threads_flag = false;
+  vector<int> time_steps = { DEFAULT_TIME_STEPS };
+  vector<int> batch_sizes = { 1, 16, 32, 64, 128 };
+  vector<int> input_sizes = { 64, 128, 256, 512 };
+  vector<int> hidden_sizes = { 128, 256, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+  while ((c = getopt_long(argc, argv, "hl:i:m:s:R:t:N:C:H:j:vr:p:S:M:zP:", long_options, &opt_index)) != -1)
+    switch (c) {
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      case 'l':
+        layer = optarg;
+        break;
+      case 'i':
+        if (optarg[0] == 'r' || optarg[0] == 'R')
+          haste_flag = false;
+        break;
+      case 'm':
+        if (optarg[0] == 'i' || optarg[0] == 'I')
+          inference_flag = true;
+        break;
+      case 's':
+        sscanf(optarg, "%d", &sample_size);
+        break;
+      case 'R':
+        sscanf(optarg, "%d", &repeat);
+        break;
+      case 't':
+        time_steps = ParseList(optarg);
+        break;
+      case 'N':
+        batch_sizes = ParseList(optarg);
+        break;
+      case 'C':
+        input_sizes = ParseList(optarg);
+        break;
+      case 'H':
+        hidden_sizes = ParseList(optarg);
+        break;
+      case 'j':
+        sscanf(optarg, "%d", &threads);
+        threads_flag = true;
+        break;
+      case 'v':
+        verify_flag = true;
+        break;
+      case 'r':
+        roofline_path = optarg;
+        break;
+      case 'p':
+        perf_path = optarg;
+        break;
+      case 'S':
+        scaling_path = optarg;
+        break;
+      case 'M':
+        memory_path = optarg;
+        break;
+      case 'z':
+        zoneout_flag = true;
+        break;
+      case 'P':
+        cache_bytes = optarg[0] == 'h' || optarg[0] == 'H' ? 2 : sizeof(float);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+
+  if (std::find_if(std::begin(kLayers), std::end(kLayers),
+      [&](const char* name) { return layer == name; }) == std::end(kLayers)) {
+    fprintf(stderr, "Unknown layer: %s\n", layer.c_str());
+    return 1;
+  }
+  if (time_steps.empty() || batch_sizes.empty() || input_sizes.empty() || hidden_sizes.empty()) {
+    fprintf(stderr, "Sweep lists must be comma-separated positive integers.\n");
+    return 1;
+  }
+  if (repeat < 1) {
+    fprintf(stderr, "Repeat count must be positive.\n");
+    return 1;
+  }
+  if (!haste_flag && !inference_flag) {
+    fprintf(stderr, "The reference implementation only supports inference mode.\n");
+    return 1;
+  }
+  if (!haste_flag && !roofline_path.empty()) {
+    fprintf(stderr, "Roofline analysis is only available for the Haste implementation.\n");
+    return 1;
+  }
+
+  FILE* roofline = nullptr;
+  Machine machine;
+  if (!roofline_path.empty()) {
+    roofline = fopen(roofline_path.c_str(), "w");
+    if (!roofline) {
+      fprintf(stderr, "Unable to open %s\n", roofline_path.c_str());
+      return 1;
+    }
+    machine = MeasureMachine(sample_size);
+    fprintf(roofline, "# peak_gflops: %f\n", machine.gflops);
+    fprintf(roofline, "# peak_gbps: %f\n", machine.gbps);
+    fprintf(roofline, "layer,mode,batch_size,hidden_size,input_size,time_steps,phase,"
+        "flops,bytes,time_ms,gflops,gbps,intensity,attainable_gflops,bound\n");
+  }
+
+  if (haste_flag && !scaling_path.empty()) {
+    fprintf(stderr, "Scaling analysis is only available for the reference implementation.\n");
+    return 1;
+  }
+
+  if (!haste_flag && !memory_path.empty()) {
+    fprintf(stderr, "Memory analysis is only available for the Haste implementation.\n");
+    return 1;
+  }
+
+  FILE* memory = nullptr;
+  if (!memory_path.empty()) {
+    memory = fopen(memory_path.c_str(), "w");
+    if (!memory) {
+      fprintf(stderr, "Unable to open %s\n", memory_path.c_str());
+      return 1;
+    }
+    fprintf(memory, "# cache_bytes_per_element: %d\n", cache_bytes);
+    fprintf(memory, "# zoneout: %d\n", zoneout_flag);
+    fprintf(memory, "layer,mode,batch_size,hidden_size,input_size,time_steps,category,buffer,value\n");
+  }
+
+  FILE* scaling = nullptr;
+  const vector<vector<int>> nodes = HostTopology();
+  const int max_threads = threads_flag ? threads : std::thread::hardware_concurrency();
+  if (!scaling_path.empty()) {
+    scaling = fopen(scaling_path.c_str(), "w");
+    if (!scaling) {
+      fprintf(stderr, "Unable to open %s\n", scaling_path.c_str());
+      return 1;
+    }
+    fprintf(scaling, "# numa_nodes: %zu\n", nodes.size());
+    fprintf(scaling, "layer,strategy,placement,batch_size,hidden_size,input_size,time_steps,"
+        "threads,numa_nodes,time_ms,speedup,efficiency\n");
+  }
+
+  FILE* perf = nullptr;
+  std::unique_ptr<PerfCounters> perf_counters;
+  if (!perf_path.empty()) {
+    perf = fopen(perf_path.c_str(), "w");
+    if (!perf) {
+      fprintf(stderr, "Unable to open %s\n", perf_path.c_str());
+      return 1;
+    }
+    // Opened before any worker threads exist so that they inherit the counters.
+    perf_counters.reset(new PerfCounters());
+    if (!perf_counters->Available())
+      fprintf(stderr, "Hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid).\n");
+    g_perf_counters = perf_counters.get();
+    fprintf(perf, "layer,mode,implementation,batch_size,hidden_size,input_size,time_steps,time_ms,"
+        "cycles,instructions,l1d_loads,l1d_load_misses,llc_loads,llc_load_misses,dtlb_load_misses,"
+        "stalled_cycles_frontend,stalled_cycles_backend,ipc,l1d_miss_rate,llc_miss_rate,dtlb_mpki\n");
+  }
+
+  // Only affects the reference implementation; Haste is driven by a single host thread.
+  Eigen::setNbThreads(threads);
+
+  printf("# Benchmark configuration:\n");
+  printf("#   Layer: %s\n", layer.c_str());
+  printf("#   Mode: %s\n", inference_flag ? "inference" : "training");
+  printf("#   Implementation: %s\n", haste_flag ? "Haste" : "reference");
+  printf("#   Sample size: %d\n", sample_size);
+  printf("#   Repeat: %d\n", repeat);
+  printf("#   Time steps: %s\n", FormatList(time_steps).c_str());
+  printf("#   Threads: %d\n", haste_flag ? 1 : Eigen::nbThreads());
+  printf("#\n");
+  printf("# batch_size,hidden_size,input_size,time_steps,time_ms\n");
+
+  // Layer normalization has no input projection so there is nothing to sweep over.
+  if (layer == "layer_norm")
+    input_sizes = { 0 };
+
+  for (const int N : batch_sizes) {
+    for (const int H : hidden_sizes) {
+      for (const int C : input_sizes) {
+        for (const int T : time_steps) {
+          const int input_size = layer == "layer_norm" ? H : C;
+          auto benchmark = NewBenchmark(layer, N, input_size, H, T);
+          Tensor3 y = benchmark->NewOutput();
+
+          // Each repeat is an independent sample for `report.py --compare`.
+          float ms;
+          for (int i = 0; i < repeat; ++i) {
+            if (!haste_flag)
+              ms = TimeHostLoop([&]() { benchmark->ReferenceInference(y); }, sample_size);
+            else if (inference_flag)
+              ms = benchmark->HasteInference(sample_size, y);
+            else
+              ms = benchmark->HasteTrain(sample_size);
+            printf("%d,%d,%d,%d,%f\n", N, H, input_size, T, ms);
+          }
+
+          if (perf) {
+            // Copied right away: the roofline and verification runs below overwrite it.
+            const PerfCounters::Values counters = g_perf_values;
+            printf("#   ipc: %.3f  l1d_miss_rate: %.4f  llc_miss_rate: %.4f  dtlb_mpki: %.3f  stalled: %.3f\n",
+                counters.Ipc(),
+                counters.L1dMissRate(),
+                counters.LlcMissRate(),
+                counters.DtlbMpki(),
+                counters.StalledFraction());
+            fprintf(perf, "%s,%s,%s,%d,%d,%d,%d,%f", layer.c_str(),
+                inference_flag ? "inference" : "training",
+                haste_flag ? "haste" : "reference",
+                N, H, input_size, T, ms);
+            for (int i = 0; i < PerfCounters::kCount; ++i)
+              fprintf(perf, ",%.0f", counters.value[i]);
+            fprintf(perf, ",%g,%g,%g,%g\n",
+                counters.Ipc(),
+                counters.L1dMissRate(),
+                counters.LlcMissRate(),
+                counters.DtlbMpki());
+          }
+
+          if (roofline) {
+            const float forward_ms = inference_flag ? ms : benchmark->HasteInference(sample_size, y);
+            const vector<Phase> phases = MeasurePhases(
+                layer,
+                !inference_flag,
+                sample_size,
+                N, input_size, H, T,
+                forward_ms,
+                ms);
+            WriteRoofline(roofline, machine, layer, !inference_flag, N, input_size, H, T, phases);
+          }
+
+          if (memory) {
+            WriteMemory(memory, *benchmark, layer, !inference_flag, zoneout_flag,
+                sizeof(float), cache_bytes, N, input_size, H, T);
+          }
+
+          if (scaling) {
+            for (const bool spread : { false, true }) {
+              if (spread && nodes.size() < 2)
+                continue;
+              WriteScaling(scaling, nodes, spread, layer, sample_size, max_threads, N, input_size, H, T);
+            }
+          }
+
+          if (haste_flag && verify_flag) {
+            Tensor3 expected = benchmark->NewOutput();
+            if (!inference_flag)
+              benchmark->HasteInference(1, y);
+            benchmark->ReferenceInference(expected);
+            const Eigen::Tensor<float, 0> error = (y - expected).abs().maximum();
+            printf("#   max abs error: %g\n", error());
+          }
+          fflush(stdout);
+        }
+      }
+    }
+  }
+
+  if (roofline)
+    fclose(roofline);
+  if (perf)
+    fclose(perf);
+  if (scaling)
+    fclose(scaling);
+  if (memory)
+    fclose(memory);
+  cublasDestroy(g_blas_handle);
+  return 0;
+}
@@ -0,0 +1,717 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <getopt.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <vector>
+
+#include "../examples/device_ptr.h"
+#include "haste.h"
+
+using std::string;
+using std::vector;
+
+using Clock = std::chrono::steady_clock;
+using Tensor1 = Eigen::Tensor<float, 1>;
+using Tensor2 = Eigen::Tensor<float, 2>;
+using Tensor3 = Eigen::Tensor<float, 3>;
+
+static constexpr int DEFAULT_STREAMS = 4;
+static constexpr int DEFAULT_CHUNK_STEPS = 10;
+static constexpr float DEFAULT_STEP_MS = 10.0f;
+static constexpr float DEFAULT_DURATION_S = 10.0f;
+
+// Log-linear latency histogram in the style of HdrHistogram. Values (in nanoseconds)
+// are bucketed by power of two with 64 linear sub-buckets each, so every percentile is
+// reported to within 1/64 of its true value regardless of magnitude.
+class LatencyHistogram {
+  public:
+    LatencyHistogram() : counts_(kSubBuckets * 66), total_(0), sum_(0.0), max_(0) {}
+
+    void Record(uint64_t ns) {
+      ++counts_[Index(ns)];
+      ++total_;
+      sum_ += ns;
+      max_ = std::max(max_, ns);
+    }
+
+    void Merge(const LatencyHistogram& other) {
+      for (size_t i = 0; i < counts_.size(); ++i)
+        counts_[i] += other.counts_[i];
+      total_ += other.total_;
+      sum_ += other.sum_;
+      max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t Count() const { return total_; }
+
+    double MeanMs() const { return total_ ? sum_ / total_ / 1e6 : 0.0; }
+
+    double MaxMs() const { return max_ / 1e6; }
+
+    // Highest value equivalent to the `p`th quantile (0 <= p <= 1), in milliseconds.
+    double PercentileMs(double p) const {
+      if (!total_)
+        return 0.0;
+      const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * total_)));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= rank)
+          return std::min(HighestEquivalent(i), max_) / 1e6;
+      }
+      return MaxMs();
+    }
+
+  private:
+    static constexpr int kSubBuckets = 64;
+
+    static size_t Index(uint64_t value) {
+      if (value < 2 * kSubBuckets)
+        return value;
+      int msb = 63;
+      while (!(value >> msb))
+        --msb;
+      const int bucket = msb - 6;
+      return bucket * kSubBuckets + (value >> bucket);
+    }
+
+    static uint64_t HighestEquivalent(size_t index) {
+      if (index < 2 * kSubBuckets)
+        return index;
+      const int bucket = index / kSubBuckets - 1;
+      const uint64_t sub = index - bucket * kSubBuckets;
+      return ((sub + 1) << bucket) - 1;
+    }
+
+    vector<uint64_t> counts_;
+    uint64_t total_;
+    double sum_;
+    uint64_t max_;
+};
+
+struct SessionResult {
+  LatencyHistogram step;
+  LatencyHistogram chunk;
+  double busy_ms = 0.0;
+  double audio_ms = 0.0;
+  int chunks = 0;
+  int missed = 0;
+};
+
+struct Config {
+  string layer;
+  bool per_step;
+  bool bidirectional;
+  int right_context;
+  float zoneout;
+  int N;
+  int C;
+  int H;
+  int chunk_steps;
+  float step_ms;
+  int chunks;
+};
+
+uint64_t Nanoseconds(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+// One simulated real-time stream. A chunk of `chunk_steps` input frames arrives every
+// `chunk_steps * step_ms`; the session processes it either with one `Run` or with one
+// `Iterate` per frame and carries the recurrent state over to the next chunk.
+//
+// Like the framework ops, an engine is created for every call with the session's stream
+// so that completion can be observed on that stream alone; sessions never synchronize
+// with each other through the default stream.
+//
+// With `bidirectional`, each chunk goes through a latency-controlled BLSTM instead, which
+// keeps its own state and buffered right context across chunks. Both directions share
+// the same weights; only their shapes matter here.
+class Session {
+  public:
+    Session(const Config& config, Clock::time_point start)
+        : config_(config),
+          start_(start),
+          gates_(config.layer == "lstm" ? 4 : 3),
+          W_(config.C * config.H * gates_),
+          R_(config.H * config.H * gates_),
+          b_(config.H * gates_),
+          br_(config.H * gates_),
+          x_(config.chunk_steps * config.N * config.C),
+          h_((config.chunk_steps + 1) * config.N * config.H),
+          c_((config.chunk_steps + 1) * config.N * config.H),
+          v_(config.chunk_steps * config.N * config.H * 4),
+          tmp_Wx_(config.chunk_steps * config.N * config.H * 3),
+          tmp_Rh_(config.N * config.H * gates_),
+          y_(config.bidirectional ? (2 * config.chunk_steps - 1) * config.N * config.H * 2 : 0) {
+      cublasCreate(&blas_handle_);
+      cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking);
+      cudaEventCreateWithFlags(&done_, cudaEventDisableTiming);
+      if (config.bidirectional)
+        blstm_.reset(new haste::v0::latency_controlled_lstm::ForwardPass<float>(
+            config.N, config.C, config.H, config.chunk_steps, config.right_context,
+            config.chunk_steps, blas_handle_, stream_));
+      W_.zero();
+      R_.zero();
+      b_.zero();
+      br_.zero();
+      x_.zero();
+      h_.zero();
+      c_.zero();
+    }
+
+    ~Session() {
+      blstm_.reset();
+      cudaEventDestroy(done_);
+      cudaStreamDestroy(stream_);
+      cublasDestroy(blas_handle_);
+    }
+
+    void Run(SessionResult& result) {
+      const double chunk_ms = config_.chunk_steps * config_.step_ms;
+      for (int i = 0; i < config_.chunks; ++i) {
+        const auto arrival = start_ + std::chrono::microseconds(
+            static_cast<int64_t>(i * chunk_ms * 1000.0));
+        std::this_thread::sleep_until(arrival);
+
+        const auto begin = Clock::now();
+        if (config_.per_step) {
+          for (int t = 0; t < config_.chunk_steps; ++t) {
+            const auto step_begin = Clock::now();
+            Step(t);
+            Wait();
+            if (i)
+              result.step.Record(Nanoseconds(step_begin, Clock::now()));
+          }
+        } else {
+          Chunk();
+          Wait();
+        }
+        if (!config_.bidirectional)
+          CarryState();
+        const auto end = Clock::now();
+
+        // The first chunk pays for cuBLAS and CUDA lazy initialization.
+        if (!i)
+          continue;
+        const uint64_t latency = Nanoseconds(arrival, end);
+        result.chunk.Record(latency);
+        result.busy_ms += Nanoseconds(begin, end) / 1e6;
+        result.audio_ms += chunk_ms;
+        result.chunks += 1;
+        result.missed += latency / 1e6 > chunk_ms;
+      }
+    }
+
+    haste::v0::latency_controlled_lstm::ChunkCost Cost() const {
+      return blstm_->Cost();
+    }
+
+  private:
+    void Chunk() {
+      const int T = config_.chunk_steps;
+      if (blstm_) {
+        blstm_->Run(T, W_.data, R_.data, b_.data, W_.data, R_.data, b_.data, x_.data, y_.data,
+            config_.zoneout);
+      } else if (gates_ == 4) {
+        haste::v0::lstm::ForwardPass<float> forward(
+            false, config_.N, config_.C, config_.H, blas_handle_, stream_);
+        forward.Run(T, W_.data, R_.data, b_.data, x_.data, h_.data, c_.data, v_.data,
+            tmp_Rh_.data, 0.0f, nullptr);
+      } else {
+        haste::v0::gru::ForwardPass<float> forward(
+            false, config_.N, config_.C, config_.H, blas_handle_, stream_);
+        forward.Run(T, W_.data, R_.data, b_.data, br_.data, x_.data, h_.data, v_.data,
+            tmp_Wx_.data, tmp_Rh_.data, 0.0f, nullptr);
+      }
+    }
+
+    void Step(int t) {
+      const int NC = config_.N * config_.C;
+      const int NH = config_.N * config_.H;
+      if (gates_ == 4) {
+        haste::v0::lstm::ForwardPass<float> forward(
+            false, config_.N, config_.C, config_.H, blas_handle_, stream_);
+        forward.Iterate(stream_, W_.data, R_.data, b_.data,
+            x_.data + t * NC,
+            h_.data + t * NH,
+            c_.data + t * NH,
+            h_.data + (t + 1) * NH,
+            c_.data + (t + 1) * NH,
+            v_.data + t * NH * 4,
+            tmp_Rh_.data,
+            0.0f,
+            nullptr);
+      } else {
+        haste::v0::gru::ForwardPass<float> forward(
+            false, config_.N, config_.C, config_.H, blas_handle_, stream_);
+        forward.Iterate(W_.data, R_.data, b_.data, br_.data,
+            x_.data + t * NC,
+            h_.data + t * NH,
+            h_.data + (t + 1) * NH,
+            v_.data + t * NH * 4,
+            tmp_Wx_.data + t * NH * 3,
+            tmp_Rh_.data,
+            0.0f,
+            nullptr);
+      }
+    }
+
+    // The last state of this chunk becomes the initial state of the next one.
+    void CarryState() {
+      const size_t NH = config_.N * config_.H;
+      const size_t offset = config_.chunk_steps * NH;
+      cudaMemcpyAsync(h_.data, h_.data + offset, NH * sizeof(float), cudaMemcpyDeviceToDevice, stream_);
+      cudaMemcpyAsync(c_.data, c_.data + offset, NH * sizeof(float), cudaMemcpyDeviceToDevice, stream_);
+    }
+
+    void Wait() {
+      cudaEventRecord(done_, stream_);
+      cudaEventSynchronize(done_);
+    }
+
+    const Config config_;
+    const Clock::time_point start_;
+    const int gates_;
+    cublasHandle_t blas_handle_;
+    cudaStream_t stream_;
+    cudaEvent_t done_;
+    device_ptr<Tensor2> W_;
+    device_ptr<Tensor2> R_;
+    device_ptr<Tensor1> b_;
+    device_ptr<Tensor1> br_;
+    device_ptr<Tensor3> x_;
+    device_ptr<Tensor3> h_;
+    device_ptr<Tensor3> c_;
+    device_ptr<Tensor3> v_;
+    device_ptr<Tensor3> tmp_Wx_;
+    device_ptr<Tensor2> tmp_Rh_;
+    device_ptr<Tensor3> y_;
+    std::unique_ptr<haste::v0::latency_controlled_lstm::ForwardPass<float>> blstm_;
+};
+
+// Background load competing with the sessions: back-to-back large SGEMMs on a stream of
+// their own, and/or host threads streaming through a buffer larger than the LLC.
+class NoisyNeighbor {
+  public:
+    NoisyNeighbor(bool gpu, bool cpu) : stop_(false) {
+      if (gpu)
+        threads_.emplace_back([this]() { GpuLoad(); });
+      if (cpu) {
+        const int count = std::max(1u, std::thread::hardware_concurrency() / 2);
+        for (int i = 0; i < count; ++i)
+          threads_.emplace_back([this]() { CpuLoad(); });
+      }
+    }
+
+    ~NoisyNeighbor() {
+      stop_ = true;
+      for (auto& thread : threads_)
+        thread.join();
+    }
+
+  private:
+    void GpuLoad() {
+      const int n = 2048;
+      const float alpha = 1.0f;
+      const float beta = 0.0f;
+      cublasHandle_t handle;
+      cudaStream_t stream;
+      cublasCreate(&handle);
+      cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+      cublasSetStream(handle, stream);
+      device_ptr<Tensor2> a(n * n);
+      device_ptr<Tensor2> b(n * n);
+      device_ptr<Tensor2> c(n * n);
+      a.zero();
+      b.zero();
+      while (!stop_) {
+        cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, n, n, n,
+            &alpha, a.data, n, b.data, n, &beta, c.data, n);
+        cudaStreamSynchronize(stream);
+      }
+      cudaStreamDestroy(stream);
+      cublasDestroy(handle);
+    }
+
+    void CpuLoad() {
+      vector<float> buffer(16 << 20, 1.0f);
+      float sum = 0.0f;
+      while (!stop_)
+        for (size_t i = 0; i < buffer.size(); i += 16)
+          sum += buffer[i];
+      volatile float sink = sum;
+      (void)sink;
+    }
+
+    std::atomic<bool> stop_;
+    vector<std::thread> threads_;
+};
+
+// Uniform random values in [-scale, scale].
+Tensor1 RandomTensor(const int size, const float scale) {
+  Tensor1 tensor(size);
+  tensor.setRandom();
+  tensor = (tensor * 2.0f - 1.0f) * scale;
+  return tensor;
+}
+
+// Checks that the latency-controlled BLSTM emits what `lstm::ForwardPass` computes for
+// each direction on its own: the forward direction over the whole sequence, and the
+// backward direction over each chunk's window from a zero state. The input arrives one
+// chunk per `Run` and ends with `Flush`, so state carry-over, right context, and the
+// final partial chunk are all covered. Returns the largest absolute difference.
+float VerifyBidirectional(const Config& config, const int steps) {
+  using haste::v0::latency_controlled_lstm::ForwardPass;
+  const int N = config.N;
+  const int C = config.C;
+  const int H = config.H;
+  const int chunk = config.chunk_steps;
+  const int right = config.right_context;
+  const int NC = N * C;
+  const int NH = N * H;
+
+  cublasHandle_t blas_handle;
+  cublasCreate(&blas_handle);
+
+  const float scale = 1.0f / std::sqrt(static_cast<float>(H));
+  const Tensor1 x = RandomTensor(steps * NC, 1.0f);
+  device_ptr<Tensor1> x_dev(x);
+  device_ptr<Tensor1> W_fw(RandomTensor(C * H * 4, scale));
+  device_ptr<Tensor1> R_fw(RandomTensor(H * H * 4, scale));
+  device_ptr<Tensor1> b_fw(RandomTensor(H * 4, scale));
+  device_ptr<Tensor1> W_bw(RandomTensor(C * H * 4, scale));
+  device_ptr<Tensor1> R_bw(RandomTensor(H * H * 4, scale));
+  device_ptr<Tensor1> b_bw(RandomTensor(H * 4, scale));
+
+  Tensor1 y(steps * NH * 2);
+  {
+    device_ptr<Tensor1> y_dev((steps + chunk + right) * NH * 2);
+    ForwardPass<float> blstm(N, C, H, chunk, right, chunk, blas_handle);
+    int emitted = 0;
+    for (int t = 0; t < steps; t += chunk) {
+      emitted += blstm.Run(std::min(chunk, steps - t),
+          W_fw.data, R_fw.data, b_fw.data, W_bw.data, R_bw.data, b_bw.data,
+          x_dev.data + t * NC, y_dev.data + emitted * NH * 2, config.zoneout);
+    }
+    emitted += blstm.Flush(R_fw.data, b_fw.data, R_bw.data, b_bw.data,
+        y_dev.data + emitted * NH * 2, config.zoneout);
+    assert(emitted == steps);
+    cudaDeviceSynchronize();
+    cudaMemcpy(y.data(), y_dev.data, y.size() * sizeof(float), cudaMemcpyDeviceToHost);
+  }
+
+  // Runs one direction over `count` steps of `input` from a zero state and returns `h`.
+  // In inference mode the zoneout mask only has to be present; it is never read.
+  auto reference = [&](const int count, const Tensor1& input, const float* W,
+      const float* R, const float* b) {
+    device_ptr<Tensor1> input_dev(input);
+    device_ptr<Tensor1> h_dev((count + 1) * NH);
+    device_ptr<Tensor1> c_dev((count + 1) * NH);
+    device_ptr<Tensor1> v_dev(count * NH * 4);
+    device_ptr<Tensor1> tmp_Rh(NH * 4);
+    device_ptr<Tensor1> mask(count * NH);
+    h_dev.zero();
+    c_dev.zero();
+    mask.zero();
+    {
+      haste::v0::lstm::ForwardPass<float> forward(false, N, C, H, blas_handle);
+      forward.Run(count, W, R, b, input_dev.data, h_dev.data, c_dev.data, v_dev.data,
+          tmp_Rh.data, config.zoneout, config.zoneout ? mask.data : nullptr);
+    }
+    Tensor1 h((count + 1) * NH);
+    h_dev.ToHost(h);
+    return h;
+  };
+
+  float max_error = 0.0f;
+  const Tensor1 h_fw = reference(steps, x, W_fw.data, R_fw.data, b_fw.data);
+  for (int t = 0; t < steps; ++t)
+    for (int i = 0; i < NH; ++i) {
+      const float out = y((t * N + i / H) * H * 2 + i % H);
+      max_error = std::max(max_error, std::abs(out - h_fw((t + 1) * NH + i)));
+    }
+
+  // Chunks are emitted as in `ForwardPass::Run`, and `Flush` emits the rest at once.
+  for (int start = 0; start < steps;) {
+    const bool full = steps - start >= chunk + right;
+    const int count = full ? chunk : steps - start;
+    const int window = full ? chunk + right : count;
+    Tensor1 reversed(window * NC);
+    for (int t = 0; t < window; ++t)
+      for (int i = 0; i < NC; ++i)
+        reversed(t * NC + i) = x((start + window - 1 - t) * NC + i);
+    const Tensor1 h_bw = reference(window, reversed, W_bw.data, R_bw.data, b_bw.data);
+    for (int t = 0; t < count; ++t)
+      for (int i = 0; i < NH; ++i) {
+        const float out = y(((start + t) * N + i / H) * H * 2 + H + i % H);
+        max_error = std::max(max_error, std::abs(out - h_bw((window - t) * NH + i)));
+      }
+    start += count;
+  }
+
+  cublasDestroy(blas_handle);
+  return max_error;
+}
+
+void PrintHistogram(const char* name, const LatencyHistogram& h) {
+  printf("%s,%llu,%f,%f,%f,%f,%f,%f\n",
+      name,
+      static_cast<unsigned long long>(h.Count()),
+      h.MeanMs(),
+      h.PercentileMs(0.5),
+      h.PercentileMs(0.9),
+      h.PercentileMs(0.99),
+      h.PercentileMs(0.999),
+      h.MaxMs());
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [OPTION]...\n", name);
+  printf("  -h, --help\n");
+  printf("  -l, --layer LAYER         <lstm|gru> (default: lstm)\n");
+  printf("  -u, --unit UNIT           <chunk|step>: one Run per chunk or one Iterate per step\n");
+  printf("                            (default: chunk)\n");
+  printf("  -k, --streams NUM         concurrent streams (default: %d)\n", DEFAULT_STREAMS);
+  printf("  -N, --batch_size NUM      batch size of each stream (default: 1)\n");
+  printf("  -C, --input_size NUM      (default: 128)\n");
+  printf("  -H, --hidden_size NUM     (default: 512)\n");
+  printf("  -c, --chunk_steps NUM     time steps per chunk (default: %d)\n", DEFAULT_CHUNK_STEPS);
+  printf("  -b, --bidirectional       latency-controlled bidirectional LSTM (chunk units only)\n");
+  printf("  -R, --right_context NUM   future steps seen by the backward direction of each\n");
+  printf("                            bidirectional chunk (default: 0)\n");
+  printf("  -z, --zoneout PROB        zoneout probability the bidirectional layer was trained\n");
+  printf("                            with (default: 0)\n");
+  printf("  -V, --verify              check the bidirectional layer's streaming output against\n");
+  printf("                            full-sequence LSTM outputs and exit\n");
+  printf("  -r, --step_ms MS          real-time duration of one time step (default: %g)\n",
+      DEFAULT_STEP_MS);
+  printf("  -d, --duration SECONDS    length of the simulated stream (default: %g)\n",
+      DEFAULT_DURATION_S);
+  printf("  -n, --noisy LOAD          <none|gpu|cpu|both> background load (default: none)\n");
+}
+
+int main(int argc, char* const* argv) {
+  static struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "layer", required_argument, 0, 'l' },
+    { "unit", required_argument, 0, 'u' },
+    { "streams", required_argument, 0, 'k' },
+    { "batch_size", required_argument, 0, 'N' },
+    { "input_size", required_argument, 0, 'C' },
+    { "hidden_size", required_argument, 0, 'H' },
+    { "chunk_steps", required_argument, 0, 'c' },
+    { "bidirectional", no_argument, 0, 'b' },
+    { "right_context", required_argument, 0, 'R' },
+    { "zoneout", required_argument, 0, 'z' },
+    { "verify", no_argument, 0, 'V' },
+    { "step_ms", required_argument, 0, 'r' },
+    { "duration", required_argument, 0, 'd' },
+    { "noisy", required_argument, 0, 'n' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  int opt_index;
+  Config config;
+  config.layer = "lstm";
+  config.per_step = false;
+  config.bidirectional = false;
+  config.right_context = 0;
+  config.zoneout = 0.0f;
+  config.N = 1;
+  config.C = 128;
+  config.H = 512;
+  config.chunk_steps = DEFAULT_CHUNK_STEPS;
+  config.step_ms = DEFAULT_STEP_MS;
+  int streams = DEFAULT_STREAMS;
+  float duration_s = DEFAULT_DURATION_S;
+  string noisy = "none";
+  bool verify = false;
+  while ((c = getopt_long(argc, argv, "hl:u:k:N:C:H:c:bR:z:Vr:d:n:", long_options, &opt_index)) != -1)
+    switch (c) {
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      case 'l':
+        config.layer = optarg;
+        break;
+      case 'u':
+        config.per_step = optarg[0] == 's' || optarg[0] == 'S';
+        break;
+      case 'k':
+        sscanf(optarg, "%d", &streams);
+        break;
+      case 'N':
+        sscanf(optarg, "%d", &config.N);
+        break;
+      case 'C':
+        sscanf(optarg, "%d", &config.C);
+        break;
+      case 'H':
+        sscanf(optarg, "%d", &config.H);
+        break;
+      case 'c':
+        sscanf(optarg, "%d", &config.chunk_steps);
+        break;
+      case 'b':
+        config.bidirectional = true;
+        break;
+      case 'R':
+        sscanf(optarg, "%d", &config.right_context);
+        break;
+      case 'z':
+        sscanf(optarg, "%f", &config.zoneout);
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'r':
+        sscanf(optarg, "%f", &config.step_ms);
+        break;
+      case 'd':
+        sscanf(optarg, "%f", &duration_s);
+        break;
+      case 'n':
+        noisy = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+
+  if (config.layer != "lstm" && config.layer != "gru") {
+    fprintf(stderr, "Streaming is only supported for lstm and gru.\n");
+    return 1;
+  }
+  if (streams <= 0 || config.N <= 0 || config.C <= 0 || config.H <= 0 ||
+      config.chunk_steps <= 0 || config.step_ms <= 0.0f) {
+    fprintf(stderr, "Sizes, rates, and counts must be positive.\n");
+    return 1;
+  }
+  if (config.bidirectional && (config.layer != "lstm" || config.per_step)) {
+    fprintf(stderr, "Bidirectional streaming is only supported for lstm in chunk units.\n");
+    return 1;
+  }
+  if (config.right_context < 0) {
+    fprintf(stderr, "Right context must not be negative.\n");
+    return 1;
+  }
+  if (config.zoneout < 0.0f || config.zoneout > 1.0f) {
+    fprintf(stderr, "Zoneout probability must be in [0, 1].\n");
+    return 1;
+  }
+  if (verify && !config.bidirectional) {
+    fprintf(stderr, "Verification is only supported for the bidirectional layer.\n");
+    return 1;
+  }
+  if (noisy != "none" && noisy != "gpu" && noisy != "cpu" && noisy != "both") {
+    fprintf(stderr, "Unknown noisy neighbor load: %s\n", noisy.c_str());
+    return 1;
+  }
+
+  if (verify) {
+    // Several full chunks followed by a partial one.
+    const int steps = 3 * config.chunk_steps + config.right_context + config.chunk_steps / 2 + 1;
+    const float error = VerifyBidirectional(config, steps);
+    printf("# verify: %d steps, zoneout %g, max abs difference %g\n", steps, config.zoneout, error);
+    return error > 1e-4f;
+  }
+
+  const double chunk_ms = config.chunk_steps * config.step_ms;
+  config.chunks = std::max(2, static_cast<int>(duration_s * 1000.0 / chunk_ms));
+
+  printf("# Benchmark configuration:\n");
+  printf("#   Layer: %s\n", config.layer.c_str());
+  printf("#   Unit: %s\n", config.per_step ? "step (Iterate)" : "chunk (Run)");
+  printf("#   Streams: %d\n", streams);
+  printf("#   Batch size: %d\n", config.N);
+  printf("#   Input size: %d\n", config.C);
+  printf("#   Hidden size: %d\n", config.H);
+  printf("#   Chunk: %d steps, %g ms\n", config.chunk_steps, chunk_ms);
+  printf("#   Chunks per stream: %d\n", config.chunks);
+  printf("#   Noisy neighbor: %s\n", noisy.c_str());
+
+  // Sessions arrive staggered across one chunk period, as independent clients would.
+  const auto start = Clock::now() + std::chrono::milliseconds(100);
+  vector<std::unique_ptr<Session>> sessions;
+  for (int i = 0; i < streams; ++i) {
+    const auto offset = std::chrono::microseconds(static_cast<int64_t>(chunk_ms * 1000.0 * i / streams));
+    sessions.emplace_back(new Session(config, start + offset));
+  }
+  cudaDeviceSynchronize();
+
+  // Measured chunk latency doesn't include waiting for the right context to arrive.
+  if (config.bidirectional) {
+    const auto cost = sessions[0]->Cost();
+    printf("#   Bidirectional: latency-controlled, %d steps right context\n", config.right_context);
+    printf("#   Algorithmic latency: %d steps, %g ms\n",
+        cost.latency_steps, cost.latency_steps * config.step_ms);
+    printf("#   GFLOP per chunk: %f projection, %f forward, %f backward, %f total\n",
+        cost.projection_flops / 1e9, cost.forward_flops / 1e9, cost.backward_flops / 1e9,
+        cost.TotalFlops() / 1e9);
+    printf("#   Right context recompute: %f GFLOP per chunk (%.1f%% overhead)\n",
+        cost.recompute_flops / 1e9, cost.Overhead() * 100.0);
+  }
+  printf("#\n");
+
+  vector<SessionResult> results(streams);
+  {
+    NoisyNeighbor neighbor(noisy == "gpu" || noisy == "both", noisy == "cpu" || noisy == "both");
+    vector<std::thread> threads;
+    for (int i = 0; i < streams; ++i)
+      threads.emplace_back([&, i]() { sessions[i]->Run(results[i]); });
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+  SessionResult total;
+  double worst_rtf = 0.0;
+  for (const auto& result : results) {
+    total.step.Merge(result.step);
+    total.chunk.Merge(result.chunk);
+    total.busy_ms += result.busy_ms;
+    total.audio_ms += result.audio_ms;
+    total.chunks += result.chunks;
+    total.missed += result.missed;
+    if (result.audio_ms > 0.0)
+      worst_rtf = std::max(worst_rtf, result.busy_ms / result.audio_ms);
+  }
+
+  // Real-time factor: processing time per unit of stream time. Below 1 keeps up.
+  printf("# real_time_factor: %f\n", total.audio_ms > 0.0 ? total.busy_ms / total.audio_ms : 0.0);
+  printf("# worst_stream_real_time_factor: %f\n", worst_rtf);
+  printf("# late_chunks: %d/%d\n", total.missed, total.chunks);
+  printf("# latency,count,mean_ms,p50_ms,p90_ms,p99_ms,p99.9_ms,max_ms\n");
+  if (config.per_step)
+    PrintHistogram("step", total.step);
+  PrintHistogram("chunk", total.chunk);
+  return 0;
+}
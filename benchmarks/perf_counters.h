@@ -0,0 +1,158 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Host hardware performance counters read with `perf_event_open` around a measured
+// region. Only user-space events of the calling process are counted (including threads
+// it creates after `PerfCounters` is constructed, e.g. the reference implementation's
+// OpenMP workers). Counters the kernel or CPU refuses to open read as NaN; values are
+// scaled up if the kernel had to multiplex them. Nothing is counted on other platforms.
+//
+// There is no portable L2 event, so only L1D and last-level cache misses are reported.
+class PerfCounters {
+  public:
+    enum Counter {
+      kCycles,
+      kInstructions,
+      kL1dLoads,
+      kL1dLoadMisses,
+      kLlcLoads,
+      kLlcLoadMisses,
+      kDtlbLoadMisses,
+      kStalledFrontend,
+      kStalledBackend,
+      kCount
+    };
+
+    struct Values {
+      double value[kCount];
+
+      double operator[](Counter c) const { return value[c]; }
+
+      double Ipc() const { return value[kInstructions] / value[kCycles]; }
+      double L1dMissRate() const { return value[kL1dLoadMisses] / value[kL1dLoads]; }
+      double LlcMissRate() const { return value[kLlcLoadMisses] / value[kLlcLoads]; }
+      double DtlbMpki() const { return value[kDtlbLoadMisses] * 1000.0 / value[kInstructions]; }
+      double StalledFraction() const {
+        return (value[kStalledFrontend] + value[kStalledBackend]) / value[kCycles];
+      }
+    };
+
+    PerfCounters() {
+      for (int i = 0; i < kCount; ++i)
+        fd_[i] = -1;
+#ifdef __linux__
+      const auto cache = [](uint64_t cache, uint64_t result) {
+        return cache |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (result << 16);
+      };
+      Open(kCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      Open(kInstructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      Open(kL1dLoads, PERF_TYPE_HW_CACHE,
+          cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS));
+      Open(kL1dLoadMisses, PERF_TYPE_HW_CACHE,
+          cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS));
+      Open(kLlcLoads, PERF_TYPE_HW_CACHE,
+          cache(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS));
+      Open(kLlcLoadMisses, PERF_TYPE_HW_CACHE,
+          cache(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS));
+      Open(kDtlbLoadMisses, PERF_TYPE_HW_CACHE,
+          cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS));
+      Open(kStalledFrontend, PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND);
+      Open(kStalledBackend, PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND);
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+      for (int i = 0; i < kCount; ++i)
+        if (fd_[i] >= 0)
+          close(fd_[i]);
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Returns true if at least cycles and instructions could be opened.
+    bool Available() const {
+      return fd_[kCycles] >= 0 && fd_[kInstructions] >= 0;
+    }
+
+    void Start() {
+#ifdef __linux__
+      for (int i = 0; i < kCount; ++i) {
+        if (fd_[i] < 0)
+          continue;
+        ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+    }
+
+    // Stops counting and returns the counts since `Start` divided by `iterations`.
+    Values Stop(int iterations) {
+      Values values;
+      for (int i = 0; i < kCount; ++i)
+        values.value[i] = NAN;
+#ifdef __linux__
+      for (int i = 0; i < kCount; ++i) {
+        if (fd_[i] < 0)
+          continue;
+        ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        // value, time enabled, time running
+        uint64_t buffer[3];
+        if (read(fd_[i], buffer, sizeof(buffer)) != sizeof(buffer) || !buffer[2])
+          continue;
+        const double scale = static_cast<double>(buffer[1]) / buffer[2];
+        values.value[i] = buffer[0] * scale / iterations;
+      }
+#endif
+      return values;
+    }
+
+  private:
+#ifdef __linux__
+    void Open(Counter counter, uint32_t type, uint64_t config) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fd_[counter] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    int fd_[kCount];
+};
@@ -14,18 +14,180 @@
 # ==============================================================================
 
 import argparse
+import csv
+import json
 import matplotlib.pyplot as plt
 import numpy as np
 import os
+import sys
 
 
 def extract(x, predicate):
   return np.array(list(filter(predicate, x)))
 
 
+def load_roofline(path):
+  peaks = {}
+  with open(path) as f:
+    lines = []
+    for line in f:
+      if line.startswith('#'):
+        key, value = line[1:].split(':')
+        peaks[key.strip()] = float(value)
+      else:
+        lines.append(line)
+  return peaks, list(csv.DictReader(lines))
+
+
+def roofline(args):
+  peaks, rows = load_roofline(args.roofline)
+  peak_gflops = peaks['peak_gflops']
+  peak_gbps = peaks['peak_gbps']
+
+  for layer, mode in sorted({(row['layer'], row['mode']) for row in rows}):
+    points = [row for row in rows if row['layer'] == layer and row['mode'] == mode]
+    phases = sorted({row['phase'] for row in points})
+
+    intensity = np.array([float(row['intensity']) for row in points if float(row['intensity']) > 0])
+    lo = min(np.min(intensity), peak_gflops / peak_gbps) / 4
+    hi = max(np.max(intensity), peak_gflops / peak_gbps) * 4
+    x = np.geomspace(lo, hi, 256)
+
+    fig, ax = plt.subplots(dpi=200)
+    ax.spines['top'].set_visible(False)
+    ax.spines['right'].set_visible(False)
+    plt.loglog(x, np.minimum(peak_gflops, peak_gbps * x), color='black', linewidth=1)
+    for phase in phases:
+      p = [row for row in points if row['phase'] == phase and float(row['intensity']) > 0]
+      plt.scatter(
+          [float(row['intensity']) for row in p],
+          [float(row['gflops']) for row in p],
+          s=4,
+          label=phase)
+    plt.title(f'{layer} ({mode})')
+    plt.xlabel('arithmetic intensity (FLOP/byte)')
+    plt.ylabel('GFLOP/s')
+    plt.legend(frameon=False, fontsize='small')
+    plt.tight_layout()
+    if args.save:
+      os.makedirs(args.save[0], exist_ok=True)
+      plt.savefig(f'{args.save[0]}/roofline_{layer}_{mode}.png', dpi=200)
+    else:
+      plt.show()
+
+
+DEFAULT_COLUMNS = ['batch_size', 'hidden_size', 'input_size', 'time_steps']
+
+
+def load_samples(path):
+  """Returns the configuration column names and a dict from each configuration to all of
+  its timings. Accepts benchmark CSV output (one row per sample, e.g. from
+  `benchmark_layers --repeat`) or a baseline JSON written by `--write_baseline`."""
+  if path.endswith('.json'):
+    with open(path) as f:
+      data = json.load(f)
+    return data['columns'], {tuple(r['config']): r['time_ms'] for r in data['results']}
+
+  columns = None
+  samples = {}
+  with open(path) as f:
+    for line in f:
+      line = line.strip()
+      if not line:
+        continue
+      if line.startswith('#'):
+        # benchmark_layers prints its CSV header as a comment.
+        header = line[1:].strip()
+        if ',' in header and ':' not in header:
+          columns = header.split(',')[:-1]
+        continue
+      values = [float(v) for v in line.split(',')]
+      samples.setdefault(tuple(values[:-1]), []).append(values[-1])
+  if columns is None and samples:
+    columns = DEFAULT_COLUMNS[:len(next(iter(samples)))]
+  return columns, samples
+
+
+def write_baseline(args):
+  columns, samples = load_samples(args.A)
+  results = [{'config': list(config), 'time_ms': times} for config, times in sorted(samples.items())]
+  with open(args.write_baseline, 'w') as f:
+    json.dump({'columns': columns, 'results': results}, f, indent=1)
+
+
+def relative_change(base, new, rng, iterations=2000, confidence=0.95):
+  """Change of the median time from `base` to `new` as a fraction, with a bootstrap
+  confidence interval. The interval is None unless both sides have repeated samples."""
+  base = np.asarray(base)
+  new = np.asarray(new)
+  change = np.median(new) / np.median(base) - 1.0
+  if len(base) < 2 or len(new) < 2:
+    return change, None
+  b = np.median(rng.choice(base, (iterations, len(base))), axis=1)
+  n = np.median(rng.choice(new, (iterations, len(new))), axis=1)
+  tail = (1.0 - confidence) / 2 * 100
+  return change, np.percentile(n / b - 1.0, [tail, 100 - tail])
+
+
+def compare(args):
+  """Matches configurations between the baseline A and the new run B, and flags a
+  regression when B is slower by more than the threshold. With repeated samples the
+  whole confidence interval has to clear the threshold, so noise alone doesn't fail
+  the gate. Returns the process exit code."""
+  columns, base = load_samples(args.A)
+  _, new = load_samples(args.B)
+  threshold = args.threshold / 100
+  rng = np.random.default_rng(0)
+
+  rows = []
+  for config in sorted(set(base) & set(new)):
+    change, interval = relative_change(base[config], new[config], rng)
+    lower = change if interval is None else interval[0]
+    upper = change if interval is None else interval[1]
+    if lower > threshold:
+      verdict = 'REGRESSION'
+    elif upper < -threshold:
+      verdict = 'improvement'
+    else:
+      verdict = ''
+    rows.append((change, config, np.median(base[config]), np.median(new[config]), interval, verdict))
+
+  missing = sorted(set(base) - set(new))
+  if missing:
+    print(f'warning: {len(missing)} baseline configurations are missing from {args.B}', file=sys.stderr)
+  if not rows:
+    print('No matching configurations.', file=sys.stderr)
+    return 2
+
+  rows.sort(key=lambda r: r[0], reverse=True)
+  regressions = [r for r in rows if r[5] == 'REGRESSION']
+  changes = np.array([r[0] for r in rows])
+
+  print(f'{len(rows)} configurations, {len(regressions)} regressions beyond {args.threshold:g}%')
+  print(f'median change: {np.median(changes)*100:+.2f}%')
+  print()
+  header = ','.join(columns) if columns else 'config'
+  print(f'{"rank":>4}  {header:<40} {"base_ms":>10} {"new_ms":>10} {"change":>8}  {"95% interval":>17}  verdict')
+  for rank, (change, config, b, n, interval, verdict) in enumerate(rows[:args.top], 1):
+    name = ','.join(f'{v:g}' for v in config)
+    ci = '' if interval is None else f'[{interval[0]*100:+6.1f}, {interval[1]*100:+6.1f}]%'
+    print(f'{rank:>4}  {name:<40} {b:10.4f} {n:10.4f} {change*100:+7.2f}%  {ci:>17}  {verdict}'.rstrip())
+
+  return 1 if regressions else 0
+
+
 def main(args):
   np.set_printoptions(suppress=True)
 
+  if args.roofline:
+    roofline(args)
+    return
+  if args.write_baseline:
+    write_baseline(args)
+    return
+  if args.compare:
+    sys.exit(compare(args))
+
   A = np.loadtxt(args.A, delimiter=',')
   B = np.loadtxt(args.B, delimiter=',')
 
@@ -38,35 +200,57 @@ def main(args):
   print(f'  min:    {np.min(faster)*100:7.4}%')
   print(f'  max:    {np.max(faster)*100:7.4}%')
 
+  # benchmark_layers also sweeps over the number of time steps (column 3).
+  time_steps = np.unique(A[:,3]) if A.shape[1] > 4 else [None]
+
   for batch_size in np.unique(A[:,0]):
     for input_size in np.unique(A[:,2]):
-      a = extract(A, lambda x: x[0] == batch_size and x[2] == input_size)
-      b = extract(B, lambda x: x[0] == batch_size and x[2] == input_size)
-      fig, ax = plt.subplots(dpi=200)
-      ax.set_xticks(a[:,1])
-      ax.set_xticklabels(a[:,1].astype(np.int32), rotation=60)
-      ax.tick_params(axis='y', which='both', length=0)
-      ax.spines['top'].set_visible(False)
-      ax.spines['right'].set_visible(False)
-      plt.title(f'batch size={int(batch_size)}, input size={int(input_size)}')
-      plt.plot(a[:,1], a[:,-1], color=args.color[0])
-      plt.plot(a[:,1], b[:,-1], color=args.color[1])
-      plt.xlabel('hidden size')
-      plt.ylabel('time (ms)')
-      plt.legend(args.name, frameon=False)
-      plt.tight_layout()
-      if args.save:
-        os.makedirs(args.save[0], exist_ok=True)
-        plt.savefig(f'{args.save[0]}/report_n={int(batch_size)}_c={int(input_size)}.png', dpi=200)
-      else:
-        plt.show()
-
+      for steps in time_steps:
+        match = lambda x: x[0] == batch_size and x[2] == input_size and (steps is None or x[3] == steps)
+        a = extract(A, match)
+        b = extract(B, match)
+        title = f'batch size={int(batch_size)}, input size={int(input_size)}'
+        suffix = f'n={int(batch_size)}_c={int(input_size)}'
+        if steps is not None:
+          title += f', time steps={int(steps)}'
+          suffix += f'_t={int(steps)}'
+        fig, ax = plt.subplots(dpi=200)
+        ax.set_xticks(a[:,1])
+        ax.set_xticklabels(a[:,1].astype(np.int32), rotation=60)
+        ax.tick_params(axis='y', which='both', length=0)
+        ax.spines['top'].set_visible(False)
+        ax.spines['right'].set_visible(False)
+        plt.title(title)
+        plt.plot(a[:,1], a[:,-1], color=args.color[0])
+        plt.plot(a[:,1], b[:,-1], color=args.color[1])
+        plt.xlabel('hidden size')
+        plt.ylabel('time (ms)')
+        plt.legend(args.name, frameon=False)
+        plt.tight_layout()
+        if args.save:
+          os.makedirs(args.save[0], exist_ok=True)
+          plt.savefig(f'{args.save[0]}/report_{suffix}.png', dpi=200)
+        else:
+          plt.show()
 
 if __name__ == '__main__':
   parser = argparse.ArgumentParser()
   parser.add_argument('--name', nargs=2, default=['A', 'B'])
   parser.add_argument('--color', nargs=2, default=['#1f77b4', '#2ca02c'])
   parser.add_argument('--save', nargs=1, default=None)
-  parser.add_argument('A')
-  parser.add_argument('B')
-  main(parser.parse_args())
+  parser.add_argument('--roofline', default=None, help='roofline CSV written by benchmark_layers -r')
+  parser.add_argument('--compare', action='store_true',
+      help='compare run B against baseline A and exit with status 1 on regressions')
+  parser.add_argument('--threshold', type=float, default=5.0,
+      help='slowdown in percent that counts as a regression (default: 5)')
+  parser.add_argument('--top', type=int, default=20, help='rows to print with --compare')
+  parser.add_argument('--write_baseline', default=None, metavar='JSON',
+      help='store the samples in A as a baseline JSON file')
+  parser.add_argument('A', nargs='?')
+  parser.add_argument('B', nargs='?')
+  args = parser.parse_args()
+  if args.write_baseline and args.A is None:
+    parser.error('A is required with --write_baseline')
+  if not args.roofline and not args.write_baseline and (args.A is None or args.B is None):
+    parser.error('A and B are required unless --roofline or --write_baseline is given')
+  main(args)
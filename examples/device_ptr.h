@@ -15,10 +15,36 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 
+// Device memory currently and at most allocated through `device_ptr`, and the number of
+// allocations made. Benchmarks reset `count` and `peak_bytes` to measure a region. Not
+// thread-safe.
+struct device_allocations {
+  size_t count = 0;
+  size_t bytes = 0;
+  size_t peak_bytes = 0;
+
+  static device_allocations& get() {
+    static device_allocations allocations;
+    return allocations;
+  }
+
+  void add(size_t size) {
+    ++count;
+    bytes += size;
+    peak_bytes = std::max(peak_bytes, bytes);
+  }
+
+  void remove(size_t size) {
+    bytes -= size;
+  }
+};
+
 template<typename T>
 struct device_ptr {
   static constexpr size_t ElemSize = sizeof(typename T::Scalar);
@@ -32,6 +58,7 @@ struct device_ptr {
     void* tmp;
     cudaMalloc(&tmp, size * ElemSize);
     data = static_cast<typename T::Scalar*>(tmp);
+    device_allocations::get().add(size * ElemSize);
   }
 
   explicit device_ptr(const T& elem)
@@ -39,6 +66,7 @@ struct device_ptr {
     void* tmp;
     cudaMalloc(&tmp, size * ElemSize);
     data = static_cast<typename T::Scalar*>(tmp);
+    device_allocations::get().add(size * ElemSize);
     ToDevice(elem);
   }
 
@@ -79,6 +107,8 @@ struct device_ptr {
   }
 
   ~device_ptr() {
+    if (data)
+      device_allocations::get().remove(size * ElemSize);
     cudaFree(data);
   }
 
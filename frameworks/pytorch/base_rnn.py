@@ -69,6 +69,20 @@ class BaseRNN(nn.Module):
       zoneout_mask = input.new_empty(0, 0, 0)
     return zoneout_mask
 
+  def _get_dropout_mask(self, input, size, prob):
+    # Variational dropout mask for the reference implementation: one [N,size] draw per
+    # call, broadcast over time and scaled so that inference needs no rescaling.
+    if not prob:
+      return 1.0
+    dropout_mask = input.new_empty(1, input.shape[1], size)
+    return dropout_mask.bernoulli_(1.0 - prob) / (1.0 - prob)
+
+  def _get_dropout_seed(self):
+    # The CUDA kernels regenerate the dropout masks from this seed in both passes, so it
+    # has to change every call. Drawing it from the torch RNG keeps `torch.manual_seed`
+    # reproducible.
+    return int(torch.randint(0, 2**62, ()).item())
+
   def _is_cuda(self):
     is_cuda = [tensor.is_cuda for tensor in list(self.parameters())]
     if any(is_cuda) and not all(is_cuda):
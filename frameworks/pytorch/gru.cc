@@ -23,14 +23,20 @@
 
 namespace {
 
-using haste::v0::gru::ForwardPass;
+using haste::v0::dropout::Variational;
+using haste::v0::gru::BackwardOptions;
 using haste::v0::gru::BackwardPass;
+using haste::v0::gru::ForwardOptions;
+using haste::v0::gru::ForwardPass;
 
 using torch::Tensor;
 
 std::vector<Tensor> gru_forward(
     bool training,
     float zoneout_prob,
+    float input_dropout,
+    float output_dropout,
+    int64_t seed,
     Tensor x,
     Tensor h0,
     Tensor kernel,
@@ -43,6 +49,7 @@ std::vector<Tensor> gru_forward(
   const auto input_size = x.size(2);
   const auto hidden_size = recurrent_kernel.size(0);
   const bool has_zoneout = zoneout_prob && zoneout_mask.size(0);
+  const bool has_dropout = training && (input_dropout > 0.0f || output_dropout > 0.0f);
 
   CHECK_INPUT(x);
   CHECK_INPUT(h0);
@@ -51,6 +58,8 @@ std::vector<Tensor> gru_forward(
   CHECK_INPUT(bias);
   CHECK_INPUT(recurrent_bias);
   CHECK_INPUT(zoneout_mask);
+  TORCH_CHECK(input_dropout >= 0.0f && input_dropout < 1.0f, "input_dropout must be in [0,1)");
+  TORCH_CHECK(output_dropout >= 0.0f && output_dropout < 1.0f, "output_dropout must be in [0,1)");
 
   const auto options = x.options();
   const at::cuda::CUDAGuard guard(options.device_index());
@@ -58,6 +67,10 @@ std::vector<Tensor> gru_forward(
   Tensor cache = torch::empty({ time_steps, batch_size, hidden_size * 4 }, options);
   Tensor tmp_Wx = torch::empty({ time_steps, batch_size, hidden_size * 3 }, options);
   Tensor tmp_Rh = torch::empty({ batch_size, hidden_size * 3 }, options);
+  Tensor y = has_dropout && output_dropout > 0.0f
+      ? torch::empty({ time_steps, batch_size, hidden_size }, options)
+      : torch::empty({ 0, 0, 0 }, options);
+  const Variational dropout = { input_dropout, output_dropout, static_cast<unsigned long long>(seed) };
 
   output[0] = h0;
 
@@ -70,6 +83,12 @@ std::vector<Tensor> gru_forward(
         at::cuda::getCurrentCUDABlasHandle(),
         at::cuda::getCurrentCUDAStream());
 
+    ForwardOptions<typename native_type<scalar_t>::T> forward_options;
+    if (has_dropout) {
+      forward_options.dropout = &dropout;
+      forward_options.y = y.numel() ? ptr<scalar_t>(y) : nullptr;
+    }
+
     forward.Run(
         time_steps,
         ptr<scalar_t>(kernel),
@@ -82,13 +101,17 @@ std::vector<Tensor> gru_forward(
         ptr<scalar_t>(tmp_Wx),
         ptr<scalar_t>(tmp_Rh),
         has_zoneout ? zoneout_prob : 0.0f,
-        has_zoneout ? ptr<scalar_t>(zoneout_mask) : nullptr);
+        has_zoneout ? ptr<scalar_t>(zoneout_mask) : nullptr,
+        forward_options);
   }));
 
-  return { output, cache };
+  return { output, cache, y };
 }
 
 std::vector<Tensor> gru_backward(
+    float input_dropout,
+    float output_dropout,
+    int64_t seed,
     Tensor x_t,
     Tensor kernel_t,
     Tensor recurrent_kernel_t,
@@ -97,12 +120,14 @@ std::vector<Tensor> gru_backward(
     Tensor zoneout_mask,
     Tensor h,
     Tensor cache,
-    Tensor dh_new) {
+    Tensor dh_new,
+    Tensor dy) {
   const auto input_size = x_t.size(0);
   const auto time_steps = x_t.size(1);
   const auto batch_size = x_t.size(2);
   const auto hidden_size = recurrent_kernel_t.size(1);
   const bool has_zoneout = !!zoneout_mask.size(0);
+  const bool has_dropout = input_dropout > 0.0f || output_dropout > 0.0f;
 
   CHECK_INPUT(x_t);
   CHECK_INPUT(kernel_t);
@@ -124,6 +149,15 @@ std::vector<Tensor> gru_backward(
   Tensor dh = torch::zeros({ batch_size, hidden_size }, options);
   Tensor dp = torch::empty({ time_steps, batch_size, hidden_size * 3 }, options);
   Tensor dq = torch::empty({ time_steps, batch_size, hidden_size * 3 }, options);
+  const Variational dropout = { input_dropout, output_dropout, static_cast<unsigned long long>(seed) };
+
+  // With output dropout, the engine reads the gradient with respect to the dropped output
+  // from `dh_new[1:]` and the one with respect to the final state from `dh`.
+  if (output_dropout > 0.0f) {
+    CHECK_INPUT(dy);
+    dh.copy_(dh_new[time_steps]);
+    dh_new = torch::cat({ dh_new.narrow(0, 0, 1), dy });
+  }
 
   AT_DISPATCH_FLOATING_TYPES_AND_HALF(x_t.scalar_type(), "gru_backward", ([&] {
     BackwardPass<typename native_type<scalar_t>::T> backward(
@@ -133,6 +167,10 @@ std::vector<Tensor> gru_backward(
         at::cuda::getCurrentCUDABlasHandle(),
         at::cuda::getCurrentCUDAStream());
 
+    BackwardOptions<typename native_type<scalar_t>::T> backward_options;
+    if (has_dropout)
+      backward_options.dropout = &dropout;
+
     backward.Run(
         time_steps,
         ptr<scalar_t>(kernel_t),
@@ -151,7 +189,8 @@ std::vector<Tensor> gru_backward(
         ptr<scalar_t>(dh),
         ptr<scalar_t>(dp),
         ptr<scalar_t>(dq),
-        has_zoneout ? ptr<scalar_t>(zoneout_mask) : nullptr);
+        has_zoneout ? ptr<scalar_t>(zoneout_mask) : nullptr,
+        backward_options);
   }));
 
   return { dx, dh, dW, dR, dbx, dbr };
@@ -68,15 +68,19 @@ def GRUScript(
 
 class GRUFunction(torch.autograd.Function):
   @staticmethod
-  def forward(ctx, training, zoneout_prob, *inputs):
-    h, cache = LIB.gru_forward(training, zoneout_prob, *inputs)
+  def forward(ctx, training, zoneout_prob, input_dropout, output_dropout, seed, *inputs):
+    h, cache, y = LIB.gru_forward(
+        training, zoneout_prob, input_dropout, output_dropout, seed, *inputs)
     ctx.save_for_backward(inputs[0], *inputs[2:], h, cache)
     ctx.mark_non_differentiable(inputs[-1])
+    if not output_dropout:
+      ctx.mark_non_differentiable(y)
     ctx.training = training
-    return h
+    ctx.dropout = (input_dropout, output_dropout, seed)
+    return h, y
 
   @staticmethod
-  def backward(ctx, grad_h):
+  def backward(ctx, grad_h, grad_y):
     if not ctx.training:
       raise RuntimeError('GRU backward can only be called in training mode')
 
@@ -84,8 +88,10 @@ class GRUFunction(torch.autograd.Function):
     saved[0] = saved[0].permute(2, 0, 1).contiguous()
     saved[1] = saved[1].permute(1, 0).contiguous()
     saved[2] = saved[2].permute(1, 0).contiguous()
-    grads = LIB.gru_backward(*saved, grad_h.contiguous())
-    return (None, None, *grads, None)
+    if grad_y is None or not ctx.dropout[1]:
+      grad_y = grad_h.new_empty(0, 0, 0)
+    grads = LIB.gru_backward(*ctx.dropout, *saved, grad_h.contiguous(), grad_y.contiguous())
+    return (None, None, None, None, None, *grads, None)
 
 
 class GRU(BaseRNN):
@@ -99,8 +105,8 @@ class GRU(BaseRNN):
   variant, 1406.1078v3, applies the reset gate before matrix multiplication
   and is currently unsupported.
 
-  This layer has built-in support for DropConnect and Zoneout, which are
-  both techniques used to regularize RNNs.
+  This layer has built-in support for DropConnect, variational dropout, and
+  Zoneout, which are all techniques used to regularize RNNs.
 
   See [\_\_init\_\_](#__init__) and [forward](#forward) for usage.
   See [from_native_weights](#from_native_weights) and
@@ -113,6 +119,8 @@ class GRU(BaseRNN):
       batch_first=False,
       dropout=0.0,
       zoneout=0.0,
+      input_dropout=0.0,
+      output_dropout=0.0,
       return_state_sequence=False):
     """
     Initialize the parameters of the GRU layer.
@@ -126,6 +134,12 @@ class GRU(BaseRNN):
         regularization on the recurrent matrix.
       zoneout: (optional) float, sets the zoneout rate for Zoneout
         regularization.
+      input_dropout: (optional) float, sets the rate of variational dropout
+        on the input features. Each sequence drops the same features at every
+        time step.
+      output_dropout: (optional) float, sets the rate of variational dropout
+        on the output units. Only the output is dropped; the returned state
+        is not. Can't be combined with `return_state_sequence` or `lengths`.
       return_state_sequence: (optional) bool, if `True`, the forward pass will
         return the entire state sequence instead of just the final state. Note
         that if the input is a padded sequence, the returned state will also
@@ -149,8 +163,16 @@ class GRU(BaseRNN):
       raise ValueError('GRU: dropout must be in [0.0, 1.0]')
     if zoneout < 0 or zoneout > 1:
       raise ValueError('GRU: zoneout must be in [0.0, 1.0]')
+    if input_dropout < 0 or input_dropout >= 1:
+      raise ValueError('GRU: input_dropout must be in [0.0, 1.0)')
+    if output_dropout < 0 or output_dropout >= 1:
+      raise ValueError('GRU: output_dropout must be in [0.0, 1.0)')
+    if output_dropout and return_state_sequence:
+      raise ValueError('GRU: output_dropout can\'t be used with return_state_sequence')
 
     self.dropout = dropout
+    self.input_dropout = input_dropout
+    self.output_dropout = output_dropout
 
     self.kernel = nn.Parameter(torch.empty(input_size, hidden_size * 3))
     self.recurrent_kernel = nn.Parameter(torch.empty(hidden_size, hidden_size * 3))
@@ -238,19 +260,27 @@ class GRU(BaseRNN):
       h_n: the hidden state for the last sequence item. Dimensions
         (1, batch_size, hidden_size).
     """
+    if self.output_dropout and lengths is not None:
+      raise ValueError('GRU: output_dropout can\'t be used with lengths')
+
     input = self._permute(input)
     state_shape = [1, input.shape[1], self.hidden_size]
     h0 = self._get_state(input, state, state_shape)
-    h = self._impl(input, h0[0], self._get_zoneout_mask(input))
+    h, y = self._impl(input, h0[0], self._get_zoneout_mask(input))
     state = self._get_final_state(h, lengths)
-    output = self._permute(h[1:])
+    output = self._permute(y)
     return output, state
 
   def _impl(self, input, state, zoneout_mask):
+    input_dropout = self.input_dropout if self.training else 0.0
+    output_dropout = self.output_dropout if self.training else 0.0
     if self._is_cuda():
-      return GRUFunction.apply(
+      h, y = GRUFunction.apply(
           self.training,
           self.zoneout,
+          input_dropout,
+          output_dropout,
+          self._get_dropout_seed(),
           input.contiguous(),
           state.contiguous(),
           self.kernel.contiguous(),
@@ -258,8 +288,10 @@ class GRU(BaseRNN):
           self.bias.contiguous(),
           self.recurrent_bias.contiguous(),
           zoneout_mask.contiguous())
+      return h, y if output_dropout else h[1:]
     else:
-      return GRUScript(
+      input = input * self._get_dropout_mask(input, input.shape[-1], input_dropout)
+      h = GRUScript(
           self.training,
           self.zoneout,
           input.contiguous(),
@@ -269,3 +301,4 @@ class GRU(BaseRNN):
           self.bias.contiguous(),
           self.recurrent_bias.contiguous(),
           zoneout_mask.contiguous())
+      return h, h[1:] * self._get_dropout_mask(input, self.hidden_size, output_dropout)
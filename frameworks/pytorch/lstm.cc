@@ -23,14 +23,20 @@
 
 namespace {
 
-using haste::v0::lstm::ForwardPass;
+using haste::v0::dropout::Variational;
+using haste::v0::lstm::BackwardOptions;
 using haste::v0::lstm::BackwardPass;
+using haste::v0::lstm::ForwardOptions;
+using haste::v0::lstm::ForwardPass;
 
 using torch::Tensor;
 
 std::vector<Tensor> lstm_forward(
     bool training,
     float zoneout_prob,
+    float input_dropout,
+    float output_dropout,
+    int64_t seed,
     Tensor x,
     Tensor h0,
     Tensor c0,
@@ -43,6 +49,7 @@ std::vector<Tensor> lstm_forward(
   const auto input_size = x.size(2);
   const auto hidden_size = recurrent_kernel.size(0);
   const bool has_zoneout = zoneout_prob && zoneout_mask.size(0);
+  const bool has_dropout = training && (input_dropout > 0.0f || output_dropout > 0.0f);
 
   CHECK_INPUT(x);
   CHECK_INPUT(h0);
@@ -51,6 +58,8 @@ std::vector<Tensor> lstm_forward(
   CHECK_INPUT(recurrent_kernel);
   CHECK_INPUT(bias);
   CHECK_INPUT(zoneout_mask);
+  TORCH_CHECK(input_dropout >= 0.0f && input_dropout < 1.0f, "input_dropout must be in [0,1)");
+  TORCH_CHECK(output_dropout >= 0.0f && output_dropout < 1.0f, "output_dropout must be in [0,1)");
 
   const auto options = x.options();
   const at::cuda::CUDAGuard guard(options.device_index());
@@ -58,6 +67,10 @@ std::vector<Tensor> lstm_forward(
   Tensor output_state = torch::empty({ time_steps + 1, batch_size, hidden_size }, options);
   Tensor cache = torch::empty({ time_steps, batch_size, hidden_size * 4 }, options);
   Tensor tmp_Rh = torch::empty({ batch_size, hidden_size * 4 }, options);
+  Tensor y = has_dropout && output_dropout > 0.0f
+      ? torch::empty({ time_steps, batch_size, hidden_size }, options)
+      : torch::empty({ 0, 0, 0 }, options);
+  const Variational dropout = { input_dropout, output_dropout, static_cast<unsigned long long>(seed) };
 
   output[0] = h0;
   output_state[0] = c0;
@@ -71,6 +84,12 @@ std::vector<Tensor> lstm_forward(
         at::cuda::getCurrentCUDABlasHandle(),
         at::cuda::getCurrentCUDAStream());
 
+    ForwardOptions<scalar_t> forward_options;
+    if (has_dropout) {
+      forward_options.dropout = &dropout;
+      forward_options.y = y.numel() ? y.data_ptr<scalar_t>() : nullptr;
+    }
+
     forward.Run(
         time_steps,
         kernel.data_ptr<scalar_t>(),
@@ -82,13 +101,17 @@ std::vector<Tensor> lstm_forward(
         cache.data_ptr<scalar_t>(),
         tmp_Rh.data_ptr<scalar_t>(),
         has_zoneout ? zoneout_prob : 0.0f,
-        has_zoneout ? zoneout_mask.data_ptr<scalar_t>() : nullptr);
+        has_zoneout ? zoneout_mask.data_ptr<scalar_t>() : nullptr,
+        forward_options);
   }));
 
-  return { output, output_state, cache };
+  return { output, output_state, cache, y };
 }
 
 std::vector<Tensor> lstm_backward(
+    float input_dropout,
+    float output_dropout,
+    int64_t seed,
     Tensor x_t,
     Tensor kernel_t,
     Tensor recurrent_kernel_t,
@@ -98,12 +121,14 @@ std::vector<Tensor> lstm_backward(
     Tensor c,
     Tensor cache,
     Tensor dh_new,
-    Tensor dc_new) {
+    Tensor dc_new,
+    Tensor dy) {
   const auto input_size = x_t.size(0);
   const auto time_steps = x_t.size(1);
   const auto batch_size = x_t.size(2);
   const auto hidden_size = recurrent_kernel_t.size(1);
   const bool has_zoneout = !!zoneout_mask.size(0);
+  const bool has_dropout = input_dropout > 0.0f || output_dropout > 0.0f;
 
   CHECK_INPUT(x_t);
   CHECK_INPUT(kernel_t);
@@ -124,6 +149,15 @@ std::vector<Tensor> lstm_backward(
   Tensor db = torch::zeros_like(bias);
   Tensor dh = torch::zeros({ batch_size, hidden_size }, options);
   Tensor dc = torch::zeros({ batch_size, hidden_size }, options);
+  const Variational dropout = { input_dropout, output_dropout, static_cast<unsigned long long>(seed) };
+
+  // With output dropout, the engine reads the gradient with respect to the dropped output
+  // from `dh_new[1:]` and the one with respect to the final state from `dh`.
+  if (output_dropout > 0.0f) {
+    CHECK_INPUT(dy);
+    dh.copy_(dh_new[time_steps]);
+    dh_new = torch::cat({ dh_new.narrow(0, 0, 1), dy });
+  }
 
   AT_DISPATCH_FLOATING_TYPES(x_t.scalar_type(), "lstm_backward", ([&] {
     BackwardPass<scalar_t> backward(
@@ -133,6 +167,10 @@ std::vector<Tensor> lstm_backward(
         at::cuda::getCurrentCUDABlasHandle(),
         at::cuda::getCurrentCUDAStream());
 
+    BackwardOptions<scalar_t> backward_options;
+    if (has_dropout)
+      backward_options.dropout = &dropout;
+
     backward.Run(
         time_steps,
         kernel_t.data_ptr<scalar_t>(),
@@ -150,7 +188,8 @@ std::vector<Tensor> lstm_backward(
         dh.data_ptr<scalar_t>(),
         dc.data_ptr<scalar_t>(),
         cache.data_ptr<scalar_t>(),
-        has_zoneout ? zoneout_mask.data_ptr<scalar_t>() : nullptr);
+        has_zoneout ? zoneout_mask.data_ptr<scalar_t>() : nullptr,
+        backward_options);
   }));
 
   return { dx, dh, dc, dW, dR, db };
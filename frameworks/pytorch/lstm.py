@@ -68,15 +68,19 @@ def LSTMScript(
 
 class LSTMFunction(torch.autograd.Function):
   @staticmethod
-  def forward(ctx, training, zoneout_prob, *inputs):
-    h, c, cache = LIB.lstm_forward(training, zoneout_prob, *inputs)
+  def forward(ctx, training, zoneout_prob, input_dropout, output_dropout, seed, *inputs):
+    h, c, cache, y = LIB.lstm_forward(
+        training, zoneout_prob, input_dropout, output_dropout, seed, *inputs)
     ctx.save_for_backward(inputs[0], *inputs[3:], h, c, cache)
     ctx.mark_non_differentiable(inputs[-1])
+    if not output_dropout:
+      ctx.mark_non_differentiable(y)
     ctx.training = training
-    return h, c
+    ctx.dropout = (input_dropout, output_dropout, seed)
+    return h, c, y
 
   @staticmethod
-  def backward(ctx, grad_h, grad_c):
+  def backward(ctx, grad_h, grad_c, grad_y):
     if not ctx.training:
       raise RuntimeError('LSTM backward can only be called in training mode')
 
@@ -84,8 +88,15 @@ class LSTMFunction(torch.autograd.Function):
     saved[0] = saved[0].permute(2, 0, 1).contiguous()
     saved[1] = saved[1].permute(1, 0).contiguous()
     saved[2] = saved[2].permute(1, 0).contiguous()
-    grads = LIB.lstm_backward(*saved, grad_h.contiguous(), grad_c.contiguous())
-    return (None, None, *grads, None)
+    if grad_y is None or not ctx.dropout[1]:
+      grad_y = grad_h.new_empty(0, 0, 0)
+    grads = LIB.lstm_backward(
+        *ctx.dropout,
+        *saved,
+        grad_h.contiguous(),
+        grad_c.contiguous(),
+        grad_y.contiguous())
+    return (None, None, None, None, None, *grads, None)
 
 
 class LSTM(BaseRNN):
@@ -95,8 +106,9 @@ class LSTM(BaseRNN):
   This LSTM layer offers a fused, GPU-accelerated PyTorch op for inference
   and training. Although this implementation is comparable in performance to
   cuDNN's LSTM, it offers additional options not typically found in other
-  high-performance implementations. DropConnect and Zoneout regularization are
-  built-in, and this layer allows setting a non-zero initial forget gate bias.
+  high-performance implementations. DropConnect, variational dropout, and Zoneout
+  regularization are built-in, and this layer allows setting a non-zero initial
+  forget gate bias.
 
   See [\_\_init\_\_](#__init__) and [forward](#forward) for general usage.
   See [from_native_weights](#from_native_weights) and
@@ -110,6 +122,8 @@ class LSTM(BaseRNN):
       forget_bias=1.0,
       dropout=0.0,
       zoneout=0.0,
+      input_dropout=0.0,
+      output_dropout=0.0,
       return_state_sequence=False):
     """
     Initialize the parameters of the LSTM layer.
@@ -125,6 +139,12 @@ class LSTM(BaseRNN):
         regularization on the recurrent matrix.
       zoneout: (optional) float, sets the zoneout rate for Zoneout
         regularization.
+      input_dropout: (optional) float, sets the rate of variational dropout
+        on the input features. Each sequence drops the same features at every
+        time step.
+      output_dropout: (optional) float, sets the rate of variational dropout
+        on the output units. Only the output is dropped; the returned state
+        is not. Can't be combined with `return_state_sequence` or `lengths`.
       return_state_sequence: (optional) bool, if `True`, the forward pass will
         return the entire state sequence instead of just the final state. Note
         that if the input is a padded sequence, the returned state will also
@@ -147,9 +167,17 @@ class LSTM(BaseRNN):
       raise ValueError('LSTM: dropout must be in [0.0, 1.0]')
     if zoneout < 0 or zoneout > 1:
       raise ValueError('LSTM: zoneout must be in [0.0, 1.0]')
+    if input_dropout < 0 or input_dropout >= 1:
+      raise ValueError('LSTM: input_dropout must be in [0.0, 1.0)')
+    if output_dropout < 0 or output_dropout >= 1:
+      raise ValueError('LSTM: output_dropout must be in [0.0, 1.0)')
+    if output_dropout and return_state_sequence:
+      raise ValueError('LSTM: output_dropout can\'t be used with return_state_sequence')
 
     self.forget_bias = forget_bias
     self.dropout = dropout
+    self.input_dropout = input_dropout
+    self.output_dropout = output_dropout
 
     self.kernel = nn.Parameter(torch.empty(input_size, hidden_size * 4))
     self.recurrent_kernel = nn.Parameter(torch.empty(hidden_size, hidden_size * 4))
@@ -231,20 +259,28 @@ class LSTM(BaseRNN):
       (h_n, c_n): the hidden and cell states, respectively, for the last
         sequence item. Dimensions (1, batch_size, hidden_size).
     """
+    if self.output_dropout and lengths is not None:
+      raise ValueError('LSTM: output_dropout can\'t be used with lengths')
+
     input = self._permute(input)
     state_shape = [1, input.shape[1], self.hidden_size]
     state_shape = (state_shape, state_shape)
     h0, c0 = self._get_state(input, state, state_shape)
-    h, c = self._impl(input, (h0[0], c0[0]), self._get_zoneout_mask(input))
+    h, c, y = self._impl(input, (h0[0], c0[0]), self._get_zoneout_mask(input))
     state = self._get_final_state((h, c), lengths)
-    output = self._permute(h[1:])
+    output = self._permute(y)
     return output, state
 
   def _impl(self, input, state, zoneout_mask):
+    input_dropout = self.input_dropout if self.training else 0.0
+    output_dropout = self.output_dropout if self.training else 0.0
     if self._is_cuda():
-      return LSTMFunction.apply(
+      h, c, y = LSTMFunction.apply(
           self.training,
           self.zoneout,
+          input_dropout,
+          output_dropout,
+          self._get_dropout_seed(),
           input.contiguous(),
           state[0].contiguous(),
           state[1].contiguous(),
@@ -252,8 +288,10 @@ class LSTM(BaseRNN):
           F.dropout(self.recurrent_kernel, self.dropout, self.training).contiguous(),
           self.bias.contiguous(),
           zoneout_mask.contiguous())
+      return h, c, y if output_dropout else h[1:]
     else:
-      return LSTMScript(
+      input = input * self._get_dropout_mask(input, input.shape[-1], input_dropout)
+      h, c = LSTMScript(
           self.training,
           self.zoneout,
           input.contiguous(),
@@ -263,3 +301,4 @@ class LSTM(BaseRNN):
           F.dropout(self.recurrent_kernel, self.dropout, self.training).contiguous(),
           self.bias.contiguous(),
           zoneout_mask.contiguous())
+      return h, c, h[1:] * self._get_dropout_mask(input, self.hidden_size, output_dropout)
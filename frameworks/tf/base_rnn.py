@@ -125,6 +125,19 @@ class BaseRNN(tf.Module):
 
     return result, state
 
+  def invalidate_weights(self):
+    """
+    Discards the weights cached for inference.
+
+    Only layers constructed with `cache_weights=True` cache their weights.
+    Call this method after assigning new values to the layer's variables
+    outside of a training call (e.g. after restoring a checkpoint). Calling
+    the layer with `training=True` discards the cache on its own.
+    """
+    for layer in [self.fw_layer, self.bw_layer]:
+      if layer is not None and layer.weight_cache is not None:
+        layer.weight_cache.invalidate()
+
   @property
   def bidirectional(self):
     """`True` if this is a bidirectional RNN, `False` otherwise."""
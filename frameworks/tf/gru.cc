@@ -25,7 +25,10 @@
 
 using namespace tensorflow;
 
+using haste::v0::dropout::Variational;
+using haste::v0::gru::BackwardOptions;
 using haste::v0::gru::BackwardPass;
+using haste::v0::gru::ForwardOptions;
 using haste::v0::gru::ForwardPass;
 using tensorflow::se::Stream;
 using tensorflow::shape_inference::DimensionHandle;
@@ -37,14 +40,18 @@ REGISTER_OP("HasteGru")
     .Attr("R: {float, double}")         // Some real number type.
     .Attr("training: bool")
     .Attr("zoneout_prob: float")
+    .Attr("input_dropout: float = 0.0")
+    .Attr("output_dropout: float = 0.0")
     .Input("x: R")                      // [T,N,C]
     .Input("kernel: R")                 // [C,H*3]
     .Input("recurrent_kernel: R")       // [H,H*3]
     .Input("bias: R")                   // [H*3]
     .Input("recurrent_bias: R")         // [H*3]
     .Input("zoneout_mask: R")           // [T,N,H]
+    .Input("seed: int64")               // []
     .Output("h: R")                     // [T,N,H]
     .Output("v: R")                     // [T,N,H*4]
+    .Output("y: R")                     // [T,N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle input_shape;
       ShapeHandle kernel_shape;
@@ -52,6 +59,7 @@ REGISTER_OP("HasteGru")
       ShapeHandle bias_shape;
       ShapeHandle recurrent_bias_shape;
       ShapeHandle zoneout_mask_shape;
+      ShapeHandle seed_shape;
 
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 3, &input_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &kernel_shape));
@@ -59,6 +67,7 @@ REGISTER_OP("HasteGru")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &bias_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &recurrent_bias_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 3, &zoneout_mask_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 0, &seed_shape));
 
       const DimensionHandle time_steps = c->Dim(input_shape, 0);
       const DimensionHandle batch_size = c->Dim(input_shape, 1);
@@ -71,6 +80,7 @@ REGISTER_OP("HasteGru")
 
       c->set_output(0, c->MakeShape({ time_steps_plus_1, batch_size, hidden_size }));
       c->set_output(1, c->MakeShape({ time_steps, batch_size, hidden_size_4 }));
+      c->set_output(2, c->UnknownShapeOfRank(3));
       return Status::OK();
     });
 
@@ -79,6 +89,12 @@ struct HasteGruOp : public OpKernel {
   explicit HasteGruOp(OpKernelConstruction* context) : OpKernel(context) {
     OP_REQUIRES_OK(context, context->GetAttr("training", &training_));
     OP_REQUIRES_OK(context, context->GetAttr("zoneout_prob", &zoneout_prob_));
+    OP_REQUIRES_OK(context, context->GetAttr("input_dropout", &dropout_.input_prob));
+    OP_REQUIRES_OK(context, context->GetAttr("output_dropout", &dropout_.output_prob));
+    OP_REQUIRES(context, dropout_.input_prob >= 0.0f && dropout_.input_prob < 1.0f,
+        errors::InvalidArgument("input_dropout must be in [0,1). Found ", dropout_.input_prob));
+    OP_REQUIRES(context, dropout_.output_prob >= 0.0f && dropout_.output_prob < 1.0f,
+        errors::InvalidArgument("output_dropout must be in [0,1). Found ", dropout_.output_prob));
   }
 
   // When running on GPU, TF backs all inputs and outputs with device memory
@@ -91,12 +107,15 @@ struct HasteGruOp : public OpKernel {
     const Tensor& bias = context->input(3);
     const Tensor& recurrent_bias = context->input(4);
     const Tensor& zoneout_mask = context->input(5);
+    const Tensor& seed = context->input(6);
 
     const auto time_steps = input.shape().dim_size(0);
     const auto batch_size = input.shape().dim_size(1);
     const auto input_size = input.shape().dim_size(2);
     const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = zoneout_prob_ && zoneout_mask.NumElements();
+    const bool has_dropout = training_ && (dropout_.input_prob > 0.0f || dropout_.output_prob > 0.0f);
+    const bool has_output_dropout = has_dropout && dropout_.output_prob > 0.0f;
     const auto data_type = DataTypeToEnum<T>::value;
 
     OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
@@ -112,6 +131,14 @@ struct HasteGruOp : public OpKernel {
     Tensor* v_out = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(1, v_out_shape, &v_out));
 
+    // The dropped-out output is only materialized with output dropout; otherwise the
+    // caller uses `h[1:]`.
+    const TensorShape y_shape = has_output_dropout
+        ? TensorShape({ time_steps, batch_size, hidden_size })
+        : TensorShape({ 0, 0, 0 });
+    Tensor* output_y = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(2, y_shape, &output_y));
+
     Tensor tmp_Wx;
     const TensorShape tmp_Wx_shape = { time_steps, batch_size, hidden_size * 3};
     OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Wx_shape, &tmp_Wx));
@@ -122,12 +149,22 @@ struct HasteGruOp : public OpKernel {
 
     cudaMemset(output->flat<T>().data(), 0, output->AllocatedBytes());
 
+    Variational dropout = dropout_;
+    dropout.seed = static_cast<unsigned long long>(seed.scalar<int64>()());
+
+    ForwardOptions<T> options;
+    if (has_dropout) {
+      options.dropout = &dropout;
+      options.y = has_output_dropout ? output_y->flat<T>().data() : nullptr;
+    }
+
     ForwardPass<T> forward(
         training_,
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     forward.Run(
         time_steps,
@@ -141,33 +178,153 @@ struct HasteGruOp : public OpKernel {
         tmp_Wx.flat<T>().data(),
         tmp_Rh.flat<T>().data(),
         has_zoneout ? zoneout_prob_ : 0.0f,
-        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr);
+        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr,
+        options);
   }
 
   private:
     bool training_;
     float zoneout_prob_;
+    Variational dropout_;
 };
 
-REGISTER_GPU_KERNEL(HasteGru, float);
-REGISTER_GPU_KERNEL(HasteGru, double);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteGru, float);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteGru, double);
+
+// Single-step variant of `HasteGru` for use inside `tf.while_loop` and RNN cell APIs.
+// Unlike `HasteGru`, the initial hidden state is an input. The first slice of the output
+// `h` is a copy of that state so that the op's gradient can reuse `HasteGruGrad`.
+REGISTER_OP("HasteGruCell")
+    .Attr("R: {float, double}")         // Some real number type.
+    .Input("x: R")                      // [N,C]
+    .Input("h: R")                      // [N,H]
+    .Input("kernel: R")                 // [C,H*3]
+    .Input("recurrent_kernel: R")       // [H,H*3]
+    .Input("bias: R")                   // [H*3]
+    .Input("recurrent_bias: R")         // [H*3]
+    .Output("h_out: R")                 // [2,N,H]
+    .Output("v: R")                     // [1,N,H*4]
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle input_shape;
+      ShapeHandle h_shape;
+      ShapeHandle kernel_shape;
+      ShapeHandle recurrent_shape;
+      ShapeHandle bias_shape;
+      ShapeHandle recurrent_bias_shape;
+
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 2, &input_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &h_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &kernel_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &recurrent_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &bias_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &recurrent_bias_shape));
+
+      const DimensionHandle batch_size = c->Dim(input_shape, 0);
+      const DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
+      DimensionHandle hidden_size_4;
+
+      TF_RETURN_IF_ERROR(c->Multiply(hidden_size, 4, &hidden_size_4));
+
+      c->set_output(0, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(1, c->MakeShape({ 1, batch_size, hidden_size_4 }));
+      return Status::OK();
+    });
+
+template<typename T>
+struct HasteGruCellOp : public OpKernel {
+  explicit HasteGruCellOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& input = context->input(0);
+    const Tensor& h = context->input(1);
+    const Tensor& kernel = context->input(2);
+    const Tensor& recurrent_kernel = context->input(3);
+    const Tensor& bias = context->input(4);
+    const Tensor& recurrent_bias = context->input(5);
+
+    const auto batch_size = input.shape().dim_size(0);
+    const auto input_size = input.shape().dim_size(1);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
+    const auto data_type = DataTypeToEnum<T>::value;
+
+    OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
+        errors::InvalidArgument("input[1] and kernel[0] dimensions must match. Found ",
+            input_size, " and ", kernel.shape().dim_size(0)));
+    OP_REQUIRES(context, h.shape() == TensorShape({ batch_size, hidden_size }),
+        errors::InvalidArgument("h must have shape [N,H]. Found ", h.shape().DebugString()));
+
+    const TensorShape output_shape = { 2, batch_size, hidden_size };
+    const TensorShape v_out_shape = { 1, batch_size, hidden_size * 4 };
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+
+    Tensor* v_out = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(1, v_out_shape, &v_out));
+
+    Tensor tmp_Wx;
+    const TensorShape tmp_Wx_shape = { batch_size, hidden_size * 3 };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Wx_shape, &tmp_Wx));
+
+    Tensor tmp_Rh;
+    const TensorShape tmp_Rh_shape = { batch_size, hidden_size * 3 };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Rh_shape, &tmp_Rh));
+
+    cudaMemcpyAsync(
+        output->flat<T>().data(),
+        h.flat<T>().data(),
+        h.TotalBytes(),
+        cudaMemcpyDeviceToDevice,
+        GetCudaStream(context));
+
+    ForwardPass<T> forward(
+        true,
+        batch_size,
+        input_size,
+        hidden_size,
+        GetCublasHandle(context),
+        GetCudaStream(context));
+
+    forward.Run(
+        1,
+        kernel.flat<T>().data(),
+        recurrent_kernel.flat<T>().data(),
+        bias.flat<T>().data(),
+        recurrent_bias.flat<T>().data(),
+        input.flat<T>().data(),
+        output->flat<T>().data(),
+        v_out->flat<T>().data(),
+        tmp_Wx.flat<T>().data(),
+        tmp_Rh.flat<T>().data(),
+        0.0f,
+        nullptr);
+  }
+};
+
+REGISTER_GPU_KERNEL(HasteGruCell, float);
+REGISTER_GPU_KERNEL(HasteGruCell, double);
 
 REGISTER_OP("HasteGruGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [T,C,N]
-    .Input("kernel_t: R")              // [H*3,C]
-    .Input("recurrent_kernel_t: R")    // [H*3,H]
+    .Attr("input_dropout: float = 0.0")
+    .Attr("output_dropout: float = 0.0")
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H*3]
+    .Input("recurrent_kernel: R")      // [H,H*3]
     .Input("bias: R")                  // [H*3]
     .Input("recurrent_bias: R")        // [H*3]
     .Input("h: R")                     // [T,N,H]
     .Input("v: R")                     // [T,N,H*4]
     .Input("dh_new: R")                // [T,N,H]
     .Input("zoneout_mask: R")          // [T,N,H]
+    .Input("seed: int64")              // []
+    .Input("dy: R")                    // [T,N,H]
     .Output("dx: R")                   // [T,N,C]
     .Output("dw: R")                   // [C,H*3]
     .Output("dr: R")                   // [H,H*3]
     .Output("dbx: R")                  // [H*3]
     .Output("dbr: R")                  // [H*3]
+    .Output("dh: R")                   // [N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle x_shape;
       ShapeHandle kernel_shape;
@@ -178,6 +335,8 @@ REGISTER_OP("HasteGruGrad")
       ShapeHandle v_shape;
       ShapeHandle dh_new_shape;
       ShapeHandle zoneout_mask_shape;
+      ShapeHandle seed_shape;
+      ShapeHandle dy_shape;
 
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 3, &x_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &kernel_shape));
@@ -188,23 +347,29 @@ REGISTER_OP("HasteGruGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 3, &v_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(7), 3, &dh_new_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(8), 3, &zoneout_mask_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(9), 0, &seed_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(10), 3, &dy_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
-      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 1);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
+      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 0);
 
       c->set_output(0, c->MakeShape({ time_steps, batch_size, input_size }));
       c->set_output(1, c->MakeShape({ input_size, c->Value(hidden_size) * 3 }));
       c->set_output(2, c->MakeShape({ hidden_size, c->Value(hidden_size) * 3 }));
       c->set_output(3, bias_shape);
       c->set_output(4, recurrent_bias_shape);
+      c->set_output(5, c->MakeShape({ batch_size, hidden_size }));
       return Status::OK();
     });
 
 template<typename T>
 struct HasteGruGradOp : public OpKernel {
-  explicit HasteGruGradOp(OpKernelConstruction* context) : OpKernel(context) {}
+  explicit HasteGruGradOp(OpKernelConstruction* context) : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("input_dropout", &dropout_.input_prob));
+    OP_REQUIRES_OK(context, context->GetAttr("output_dropout", &dropout_.output_prob));
+  }
 
   void Compute(OpKernelContext* context) override {
     const Tensor& input = context->input(0);
@@ -216,14 +381,37 @@ struct HasteGruGradOp : public OpKernel {
     const Tensor& v_vector = context->input(6);
     const Tensor& dh_new = context->input(7);
     const Tensor& zoneout_mask = context->input(8);
+    const Tensor& seed = context->input(9);
+    const Tensor& dy = context->input(10);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
-    const auto hidden_size = recurrent_kernel.shape().dim_size(1);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
+    const bool has_dropout = dropout_.input_prob > 0.0f || dropout_.output_prob > 0.0f;
+    const bool has_output_dropout = dropout_.output_prob > 0.0f;
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Tensor recurrent_kernel_t;
+    const TensorShape recurrent_kernel_t_shape = { recurrent_kernel.dim_size(1), recurrent_kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, recurrent_kernel_t_shape, &recurrent_kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+    Transpose<T>(context, recurrent_kernel.dim_size(0), recurrent_kernel.dim_size(1),
+        recurrent_kernel.flat<T>().data(), recurrent_kernel_t.flat<T>().data());
+
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dx_shape = { time_steps, batch_size, input_size };
     Tensor* dx = nullptr;
@@ -249,10 +437,10 @@ struct HasteGruGradOp : public OpKernel {
     Tensor* dbr = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(4, dbr_shape, &dbr));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial hidden state when done.
     const TensorShape dh_shape = { batch_size, hidden_size };
-    Tensor dh;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_shape, &dh));
+    Tensor* dh = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(5, dh_shape, &dh));
 
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dp_shape = { time_steps, batch_size, hidden_size * 3 };
@@ -268,35 +456,66 @@ struct HasteGruGradOp : public OpKernel {
     cudaMemset(dR->flat<T>().data(), 0, dR->AllocatedBytes());
     cudaMemset(dbx->flat<T>().data(), 0, dbx->AllocatedBytes());
     cudaMemset(dbr->flat<T>().data(), 0, dbr->AllocatedBytes());
-    cudaMemset(dh.flat<T>().data(), 0, dh.AllocatedBytes());
+    cudaMemset(dh->flat<T>().data(), 0, dh->AllocatedBytes());
+
+    Variational dropout = dropout_;
+    dropout.seed = static_cast<unsigned long long>(seed.scalar<int64>()());
+
+    BackwardOptions<T> options;
+    if (has_dropout)
+      options.dropout = &dropout;
+
+    // With output dropout, the engine reads the gradient with respect to the dropped output
+    // from `dh_new[1:]` and the one with respect to the final state from `dh`.
+    const T* dh_new_data = dh_new.flat<T>().data();
+    Tensor dh_new_dropout;
+    if (has_output_dropout) {
+      OP_REQUIRES(context, dy.NumElements() == time_steps * batch_size * hidden_size,
+          errors::InvalidArgument("dy must have shape [T,N,H] with output dropout. Found ",
+              dy.shape().DebugString()));
+      OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_new.shape(), &dh_new_dropout));
+      const cudaStream_t stream = GetCudaStream(context);
+      const auto NH = batch_size * hidden_size;
+      T* data = dh_new_dropout.flat<T>().data();
+      cudaMemcpyAsync(dh->flat<T>().data(), dh_new_data + time_steps * NH, NH * sizeof(T),
+          cudaMemcpyDeviceToDevice, stream);
+      cudaMemcpyAsync(data + NH, dy.flat<T>().data(), dy.TotalBytes(),
+          cudaMemcpyDeviceToDevice, stream);
+      dh_new_data = data;
+    }
 
     BackwardPass<T> backward(
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     backward.Run(
         time_steps,
-        kernel.flat<T>().data(),
-        recurrent_kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
+        recurrent_kernel_t.flat<T>().data(),
         bias.flat<T>().data(),
         recurrent_bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         v_vector.flat<T>().data(),
-        dh_new.flat<T>().data(),
+        dh_new_data,
         dx->flat<T>().data(),
         dW->flat<T>().data(),
         dR->flat<T>().data(),
         dbx->flat<T>().data(),
         dbr->flat<T>().data(),
-        dh.flat<T>().data(),
+        dh->flat<T>().data(),
         dp.flat<T>().data(),
         dq.flat<T>().data(),
-        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr);
+        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr,
+        options);
   }
+
+  private:
+    Variational dropout_;
 };
 
-REGISTER_GPU_KERNEL(HasteGruGrad, float);
-REGISTER_GPU_KERNEL(HasteGruGrad, double);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteGruGrad, float);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteGruGrad, double);
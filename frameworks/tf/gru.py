@@ -21,7 +21,7 @@ import tensorflow as tf
 
 from tensorflow.compat import v1
 from .base_rnn import BaseRNN
-from .weight_config import WeightConfig
+from .weight_config import WeightCache, WeightConfig
 
 
 __all__ = [
@@ -46,17 +46,44 @@ def gru_gradient(op, *grads):
   bx = op.inputs[3]
   br = op.inputs[4]
   zoneout_mask = op.inputs[5]
+  seed = op.inputs[6]
   h = op.outputs[0]
   v = op.outputs[1]
+  input_dropout = op.get_attr('input_dropout')
+  output_dropout = op.get_attr('output_dropout')
 
-  # Pre-transpose matrices for better performance.
-  x = tf.transpose(x, [2, 0, 1])
-  W = tf.transpose(W, [1, 0])
-  R = tf.transpose(R, [1, 0])
+  # Without output dropout, `y` is empty and the output gradient arrives through `h`.
+  dy = grads[2] if grads[2] is not None else tf.zeros_like(op.outputs[2])
 
-  dx, dW, dR, dbx, dbr = LIB.haste_gru_grad(x, W, R, bx, br, h, v, grads[0], zoneout_mask)
+  dx, dW, dR, dbx, dbr, _ = LIB.haste_gru_grad(
+      x, W, R, bx, br, h, v, grads[0], zoneout_mask, seed, dy,
+      input_dropout=input_dropout,
+      output_dropout=output_dropout)
 
-  return [dx, dW, dR, dbx, dbr, None]
+  return [dx, dW, dR, dbx, dbr, None, None]
+
+
+@tf.RegisterGradient("HasteGruCell")
+def gru_cell_gradient(op, *grads):
+  # Extract inputs and outputs from the op.
+  x = op.inputs[0]
+  W = op.inputs[2]
+  R = op.inputs[3]
+  bx = op.inputs[4]
+  br = op.inputs[5]
+  h = op.outputs[0]
+  v = op.outputs[1]
+
+  # The cell is a single time step of the layer so its gradient is too.
+  x = tf.expand_dims(x, 0)
+  zoneout_mask = tf.zeros([0, 0, 0], dtype=x.dtype)
+  seed = tf.zeros([], dtype=tf.int64)
+  dy = tf.zeros([0, 0, 0], dtype=x.dtype)
+
+  dx, dW, dR, dbx, dbr, dh = LIB.haste_gru_grad(
+      x, W, R, bx, br, h, v, grads[0], zoneout_mask, seed, dy)
+
+  return [dx[0], dh, dW, dR, dbx, dbr]
 
 
 class GRULayer(tf.Module):
@@ -72,8 +99,11 @@ class GRULayer(tf.Module):
         recurrent_bias_transform=None,
         dropout=0.0,
         zoneout=0.0,
+        input_dropout=0.0,
+        output_dropout=0.0,
         dtype=None,
-        name=None):
+        name=None,
+        cache_weights=False):
     super(GRULayer, self).__init__(name)
     self.realname = name
     self.num_units = num_units
@@ -91,7 +121,13 @@ class GRULayer(tf.Module):
 
     self.dropout = dropout
     self.zoneout = zoneout
+    self.input_dropout = input_dropout
+    self.output_dropout = output_dropout
     self.dtype = dtype or tf.float32
+    self.weight_cache = None
+    if cache_weights:
+      self.weight_cache = WeightCache(
+          ['kernel', 'recurrent_kernel', 'bias', 'recurrent_bias'], self.dtype)
     self.built = False
 
   def build(self, shape):
@@ -146,20 +182,38 @@ class GRULayer(tf.Module):
       zoneout_mask += tf.random.uniform([time_steps, batch_size, self.num_units], dtype=self.dtype)
       zoneout_mask = tf.floor(zoneout_mask)
 
-    weights = self.get_weights()
+    # The op regenerates the variational dropout masks from this seed in the
+    # gradient, so draw a new one every call.
+    input_dropout = self.input_dropout if training else 0.0
+    output_dropout = self.output_dropout if training else 0.0
+    if output_dropout and sequence_length is not None:
+      raise ValueError('GRU: output_dropout can\'t be used with sequence_length')
+    seed = tf.random.uniform([], maxval=tf.int64.max, dtype=tf.int64)
+
+    if self.weight_cache is None:
+      weights = self.get_weights()
+    elif training:
+      # The optimizer is about to change the variables.
+      self.weight_cache.invalidate()
+      weights = self.get_weights()
+    else:
+      weights = self.weight_cache.get(self.get_weights)
     if training and self.dropout > 0:
       recurrent_kernel = tf.nn.dropout(weights['recurrent_kernel'], rate=self.dropout)
     else:
       recurrent_kernel = weights['recurrent_kernel']
-    result, _ = LIB.haste_gru(
+    result, _, y = LIB.haste_gru(
         inputs,
         weights['kernel'],
         recurrent_kernel,
         weights['bias'],
         weights['recurrent_bias'],
         zoneout_mask,
+        seed,
         training=training,
-        zoneout_prob=self.zoneout)
+        zoneout_prob=self.zoneout,
+        input_dropout=input_dropout,
+        output_dropout=output_dropout)
 
     if sequence_length is not None:
       # 0-indexed tensors, so length-1.
@@ -169,7 +223,7 @@ class GRULayer(tf.Module):
     else:
       state = result[-1]
 
-    return result[1:], state
+    return y if output_dropout else result[1:], state
 
 
 class GRU(BaseRNN):
@@ -183,8 +237,8 @@ class GRU(BaseRNN):
   variant, 1406.1078v3, applies the reset gate before matrix multiplication
   and is currently unsupported.
 
-  This layer has built-in support for DropConnect and Zoneout, which are
-  both techniques used to regularize RNNs.
+  This layer has built-in support for DropConnect, variational dropout, and
+  Zoneout, which are all techniques used to regularize RNNs.
   """
 
   def __init__(self, num_units, direction='unidirectional', **kwargs):
@@ -221,7 +275,20 @@ class GRU(BaseRNN):
         regularization on the recurrent matrix. Defaults to 0.
       zoneout: (optional) float, sets the zoneout rate for Zoneout
         regularization. Defaults to 0.
+      input_dropout: (optional) float, sets the rate of variational dropout on
+        the input features. Each sequence drops the same features at every
+        time step. Defaults to 0.
+      output_dropout: (optional) float, sets the rate of variational dropout
+        on the output units. Only the output is dropped; the returned state is
+        not. Can't be combined with `sequence_length`. Defaults to 0.
       dtype: (optional) the data type for this layer. Defaults to `tf.float32`.
       name: (optional) string, the name for this layer.
+      cache_weights: (optional) bool, if `True`, inference calls reuse the
+        transformed weights computed by an earlier inference call instead of
+        recomputing them. Calls with `training=True` discard the cached
+        weights; call `invalidate_weights` after changing the variables in any
+        other way (e.g. restoring a checkpoint). The cache is not saved with
+        the layer's variables, and functions that use it can't be exported
+        with `tf.saved_model.save`. Defaults to `False`.
     """
     super().__init__(GRULayer, num_units, direction, 'gru_cell', **kwargs)
@@ -20,6 +20,7 @@ import tensorflow as tf
 
 from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
+from .gru import LIB
 
 
 class GRUCell(rnn_cell.RNNCell):
@@ -29,12 +30,16 @@ class GRUCell(rnn_cell.RNNCell):
   This cell can be used on hardware other than GPUs and with other TensorFlow
   classes that operate on RNN cells (e.g. `dynamic_rnn`, `BasicDecoder`, cell
   wrappers, etc.).
+
+  Set `fused=True` to compute each step with a single GPU op instead of a
+  composition of TensorFlow ops. The fused cell only runs on GPUs.
   """
-  def __init__(self, num_units, name=None, **kwargs):
+  def __init__(self, num_units, fused=False, name=None, **kwargs):
     super(GRUCell, self).__init__(name=name, **kwargs)
 
     self.realname = name
     self.num_units = num_units
+    self.fused = fused
     self.built = False
 
   @property
@@ -68,6 +73,16 @@ class GRUCell(rnn_cell.RNNCell):
   def __call__(self, inputs, state, scope=None):
     self.build(inputs.shape)
 
+    if self.fused:
+      h, _ = LIB.haste_gru_cell(
+          inputs,
+          state,
+          self.kernel,
+          self.recurrent_kernel,
+          self.bias,
+          self.recurrent_bias)
+      return h[1], h[1]
+
     h_proj = tf.nn.xw_plus_b(state, self.recurrent_kernel, self.recurrent_bias)
     x = tf.nn.xw_plus_b(inputs, self.kernel, self.bias)
     h_z, h_r, h_g = tf.split(h_proj, 3, axis=-1)
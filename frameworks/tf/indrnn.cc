@@ -103,7 +103,8 @@ struct HasteIndrnnOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     forward.Run(
         time_steps,
@@ -127,8 +128,8 @@ REGISTER_GPU_KERNEL(HasteIndrnn, double);
 
 REGISTER_OP("HasteIndrnnGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [C,N,T]
-    .Input("kernel_t: R")              // [4,C]
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H]
     .Input("recurrent_scale: R")       // [H]
     .Input("bias: R")                  // [H]
     .Input("zoneout_mask: R")          // [T,N,H]
@@ -155,9 +156,9 @@ REGISTER_OP("HasteIndrnnGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 3, &h_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 3, &dh_new_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
       DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
 
       c->set_output(0, c->MakeShape({ time_steps, batch_size, input_size }));
@@ -180,13 +181,26 @@ struct HasteIndrnnGradOp : public OpKernel {
     const Tensor& h_vector = context->input(5);
     const Tensor& dh_new = context->input(6);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
     const auto hidden_size = recurrent_scale.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dx_shape = { time_steps, batch_size, input_size };
     Tensor* dx = nullptr;
@@ -225,14 +239,15 @@ struct HasteIndrnnGradOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     backward.Run(
         time_steps,
-        kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
         recurrent_scale.flat<T>().data(),
         bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         dh_new.flat<T>().data(),
         dx->flat<T>().data(),
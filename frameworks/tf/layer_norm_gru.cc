@@ -158,7 +158,8 @@ struct HasteLayerNormGruOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     gru.Run(
         time_steps,
@@ -187,11 +188,157 @@ struct HasteLayerNormGruOp : public OpKernel {
 REGISTER_GPU_KERNEL(HasteLayerNormGru, float);
 REGISTER_GPU_KERNEL(HasteLayerNormGru, double);
 
+// Single-step variant of `HasteLayerNormGru` for use inside `tf.while_loop` and RNN cell
+// APIs. Unlike `HasteLayerNormGru`, the initial hidden state is an input. The first slice
+// of the output `h` is a copy of that state so that the op's gradient can reuse
+// `HasteLayerNormGruGrad`.
+REGISTER_OP("HasteLayerNormGruCell")
+    .Attr("R: {float, double}")         // Some real number type.
+    .Input("x: R")                      // [N,C]
+    .Input("h: R")                      // [N,H]
+    .Input("kernel: R")                 // [C,H*3]
+    .Input("recurrent_kernel: R")       // [H,H*3]
+    .Input("bias: R")                   // [H*3]
+    .Input("recurrent_bias: R")         // [H*3]
+    .Input("gamma: R")                  // [2,H*3]
+    .Output("h_out: R")                 // [2,N,H]
+    .Output("cache: R")                 // [?] (activations cache)
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle input_shape;
+      ShapeHandle h_shape;
+      ShapeHandle kernel_shape;
+      ShapeHandle recurrent_shape;
+      ShapeHandle bias_shape;
+      ShapeHandle recurrent_bias_shape;
+      ShapeHandle gamma_shape;
+
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 2, &input_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &h_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &kernel_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &recurrent_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &bias_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &recurrent_bias_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 2, &gamma_shape));
+
+      const DimensionHandle batch_size = c->Dim(input_shape, 0);
+      const DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
+
+      c->set_output(0, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(1, c->UnknownShapeOfRank(1));
+      return Status::OK();
+    });
+
+template<typename T>
+struct HasteLayerNormGruCellOp : public OpKernel {
+  explicit HasteLayerNormGruCellOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& input = context->input(0);
+    const Tensor& h = context->input(1);
+    const Tensor& kernel = context->input(2);
+    const Tensor& recurrent_kernel = context->input(3);
+    const Tensor& bias = context->input(4);
+    const Tensor& recurrent_bias = context->input(5);
+    const Tensor& gamma = context->input(6);
+
+    const auto batch_size = input.shape().dim_size(0);
+    const auto input_size = input.shape().dim_size(1);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
+    const auto data_type = DataTypeToEnum<T>::value;
+
+    OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
+        errors::InvalidArgument("input[1] and kernel[0] dimensions must match. Found ",
+            input_size, " and ", kernel.shape().dim_size(0)));
+    OP_REQUIRES(context, h.shape() == TensorShape({ batch_size, hidden_size }),
+        errors::InvalidArgument("h must have shape [N,H]. Found ", h.shape().DebugString()));
+
+    const TensorShape output_shape = { 2, batch_size, hidden_size };
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+
+    // Same layout as `HasteLayerNormGru` with a single time step.
+    const ArenaLayout<T> memory_layout = {
+      { "cache", { 1, batch_size, hidden_size * 4 } },
+      { "act_Wx", { 1, batch_size, hidden_size * 3 } },
+      { "act_Wx_norm_cache", { 1, batch_size, 2 } },
+      { "act_Rh", { 1, batch_size, hidden_size * 3 } },
+      { "act_Rh_norm_cache", { 1, batch_size, 2 } },
+    };
+
+    Tensor* output_cache = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(1, { memory_layout.NumElements() }, &output_cache));
+
+    Arena<T> memory = memory_layout.Realize(output_cache->flat<T>().data());
+    TensorView<T> cache = memory["cache"];
+    TensorView<T> act_Wx = memory["act_Wx"];
+    TensorView<T> act_Wx_norm_cache = memory["act_Wx_norm_cache"];
+    TensorView<T> act_Rh = memory["act_Rh"];
+    TensorView<T> act_Rh_norm_cache = memory["act_Rh_norm_cache"];
+
+    const TensorShape tmp_norm_shape = { batch_size, hidden_size * 3 };
+    Tensor tmp_Wx_norm;
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_norm_shape, &tmp_Wx_norm));
+
+    Tensor tmp_Rh_norm;
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_norm_shape, &tmp_Rh_norm));
+
+    cudaMemcpyAsync(
+        output->flat<T>().data(),
+        h.flat<T>().data(),
+        h.TotalBytes(),
+        cudaMemcpyDeviceToDevice,
+        GetCudaStream(context));
+
+    layer_norm::ForwardPass<T> layer_norm1(
+        batch_size,
+        hidden_size * 3,
+        gamma.SubSlice(0).unaligned_flat<T>().data(),
+        nullptr,
+        act_Wx_norm_cache.data());
+
+    layer_norm::ForwardPass<T> layer_norm2(
+        batch_size,
+        hidden_size * 3,
+        gamma.SubSlice(1).unaligned_flat<T>().data(),
+        nullptr,
+        act_Rh_norm_cache.data());
+
+    layer_norm_gru::ForwardPass<T> gru(
+        true,
+        batch_size,
+        input_size,
+        hidden_size,
+        GetCublasHandle(context),
+        GetCudaStream(context));
+
+    gru.Run(
+        1,
+        kernel.flat<T>().data(),
+        recurrent_kernel.flat<T>().data(),
+        bias.flat<T>().data(),
+        recurrent_bias.flat<T>().data(),
+        input.flat<T>().data(),
+        output->flat<T>().data(),
+        cache.data(),
+        act_Wx.data(),
+        layer_norm1,
+        tmp_Wx_norm.flat<T>().data(),
+        act_Rh.data(),
+        layer_norm2,
+        tmp_Rh_norm.flat<T>().data(),
+        0.0f,
+        nullptr);
+  }
+};
+
+REGISTER_GPU_KERNEL(HasteLayerNormGruCell, float);
+REGISTER_GPU_KERNEL(HasteLayerNormGruCell, double);
+
 REGISTER_OP("HasteLayerNormGruGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [T,C,N]
-    .Input("kernel_t: R")              // [H*3,C]
-    .Input("recurrent_kernel_t: R")    // [H*3,H]
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H*3]
+    .Input("recurrent_kernel: R")      // [H,H*3]
     .Input("bias: R")                  // [H*3]
     .Input("recurrent_bias: R")        // [H*3]
     .Input("gamma: R")                 // [2,H*3]
@@ -205,6 +352,7 @@ REGISTER_OP("HasteLayerNormGruGrad")
     .Output("dbx: R")                  // [H*3]
     .Output("dbr: R")                  // [H*3]
     .Output("dgamma: R")
+    .Output("dh: R")                   // [N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle x_shape;
       ShapeHandle kernel_shape;
@@ -228,10 +376,10 @@ REGISTER_OP("HasteLayerNormGruGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(8), 3, &dh_new_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(9), 3, &zoneout_mask_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
-      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 1);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
+      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 0);
 
       c->set_output(0, c->MakeShape({ time_steps, batch_size, input_size }));
       c->set_output(1, c->MakeShape({ input_size, c->Value(hidden_size) * 3 }));
@@ -239,6 +387,7 @@ REGISTER_OP("HasteLayerNormGruGrad")
       c->set_output(3, bias_shape);
       c->set_output(4, recurrent_bias_shape);
       c->set_output(5, gamma_shape);
+      c->set_output(6, c->MakeShape({ batch_size, hidden_size }));
       return Status::OK();
     });
 
@@ -258,13 +407,32 @@ struct HasteLayerNormGruGradOp : public OpKernel {
     const Tensor& dh_new = context->input(8);
     const Tensor& zoneout_mask = context->input(9);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
-    const auto hidden_size = recurrent_kernel.shape().dim_size(1);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Tensor recurrent_kernel_t;
+    const TensorShape recurrent_kernel_t_shape = { recurrent_kernel.dim_size(1), recurrent_kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, recurrent_kernel_t_shape, &recurrent_kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+    Transpose<T>(context, recurrent_kernel.dim_size(0), recurrent_kernel.dim_size(1),
+        recurrent_kernel.flat<T>().data(), recurrent_kernel_t.flat<T>().data());
+
     const ArenaLayout<T> memory_layout = {
       { "cache", { time_steps, batch_size, hidden_size * 4 } },
       { "act_Wx", { time_steps, batch_size, hidden_size * 3 } },
@@ -311,10 +479,10 @@ struct HasteLayerNormGruGradOp : public OpKernel {
     Tensor* dgamma = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(5, gamma.shape(), &dgamma));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial hidden state when done.
     const TensorShape dh_shape = { batch_size, hidden_size };
-    Tensor dh;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_shape, &dh));
+    Tensor* dh = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(6, dh_shape, &dh));
 
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dp_shape = { time_steps, batch_size, hidden_size * 3 };
@@ -330,7 +498,7 @@ struct HasteLayerNormGruGradOp : public OpKernel {
     cudaMemset(dR->flat<T>().data(), 0, dR->AllocatedBytes());
     cudaMemset(dbx->flat<T>().data(), 0, dbx->AllocatedBytes());
     cudaMemset(dbr->flat<T>().data(), 0, dbr->AllocatedBytes());
-    cudaMemset(dh.flat<T>().data(), 0, dh.AllocatedBytes());
+    cudaMemset(dh->flat<T>().data(), 0, dh->AllocatedBytes());
     cudaMemset(dgamma->flat<T>().data(), 0, dgamma->AllocatedBytes());
 
     layer_norm::BackwardPass<T> layer_norm1(
@@ -357,15 +525,16 @@ struct HasteLayerNormGruGradOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     gru.Run(
         time_steps,
-        kernel.flat<T>().data(),
-        recurrent_kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
+        recurrent_kernel_t.flat<T>().data(),
         bias.flat<T>().data(),
         recurrent_bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         cache.data(),
         dh_new.flat<T>().data(),
@@ -374,7 +543,7 @@ struct HasteLayerNormGruGradOp : public OpKernel {
         dR->flat<T>().data(),
         dbx->flat<T>().data(),
         dbr->flat<T>().data(),
-        dh.flat<T>().data(),
+        dh->flat<T>().data(),
         dp.flat<T>().data(),
         dq.flat<T>().data(),
         layer_norm1,
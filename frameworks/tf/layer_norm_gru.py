@@ -21,7 +21,7 @@ import tensorflow as tf
 
 from tensorflow.compat import v1
 from .base_rnn import BaseRNN
-from .weight_config import WeightConfig
+from .weight_config import WeightCache, WeightConfig
 
 
 __all__ = [
@@ -50,14 +50,32 @@ def layer_norm_gru_gradient(op, *grads):
   h = op.outputs[0]
   cache = op.outputs[1]
 
-  # Pre-transpose matrices for better performance.
-  x = tf.transpose(x, [2, 0, 1])
-  W = tf.transpose(W, [1, 0])
-  R = tf.transpose(R, [1, 0])
+  dx, dW, dR, dbx, dbr, dgamma, _ = LIB.haste_layer_norm_gru_grad(
+      x, W, R, bx, br, gamma, h, cache, grads[0], zoneout_mask)
 
-  grads = LIB.haste_layer_norm_gru_grad(x, W, R, bx, br, gamma, h, cache, grads[0], zoneout_mask)
+  return [dx, dW, dR, dbx, dbr, dgamma, None]
 
-  return [*grads, None]
+
+@tf.RegisterGradient("HasteLayerNormGruCell")
+def layer_norm_gru_cell_gradient(op, *grads):
+  # Extract inputs and outputs from the op.
+  x = op.inputs[0]
+  W = op.inputs[2]
+  R = op.inputs[3]
+  bx = op.inputs[4]
+  br = op.inputs[5]
+  gamma = op.inputs[6]
+  h = op.outputs[0]
+  cache = op.outputs[1]
+
+  # The cell is a single time step of the layer so its gradient is too.
+  x = tf.expand_dims(x, 0)
+  zoneout_mask = tf.zeros([0, 0, 0], dtype=x.dtype)
+
+  dx, dW, dR, dbx, dbr, dgamma, dh = LIB.haste_layer_norm_gru_grad(
+      x, W, R, bx, br, gamma, h, cache, grads[0], zoneout_mask)
+
+  return [dx[0], dh, dW, dR, dbx, dbr, dgamma]
 
 
 class LayerNormGRULayer(tf.Module):
@@ -74,7 +92,8 @@ class LayerNormGRULayer(tf.Module):
         dropout=0.0,
         zoneout=0.0,
         dtype=None,
-        name=None):
+        name=None,
+        cache_weights=False):
     super(LayerNormGRULayer, self).__init__(name)
     self.realname = name
     self.num_units = num_units
@@ -93,6 +112,10 @@ class LayerNormGRULayer(tf.Module):
     self.dropout = dropout
     self.zoneout = zoneout
     self.dtype = dtype or tf.float32
+    self.weight_cache = None
+    if cache_weights:
+      self.weight_cache = WeightCache(
+          ['kernel', 'recurrent_kernel', 'bias', 'recurrent_bias', 'gamma'], self.dtype)
     self.built = False
 
   def build(self, shape):
@@ -149,7 +172,14 @@ class LayerNormGRULayer(tf.Module):
       zoneout_mask += tf.random.uniform([time_steps, batch_size, self.num_units], dtype=self.dtype)
       zoneout_mask = tf.floor(zoneout_mask)
 
-    weights = self.get_weights()
+    if self.weight_cache is None:
+      weights = self.get_weights()
+    elif training:
+      # The optimizer is about to change the variables.
+      self.weight_cache.invalidate()
+      weights = self.get_weights()
+    else:
+      weights = self.weight_cache.get(self.get_weights)
     if training and self.dropout > 0:
       recurrent_kernel = tf.nn.dropout(weights['recurrent_kernel'], rate=self.dropout)
     else:
@@ -227,5 +257,12 @@ class LayerNormGRU(BaseRNN):
         regularization. Defaults to 0.
       dtype: (optional) the data type for this layer. Defaults to `tf.float32`.
       name: (optional) string, the name for this layer.
+      cache_weights: (optional) bool, if `True`, inference calls reuse the
+        transformed weights computed by an earlier inference call instead of
+        recomputing them. Calls with `training=True` discard the cached
+        weights; call `invalidate_weights` after changing the variables in any
+        other way (e.g. restoring a checkpoint). The cache is not saved with
+        the layer's variables, and functions that use it can't be exported
+        with `tf.saved_model.save`. Defaults to `False`.
     """
     super().__init__(LayerNormGRULayer, num_units, direction, 'gru_cell', **kwargs)
@@ -20,6 +20,7 @@ import tensorflow as tf
 
 from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
+from .layer_norm_gru import LIB
 
 
 __all__ = [
@@ -34,12 +35,16 @@ class LayerNormGRUCell(rnn_cell.RNNCell):
   This cell can be used on hardware other than GPUs and with other TensorFlow
   classes that operate on RNN cells (e.g. `dynamic_rnn`, `BasicDecoder`, cell
   wrappers, etc.).
+
+  Set `fused=True` to compute each step with a single GPU op instead of a
+  composition of TensorFlow ops. The fused cell only runs on GPUs.
   """
 
   def __init__(self,
         num_units,
         forget_bias=1.0,
         dropout=0.0,
+        fused=False,
         dtype=None,
         name=None,
         **kwargs):
@@ -49,6 +54,7 @@ class LayerNormGRUCell(rnn_cell.RNNCell):
 
     self.forget_bias = forget_bias
     self.dropout = dropout
+    self.fused = fused
     self.kernel = None
     self.recurrent_kernel = None
     self.bias = None
@@ -93,6 +99,17 @@ class LayerNormGRUCell(rnn_cell.RNNCell):
     else:
       R = self.recurrent_kernel
 
+    if self.fused:
+      h, _ = LIB.haste_layer_norm_gru_cell(
+          inputs,
+          state,
+          self.kernel,
+          R,
+          self.bias,
+          self.recurrent_bias,
+          self.gamma)
+      return h[1], h[1]
+
     x = self._layer_norm(inputs @ self.kernel, self.gamma[0]) + self.bias
     h_proj = self._layer_norm(state @ R, self.gamma[1]) + self.recurrent_bias
     h_z, h_r, h_g = tf.split(h_proj, 3, axis=-1)
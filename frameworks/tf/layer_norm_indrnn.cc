@@ -130,7 +130,8 @@ struct HasteLayerNormIndrnnOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     forward.Run(
         time_steps,
@@ -156,8 +157,8 @@ REGISTER_GPU_KERNEL(HasteLayerNormIndrnn, double);
 
 REGISTER_OP("HasteLayerNormIndrnnGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [C,N,T]
-    .Input("kernel_t: R")              // [4,C]
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H]
     .Input("recurrent_scale: R")       // [H]
     .Input("bias: R")                  // [H]
     .Input("gamma: R")                 // [2,H]
@@ -191,9 +192,9 @@ REGISTER_OP("HasteLayerNormIndrnnGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(7), 1, &cache_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(8), 3, &dh_new_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
       DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
 
       c->set_output(0, c->MakeShape({ time_steps, batch_size, input_size }));
@@ -219,13 +220,26 @@ struct HasteLayerNormIndrnnGradOp : public OpKernel {
     const Tensor& cache_input = context->input(7);
     const Tensor& dh_new = context->input(8);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
     const auto hidden_size = recurrent_scale.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+
     const ArenaLayout<T> memory_layout = {
       { "act_Wx", { time_steps, batch_size, hidden_size } },
       { "act_Wx_norm_cache", { time_steps, batch_size, 2 } },
@@ -289,14 +303,15 @@ struct HasteLayerNormIndrnnGradOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     backward.Run(
         time_steps,
-        kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
         recurrent_scale.flat<T>().data(),
         bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         dh_new.flat<T>().data(),
         dx->flat<T>().data(),
@@ -23,7 +23,7 @@ from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
 
 from .base_rnn import BaseRNN
-from .weight_config import WeightConfig
+from .weight_config import WeightCache, WeightConfig
 
 
 __all__ = [
@@ -51,10 +51,6 @@ def layer_norm_indrnn_gradient(op, *grads):
   h = op.outputs[0]
   cache = op.outputs[1]
 
-  # Pre-transpose matrices for better performance.
-  x = tf.transpose(x, [2, 0, 1])
-  W = tf.transpose(W, [1, 0])
-
   grads = LIB.haste_layer_norm_indrnn_grad(x, W, u, b, gamma, zoneout_mask, h, cache, grads[0])
   return [*grads, None]
 
@@ -82,7 +78,8 @@ class LayerNormIndRNNLayer(tf.Module):
         bias_transform=None,
         zoneout=0.0,
         dtype=None,
-        name=None):
+        name=None,
+        cache_weights=False):
     super().__init__(name)
     self.realname = name
     self.num_units = num_units
@@ -103,6 +100,10 @@ class LayerNormIndRNNLayer(tf.Module):
     self.bias = None
     self.gamma = None
     self.recurrent_bias = None
+    self.weight_cache = None
+    if cache_weights:
+      self.weight_cache = WeightCache(
+          ['kernel', 'recurrent_scale', 'bias', 'gamma'], self.dtype)
     self.built = False
 
   def build(self, shape):
@@ -151,7 +152,14 @@ class LayerNormIndRNNLayer(tf.Module):
       zoneout_mask += tf.random.uniform([time_steps, batch_size, self.num_units], dtype=self.dtype)
       zoneout_mask = tf.floor(zoneout_mask)
 
-    weights = self.get_weights()
+    if self.weight_cache is None:
+      weights = self.get_weights()
+    elif training:
+      # The optimizer is about to change the variables.
+      self.weight_cache.invalidate()
+      weights = self.get_weights()
+    else:
+      weights = self.weight_cache.get(self.get_weights)
     result, _ = LIB.haste_layer_norm_indrnn(
         inputs,
         weights['kernel'],
@@ -215,5 +223,12 @@ class LayerNormIndRNN(BaseRNN):
         regularization. Defaults to 0.
       dtype: (optional) the data type for this layer. Defaults to `tf.float32`.
       name: (optional) string, the name for this layer.
+      cache_weights: (optional) bool, if `True`, inference calls reuse the
+        transformed weights computed by an earlier inference call instead of
+        recomputing them. Calls with `training=True` discard the cached
+        weights; call `invalidate_weights` after changing the variables in any
+        other way (e.g. restoring a checkpoint). The cache is not saved with
+        the layer's variables, and functions that use it can't be exported
+        with `tf.saved_model.save`. Defaults to `False`.
     """
     super().__init__(LayerNormIndRNNLayer, num_units, direction, 'indrnn_cell', **kwargs)
@@ -178,7 +178,8 @@ struct HasteLayerNormLstmOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     lstm.Run(
         time_steps,
@@ -208,11 +209,183 @@ struct HasteLayerNormLstmOp : public OpKernel {
 REGISTER_GPU_KERNEL(HasteLayerNormLstm, float);
 REGISTER_GPU_KERNEL(HasteLayerNormLstm, double);
 
+// Single-step variant of `HasteLayerNormLstm` for use inside `tf.while_loop` and RNN cell
+// APIs. Unlike `HasteLayerNormLstm`, the initial hidden and cell states are inputs. The
+// first slice of `h_out` and `c_out` is a copy of those states so that the op's gradient
+// can reuse `HasteLayerNormLstmGrad`.
+REGISTER_OP("HasteLayerNormLstmCell")
+    .Attr("R: {float, double}")         // Some real number type.
+    .Input("x: R")                      // [N,C]
+    .Input("h: R")                      // [N,H]
+    .Input("c: R")                      // [N,H]
+    .Input("kernel: R")                 // [C,H*4]
+    .Input("recurrent_kernel: R")       // [H,H*4]
+    .Input("bias: R")                   // [H*4]
+    .Input("gamma: R")
+    .Input("gamma_h: R")
+    .Input("beta_h: R")
+    .Output("h_out: R")                 // [2,N,H]
+    .Output("c_out: R")                 // [2,N,H]
+    .Output("cache: R")                 // [?] (activations cache)
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle input_shape;
+      ShapeHandle h_shape;
+      ShapeHandle c_shape;
+      ShapeHandle kernel_shape;
+      ShapeHandle recurrent_shape;
+      ShapeHandle bias_shape;
+      ShapeHandle gamma_shape;
+      ShapeHandle gamma_h_shape;
+      ShapeHandle beta_h_shape;
+
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 2, &input_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &h_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &c_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &kernel_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 2, &recurrent_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &bias_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 2, &gamma_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(7), 1, &gamma_h_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(8), 1, &beta_h_shape));
+
+      const DimensionHandle batch_size = c->Dim(input_shape, 0);
+      const DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
+
+      c->set_output(0, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(1, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(2, c->UnknownShapeOfRank(1));
+      return Status::OK();
+    });
+
+template<typename T>
+struct HasteLayerNormLstmCellOp : public OpKernel {
+  explicit HasteLayerNormLstmCellOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& input = context->input(0);
+    const Tensor& h = context->input(1);
+    const Tensor& c = context->input(2);
+    const Tensor& kernel = context->input(3);
+    const Tensor& recurrent_kernel = context->input(4);
+    const Tensor& bias = context->input(5);
+    const Tensor& gamma = context->input(6);
+    const Tensor& gamma_h = context->input(7);
+    const Tensor& beta_h = context->input(8);
+
+    const auto batch_size = input.shape().dim_size(0);
+    const auto input_size = input.shape().dim_size(1);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
+    const auto data_type = DataTypeToEnum<T>::value;
+    const TensorShape state_shape = { batch_size, hidden_size };
+
+    OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
+        errors::InvalidArgument("input[1] and kernel[0] dimensions must match. Found ",
+            input_size, " and ", kernel.shape().dim_size(0)));
+    OP_REQUIRES(context, h.shape() == state_shape && c.shape() == state_shape,
+        errors::InvalidArgument("h and c must have shape [N,H]. Found ",
+            h.shape().DebugString(), " and ", c.shape().DebugString()));
+
+    const TensorShape output_shape = { 2, batch_size, hidden_size };
+    const TensorShape activations_shape = { 1, batch_size, hidden_size * 4 };
+    const TensorShape norm_cache_shape = { 1, batch_size, 2 };
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+
+    Tensor* output_cell_state = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(1, output_shape, &output_cell_state));
+
+    // Same layout as `HasteLayerNormLstm` with a single time step.
+    const ArenaLayout<T> memory_layout = {
+      { "act_Wx", activations_shape },
+      { "act_Wx_norm", activations_shape },
+      { "act_Wx_norm_cache", norm_cache_shape },
+      { "act_Rh", activations_shape },
+      { "act_Rh_norm_cache", norm_cache_shape },
+      { "act_c_norm", { 1, batch_size, hidden_size } },
+      { "act_c_norm_cache", norm_cache_shape },
+    };
+
+    Tensor* output_cache = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(2, { memory_layout.NumElements() }, &output_cache));
+
+    Arena<T> memory = memory_layout.Realize(output_cache->flat<T>().data());
+    TensorView<T> act_Wx = memory["act_Wx"];
+    TensorView<T> act_Wx_norm = memory["act_Wx_norm"];
+    TensorView<T> act_Wx_norm_cache = memory["act_Wx_norm_cache"];
+    TensorView<T> act_Rh = memory["act_Rh"];
+    TensorView<T> act_Rh_norm_cache = memory["act_Rh_norm_cache"];
+    TensorView<T> act_c_norm = memory["act_c_norm"];
+    TensorView<T> act_c_norm_cache = memory["act_c_norm_cache"];
+
+    Tensor tmp_Rh;
+    const TensorShape tmp_Rh_shape = { batch_size, 4 * hidden_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Rh_shape, &tmp_Rh));
+
+    const cudaStream_t stream = GetCudaStream(context);
+    cudaMemcpyAsync(output->flat<T>().data(), h.flat<T>().data(), h.TotalBytes(),
+        cudaMemcpyDeviceToDevice, stream);
+    cudaMemcpyAsync(output_cell_state->flat<T>().data(), c.flat<T>().data(), c.TotalBytes(),
+        cudaMemcpyDeviceToDevice, stream);
+
+    layer_norm::ForwardPass<T> layer_norm1(
+        batch_size,
+        hidden_size * 4,
+        gamma.SubSlice(0).unaligned_flat<T>().data(),
+        nullptr,
+        act_Wx_norm_cache.data());
+
+    layer_norm::ForwardPass<T> layer_norm2(
+        batch_size,
+        hidden_size * 4,
+        gamma.SubSlice(1).unaligned_flat<T>().data(),
+        nullptr,
+        act_Rh_norm_cache.data());
+
+    layer_norm::ForwardPass<T> layer_norm3(
+        batch_size,
+        hidden_size,
+        gamma_h.flat<T>().data(),
+        beta_h.flat<T>().data(),
+        act_c_norm_cache.data());
+
+    layer_norm_lstm::ForwardPass<T> lstm(
+        true,
+        batch_size,
+        input_size,
+        hidden_size,
+        GetCublasHandle(context),
+        stream);
+
+    lstm.Run(
+        1,
+        kernel.flat<T>().data(),
+        recurrent_kernel.flat<T>().data(),
+        bias.flat<T>().data(),
+        input.flat<T>().data(),
+        output->flat<T>().data(),
+        output_cell_state->flat<T>().data(),
+        act_Wx.data(),
+        tmp_Rh.flat<T>().data(),
+        layer_norm1,
+        act_Wx_norm.data(),
+        act_Rh.data(),
+        layer_norm2,
+        layer_norm3,
+        act_c_norm.data(),
+        0.0f,
+        nullptr);
+  }
+};
+
+REGISTER_GPU_KERNEL(HasteLayerNormLstmCell, float);
+REGISTER_GPU_KERNEL(HasteLayerNormLstmCell, double);
+
 REGISTER_OP("HasteLayerNormLstmGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [C,N,T]
-    .Input("kernel_t: R")              // [H*4,C]
-    .Input("recurrent_kernel_t: R")    // [H*4,H]
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H*4]
+    .Input("recurrent_kernel: R")      // [H,H*4]
     .Input("bias: R")                  // [H*4]
     .Input("gamma: R")
     .Input("gamma_h: R")
@@ -230,6 +403,8 @@ REGISTER_OP("HasteLayerNormLstmGrad")
     .Output("dgamma: R")
     .Output("dgamma_h: R")
     .Output("dbeta_h: R")
+    .Output("dh: R")                   // [N,H]
+    .Output("dc: R")                   // [N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle x_shape;
       ShapeHandle kernel_shape;
@@ -259,10 +434,10 @@ REGISTER_OP("HasteLayerNormLstmGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(11), 3, &dc_new_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(12), 3, &zoneout_mask_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
-      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 1);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
+      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 0);
       DimensionHandle hidden_size_4;
 
       TF_RETURN_IF_ERROR(c->Multiply(hidden_size, 4, &hidden_size_4));
@@ -274,6 +449,8 @@ REGISTER_OP("HasteLayerNormLstmGrad")
       c->set_output(4, gamma_shape);
       c->set_output(5, gamma_h_shape);
       c->set_output(6, beta_h_shape);
+      c->set_output(7, c->MakeShape({ batch_size, hidden_size }));
+      c->set_output(8, c->MakeShape({ batch_size, hidden_size }));
       return Status::OK();
     });
 
@@ -296,13 +473,32 @@ struct HasteLayerNormLstmGradOp : public OpKernel {
     const Tensor& dc_new = context->input(11);
     const Tensor& zoneout_mask = context->input(12);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
-    const auto hidden_size = recurrent_kernel.shape().dim_size(1);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Tensor recurrent_kernel_t;
+    const TensorShape recurrent_kernel_t_shape = { recurrent_kernel.dim_size(1), recurrent_kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, recurrent_kernel_t_shape, &recurrent_kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+    Transpose<T>(context, recurrent_kernel.dim_size(0), recurrent_kernel.dim_size(1),
+        recurrent_kernel.flat<T>().data(), recurrent_kernel_t.flat<T>().data());
+
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dx_shape = { time_steps, batch_size, input_size };
     Tensor* dx = nullptr;
@@ -335,15 +531,15 @@ struct HasteLayerNormLstmGradOp : public OpKernel {
     Tensor* dbeta_h = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(6, beta_h.shape(), &dbeta_h));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial hidden state when done.
     const TensorShape dh_shape = { batch_size, hidden_size };
-    Tensor dh;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_shape, &dh));
+    Tensor* dh = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(7, dh_shape, &dh));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial cell state when done.
     const TensorShape dc_shape = { batch_size, hidden_size };
-    Tensor dc;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dc_shape, &dc));
+    Tensor* dc = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(8, dc_shape, &dc));
 
     const TensorShape activations_shape = { time_steps, batch_size, hidden_size * 4 };
     const TensorShape norm_cache_shape = { time_steps, batch_size, 2 };
@@ -374,8 +570,8 @@ struct HasteLayerNormLstmGradOp : public OpKernel {
     cudaMemset(dgamma->flat<T>().data(), 0, dgamma->AllocatedBytes());
     cudaMemset(dgamma_h->flat<T>().data(), 0, dgamma_h->AllocatedBytes());
     cudaMemset(dbeta_h->flat<T>().data(), 0, dbeta_h->AllocatedBytes());
-    cudaMemset(dh.flat<T>().data(), 0, dh.AllocatedBytes());
-    cudaMemset(dc.flat<T>().data(), 0, dc.AllocatedBytes());
+    cudaMemset(dh->flat<T>().data(), 0, dh->AllocatedBytes());
+    cudaMemset(dc->flat<T>().data(), 0, dc->AllocatedBytes());
 
     layer_norm::BackwardPass<T> layer_norm1(
         time_steps * batch_size,
@@ -411,14 +607,15 @@ struct HasteLayerNormLstmGradOp : public OpKernel {
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     lstm.Run(
         time_steps,
-        kernel.flat<T>().data(),
-        recurrent_kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
+        recurrent_kernel_t.flat<T>().data(),
         bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         c_vector.flat<T>().data(),
         dh_new.flat<T>().data(),
@@ -427,8 +624,8 @@ struct HasteLayerNormLstmGradOp : public OpKernel {
         dW->flat<T>().data(),
         dR->flat<T>().data(),
         db->flat<T>().data(),
-        dh.flat<T>().data(),
-        dc.flat<T>().data(),
+        dh->flat<T>().data(),
+        dc->flat<T>().data(),
         act_Wx.data(),
         layer_norm1,
         act_Wx_norm.data(),
@@ -22,7 +22,7 @@ import tensorflow as tf
 from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
 from .base_rnn import BaseRNN
-from .weight_config import WeightConfig
+from .weight_config import WeightCache, WeightConfig
 
 
 __all__ = [
@@ -53,12 +53,7 @@ def lstm_gradient(op, *grads):
   c = op.outputs[1]
   cache = op.outputs[2]
 
-  # Pre-transpose matrices for better performance.
-  x = tf.transpose(x, [2, 0, 1])
-  W = tf.transpose(W, [1, 0])
-  R = tf.transpose(R, [1, 0])
-
-  dx, dW, dR, db, dgamma, dgamma_h, dbeta_h = LIB.haste_layer_norm_lstm_grad(
+  dx, dW, dR, db, dgamma, dgamma_h, dbeta_h, _, _ = LIB.haste_layer_norm_lstm_grad(
       x,
       W,
       R,
@@ -75,6 +70,41 @@ def lstm_gradient(op, *grads):
   return [dx, dW, dR, db, dgamma, dgamma_h, dbeta_h, None]
 
 
+@tf.RegisterGradient("HasteLayerNormLstmCell")
+def lstm_cell_gradient(op, *grads):
+  # Extract inputs and outputs from the op.
+  x = op.inputs[0]
+  W = op.inputs[3]
+  R = op.inputs[4]
+  b = op.inputs[5]
+  gamma = op.inputs[6]
+  gamma_h = op.inputs[7]
+  beta_h = op.inputs[8]
+  h = op.outputs[0]
+  c = op.outputs[1]
+  cache = op.outputs[2]
+
+  # The cell is a single time step of the layer so its gradient is too.
+  x = tf.expand_dims(x, 0)
+  zoneout_mask = tf.zeros([0, 0, 0], dtype=x.dtype)
+
+  dx, dW, dR, db, dgamma, dgamma_h, dbeta_h, dh, dc = LIB.haste_layer_norm_lstm_grad(
+      x,
+      W,
+      R,
+      b,
+      gamma,
+      gamma_h,
+      beta_h,
+      h,
+      c,
+      cache,
+      grads[0],
+      grads[1],
+      zoneout_mask)
+  return [dx[0], dh, dc, dW, dR, db, dgamma, dgamma_h, dbeta_h]
+
+
 class LayerNormLSTMLayer(tf.Module):
   def __init__(self,
         num_units,
@@ -88,7 +118,8 @@ class LayerNormLSTMLayer(tf.Module):
         dropout=0.0,
         zoneout=0.0,
         dtype=None,
-        name=None):
+        name=None,
+        cache_weights=False):
     super(LayerNormLSTMLayer, self).__init__(name)
     self.realname = name
     self.num_units = num_units
@@ -111,6 +142,10 @@ class LayerNormLSTMLayer(tf.Module):
     self.gamma = None
     self.gamma_h = None
     self.beta_h = None
+    self.weight_cache = None
+    if cache_weights:
+      self.weight_cache = WeightCache(
+          ['kernel', 'recurrent_kernel', 'bias', 'gamma', 'gamma_h', 'beta_h'], self.dtype)
     self.built = False
 
   def build(self, shape):
@@ -182,7 +217,14 @@ class LayerNormLSTMLayer(tf.Module):
       zoneout_mask += tf.random.uniform([time_steps, batch_size, self.num_units], dtype=self.dtype)
       zoneout_mask = tf.floor(zoneout_mask)
 
-    weights = self.get_weights()
+    if self.weight_cache is None:
+      weights = self.get_weights()
+    elif training:
+      # The optimizer is about to change the variables.
+      self.weight_cache.invalidate()
+      weights = self.get_weights()
+    else:
+      weights = self.weight_cache.get(self.get_weights)
     if training and self.dropout > 0:
       recurrent_kernel = tf.nn.dropout(weights['recurrent_kernel'], rate=self.dropout)
     else:
@@ -257,5 +299,12 @@ class LayerNormLSTM(BaseRNN):
         regularization. Defaults to 0.
       dtype: (optional) the data type for this layer. Defaults to `tf.float32`.
       name: (optional) string, the name for this layer.
+      cache_weights: (optional) bool, if `True`, inference calls reuse the
+        transformed weights computed by an earlier inference call instead of
+        recomputing them. Calls with `training=True` discard the cached
+        weights; call `invalidate_weights` after changing the variables in any
+        other way (e.g. restoring a checkpoint). The cache is not saved with
+        the layer's variables, and functions that use it can't be exported
+        with `tf.saved_model.save`. Defaults to `False`.
     """
     super().__init__(LayerNormLSTMLayer, num_units, direction, 'lstm_cell', **kwargs)
@@ -20,6 +20,7 @@ import tensorflow as tf
 
 from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
+from .layer_norm_lstm import LIB
 
 
 __all__ = [
@@ -34,12 +35,16 @@ class LayerNormLSTMCell(rnn_cell.RNNCell):
   This cell can be used on hardware other than GPUs and with other TensorFlow
   classes that operate on RNN cells (e.g. `dynamic_rnn`, `BasicDecoder`, cell
   wrappers, etc.).
+
+  Set `fused=True` to compute each step with a single GPU op instead of a
+  composition of TensorFlow ops. The fused cell only runs on GPUs.
   """
 
   def __init__(self,
         num_units,
         forget_bias=1.0,
         dropout=0.0,
+        fused=False,
         dtype=None,
         name=None,
         **kwargs):
@@ -49,6 +54,7 @@ class LayerNormLSTMCell(rnn_cell.RNNCell):
 
     self.forget_bias = forget_bias
     self.dropout = dropout
+    self.fused = fused
     self.kernel = None
     self.recurrent_kernel = None
     self.bias = None
@@ -89,6 +95,19 @@ class LayerNormLSTMCell(rnn_cell.RNNCell):
     else:
       R = self.recurrent_kernel
 
+    if self.fused:
+      h, c, _ = LIB.haste_layer_norm_lstm_cell(
+          inputs,
+          state.h,
+          state.c,
+          self.kernel,
+          R,
+          self.bias,
+          self.gamma,
+          self.gamma_h,
+          self.beta_h)
+      return h[1], rnn_cell.LSTMStateTuple(c[1], h[1])
+
     Wx = self._layer_norm(tf.matmul(inputs, self.kernel), self.gamma[0], self.null)
     Rh = self._layer_norm(tf.matmul(state.h, R), self.gamma[1], self.null)
     v = Wx + Rh + self.bias
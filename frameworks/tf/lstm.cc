@@ -25,8 +25,11 @@
 
 using namespace tensorflow;
 
-using haste::v0::lstm::ForwardPass;
+using haste::v0::dropout::Variational;
+using haste::v0::lstm::BackwardOptions;
 using haste::v0::lstm::BackwardPass;
+using haste::v0::lstm::ForwardOptions;
+using haste::v0::lstm::ForwardPass;
 using tensorflow::se::Stream;
 using tensorflow::shape_inference::DimensionHandle;
 using tensorflow::shape_inference::InferenceContext;
@@ -37,26 +40,32 @@ REGISTER_OP("HasteLstm")
     .Attr("R: {float, double}")         // Some real number type.
     .Attr("training: bool")
     .Attr("zoneout_prob: float")
+    .Attr("input_dropout: float = 0.0")
+    .Attr("output_dropout: float = 0.0")
     .Input("x: R")                      // [T,N,C]
     .Input("kernel: R")                 // [C,H*4]
     .Input("recurrent_kernel: R")       // [H,H*4]
     .Input("bias: R")                   // [H*4]
     .Input("zoneout_mask: R")           // [T,N,H]
+    .Input("seed: int64")               // []
     .Output("h: R")                     // [T,N,H]
     .Output("c: R")                     // [T,N,H]
     .Output("v: R")                     // [T,N,H*4]
+    .Output("y: R")                     // [T,N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle input_shape;
       ShapeHandle kernel_shape;
       ShapeHandle recurrent_shape;
       ShapeHandle bias_shape;
       ShapeHandle zoneout_mask_shape;
+      ShapeHandle seed_shape;
 
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 3, &input_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &kernel_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &recurrent_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &bias_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 3, &zoneout_mask_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 0, &seed_shape));
 
       const DimensionHandle time_steps = c->Dim(input_shape, 0);
       const DimensionHandle batch_size = c->Dim(input_shape, 1);
@@ -70,6 +79,7 @@ REGISTER_OP("HasteLstm")
       c->set_output(0, c->MakeShape({ time_steps_plus_1, batch_size, hidden_size }));
       c->set_output(1, c->MakeShape({ time_steps_plus_1, batch_size, hidden_size }));
       c->set_output(2, c->MakeShape({ time_steps, batch_size, hidden_size_4 }));
+      c->set_output(3, c->UnknownShapeOfRank(3));
       return Status::OK();
     });
 
@@ -78,6 +88,12 @@ struct HasteLstmOp : public OpKernel {
   explicit HasteLstmOp(OpKernelConstruction* context) : OpKernel(context) {
     OP_REQUIRES_OK(context, context->GetAttr("training", &training_));
     OP_REQUIRES_OK(context, context->GetAttr("zoneout_prob", &zoneout_prob_));
+    OP_REQUIRES_OK(context, context->GetAttr("input_dropout", &dropout_.input_prob));
+    OP_REQUIRES_OK(context, context->GetAttr("output_dropout", &dropout_.output_prob));
+    OP_REQUIRES(context, dropout_.input_prob >= 0.0f && dropout_.input_prob < 1.0f,
+        errors::InvalidArgument("input_dropout must be in [0,1). Found ", dropout_.input_prob));
+    OP_REQUIRES(context, dropout_.output_prob >= 0.0f && dropout_.output_prob < 1.0f,
+        errors::InvalidArgument("output_dropout must be in [0,1). Found ", dropout_.output_prob));
   }
 
   // When running on GPU, TF backs all inputs and outputs with device memory
@@ -89,12 +105,15 @@ struct HasteLstmOp : public OpKernel {
     const Tensor& recurrent_kernel = context->input(2);
     const Tensor& bias = context->input(3);
     const Tensor& zoneout_mask = context->input(4);
+    const Tensor& seed = context->input(5);
 
     const auto time_steps = input.shape().dim_size(0);
     const auto batch_size = input.shape().dim_size(1);
     const auto input_size = input.shape().dim_size(2);
     const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = zoneout_prob_ && zoneout_mask.NumElements();
+    const bool has_dropout = training_ && (dropout_.input_prob > 0.0f || dropout_.output_prob > 0.0f);
+    const bool has_output_dropout = has_dropout && dropout_.output_prob > 0.0f;
     const auto data_type = DataTypeToEnum<T>::value;
 
     OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
@@ -122,18 +141,36 @@ struct HasteLstmOp : public OpKernel {
       output_v = &output_v_temp;
     }
 
+    // The dropped-out output is only materialized with output dropout; otherwise the
+    // caller uses `h[1:]`.
+    const TensorShape y_shape = has_output_dropout
+        ? TensorShape({ time_steps, batch_size, hidden_size })
+        : TensorShape({ 0, 0, 0 });
+    Tensor* output_y = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(3, y_shape, &output_y));
+
     Tensor tmp_Rh;
     const TensorShape tmp_Rh_shape = { batch_size, 4 * hidden_size };
     OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Rh_shape, &tmp_Rh));
     cudaMemset(output->flat<T>().data(), 0, output->AllocatedBytes());
     cudaMemset(output_cell_state->flat<T>().data(), 0, output_cell_state->AllocatedBytes());
 
+    Variational dropout = dropout_;
+    dropout.seed = static_cast<unsigned long long>(seed.scalar<int64>()());
+
+    ForwardOptions<T> options;
+    if (has_dropout) {
+      options.dropout = &dropout;
+      options.y = has_output_dropout ? output_y->flat<T>().data() : nullptr;
+    }
+
     ForwardPass<T> forward = ForwardPass<T>(
         training_,
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     forward.Run(
         time_steps,
@@ -146,22 +183,141 @@ struct HasteLstmOp : public OpKernel {
         output_v->flat<T>().data(),
         tmp_Rh.flat<T>().data(),
         has_zoneout ? zoneout_prob_ : 0.0f,
-        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr);
+        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr,
+        options);
   }
 
   private:
     bool training_;
     float zoneout_prob_;
+    Variational dropout_;
+};
+
+REGISTER_GPU_KERNEL_WITH_SEED(HasteLstm, float);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteLstm, double);
+
+// Single-step variant of `HasteLstm` for use inside `tf.while_loop` and RNN cell APIs.
+// Unlike `HasteLstm`, the initial hidden and cell states are inputs. The first slice of
+// `h_out` and `c_out` is a copy of those states so that the op's gradient can reuse
+// `HasteLstmGrad`.
+REGISTER_OP("HasteLstmCell")
+    .Attr("R: {float, double}")         // Some real number type.
+    .Input("x: R")                      // [N,C]
+    .Input("h: R")                      // [N,H]
+    .Input("c: R")                      // [N,H]
+    .Input("kernel: R")                 // [C,H*4]
+    .Input("recurrent_kernel: R")       // [H,H*4]
+    .Input("bias: R")                   // [H*4]
+    .Output("h_out: R")                 // [2,N,H]
+    .Output("c_out: R")                 // [2,N,H]
+    .Output("v: R")                     // [1,N,H*4]
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle input_shape;
+      ShapeHandle h_shape;
+      ShapeHandle c_shape;
+      ShapeHandle kernel_shape;
+      ShapeHandle recurrent_shape;
+      ShapeHandle bias_shape;
+
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 2, &input_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &h_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &c_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &kernel_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 2, &recurrent_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &bias_shape));
+
+      const DimensionHandle batch_size = c->Dim(input_shape, 0);
+      const DimensionHandle hidden_size = c->Dim(recurrent_shape, 0);
+      DimensionHandle hidden_size_4;
+
+      TF_RETURN_IF_ERROR(c->Multiply(hidden_size, 4, &hidden_size_4));
+
+      c->set_output(0, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(1, c->MakeShape({ 2, batch_size, hidden_size }));
+      c->set_output(2, c->MakeShape({ 1, batch_size, hidden_size_4 }));
+      return Status::OK();
+    });
+
+template<typename T>
+struct HasteLstmCellOp : public OpKernel {
+  explicit HasteLstmCellOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& input = context->input(0);
+    const Tensor& h = context->input(1);
+    const Tensor& c = context->input(2);
+    const Tensor& kernel = context->input(3);
+    const Tensor& recurrent_kernel = context->input(4);
+    const Tensor& bias = context->input(5);
+
+    const auto batch_size = input.shape().dim_size(0);
+    const auto input_size = input.shape().dim_size(1);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
+    const auto data_type = DataTypeToEnum<T>::value;
+    const TensorShape state_shape = { batch_size, hidden_size };
+
+    OP_REQUIRES(context, input_size == kernel.shape().dim_size(0),
+        errors::InvalidArgument("input[1] and kernel[0] dimensions must match. Found ",
+            input_size, " and ", kernel.shape().dim_size(0)));
+    OP_REQUIRES(context, h.shape() == state_shape && c.shape() == state_shape,
+        errors::InvalidArgument("h and c must have shape [N,H]. Found ",
+            h.shape().DebugString(), " and ", c.shape().DebugString()));
+
+    const TensorShape output_shape = { 2, batch_size, hidden_size };
+    const TensorShape activations_shape = { 1, batch_size, hidden_size * 4 };
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+
+    Tensor* output_cell_state = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(1, output_shape, &output_cell_state));
+
+    Tensor* output_v = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(2, activations_shape, &output_v));
+
+    Tensor tmp_Rh;
+    const TensorShape tmp_Rh_shape = { batch_size, 4 * hidden_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, tmp_Rh_shape, &tmp_Rh));
+
+    const cudaStream_t stream = GetCudaStream(context);
+    cudaMemcpyAsync(output->flat<T>().data(), h.flat<T>().data(), h.TotalBytes(),
+        cudaMemcpyDeviceToDevice, stream);
+    cudaMemcpyAsync(output_cell_state->flat<T>().data(), c.flat<T>().data(), c.TotalBytes(),
+        cudaMemcpyDeviceToDevice, stream);
+
+    ForwardPass<T> forward = ForwardPass<T>(
+        true,
+        batch_size,
+        input_size,
+        hidden_size,
+        GetCublasHandle(context),
+        stream);
+
+    forward.Run(
+        1,
+        kernel.flat<T>().data(),
+        recurrent_kernel.flat<T>().data(),
+        bias.flat<T>().data(),
+        input.flat<T>().data(),
+        output->flat<T>().data(),
+        output_cell_state->flat<T>().data(),
+        output_v->flat<T>().data(),
+        tmp_Rh.flat<T>().data(),
+        0.0f,
+        nullptr);
+  }
 };
 
-REGISTER_GPU_KERNEL(HasteLstm, float);
-REGISTER_GPU_KERNEL(HasteLstm, double);
+REGISTER_GPU_KERNEL(HasteLstmCell, float);
+REGISTER_GPU_KERNEL(HasteLstmCell, double);
 
 REGISTER_OP("HasteLstmGrad")
     .Attr("R: {float, double}")
-    .Input("x_t: R")                   // [C,N,T]
-    .Input("kernel_t: R")              // [H*4,C]
-    .Input("recurrent_kernel_t: R")    // [H*4,H]
+    .Attr("input_dropout: float = 0.0")
+    .Attr("output_dropout: float = 0.0")
+    .Input("x: R")                     // [T,N,C]
+    .Input("kernel: R")                // [C,H*4]
+    .Input("recurrent_kernel: R")      // [H,H*4]
     .Input("bias: R")                  // [H*4]
     .Input("h: R")                     // [T,N,H]
     .Input("c: R")                     // [T,N,H]
@@ -169,10 +325,14 @@ REGISTER_OP("HasteLstmGrad")
     .Input("dh_new: R")                // [T,N,H]
     .Input("dc_new: R")                // [T,N,H]
     .Input("zoneout_mask: R")          // [T,N,H]
+    .Input("seed: int64")              // []
+    .Input("dy: R")                    // [T,N,H]
     .Output("dx: R")                   // [T,N,C]
     .Output("dw: R")                   // [C,H*4]
     .Output("dr: R")                   // [H,H*4]
     .Output("db: R")                   // [H*4]
+    .Output("dh: R")                   // [N,H]
+    .Output("dc: R")                   // [N,H]
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle x_shape;
       ShapeHandle kernel_shape;
@@ -184,6 +344,8 @@ REGISTER_OP("HasteLstmGrad")
       ShapeHandle dh_new_shape;
       ShapeHandle dc_new_shape;
       ShapeHandle zoneout_mask_shape;
+      ShapeHandle seed_shape;
+      ShapeHandle dy_shape;
 
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 3, &x_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 2, &kernel_shape));
@@ -195,11 +357,13 @@ REGISTER_OP("HasteLstmGrad")
       TF_RETURN_IF_ERROR(c->WithRank(c->input(7), 3, &dh_new_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(8), 3, &dc_new_shape));
       TF_RETURN_IF_ERROR(c->WithRank(c->input(9), 3, &zoneout_mask_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(10), 0, &seed_shape));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(11), 3, &dy_shape));
 
-      DimensionHandle input_size = c->Dim(x_shape, 0);
-      DimensionHandle time_steps = c->Dim(x_shape, 1);
-      DimensionHandle batch_size = c->Dim(x_shape, 2);
-      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 1);
+      DimensionHandle time_steps = c->Dim(x_shape, 0);
+      DimensionHandle batch_size = c->Dim(x_shape, 1);
+      DimensionHandle input_size = c->Dim(x_shape, 2);
+      DimensionHandle hidden_size = c->Dim(recurrent_kernel_shape, 0);
       DimensionHandle hidden_size_4;
 
       TF_RETURN_IF_ERROR(c->Multiply(hidden_size, 4, &hidden_size_4));
@@ -208,12 +372,17 @@ REGISTER_OP("HasteLstmGrad")
       c->set_output(1, c->MakeShape({ input_size, hidden_size_4 }));
       c->set_output(2, c->MakeShape({ hidden_size, hidden_size_4 }));
       c->set_output(3, bias_shape);
+      c->set_output(4, c->MakeShape({ batch_size, hidden_size }));
+      c->set_output(5, c->MakeShape({ batch_size, hidden_size }));
       return Status::OK();
     });
 
 template<typename T>
 struct HasteLstmGradOp : public OpKernel {
-  explicit HasteLstmGradOp(OpKernelConstruction* context) : OpKernel(context) {}
+  explicit HasteLstmGradOp(OpKernelConstruction* context) : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("input_dropout", &dropout_.input_prob));
+    OP_REQUIRES_OK(context, context->GetAttr("output_dropout", &dropout_.output_prob));
+  }
 
   void Compute(OpKernelContext* context) override {
     const Tensor& input = context->input(0);
@@ -226,14 +395,37 @@ struct HasteLstmGradOp : public OpKernel {
     const Tensor& dh_new = context->input(7);
     const Tensor& dc_new = context->input(8);
     const Tensor& zoneout_mask = context->input(9);
+    const Tensor& seed = context->input(10);
+    const Tensor& dy = context->input(11);
 
-    const auto input_size = input.shape().dim_size(0);
-    const auto time_steps = input.shape().dim_size(1);
-    const auto batch_size = input.shape().dim_size(2);
-    const auto hidden_size = recurrent_kernel.shape().dim_size(1);
+    const auto time_steps = input.shape().dim_size(0);
+    const auto batch_size = input.shape().dim_size(1);
+    const auto input_size = input.shape().dim_size(2);
+    const auto hidden_size = recurrent_kernel.shape().dim_size(0);
     const bool has_zoneout = !!zoneout_mask.NumElements();
+    const bool has_dropout = dropout_.input_prob > 0.0f || dropout_.output_prob > 0.0f;
+    const bool has_output_dropout = dropout_.output_prob > 0.0f;
     const auto data_type = DataTypeToEnum<T>::value;
 
+    // Transpose the inputs and weights into the layout expected by the backward pass here
+    // instead of with separate ops in the gradient function.
+    Tensor input_t;
+    const TensorShape input_t_shape = { input_size, time_steps, batch_size };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, input_t_shape, &input_t));
+
+    Tensor kernel_t;
+    const TensorShape kernel_t_shape = { kernel.dim_size(1), kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, kernel_t_shape, &kernel_t));
+
+    Tensor recurrent_kernel_t;
+    const TensorShape recurrent_kernel_t_shape = { recurrent_kernel.dim_size(1), recurrent_kernel.dim_size(0) };
+    OP_REQUIRES_OK(context, context->allocate_temp(data_type, recurrent_kernel_t_shape, &recurrent_kernel_t));
+
+    Transpose<T>(context, time_steps * batch_size, input_size, input.flat<T>().data(), input_t.flat<T>().data());
+    Transpose<T>(context, kernel.dim_size(0), kernel.dim_size(1), kernel.flat<T>().data(), kernel_t.flat<T>().data());
+    Transpose<T>(context, recurrent_kernel.dim_size(0), recurrent_kernel.dim_size(1),
+        recurrent_kernel.flat<T>().data(), recurrent_kernel_t.flat<T>().data());
+
     // Can be uninitialized. Output only, no accumulation.
     const TensorShape dx_shape = { time_steps, batch_size, input_size };
     Tensor* dx = nullptr;
@@ -254,48 +446,79 @@ struct HasteLstmGradOp : public OpKernel {
     Tensor* db = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(3, db_shape, &db));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial hidden state when done.
     const TensorShape dh_shape = { batch_size, hidden_size };
-    Tensor dh;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_shape, &dh));
+    Tensor* dh = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(4, dh_shape, &dh));
 
-    // Needs to be initialized to 0.
+    // Needs to be initialized to 0. Holds the gradient of the initial cell state when done.
     const TensorShape dc_shape = { batch_size, hidden_size };
-    Tensor dc;
-    OP_REQUIRES_OK(context, context->allocate_temp(data_type, dc_shape, &dc));
+    Tensor* dc = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(5, dc_shape, &dc));
 
     cudaMemset(dW->flat<T>().data(), 0, dW->AllocatedBytes());
     cudaMemset(dR->flat<T>().data(), 0, dR->AllocatedBytes());
     cudaMemset(db->flat<T>().data(), 0, db->AllocatedBytes());
-    cudaMemset(dh.flat<T>().data(), 0, dh.AllocatedBytes());
-    cudaMemset(dc.flat<T>().data(), 0, dc.AllocatedBytes());
+    cudaMemset(dh->flat<T>().data(), 0, dh->AllocatedBytes());
+    cudaMemset(dc->flat<T>().data(), 0, dc->AllocatedBytes());
+
+    Variational dropout = dropout_;
+    dropout.seed = static_cast<unsigned long long>(seed.scalar<int64>()());
+
+    BackwardOptions<T> options;
+    if (has_dropout)
+      options.dropout = &dropout;
+
+    // With output dropout, the engine reads the gradient with respect to the dropped output
+    // from `dh_new[1:]` and the one with respect to the final state from `dh`.
+    const T* dh_new_data = dh_new.flat<T>().data();
+    Tensor dh_new_dropout;
+    if (has_output_dropout) {
+      OP_REQUIRES(context, dy.NumElements() == time_steps * batch_size * hidden_size,
+          errors::InvalidArgument("dy must have shape [T,N,H] with output dropout. Found ",
+              dy.shape().DebugString()));
+      OP_REQUIRES_OK(context, context->allocate_temp(data_type, dh_new.shape(), &dh_new_dropout));
+      const cudaStream_t stream = GetCudaStream(context);
+      const auto NH = batch_size * hidden_size;
+      T* data = dh_new_dropout.flat<T>().data();
+      cudaMemcpyAsync(dh->flat<T>().data(), dh_new_data + time_steps * NH, NH * sizeof(T),
+          cudaMemcpyDeviceToDevice, stream);
+      cudaMemcpyAsync(data + NH, dy.flat<T>().data(), dy.TotalBytes(),
+          cudaMemcpyDeviceToDevice, stream);
+      dh_new_data = data;
+    }
 
     BackwardPass<T> backward = BackwardPass<T>(
         batch_size,
         input_size,
         hidden_size,
-        GetCublasHandle(context));
+        GetCublasHandle(context),
+        GetCudaStream(context));
 
     backward.Run(
         time_steps,
-        kernel.flat<T>().data(),
-        recurrent_kernel.flat<T>().data(),
+        kernel_t.flat<T>().data(),
+        recurrent_kernel_t.flat<T>().data(),
         bias.flat<T>().data(),
-        input.flat<T>().data(),
+        input_t.flat<T>().data(),
         h_vector.flat<T>().data(),
         c_vector.flat<T>().data(),
-        dh_new.flat<T>().data(),
+        dh_new_data,
         dc_new.flat<T>().data(),
         dx->flat<T>().data(),
         dW->flat<T>().data(),
         dR->flat<T>().data(),
         db->flat<T>().data(),
-        dh.flat<T>().data(),
-        dc.flat<T>().data(),
+        dh->flat<T>().data(),
+        dc->flat<T>().data(),
         const_cast<T*>(dv.flat<T>().data()),
-        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr);
+        has_zoneout ? zoneout_mask.flat<T>().data() : nullptr,
+        options);
   }
+
+  private:
+    Variational dropout_;
 };
 
-REGISTER_GPU_KERNEL(HasteLstmGrad, float);
-REGISTER_GPU_KERNEL(HasteLstmGrad, double);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteLstmGrad, float);
+REGISTER_GPU_KERNEL_WITH_SEED(HasteLstmGrad, double);
@@ -23,7 +23,7 @@ from tensorflow.compat import v1
 from tensorflow.compat.v1.nn import rnn_cell
 
 from .base_rnn import BaseRNN
-from .weight_config import WeightConfig
+from .weight_config import WeightCache, WeightConfig
 
 
 __all__ = [
@@ -47,17 +47,43 @@ def lstm_gradient(op, *grads):
   R = op.inputs[2]
   b = op.inputs[3]
   zoneout_mask = op.inputs[4]
+  seed = op.inputs[5]
   h = op.outputs[0]
   c = op.outputs[1]
   v = op.outputs[2]
+  input_dropout = op.get_attr('input_dropout')
+  output_dropout = op.get_attr('output_dropout')
 
-  # Pre-transpose matrices for better performance.
-  x = tf.transpose(x, [2, 0, 1])
-  W = tf.transpose(W, [1, 0])
-  R = tf.transpose(R, [1, 0])
+  # Without output dropout, `y` is empty and the output gradient arrives through `h`.
+  dy = grads[3] if grads[3] is not None else tf.zeros_like(op.outputs[3])
 
-  dx, dW, dR, db = LIB.haste_lstm_grad(x, W, R, b, h, c, v, grads[0], grads[1], zoneout_mask)
-  return [dx, dW, dR, db, None]
+  dx, dW, dR, db, _, _ = LIB.haste_lstm_grad(
+      x, W, R, b, h, c, v, grads[0], grads[1], zoneout_mask, seed, dy,
+      input_dropout=input_dropout,
+      output_dropout=output_dropout)
+  return [dx, dW, dR, db, None, None]
+
+
+@tf.RegisterGradient("HasteLstmCell")
+def lstm_cell_gradient(op, *grads):
+  # Extract inputs and outputs from the op.
+  x = op.inputs[0]
+  W = op.inputs[3]
+  R = op.inputs[4]
+  b = op.inputs[5]
+  h = op.outputs[0]
+  c = op.outputs[1]
+  v = op.outputs[2]
+
+  # The cell is a single time step of the layer so its gradient is too.
+  x = tf.expand_dims(x, 0)
+  zoneout_mask = tf.zeros([0, 0, 0], dtype=x.dtype)
+  seed = tf.zeros([], dtype=tf.int64)
+  dy = tf.zeros([0, 0, 0], dtype=x.dtype)
+
+  dx, dW, dR, db, dh, dc = LIB.haste_lstm_grad(
+      x, W, R, b, h, c, v, grads[0], grads[1], zoneout_mask, seed, dy)
+  return [dx[0], dh, dc, dW, dR, db]
 
 
 class LSTMLayer(tf.Module):
@@ -72,9 +98,12 @@ class LSTMLayer(tf.Module):
         forget_bias=1.0,
         dropout=0.0,
         zoneout=0.0,
+        input_dropout=0.0,
+        output_dropout=0.0,
         dtype=None,
         name=None,
-        cudnn_compat=False):
+        cudnn_compat=False,
+        cache_weights=False):
     super(LSTMLayer, self).__init__(name)
     self.realname = name
     self.input_size = None
@@ -92,11 +121,16 @@ class LSTMLayer(tf.Module):
     self.forget_bias = forget_bias
     self.dropout = dropout
     self.zoneout = zoneout
+    self.input_dropout = input_dropout
+    self.output_dropout = output_dropout
     self.dtype = dtype or tf.float32
     self.cudnn_compat = cudnn_compat
     self.opaque = None
     self.kernel = None
     self.bias = None
+    self.weight_cache = None
+    if cache_weights:
+      self.weight_cache = WeightCache(['kernel', 'recurrent_kernel', 'bias'], self.dtype)
     self.built = False
 
   def build(self, shape):
@@ -203,19 +237,37 @@ class LSTMLayer(tf.Module):
       zoneout_mask += tf.random.uniform([time_steps, batch_size, self.num_units], dtype=self.dtype)
       zoneout_mask = tf.floor(zoneout_mask)
 
-    weights = self.get_weights()
+    # The op regenerates the variational dropout masks from this seed in the
+    # gradient, so draw a new one every call.
+    input_dropout = self.input_dropout if training else 0.0
+    output_dropout = self.output_dropout if training else 0.0
+    if output_dropout and sequence_length is not None:
+      raise ValueError('LSTM: output_dropout can\'t be used with sequence_length')
+    seed = tf.random.uniform([], maxval=tf.int64.max, dtype=tf.int64)
+
+    if self.weight_cache is None:
+      weights = self.get_weights()
+    elif training:
+      # The optimizer is about to change the variables.
+      self.weight_cache.invalidate()
+      weights = self.get_weights()
+    else:
+      weights = self.weight_cache.get(self.get_weights)
     if training and self.dropout > 0:
       recurrent_kernel = tf.nn.dropout(weights['recurrent_kernel'], rate=self.dropout)
     else:
       recurrent_kernel = weights['recurrent_kernel']
-    h, c, _ = LIB.haste_lstm(
+    h, c, _, y = LIB.haste_lstm(
         x,
         weights['kernel'],
         recurrent_kernel,
         weights['bias'],
         zoneout_mask,
+        seed,
         training=training,
-        zoneout_prob=self.zoneout)
+        zoneout_prob=self.zoneout,
+        input_dropout=input_dropout,
+        output_dropout=output_dropout)
 
     if sequence_length is not None:
       indices = sequence_length
@@ -224,7 +276,7 @@ class LSTMLayer(tf.Module):
     else:
       state = rnn_cell.LSTMStateTuple(c[-1], h[-1])
 
-    return h[1:], state
+    return y if output_dropout else h[1:], state
 
 
 class LSTM(BaseRNN):
@@ -238,8 +290,9 @@ class LSTM(BaseRNN):
 
   Although this implementation is comparable in performance to cuDNN's LSTM,
   it offers additional options not typically found in other high-performance
-  implementations. DropConnect and Zoneout regularization are built-in, and
-  this layer allows setting a non-zero initial forget gate bias.
+  implementations. DropConnect, variational dropout, and Zoneout regularization
+  are built-in, and this layer allows setting a non-zero initial forget gate
+  bias.
   """
 
   def __init__(self, num_units, direction='unidirectional', **kwargs):
@@ -275,6 +328,12 @@ class LSTM(BaseRNN):
         regularization on the recurrent matrix. Defaults to 0.
       zoneout: (optional) float, sets the zoneout rate for Zoneout
         regularization. Defaults to 0.
+      input_dropout: (optional) float, sets the rate of variational dropout on
+        the input features. Each sequence drops the same features at every
+        time step. Defaults to 0.
+      output_dropout: (optional) float, sets the rate of variational dropout
+        on the output units. Only the output is dropped; the returned state is
+        not. Can't be combined with `sequence_length`. Defaults to 0.
       dtype: (optional) the data type for this layer. Defaults to `tf.float32`.
       name: (optional) string, the name for this layer.
       cudnn_compat: (optional) bool, if `True`, the variables created by this
@@ -282,5 +341,12 @@ class LSTM(BaseRNN):
         this should only be set if you're restoring variables from a cuDNN
         model. It's currently not possible to train a model with
         `cudnn_compat=True` and restore it with CudnnLSTM. Defaults to `False`.
+      cache_weights: (optional) bool, if `True`, inference calls reuse the
+        transformed weights computed by an earlier inference call instead of
+        recomputing them. Calls with `training=True` discard the cached
+        weights; call `invalidate_weights` after changing the variables in any
+        other way (e.g. restoring a checkpoint). The cache is not saved with
+        the layer's variables, and functions that use it can't be exported
+        with `tf.saved_model.save`. Defaults to `False`.
     """
     super().__init__(LSTMLayer, num_units, direction, 'lstm_cell', **kwargs)
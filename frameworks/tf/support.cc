@@ -19,6 +19,7 @@
 #include <unordered_map>
 #include <utility>
 
+#include "blas.h"
 #include "support.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/util/stream_executor_util.h"
@@ -66,3 +67,30 @@ const cudaStream_t& GetCudaStream(tensorflow::OpKernelContext* context) {
       context->op_device_context()->stream()->implementation()->GpuStreamMemberHack();
   return *reinterpret_cast<const cudaStream_t*>(ptr);
 }
+
+template<typename T>
+void Transpose(
+    tensorflow::OpKernelContext* context,
+    const int rows,
+    const int cols,
+    const T* in,
+    T* out) {
+  static const T alpha = static_cast<T>(1.0);
+  static const T beta = static_cast<T>(0.0);
+
+  const cublasHandle_t blas_handle = GetCublasHandle(context);
+  const blas<void>::set_pointer_mode scoped(blas_handle);
+
+  // cuBLAS is column-major, so `in` looks like a [cols,rows] matrix to it.
+  blas<T>::geam(blas_handle,
+      CUBLAS_OP_T, CUBLAS_OP_N,
+      rows, cols,
+      &alpha,
+      in, cols,
+      &beta,
+      out, rows,
+      out, rows);
+}
+
+template void Transpose<float>(tensorflow::OpKernelContext*, const int, const int, const float*, float*);
+template void Transpose<double>(tensorflow::OpKernelContext*, const int, const int, const double*, double*);
@@ -28,5 +28,24 @@ class OpKernelContext;
                             .TypeConstraint<T>("R"), \
                           NAME##Op<T>)
 
+// Same as `REGISTER_GPU_KERNEL` for ops that take a scalar `seed` input, which is read on
+// the host.
+#define REGISTER_GPU_KERNEL_WITH_SEED(NAME, T)       \
+  REGISTER_KERNEL_BUILDER(Name(#NAME)                \
+                            .Device(DEVICE_GPU)      \
+                            .HostMemory("seed")      \
+                            .TypeConstraint<T>("R"), \
+                          NAME##Op<T>)
+
 cublasHandle_t GetCublasHandle(tensorflow::OpKernelContext* context);
 const cudaStream_t& GetCudaStream(tensorflow::OpKernelContext* context);
+
+// Writes the transpose of the row-major [rows,cols] matrix `in` to `out` ([cols,rows])
+// on the op's CUDA stream.
+template<typename T>
+void Transpose(
+    tensorflow::OpKernelContext* context,
+    const int rows,
+    const int cols,
+    const T* in,
+    T* out);
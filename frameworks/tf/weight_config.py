@@ -14,6 +14,82 @@
 # ==============================================================================
 
 
+import tensorflow as tf
+
+
+__all__ = [
+    'WeightCache',
+    'WeightConfig'
+]
+
+
+class WeightCache:
+  """
+  Memoizes the transformed weights of a layer for inference.
+
+  Weight transforms (and, for some layers, reordering of the raw variables)
+  are otherwise re-applied on every call even though they produce identical
+  results until the variables change. Layers only use a cache when they're
+  constructed with `cache_weights=True`.
+
+  The cache holds the transformed weights in non-trainable variables and a
+  flag that says whether they're current, so it works eagerly and inside
+  `tf.function` alike. Training calls clear the flag as they run. Nothing
+  else does: call `invalidate` after assigning new values to the layer's
+  variables any other way, e.g. after restoring a checkpoint.
+
+  The cache is a plain Python object, so its variables aren't part of the
+  layer's `variables` and aren't written to checkpoints. For the same reason,
+  functions that use a cache can't be exported with `tf.saved_model.save`.
+  Layers built in TF1-style graphs compute their weights inline.
+  """
+  __slots__ = ['weights', 'valid']
+
+  def __init__(self, keys, dtype):
+    self.weights = None
+    self.valid = None
+    if not tf.executing_eagerly():
+      return
+    # Shapes are only known once the weights are first computed.
+    self.weights = {
+        key: tf.Variable(tf.zeros([0], dtype=dtype), trainable=False, shape=tf.TensorShape(None))
+        for key in keys
+    }
+    self.valid = tf.Variable(False, trainable=False)
+
+  def get(self, compute):
+    """
+    Returns the result of `compute()`, a dict of tensors, reusing the cached
+    result unless it was invalidated since it was computed.
+    """
+    if self.weights is None:
+      return compute()
+
+    shapes = {}
+
+    def refresh():
+      weights = compute()
+      shapes.update({key: value.shape for key, value in weights.items()})
+      updates = [self.weights[key].assign(value) for key, value in weights.items()]
+      updates.append(self.valid.assign(True))
+      with tf.control_dependencies(updates):
+        return {key: tf.identity(value) for key, value in weights.items()}
+
+    def reuse():
+      return {key: tf.identity(value) for key, value in self.weights.items()}
+
+    weights = tf.cond(self.valid, reuse, refresh)
+    # The variables have no static shape; the traced `refresh` branch does.
+    for key, shape in shapes.items():
+      weights[key].set_shape(shape)
+    return weights
+
+  def invalidate(self):
+    """Makes the next call to `get` recompute the weights."""
+    if self.valid is not None:
+      self.valid.assign(False)
+
+
 class WeightConfig:
   __slots__ = ['initializer', 'constraint', 'transform']
 
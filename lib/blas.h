@@ -43,19 +43,36 @@ struct blas {
       cublasHandle_t handle_;
       cublasMath_t old_mode_;
   };
+  struct set_default_math {
+    set_default_math(cublasHandle_t handle) : handle_(handle) {
+      cublasGetMathMode(handle_, &old_mode_);
+      cublasSetMathMode(handle_, CUBLAS_DEFAULT_MATH);
+    }
+    ~set_default_math() {
+      cublasSetMathMode(handle_, old_mode_);
+    }
+    private:
+      cublasHandle_t handle_;
+      cublasMath_t old_mode_;
+  };
 };
 
 template<>
 struct blas<__half> {
   static constexpr decltype(cublasHgemm)* gemm = &cublasHgemm;
+  static constexpr decltype(cublasHgemmBatched)* gemm_batched = &cublasHgemmBatched;
 };
 
 template<>
 struct blas<float> {
   static constexpr decltype(cublasSgemm)* gemm = &cublasSgemm;
+  static constexpr decltype(cublasSgemmBatched)* gemm_batched = &cublasSgemmBatched;
+  static constexpr decltype(cublasSgeam)* geam = &cublasSgeam;
 };
 
 template<>
 struct blas<double> {
   static constexpr decltype(cublasDgemm)* gemm = &cublasDgemm;
+  static constexpr decltype(cublasDgemmBatched)* gemm_batched = &cublasDgemmBatched;
+  static constexpr decltype(cublasDgeam)* geam = &cublasDgeam;
 };
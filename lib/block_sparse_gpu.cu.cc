@@ -0,0 +1,427 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <algorithm>
+#include <cassert>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+#include <cuda_fp16.h>
+#include <numeric>
+#include <vector>
+
+#include "blas.h"
+#include "haste.h"
+
+namespace {
+
+constexpr int kMaxBlockSize = 32;
+// Each thread block of `BlockSparseGemm` computes a [kTileN,B] tile of the output with
+// kTileN x kTileRows threads.
+constexpr int kTileN = 32;
+constexpr int kTileRows = 8;
+
+// Products are accumulated in float for half, which also keeps `BlockSparseGemm` free of
+// half arithmetic that compute capabilities below 5.3 don't have.
+template<typename T>
+struct AccumulatorType {
+  typedef T type;
+};
+
+template<>
+struct AccumulatorType<half> {
+  typedef float type;
+};
+
+// out = R·h for one block column of `R` (one block of gates) and kTileN batch entries,
+// summing over the live blocks of that column only. R is [inner,rows] and h is
+// [batch,inner], both as laid out by the engines.
+template<typename T>
+__global__
+void BlockSparseGemm(
+    const int block_size,
+    const int rows,
+    const int inner,
+    const int batch_size,
+    const int* offsets,     // [block_cols+1]
+    const int* live_rows,   // [live]
+    const T* R,
+    const T* h,
+    T* out) {
+  typedef typename AccumulatorType<T>::type Acc;
+  extern __shared__ unsigned char shared[];
+  const int B = block_size;
+  const int stride = B + 1;  // Pad to avoid bank conflicts on the transposed reads.
+  T* R_s = reinterpret_cast<T*>(shared);  // [B,B]
+  T* h_s = R_s + B * B;                   // [kTileN,B+1]
+
+  const int col = blockIdx.x;
+  const int n0 = blockIdx.y * kTileN;
+  const int tid = threadIdx.y * blockDim.x + threadIdx.x;
+  const int threads = blockDim.x * blockDim.y;
+
+  Acc acc[kMaxBlockSize / kTileRows];
+  for (int k = 0; k < kMaxBlockSize / kTileRows; ++k)
+    acc[k] = static_cast<Acc>(0.0f);
+
+  for (int e = offsets[col]; e < offsets[col + 1]; ++e) {
+    const int row = live_rows[e];
+    for (int k = tid; k < B * B; k += threads) {
+      const int i = k % B;
+      const int j = k / B;
+      R_s[k] = R[(row * B + j) * rows + col * B + i];
+    }
+    for (int k = tid; k < B * kTileN; k += threads) {
+      const int j = k % B;
+      const int n = k / B;
+      h_s[n * stride + j] = n0 + n < batch_size ? h[(n0 + n) * inner + row * B + j] : static_cast<T>(0.0f);
+    }
+    __syncthreads();
+
+    for (int k = 0, i = threadIdx.y; i < B; ++k, i += kTileRows)
+      for (int j = 0; j < B; ++j)
+        acc[k] += static_cast<Acc>(R_s[j * B + i]) * static_cast<Acc>(h_s[threadIdx.x * stride + j]);
+    __syncthreads();
+  }
+
+  const int n = n0 + threadIdx.x;
+  if (n >= batch_size)
+    return;
+  for (int k = 0, i = threadIdx.y; i < B; ++k, i += kTileRows)
+    out[n * rows + col * B + i] = static_cast<T>(acc[k]);
+}
+
+// Points the operands of one batched GEMM entry at each live block.
+template<typename T>
+__global__
+void BlockPointers(
+    const int live,
+    const int block_size,
+    const int block_cols,
+    const int rows,
+    const int* live_index,  // [live]
+    const T* dv,
+    const T* h,
+    T* dR,
+    const T** dv_blocks,
+    const T** h_blocks,
+    T** dR_blocks) {
+  const int e = blockDim.x * blockIdx.x + threadIdx.x;
+  if (e >= live)
+    return;
+  const int row = live_index[e] / block_cols;
+  const int col = live_index[e] % block_cols;
+  dv_blocks[e] = dv + col * block_size;
+  h_blocks[e] = h + row * block_size;
+  dR_blocks[e] = dR + row * block_size * rows + col * block_size;
+}
+
+template<typename T>
+__global__
+void BlockNorms(const int block_size, const int rows, const T* R, float* norms) {
+  __shared__ float partial[256];
+  const int B = block_size;
+  const int col = blockIdx.x;
+  const int row = blockIdx.y;
+
+  float sum = 0.0f;
+  for (int k = threadIdx.x; k < B * B; k += blockDim.x) {
+    const float value = static_cast<float>(R[(row * B + k / B) * rows + col * B + k % B]);
+    sum += value * value;
+  }
+  partial[threadIdx.x] = sum;
+  __syncthreads();
+
+  for (int s = blockDim.x / 2; s > 0; s /= 2) {
+    if (threadIdx.x < s)
+      partial[threadIdx.x] += partial[threadIdx.x + s];
+    __syncthreads();
+  }
+  if (threadIdx.x == 0)
+    norms[row * gridDim.x + col] = partial[0];
+}
+
+template<typename T>
+__global__
+void ZeroDeadBlocks(
+    const int size,
+    const int block_size,
+    const int block_cols,
+    const int rows,
+    const uint8_t* mask,
+    T* R) {
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    const int row = i / rows / block_size;
+    const int col = i % rows / block_size;
+    if (!mask[row * block_cols + col])
+      R[i] = static_cast<T>(0.0f);
+  }
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace block_sparse {
+
+template<typename T>
+struct Mask<T>::private_data {
+  int hidden_size;
+  int rows;
+  int block_size;
+  int block_rows;
+  int block_cols;
+  int live;
+  std::vector<uint8_t> mask;
+  std::vector<float> norms;
+  uint8_t* mask_dev;
+  int* offsets;     // [block_cols+1] start of each block column in `live_rows`
+  int* live_rows;   // [blocks] block row of each live block, grouped by column
+  int* live_index;  // [blocks] row * block_cols + col of each live block
+  float* norms_dev;
+  const T** dv_blocks;
+  const T** h_blocks;
+  T** dR_blocks;
+};
+
+template<typename T>
+Mask<T>::Mask(
+    const int hidden_size,
+    const int gate_count,
+    const int block_size) : data_(new private_data) {
+  assert(block_size <= kMaxBlockSize);
+  assert(hidden_size % block_size == 0);
+  const int blocks = (hidden_size / block_size) * (hidden_size * gate_count / block_size);
+  data_->hidden_size = hidden_size;
+  data_->rows = hidden_size * gate_count;
+  data_->block_size = block_size;
+  data_->block_rows = hidden_size / block_size;
+  data_->block_cols = hidden_size * gate_count / block_size;
+  data_->mask.assign(blocks, 1);
+  data_->norms.resize(blocks);
+  cudaMalloc(&data_->mask_dev, blocks * sizeof(uint8_t));
+  cudaMalloc(&data_->offsets, (data_->block_cols + 1) * sizeof(int));
+  cudaMalloc(&data_->live_rows, blocks * sizeof(int));
+  cudaMalloc(&data_->live_index, blocks * sizeof(int));
+  cudaMalloc(&data_->norms_dev, blocks * sizeof(float));
+  cudaMalloc(&data_->dv_blocks, blocks * sizeof(T*));
+  cudaMalloc(&data_->h_blocks, blocks * sizeof(T*));
+  cudaMalloc(&data_->dR_blocks, blocks * sizeof(T*));
+  Upload();
+}
+
+template<typename T>
+Mask<T>::~Mask() {
+  cudaFree(data_->dR_blocks);
+  cudaFree(data_->h_blocks);
+  cudaFree(data_->dv_blocks);
+  cudaFree(data_->norms_dev);
+  cudaFree(data_->live_index);
+  cudaFree(data_->live_rows);
+  cudaFree(data_->offsets);
+  cudaFree(data_->mask_dev);
+  delete data_;
+}
+
+template<typename T>
+int Mask<T>::hidden_size() const {
+  return data_->hidden_size;
+}
+
+template<typename T>
+int Mask<T>::gate_count() const {
+  return data_->rows / data_->hidden_size;
+}
+
+template<typename T>
+int Mask<T>::block_size() const {
+  return data_->block_size;
+}
+
+template<typename T>
+int Mask<T>::block_rows() const {
+  return data_->block_rows;
+}
+
+template<typename T>
+int Mask<T>::block_cols() const {
+  return data_->block_cols;
+}
+
+template<typename T>
+int Mask<T>::live_blocks() const {
+  return data_->live;
+}
+
+template<typename T>
+void Mask<T>::Set(const uint8_t* mask) {
+  for (size_t i = 0; i < data_->mask.size(); ++i)
+    data_->mask[i] = mask[i] ? 1 : 0;
+  Upload();
+}
+
+template<typename T>
+void Mask<T>::Get(uint8_t* mask) const {
+  std::copy(data_->mask.begin(), data_->mask.end(), mask);
+}
+
+template<typename T>
+void Mask<T>::Upload() {
+  const int block_rows = data_->block_rows;
+  const int block_cols = data_->block_cols;
+
+  std::vector<int> offsets(block_cols + 1, 0);
+  std::vector<int> rows;
+  std::vector<int> blocks;
+  for (int col = 0; col < block_cols; ++col) {
+    for (int row = 0; row < block_rows; ++row) {
+      if (data_->mask[row * block_cols + col]) {
+        rows.push_back(row);
+        blocks.push_back(row * block_cols + col);
+      }
+    }
+    offsets[col + 1] = rows.size();
+  }
+  data_->live = rows.size();
+
+  cudaMemcpy(data_->mask_dev, data_->mask.data(), data_->mask.size() * sizeof(uint8_t), cudaMemcpyHostToDevice);
+  cudaMemcpy(data_->offsets, offsets.data(), offsets.size() * sizeof(int), cudaMemcpyHostToDevice);
+  cudaMemcpy(data_->live_rows, rows.data(), rows.size() * sizeof(int), cudaMemcpyHostToDevice);
+  cudaMemcpy(data_->live_index, blocks.data(), blocks.size() * sizeof(int), cudaMemcpyHostToDevice);
+}
+
+template<typename T>
+void Mask<T>::Apply(const cudaStream_t& stream, T* R) const {
+  const int size = data_->hidden_size * data_->rows;
+  ZeroDeadBlocks<T><<<(size + 255) / 256, 256, 0, stream>>>(
+      size,
+      data_->block_size,
+      data_->block_cols,
+      data_->rows,
+      data_->mask_dev,
+      R);
+}
+
+template<typename T>
+void Mask<T>::Prune(const cudaStream_t& stream, T* R, const float sparsity) {
+  const int blocks = data_->mask.size();
+  const dim3 gridDim(data_->block_cols, data_->block_rows);
+  BlockNorms<T><<<gridDim, 256, 0, stream>>>(data_->block_size, data_->rows, R, data_->norms_dev);
+  cudaMemcpyAsync(data_->norms.data(), data_->norms_dev, blocks * sizeof(float), cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+
+  // Ties are broken by position so that the mask is deterministic.
+  const int dead = std::min(blocks, std::max(0, static_cast<int>(sparsity * blocks + 0.5f)));
+  const std::vector<float>& norms = data_->norms;
+  std::vector<int> order(blocks);
+  std::iota(order.begin(), order.end(), 0);
+  std::nth_element(order.begin(), order.begin() + dead, order.end(), [&](int a, int b) {
+    return norms[a] < norms[b] || (norms[a] == norms[b] && a < b);
+  });
+  std::fill(data_->mask.begin(), data_->mask.end(), 1);
+  for (int i = 0; i < dead; ++i)
+    data_->mask[order[i]] = 0;
+
+  Upload();
+  Apply(stream, R);
+}
+
+template<typename T>
+bool Mask<T>::Step(
+    const cudaStream_t& stream,
+    T* R,
+    const PruningSchedule& schedule,
+    const int step) {
+  if (!schedule.ShouldPrune(step))
+    return false;
+  Prune(stream, R, schedule.Sparsity(step));
+  return true;
+}
+
+template<typename T>
+void Mask<T>::Multiply(
+    const cudaStream_t& stream,
+    const int batch_size,
+    const int hidden_size,
+    const int gate_count,
+    const T* R,
+    const T* h,
+    T* out) const {
+  assert(hidden_size == data_->hidden_size && hidden_size * gate_count == data_->rows);
+  const int B = data_->block_size;
+  const dim3 blockDim(kTileN, kTileRows);
+  const dim3 gridDim(data_->block_cols, (batch_size + kTileN - 1) / kTileN);
+  const int shared_bytes = (B * B + kTileN * (B + 1)) * sizeof(T);
+  BlockSparseGemm<T><<<gridDim, blockDim, shared_bytes, stream>>>(
+      B,
+      data_->rows,
+      data_->hidden_size,
+      batch_size,
+      data_->offsets,
+      data_->live_rows,
+      R,
+      h,
+      out);
+}
+
+template<typename T>
+void Mask<T>::AccumulateGradient(
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream,
+    const int count,
+    const int hidden_size,
+    const int gate_count,
+    const T* dv,
+    const T* h,
+    T* dR) const {
+  assert(hidden_size == data_->hidden_size && hidden_size * gate_count == data_->rows);
+  const T alpha = static_cast<T>(1.0);
+  const T beta_sum = static_cast<T>(1.0);
+
+  const int live = data_->live;
+  if (!live)
+    return;
+
+  const int B = data_->block_size;
+  BlockPointers<T><<<(live + 255) / 256, 256, 0, stream>>>(
+      live,
+      B,
+      data_->block_cols,
+      data_->rows,
+      data_->live_index,
+      dv,
+      h,
+      dR,
+      data_->dv_blocks,
+      data_->h_blocks,
+      data_->dR_blocks);
+
+  blas<T>::gemm_batched(blas_handle,
+      CUBLAS_OP_N, CUBLAS_OP_T,
+      B, B, count,
+      &alpha,
+      data_->dv_blocks, data_->rows,
+      data_->h_blocks, data_->hidden_size,
+      &beta_sum,
+      data_->dR_blocks, data_->rows,
+      live);
+}
+
+template class Mask<half>;
+template class Mask<float>;
+template class Mask<double>;
+
+}  // namespace block_sparse
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,136 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include "cell_ops.h"
+#include "inline_ops.h"
+
+namespace {
+
+template<typename T>
+__device__ __forceinline__
+T hard_sigmoid(const T x) {
+  const T y = static_cast<T>(0.2) * x + static_cast<T>(0.5);
+  return y < static_cast<T>(0.0) ? static_cast<T>(0.0) : (y > static_cast<T>(1.0) ? static_cast<T>(1.0) : y);
+}
+
+template<typename T>
+__device__ __forceinline__
+T hard_tanh(const T x) {
+  return x < static_cast<T>(-1.0) ? static_cast<T>(-1.0) : (x > static_cast<T>(1.0) ? static_cast<T>(1.0) : x);
+}
+
+// The derivatives are taken from the outputs; they are zero wherever the output saturates.
+template<typename T>
+__device__ __forceinline__
+T d_hard_sigmoid(const T output) {
+  return (output > static_cast<T>(0.0) && output < static_cast<T>(1.0)) ? static_cast<T>(0.2) : static_cast<T>(0.0);
+}
+
+template<typename T>
+__device__ __forceinline__
+T d_hard_tanh(const T output) {
+  return (output > static_cast<T>(-1.0) && output < static_cast<T>(1.0)) ? static_cast<T>(1.0) : static_cast<T>(0.0);
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace cell {
+
+struct HardLstm {
+  static constexpr int kGates = 4;
+  static constexpr bool kHasCell = true;
+
+  template<typename T>
+  __device__ static void Forward(const T* pre, T* act, T& h, T& c) {
+    const T i = hard_sigmoid(pre[0]);
+    const T g = hard_tanh(pre[1]);
+    const T f = hard_sigmoid(pre[2]);
+    const T o = hard_sigmoid(pre[3]);
+    act[0] = i;
+    act[1] = g;
+    act[2] = f;
+    act[3] = o;
+    c = f * c + i * g;
+    h = o * hard_tanh(c);
+  }
+
+  template<typename T>
+  __device__ static void Backward(
+      const T* act, const T h_prev, const T c_prev, const T c,
+      T& dh, T& dc, T* dpre) {
+    const T i = act[0];
+    const T g = act[1];
+    const T f = act[2];
+    const T o = act[3];
+    const T c_tanh = hard_tanh(c);
+    dc += dh * o * d_hard_tanh(c_tanh);
+    dpre[0] = dc * g * d_hard_sigmoid(i);
+    dpre[1] = dc * i * d_hard_tanh(g);
+    dpre[2] = dc * c_prev * d_hard_sigmoid(f);
+    dpre[3] = dh * c_tanh * d_hard_sigmoid(o);
+    // `h_prev` only reaches the gates through `R`, which the engine differentiates.
+    dh = static_cast<T>(0.0);
+    dc = dc * f;
+  }
+};
+
+struct Cifg {
+  static constexpr int kGates = 3;
+  static constexpr bool kHasCell = true;
+
+  template<typename T>
+  __device__ static void Forward(const T* pre, T* act, T& h, T& c) {
+    const T f = sigmoid(pre[0]);
+    const T g = tanh(pre[1]);
+    const T o = sigmoid(pre[2]);
+    act[0] = f;
+    act[1] = g;
+    act[2] = o;
+    c = f * c + (static_cast<T>(1.0) - f) * g;
+    h = o * tanh(c);
+  }
+
+  template<typename T>
+  __device__ static void Backward(
+      const T* act, const T h_prev, const T c_prev, const T c,
+      T& dh, T& dc, T* dpre) {
+    const T f = act[0];
+    const T g = act[1];
+    const T o = act[2];
+    const T c_tanh = tanh(c);
+    dc += dh * o * d_tanh(c_tanh);
+    dpre[0] = dc * (c_prev - g) * d_sigmoid(f);
+    dpre[1] = dc * (static_cast<T>(1.0) - f) * d_tanh(g);
+    dpre[2] = dh * c_tanh * d_sigmoid(o);
+    // `h_prev` only reaches the gates through `R`, which the engine differentiates.
+    dh = static_cast<T>(0.0);
+    dc = dc * f;
+  }
+};
+
+template class ForwardPass<HardLstm, float>;
+template class ForwardPass<HardLstm, double>;
+template class BackwardPass<HardLstm, float>;
+template class BackwardPass<HardLstm, double>;
+template class ForwardPass<Cifg, float>;
+template class ForwardPass<Cifg, double>;
+template class BackwardPass<Cifg, float>;
+template class BackwardPass<Cifg, double>;
+
+}  // namespace cell
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,508 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+// Engines for `cell::ForwardPass` and `cell::BackwardPass`. Include this file from the
+// CUDA translation unit that defines a cell and instantiate the engines there:
+//
+//   template class haste::v0::cell::ForwardPass<MyCell, float>;
+//   template class haste::v0::cell::BackwardPass<MyCell, float>;
+
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+#include "blas.h"
+#include "gradient_ops.h"
+#include "haste.h"
+#include "health_ops.h"
+#include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
+
+namespace haste {
+namespace v0 {
+namespace cell {
+namespace internal {
+
+using namespace haste::v0::gradient::internal;
+using namespace haste::v0::health::internal;
+
+// `h` and `h_out` may not be aliased, nor may `c` and `c_out`.
+template<typename Cell, typename T, bool Training>
+__global__
+void CellFwdOps(
+    const int batch_size,
+    const int hidden_size,
+    const T* Wx,      // [N,H*G]
+    const T* Rh,      // [N,H*G]
+    const T* b,       // [H*G]
+    const T* h,       // [N,H]
+    const T* c,       // [N,H] (only used if Cell::kHasCell)
+    T* h_out,         // [N,H]
+    T* c_out,         // [N,H] (only used if Cell::kHasCell)
+    T* v_out,         // [N,H*G] (only used if Training==true)
+    Record* health,   // Non-finite value record (may be null)
+    const int step) {
+  constexpr int G = Cell::kGates;
+  const int row = blockDim.x * blockIdx.x + threadIdx.x;
+  const int col = blockDim.y * blockIdx.y + threadIdx.y;
+
+  if (row >= hidden_size || col >= batch_size)
+    return;
+
+  const int weight_idx = col * (hidden_size * G) + row;
+  const int output_idx = col * hidden_size + row;
+
+  T pre[G];
+  #pragma unroll
+  for (int g = 0; g < G; ++g)
+    pre[g] = Wx[weight_idx + g * hidden_size] + Rh[weight_idx + g * hidden_size] + b[row + g * hidden_size];
+
+  T act[G];
+  T cur_h_value = h[output_idx];
+  T cur_c_value = Cell::kHasCell ? c[output_idx] : static_cast<T>(0.0);
+  Cell::Forward(pre, act, cur_h_value, cur_c_value);
+
+  if (Training) {
+    #pragma unroll
+    for (int g = 0; g < G; ++g)
+      v_out[weight_idx + g * hidden_size] = act[g];
+  }
+
+  h_out[output_idx] = cur_h_value;
+  Check(health, kState, step, col, cur_h_value);
+  if (Cell::kHasCell) {
+    c_out[output_idx] = cur_c_value;
+    Check(health, kCell, step, col, cur_c_value);
+  }
+}
+
+template<typename Cell, typename T>
+__global__
+void CellBwdOps(
+    const int batch_size,
+    const int hidden_size,
+    const T* h,        // [N,H]
+    const T* c,        // [N,H] (only used if Cell::kHasCell)
+    const T* c_new,    // [N,H] (only used if Cell::kHasCell)
+    const T* dh_new,   // [N,H]
+    const T* dc_new,   // [N,H] (may be null)
+    T* db_out,         // [H*G]
+    T* dh_inout,       // [N,H]
+    T* dc_inout,       // [N,H] (only used if Cell::kHasCell)
+    T* v,              // [N,H*G] cell activations in, pre-activation gradients out
+    const float max_state_grad,
+    Record* health,    // Non-finite value record (may be null)
+    const int step) {
+  constexpr int G = Cell::kGates;
+  const int row = blockDim.x * blockIdx.x + threadIdx.x;
+  const int col = blockDim.y * blockIdx.y + threadIdx.y;
+
+  if (row >= hidden_size || col >= batch_size)
+    return;
+
+  const int base_idx = col * hidden_size + row;
+  const int weight_idx = col * (hidden_size * G) + row;
+
+  T dh_total = dh_new[base_idx] + dh_inout[base_idx];
+  Check(health, kGradient, step, col, dh_total);
+  dh_total = ClampState(dh_total, max_state_grad);
+
+  T dc_total = static_cast<T>(0.0);
+  T c_prev = static_cast<T>(0.0);
+  T c_cur = static_cast<T>(0.0);
+  if (Cell::kHasCell) {
+    dc_total = dc_inout[base_idx];
+    // The branch is uniform across the whole launch.
+    if (dc_new)
+      dc_total += dc_new[base_idx];
+    Check(health, kGradient, step, col, dc_total);
+    dc_total = ClampState(dc_total, max_state_grad);
+    c_prev = c[base_idx];
+    c_cur = c_new[base_idx];
+  }
+
+  T act[G];
+  #pragma unroll
+  for (int g = 0; g < G; ++g)
+    act[g] = v[weight_idx + g * hidden_size];
+
+  T dpre[G];
+  Cell::Backward(act, h[base_idx], c_prev, c_cur, dh_total, dc_total, dpre);
+
+  // The path through `R` is added by the GEMM that follows.
+  dh_inout[base_idx] = dh_total;
+  if (Cell::kHasCell)
+    dc_inout[base_idx] = dc_total;
+
+  #pragma unroll
+  for (int g = 0; g < G; ++g) {
+    v[weight_idx + g * hidden_size] = dpre[g];
+    atomicAdd(&db_out[row + g * hidden_size], dpre[g]);
+  }
+}
+
+}  // namespace internal
+
+template<typename Cell, typename T>
+struct ForwardPass<Cell, T>::private_data {
+  bool training;
+  int batch_size;
+  int input_size;
+  int hidden_size;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream;
+  cudaEvent_t event;
+  cudaStream_t sync_stream;
+};
+
+template<typename Cell, typename T>
+ForwardPass<Cell, T>::ForwardPass(
+    const bool training,
+    const int batch_size,
+    const int input_size,
+    const int hidden_size,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  data_->training = training;
+  data_->batch_size = batch_size;
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
+  cudaStreamCreate(&data_->stream);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
+}
+
+template<typename Cell, typename T>
+ForwardPass<Cell, T>::~ForwardPass() {
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream);
+  }
+  cudaEventDestroy(data_->event);
+  cudaStreamDestroy(data_->stream);
+  delete data_;
+}
+
+template<typename Cell, typename T>
+void ForwardPass<Cell, T>::Run(
+    const int steps,
+    const T* W,       // [C,H*G]
+    const T* R,       // [H,H*G]
+    const T* b,       // [H*G]
+    const T* x,       // [T,N,C]
+    T* h,             // [T+1,N,H]
+    T* c,             // [T+1,N,H]
+    T* v,             // [T,N,H*G]
+    T* tmp_Rh) {      // [N,H*G]
+  HASTE_PROBE_RUN(kCell, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  static const T alpha = static_cast<T>(1.0);
+  static const T beta = static_cast<T>(0.0);
+  constexpr int G = Cell::kGates;
+
+  const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
+
+  const bool training = data_->training;
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+  const cudaStream_t stream = data_->stream;
+
+  cudaStream_t save_stream;
+  cublasGetStream(blas_handle, &save_stream);
+
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(stream, data_->event, 0);
+  }
+
+  cublasSetStream(blas_handle, stream);
+  HASTE_PROBE_GEMM(kCell, kInputGemm, hidden_size * G, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(v_timer, kCell, kInputGemm, stream);
+  blas<T>::gemm(blas_handle,
+      CUBLAS_OP_N, CUBLAS_OP_N,
+      hidden_size * G, steps * batch_size, input_size,
+      &alpha,
+      W, hidden_size * G,
+      x, input_size,
+      &beta,
+      v, hidden_size * G);
+  HASTE_STATS_END(v_timer);
+
+  const dim3 blockDim(64, 16);
+  const dim3 gridDim(
+      (hidden_size + blockDim.x - 1) / blockDim.x,
+      (batch_size + blockDim.y - 1) / blockDim.y);
+  const int NH = batch_size * hidden_size;
+  health::Record* health_record = health::Active();
+
+  for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kCell, batch_size, input_size, hidden_size, i);
+    HASTE_PROBE_GEMM(kCell, kRecurrentGemm, hidden_size * G, batch_size, hidden_size);
+    HASTE_STATS_BEGIN(tmp_Rh_timer, kCell, kRecurrentGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * G, batch_size, hidden_size,
+        &alpha,
+        R, hidden_size * G,
+        h + i * NH, hidden_size,
+        &beta,
+        tmp_Rh, hidden_size * G);
+    HASTE_STATS_END(tmp_Rh_timer);
+
+    const T* c_in = Cell::kHasCell ? c + i * NH : nullptr;
+    T* c_out = Cell::kHasCell ? c + (i + 1) * NH : nullptr;
+    HASTE_STATS_BEGIN(pointwise_timer, kCell, kPointwise, stream);
+    if (training) {
+      internal::CellFwdOps<Cell, T, true><<<gridDim, blockDim, 0, stream>>>(
+          batch_size,
+          hidden_size,
+          v + i * NH * G,
+          tmp_Rh,
+          b,
+          h + i * NH,
+          c_in,
+          h + (i + 1) * NH,
+          c_out,
+          v + i * NH * G,
+          health_record,
+          i);
+    } else {
+      internal::CellFwdOps<Cell, T, false><<<gridDim, blockDim, 0, stream>>>(
+          batch_size,
+          hidden_size,
+          v + i * NH * G,
+          tmp_Rh,
+          b,
+          h + i * NH,
+          c_in,
+          h + (i + 1) * NH,
+          c_out,
+          nullptr,
+          health_record,
+          i);
+    }
+    HASTE_STATS_END(pointwise_timer);
+  }
+
+  cublasSetStream(blas_handle, save_stream);
+}
+
+template<typename Cell, typename T>
+struct BackwardPass<Cell, T>::private_data {
+  int batch_size;
+  int input_size;
+  int hidden_size;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream[2];
+  cudaEvent_t event;
+  cudaStream_t sync_stream;
+};
+
+template<typename Cell, typename T>
+BackwardPass<Cell, T>::BackwardPass(
+    const int batch_size,
+    const int input_size,
+    const int hidden_size,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  data_->batch_size = batch_size;
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
+  cudaStreamCreate(&data_->stream[0]);
+  cudaStreamCreate(&data_->stream[1]);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
+}
+
+template<typename Cell, typename T>
+BackwardPass<Cell, T>::~BackwardPass() {
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream[1]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+    cudaEventRecord(data_->event, data_->stream[0]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream[1]);
+    cudaStreamSynchronize(data_->stream[0]);
+  }
+  cudaEventDestroy(data_->event);
+  cudaStreamDestroy(data_->stream[1]);
+  cudaStreamDestroy(data_->stream[0]);
+  delete data_;
+}
+
+template<typename Cell, typename T>
+void BackwardPass<Cell, T>::Run(
+    const int steps,
+    const T* W_t,     // [H*G,C]
+    const T* R_t,     // [H*G,H]
+    const T* b,       // [H*G]
+    const T* x_t,     // [C,T,N]
+    const T* h,       // [T+1,N,H]
+    const T* c,       // [T+1,N,H]
+    const T* dh_new,  // [T+1,N,H]
+    const T* dc_new,  // [T+1,N,H]
+    T* dx,            // [T,N,C]
+    T* dW,            // [C,H*G]
+    T* dR,            // [H,H*G]
+    T* db,            // [H*G]
+    T* dh,            // [N,H]
+    T* dc,            // [N,H]
+    T* v,             // [T,N,H*G]
+    const gradient::Options* gradient) {
+  HASTE_PROBE_RUN(kCell, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const T alpha = static_cast<T>(1.0);
+  const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
+  const T beta_assign = static_cast<T>(0.0);
+  constexpr int G = Cell::kGates;
+
+  const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
+
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+  const cudaStream_t stream1 = data_->stream[0];
+  const cudaStream_t stream2 = data_->stream[1];
+  const cudaEvent_t event = data_->event;
+
+  cudaStream_t save_stream;
+  cublasGetStream(blas_handle, &save_stream);
+
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(event, data_->sync_stream);
+    cudaStreamWaitEvent(stream1, event, 0);
+    cudaStreamWaitEvent(stream2, event, 0);
+  }
+
+  const dim3 blockDim(64, 16);
+  const dim3 gridDim(
+      (hidden_size + blockDim.x - 1) / blockDim.x,
+      (batch_size + blockDim.y - 1) / blockDim.y);
+  const int NH = batch_size * hidden_size;
+  const float max_state_grad = gradient ? gradient->max_state_grad : 0.0f;
+  health::Record* health_record = health::Active();
+
+  internal::ClearParameter(stream1, gradient, input_size * hidden_size * G, dW);
+  internal::ClearParameter(stream1, gradient, hidden_size * hidden_size * G, dR);
+  internal::ClearParameter(stream1, gradient, hidden_size * G, db);
+
+  cublasSetStream(blas_handle, stream1);
+  for (int i = steps - 1; i >= 0; --i) {
+    HASTE_PROBE_STEP(kCell, batch_size, input_size, hidden_size, i);
+    HASTE_STATS_BEGIN(pointwise_timer, kCell, kPointwise, stream1);
+    internal::CellBwdOps<Cell, T><<<gridDim, blockDim, 0, stream1>>>(
+        batch_size,
+        hidden_size,
+        h + i * NH,
+        Cell::kHasCell ? c + i * NH : nullptr,
+        Cell::kHasCell ? c + (i + 1) * NH : nullptr,
+        dh_new + (i + 1) * NH,
+        Cell::kHasCell && dc_new ? dc_new + (i + 1) * NH : nullptr,
+        db,
+        dh,
+        dc,
+        v + i * NH * G,
+        max_state_grad,
+        health_record,
+        i);
+    HASTE_STATS_END(pointwise_timer);
+
+    HASTE_PROBE_GEMM(kCell, kRecurrentGemm, hidden_size, batch_size, hidden_size * G);
+    HASTE_STATS_BEGIN(dh_timer, kCell, kRecurrentGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size, batch_size, hidden_size * G,
+        &alpha,
+        R_t, hidden_size,
+        v + i * NH * G, hidden_size * G,
+        &beta_sum,
+        dh, hidden_size);
+    HASTE_STATS_END(dh_timer);
+  }
+  cudaEventRecord(event, stream1);
+
+  cudaStreamWaitEvent(stream2, event, 0);
+  cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kCell, kReduction, hidden_size * G, input_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dW_timer, kCell, kReduction, stream2);
+  blas<T>::gemm(blas_handle,
+      CUBLAS_OP_N, CUBLAS_OP_N,
+      hidden_size * G, input_size, batch_size * steps,
+      &alpha,
+      v, hidden_size * G,
+      x_t, batch_size * steps,
+      &beta_sum,
+      dW, hidden_size * G);
+  HASTE_STATS_END(dW_timer);
+
+  cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kCell, kReduction, hidden_size * G, hidden_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dR_timer, kCell, kReduction, stream1);
+  blas<T>::gemm(blas_handle,
+      CUBLAS_OP_N, CUBLAS_OP_T,
+      hidden_size * G, hidden_size, batch_size * steps,
+      &alpha,
+      v, hidden_size * G,
+      h, hidden_size,
+      &beta_sum,
+      dR, hidden_size * G);
+  HASTE_STATS_END(dR_timer);
+
+  HASTE_PROBE_GEMM(kCell, kInputGemm, input_size, steps * batch_size, hidden_size * G);
+  HASTE_STATS_BEGIN(dx_timer, kCell, kInputGemm, stream1);
+  blas<T>::gemm(blas_handle,
+      CUBLAS_OP_N, CUBLAS_OP_N,
+      input_size, steps * batch_size, hidden_size * G,
+      &alpha,
+      W_t, input_size,
+      v, hidden_size * G,
+      &beta_assign,
+      dx, input_size);
+  HASTE_STATS_END(dx_timer);
+
+  // `db` is final now that the pointwise operations are, so its norm is taken in the same
+  // pass as that of `dx`.
+  HASTE_STATS_BEGIN(finish_timer, kCell, kPointwise, stream1);
+  internal::FinishInputGradient(
+      stream1, nullptr, gradient, steps, batch_size, input_size, dx, hidden_size * G, db);
+  HASTE_STATS_END(finish_timer);
+
+  // The GEMM outputs are reduced in passes of their own since cuBLAS has no epilogue for
+  // them. Wait for the ones on stream2.
+  if (gradient && gradient->accumulator) {
+    cudaEventRecord(event, stream2);
+    cudaStreamWaitEvent(stream1, event, 0);
+    HASTE_STATS_BEGIN(norm_timer, kCell, kReduction, stream1);
+    internal::AccumulateSquares(stream1, gradient, internal::kParameters, input_size * hidden_size * G, dW);
+    internal::AccumulateSquares(stream1, gradient, internal::kParameters, hidden_size * hidden_size * G, dR);
+    HASTE_STATS_END(norm_timer);
+  }
+
+  cublasSetStream(blas_handle, save_stream);
+}
+
+}  // namespace cell
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,188 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <algorithm>
+#include <cassert>
+#include <cuda_runtime_api.h>
+#include <vector>
+
+#include "haste.h"
+#include "phase_timer.h"
+
+namespace {
+
+template<typename T>
+__global__
+void Accumulate(const int size, const T* src, T* dst) {
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x)
+    dst[i] += src[i];
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace data_parallel {
+
+template<typename T>
+struct AllReduce<T>::private_data {
+  std::vector<int> devices;
+  int size;
+  int chunk_size;
+  std::vector<T*> scratch;
+  std::vector<cudaEvent_t> events;
+};
+
+template<typename T>
+AllReduce<T>::AllReduce(
+    const std::vector<int>& devices,
+    const int size) : data_(new private_data) {
+  const int count = devices.size();
+  data_->devices = devices;
+  data_->size = size;
+  data_->chunk_size = (size + count - 1) / count;
+  data_->scratch.resize(count);
+  data_->events.resize(count);
+
+  int save_device;
+  cudaGetDevice(&save_device);
+  for (int i = 0; i < count; ++i) {
+    const int peer = devices[(i + count - 1) % count];
+    int can_access = 0;
+    cudaSetDevice(devices[i]);
+    cudaDeviceCanAccessPeer(&can_access, devices[i], peer);
+    if (can_access && peer != devices[i]) {
+      // Fails harmlessly if peer access was already enabled by someone else.
+      cudaDeviceEnablePeerAccess(peer, 0);
+      cudaGetLastError();
+    }
+    cudaMalloc(&data_->scratch[i], data_->chunk_size * sizeof(T));
+    HASTE_STATS_ALLOCATION(data_->chunk_size * sizeof(T));
+    cudaEventCreateWithFlags(&data_->events[i], cudaEventDisableTiming);
+  }
+  cudaSetDevice(save_device);
+}
+
+template<typename T>
+AllReduce<T>::~AllReduce() {
+  int save_device;
+  cudaGetDevice(&save_device);
+  for (size_t i = 0; i < data_->devices.size(); ++i) {
+    cudaSetDevice(data_->devices[i]);
+    cudaEventSynchronize(data_->events[i]);
+    cudaEventDestroy(data_->events[i]);
+    cudaFree(data_->scratch[i]);
+  }
+  cudaSetDevice(save_device);
+  delete data_;
+}
+
+template<typename T>
+void AllReduce<T>::Run(
+    const std::vector<T*>& buffers,
+    const std::vector<cudaStream_t>& streams) {
+  const int count = data_->devices.size();
+  const int size = data_->size;
+  const int chunk_size = data_->chunk_size;
+  const std::vector<int>& devices = data_->devices;
+  const std::vector<cudaEvent_t>& events = data_->events;
+
+  assert(buffers.size() == devices.size());
+  assert(streams.size() == devices.size());
+
+  if (count < 2)
+    return;
+
+  int save_device;
+  cudaGetDevice(&save_device);
+
+  // Bounds of the `chunk`'th slice of each buffer. The last chunk may be short or empty.
+  auto chunk_begin = [&](int chunk) { return std::min(size, chunk * chunk_size); };
+  auto chunk_length = [&](int chunk) { return std::min(size, (chunk + 1) * chunk_size) - chunk_begin(chunk); };
+
+  // Every step reads a chunk from the left neighbour and writes a different chunk locally.
+  // All streams wait for every other stream between steps so that a chunk is never read
+  // by one device while its owner is still writing it.
+  auto barrier = [&]() {
+    for (int i = 0; i < count; ++i) {
+      cudaSetDevice(devices[i]);
+      cudaEventRecord(events[i], streams[i]);
+    }
+    for (int i = 0; i < count; ++i) {
+      cudaSetDevice(devices[i]);
+      for (int j = 0; j < count; ++j)
+        if (j != i)
+          cudaStreamWaitEvent(streams[i], events[j], 0);
+    }
+  };
+
+  // Reduce-scatter: after `count - 1` steps, device `i` holds the full sum of chunk `i + 1`.
+  for (int step = 0; step < count - 1; ++step) {
+    barrier();
+    for (int i = 0; i < count; ++i) {
+      const int src = (i + count - 1) % count;
+      const int chunk = (src - step + count) % count;
+      const int length = chunk_length(chunk);
+      if (length <= 0)
+        continue;
+
+      cudaSetDevice(devices[i]);
+      cudaMemcpyPeerAsync(
+          data_->scratch[i], devices[i],
+          buffers[src] + chunk_begin(chunk), devices[src],
+          length * sizeof(T),
+          streams[i]);
+
+      const int blockDim = 256;
+      const int gridDim = std::min((length + blockDim - 1) / blockDim, 1024);
+      Accumulate<T><<<gridDim, blockDim, 0, streams[i]>>>(
+          length,
+          data_->scratch[i],
+          buffers[i] + chunk_begin(chunk));
+    }
+  }
+
+  // All-gather: pass each fully reduced chunk around the ring.
+  for (int step = 0; step < count - 1; ++step) {
+    barrier();
+    for (int i = 0; i < count; ++i) {
+      const int src = (i + count - 1) % count;
+      const int chunk = (src + 1 - step + count) % count;
+      const int length = chunk_length(chunk);
+      if (length <= 0)
+        continue;
+
+      cudaSetDevice(devices[i]);
+      cudaMemcpyPeerAsync(
+          buffers[i] + chunk_begin(chunk), devices[i],
+          buffers[src] + chunk_begin(chunk), devices[src],
+          length * sizeof(T),
+          streams[i]);
+    }
+  }
+
+  for (int i = 0; i < count; ++i) {
+    cudaSetDevice(devices[i]);
+    cudaEventRecord(events[i], streams[i]);
+  }
+  cudaSetDevice(save_device);
+}
+
+template class AllReduce<float>;
+template class AllReduce<double>;
+
+}  // namespace data_parallel
+}  // namespace v0
+}  // namespace haste
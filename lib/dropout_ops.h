@@ -0,0 +1,165 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+// Mask generation for `dropout::Variational`. A mask element is a pure function of the
+// seed, the mask, and the element's position within the sequence's mask, so any kernel
+// can regenerate it where it's needed instead of reading it from memory.
+
+#include <cuda_fp16.h>
+
+namespace haste {
+namespace v0 {
+namespace dropout {
+namespace internal {
+
+enum Stream : unsigned int {
+  kInputMask = 0,
+  kOutputMask = 1,
+};
+
+// The scale of element `index` of `mask`: 0 if it's dropped, 1/(1-prob) otherwise.
+template<typename T>
+__device__ __forceinline__
+T Scale(const unsigned long long seed, const Stream mask, const int index, const float prob) {
+  // SplitMix64 finalizer over the element's position.
+  unsigned long long z = seed + 0x9e3779b97f4a7c15ull *
+      ((static_cast<unsigned long long>(mask) << 32) + static_cast<unsigned int>(index) + 1);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  const float uniform = static_cast<float>(z >> 40) * (1.0f / 16777216.0f);
+  return uniform < prob ? static_cast<T>(0.0) : static_cast<T>(1.0f / (1.0f - prob));
+}
+
+// x * scale. Half values are scaled in float, which every compute capability supports.
+template<typename T>
+__device__ __forceinline__
+T ApplyScale(const T x, const float scale) {
+  return x * static_cast<T>(scale);
+}
+
+template<>
+__device__ __forceinline__
+half ApplyScale(const half x, const float scale) {
+  return __float2half(__half2float(x) * scale);
+}
+
+// The type `MaskedGemm` accumulates in: float, except for double.
+template<typename T>
+struct GemmAccumulator {
+  typedef float type;
+};
+
+template<>
+struct GemmAccumulator<double> {
+  typedef double type;
+};
+
+// C = A * (B . mask) + beta * C with column-major operands, like `blas<T>::gemm` with
+// alpha = 1. B is `x` [T,N,C] or its transpose and the [N,C] input mask is regenerated as
+// each element of B is loaded, so the dropped-out input is never written to memory. If
+// `kFeaturesInRows`, B's rows are the C input features and its columns run over T*N
+// (`x` in the forward pass); otherwise it's the other way around (`x_t` in the backward
+// pass). Each block computes a 16x16 tile of C.
+template<typename T, bool kFeaturesInRows>
+__global__
+void MaskedGemm(
+    const int m,
+    const int n,
+    const int k,
+    const T* A,
+    const int lda,
+    const T* B,
+    const int ldb,
+    const T beta,
+    T* C,
+    const int ldc,
+    const int batch_size,
+    const int input_size,
+    const unsigned long long seed,
+    const float prob) {
+  typedef typename GemmAccumulator<T>::type Acc;
+  __shared__ Acc A_tile[16][17];
+  __shared__ Acc B_tile[16][17];
+
+  const int row = blockIdx.x * 16 + threadIdx.x;
+  const int col = blockIdx.y * 16 + threadIdx.y;
+
+  Acc sum = static_cast<Acc>(0.0);
+  for (int k0 = 0; k0 < k; k0 += 16) {
+    const int a_k = k0 + threadIdx.y;
+    A_tile[threadIdx.y][threadIdx.x] =
+        row < m && a_k < k ? static_cast<Acc>(A[row + a_k * lda]) : static_cast<Acc>(0.0);
+
+    const int b_k = k0 + threadIdx.x;
+    Acc b = static_cast<Acc>(0.0);
+    if (col < n && b_k < k) {
+      const int index = kFeaturesInRows
+          ? (col % batch_size) * input_size + b_k
+          : (b_k % batch_size) * input_size + col;
+      b = static_cast<Acc>(B[b_k + col * ldb]) * Scale<Acc>(seed, kInputMask, index, prob);
+    }
+    B_tile[threadIdx.y][threadIdx.x] = b;
+    __syncthreads();
+
+    for (int i = 0; i < 16; ++i)
+      sum += A_tile[i][threadIdx.x] * B_tile[threadIdx.y][i];
+    __syncthreads();
+  }
+
+  if (row >= m || col >= n)
+    return;
+  T* out = C + row + col * ldc;
+  if (static_cast<Acc>(beta) != static_cast<Acc>(0.0))
+    sum += static_cast<Acc>(beta) * static_cast<Acc>(*out);
+  *out = static_cast<T>(sum);
+}
+
+// Launches `MaskedGemm` on `stream`.
+template<typename T>
+void InputMaskedGemm(
+    const cudaStream_t& stream,
+    const bool features_in_rows,
+    const int m,
+    const int n,
+    const int k,
+    const T* A,
+    const int lda,
+    const T* B,
+    const int ldb,
+    const T beta,
+    T* C,
+    const int ldc,
+    const int batch_size,
+    const int input_size,
+    const unsigned long long seed,
+    const float prob) {
+  const dim3 blockDim(16, 16);
+  const dim3 gridDim((m + 15) / 16, (n + 15) / 16);
+  if (features_in_rows) {
+    MaskedGemm<T, true><<<gridDim, blockDim, 0, stream>>>(
+        m, n, k, A, lda, B, ldb, beta, C, ldc, batch_size, input_size, seed, prob);
+  } else {
+    MaskedGemm<T, false><<<gridDim, blockDim, 0, stream>>>(
+        m, n, k, A, lda, B, ldb, beta, C, ldc, batch_size, input_size, seed, prob);
+  }
+}
+
+}  // namespace internal
+}  // namespace dropout
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,55 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cmath>
+#include <cuda_runtime_api.h>
+
+#include "haste/gradient.h"
+
+namespace haste {
+namespace v0 {
+namespace gradient {
+
+Accumulator::Accumulator() {
+  cudaMalloc(&sums_, 2 * sizeof(float));
+  cudaMemset(sums_, 0, 2 * sizeof(float));
+}
+
+Accumulator::~Accumulator() {
+  cudaFree(sums_);
+}
+
+void Accumulator::Reset(const cudaStream_t& stream) {
+  cudaMemsetAsync(sums_, 0, 2 * sizeof(float), stream);
+}
+
+Norms Accumulator::Query(const cudaStream_t& stream) const {
+  float sums[2];
+  cudaMemcpyAsync(sums, sums_, sizeof(sums), cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+
+  Norms norms;
+  norms.parameters = std::sqrt(sums[0]);
+  norms.inputs = std::sqrt(sums[1]);
+  return norms;
+}
+
+float* Accumulator::data() const {
+  return sums_;
+}
+
+}  // namespace gradient
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,198 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <algorithm>
+#include <cuda_runtime_api.h>
+
+#include "dropout_ops.h"
+#include "haste/dropout.h"
+#include "haste/gradient.h"
+
+namespace haste {
+namespace v0 {
+namespace gradient {
+namespace internal {
+
+enum Slot : int {
+  kParameters = 0,
+  kInputs = 1,
+};
+
+// Clamps a state gradient to [-max, max]; `max` <= 0 disables clamping. `max` is the
+// same for the whole launch, so the branch is uniform. NaN and ±Inf pass through
+// unchanged so the gradient norm and health checks still see them. The comparison is
+// done in float, which works for half on every compute capability.
+template<typename T>
+__device__ __forceinline__
+T ClampState(const T x, const float max) {
+  const float value = static_cast<float>(x);
+  if (max <= 0.0f || !isfinite(value))
+    return x;
+  return value > max ? static_cast<T>(max) : (value < -max ? static_cast<T>(-max) : x);
+}
+
+template<typename T>
+__global__
+void SumSquares(const int size, const T* x, float* sum) {
+  __shared__ float partial[256];
+
+  float local = 0.0f;
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    const float value = static_cast<float>(x[i]);
+    local += value * value;
+  }
+  partial[threadIdx.x] = local;
+  __syncthreads();
+
+  for (int s = blockDim.x / 2; s > 0; s /= 2) {
+    if (threadIdx.x < s)
+      partial[threadIdx.x] += partial[threadIdx.x + s];
+    __syncthreads();
+  }
+  if (threadIdx.x == 0)
+    atomicAdd(sum, partial[0]);
+}
+
+// Adds the sum of squares of `x` to `slot` of `options`' accumulator on `stream`.
+// Does nothing without an accumulator or for an empty tensor.
+template<typename T>
+void AccumulateSquares(
+    const cudaStream_t& stream,
+    const Options* options,
+    const Slot slot,
+    const int size,
+    const T* x) {
+  if (!options || !options->accumulator || size <= 0)
+    return;
+  const int blocks = std::min((size + 255) / 256, 1024);
+  SumSquares<T><<<blocks, 256, 0, stream>>>(size, x, options->accumulator->data() + slot);
+}
+
+// Clears a parameter gradient on `stream` if `options` has an accumulator. `Run` then
+// writes this call's gradient instead of adding to the previous contents, so the sums
+// of squares don't count earlier calls again.
+template<typename T>
+void ClearParameter(
+    const cudaStream_t& stream,
+    const Options* options,
+    const int size,
+    T* x) {
+  if (!options || !options->accumulator || size <= 0)
+    return;
+  cudaMemsetAsync(x, 0, size * sizeof(T), stream);
+}
+
+// Applies the input dropout mask (if `prob` is nonzero) to the [T,N,C] input gradient
+// `dx` in place and, if `sums` isn't null, adds the sums of squares of `dx` and of the
+// [param_size] parameter gradients `p0` and `p1` (`p1` may be null) to it. `p0` and
+// `p1` are the per-unit vectors that the pointwise kernels accumulate with atomics, so
+// they are only final after the last step; this is the first pass that sees them.
+template<typename T>
+__global__
+void MaskAndSumSquares(
+    const int size,
+    const int batch_size,
+    const int input_size,
+    const unsigned long long seed,
+    const float prob,
+    T* dx,
+    const int param_size,
+    const T* p0,
+    const T* p1,
+    float* sums) {
+  __shared__ float partial[2][256];
+
+  float inputs = 0.0f;
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    T value = dx[i];
+    if (prob > 0.0f) {
+      const int index = i % (batch_size * input_size);
+      value = dropout::internal::ApplyScale(value, dropout::internal::Scale<float>(
+          seed, dropout::internal::kInputMask, index, prob));
+      dx[i] = value;
+    }
+    const float f = static_cast<float>(value);
+    inputs += f * f;
+  }
+
+  // The branch is uniform across the whole launch.
+  if (!sums)
+    return;
+
+  float parameters = 0.0f;
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < param_size; i += blockDim.x * gridDim.x) {
+    const float f0 = static_cast<float>(p0[i]);
+    const float f1 = p1 ? static_cast<float>(p1[i]) : 0.0f;
+    parameters += f0 * f0 + f1 * f1;
+  }
+
+  partial[kParameters][threadIdx.x] = parameters;
+  partial[kInputs][threadIdx.x] = inputs;
+  __syncthreads();
+
+  for (int s = blockDim.x / 2; s > 0; s /= 2) {
+    if (threadIdx.x < s) {
+      partial[kParameters][threadIdx.x] += partial[kParameters][threadIdx.x + s];
+      partial[kInputs][threadIdx.x] += partial[kInputs][threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    atomicAdd(sums + kParameters, partial[kParameters][0]);
+    atomicAdd(sums + kInputs, partial[kInputs][0]);
+  }
+}
+
+// Finishes the input gradient `dx` [steps,N,C] on `stream` and takes the sums of squares
+// of it and of the per-unit parameter gradients `p0` and `p1` [param_size] in the same
+// pass (see `MaskAndSumSquares`). Does nothing if there's neither an input mask to apply nor
+// an accumulator to add to.
+template<typename T>
+void FinishInputGradient(
+    const cudaStream_t& stream,
+    const dropout::Variational* dropout,
+    const Options* options,
+    const int steps,
+    const int batch_size,
+    const int input_size,
+    T* dx,
+    const int param_size,
+    const T* p0,
+    const T* p1 = nullptr) {
+  const float prob = dropout ? dropout->input_prob : 0.0f;
+  float* sums = options && options->accumulator ? options->accumulator->data() : nullptr;
+  if (prob <= 0.0f && !sums)
+    return;
+  const int size = steps * batch_size * input_size;
+  const int blocks = std::max(std::min((std::max(size, param_size) + 255) / 256, 1024), 1);
+  MaskAndSumSquares<T><<<blocks, 256, 0, stream>>>(
+      size,
+      batch_size,
+      input_size,
+      dropout ? dropout->seed : 0,
+      prob,
+      dx,
+      param_size,
+      p0,
+      p1,
+      sums);
+}
+
+}  // namespace internal
+}  // namespace gradient
+}  // namespace v0
+}  // namespace haste
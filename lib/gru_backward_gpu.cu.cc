@@ -18,11 +18,20 @@
 
 #include "blas.h"
 #include "device_assert.h"
+#include "dropout_ops.h"
+#include "gradient_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::gradient::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool ApplyZoneout>
 __global__
 void PointwiseOperations(const int batch_dim,
@@ -35,7 +44,13 @@ void PointwiseOperations(const int batch_dim,
                          T* dh_inout,
                          T* dp_out,
                          T* dq_out,
-                         const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+                         T* dUs_inout,             // Conditioning gradient accumulator (may be null)
+                         const unsigned long long seed,
+                         const float output_prob,
+                         const float max_state_grad,
+                         Record* health,           // Non-finite value record (may be null)
+                         const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -44,7 +59,14 @@ void PointwiseOperations(const int batch_dim,
 
   const int base_idx = col * hidden_dim + row;
 
-  T dh_total = dh_new[base_idx] + dh_inout[base_idx];
+  // With output dropout, `dh_new` is the gradient with respect to the dropped output. The
+  // branch is uniform across the whole launch.
+  T dh_out = dh_new[base_idx];
+  if (output_prob > 0.0f)
+    dh_out *= Scale<T>(seed, kOutputMask, base_idx, output_prob);
+  T dh_total = dh_out + dh_inout[base_idx];
+  Check(health, kGradient, step, col, dh_total);
+  dh_total = ClampState(dh_total, max_state_grad);
 
   const int stride4_base_idx = col * (hidden_dim * 4) + row;
   const int z_idx = stride4_base_idx + 0 * hidden_dim;
@@ -86,6 +108,14 @@ void PointwiseOperations(const int batch_dim,
   dq_out[idx + 1 * hidden_dim] = dq_r;
   dq_out[idx + 2 * hidden_dim] = dq_g;
 
+  // Each element is owned by a single thread and time steps run in sequence on one
+  // stream, so the accumulation needs no atomics.
+  if (dUs_inout) {
+    dUs_inout[idx + 0 * hidden_dim] += dp_z;
+    dUs_inout[idx + 1 * hidden_dim] += dp_r;
+    dUs_inout[idx + 2 * hidden_dim] += dp_g;
+  }
+
   atomicAdd(&dbx_out[row + 0 * hidden_dim], dp_z);
   atomicAdd(&dbx_out[row + 1 * hidden_dim], dp_r);
   atomicAdd(&dbx_out[row + 2 * hidden_dim], dp_g);
@@ -108,7 +138,13 @@ void PointwiseOperations(const int batch_dim,
                          half* dh_inout,
                          half* dp_out,
                          half* dq_out,
-                         const half* zoneout_mask) {
+                         const half* zoneout_mask,
+                         half* dUs_inout,
+                         const unsigned long long seed,
+                         const float output_prob,
+                         const float max_state_grad,
+                         Record* health,
+                         const int step) {
   device_assert_fail("FP16 is not supported on compute capability < 7.0.");
 }
 #endif
@@ -183,6 +219,7 @@ void BackwardPass<T>::Iterate(
     T* dp,            // [N,H*3]
     T* dq,            // [N,H*3]
     const T* zoneout_mask) {  // [N,H]
+  HASTE_PROBE_ITERATE(kGru, data_->batch_size, data_->input_size, data_->hidden_size);
   const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
 
   const T alpha = static_cast<T>(1.0);
@@ -210,9 +247,15 @@ void BackwardPass<T>::Iterate(
       dh,
       dp,
       dq,
-      zoneout_mask);
+      zoneout_mask,
+      nullptr,
+      nullptr,
+      nullptr,
+      0);
 
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kGru, kReduction, hidden_size * 3, input_size, batch_size);
+  HASTE_STATS_BEGIN(dW_timer, kGru, kReduction, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 3, input_size, batch_size,
@@ -221,12 +264,15 @@ void BackwardPass<T>::Iterate(
       x_t, batch_size,
       &beta_sum,
       dW, hidden_size * 3);
+  HASTE_STATS_END(dW_timer);
 
   // Wait for pointwise operations to complete since there's a
   // data dependency between its output (`dp`, `dq`) and the following matmuls.
   cudaStreamWaitEvent(stream2, event, 0);
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kGru, kInputGemm, input_size, batch_size, hidden_size * 3);
+  HASTE_STATS_BEGIN(dx_timer, kGru, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, batch_size, hidden_size * 3,
@@ -235,8 +281,11 @@ void BackwardPass<T>::Iterate(
       dp, hidden_size * 3,
       &beta_assign,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kGru, kReduction, hidden_size * 3, hidden_size, batch_size);
+  HASTE_STATS_BEGIN(dR_timer, kGru, kReduction, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_T,
       hidden_size * 3, hidden_size, batch_size,
@@ -245,6 +294,7 @@ void BackwardPass<T>::Iterate(
       h, hidden_size,
       &beta_sum,
       dR, hidden_size * 3);
+  HASTE_STATS_END(dR_timer);
 
   cublasSetStream(blas_handle, save_stream);
 }
@@ -260,7 +310,11 @@ void BackwardPass<T>::IterateInternal(
     T* dh,            // [N,H]
     T* dp,            // [N,H*3]
     T* dq,            // [N,H*3]
-    const T* zoneout_mask) {  // [N,H]
+    const T* zoneout_mask,  // [N,H]
+    T* dUs,           // [N,H*3]
+    const dropout::Variational* dropout,
+    const gradient::Options* gradient,
+    const int step) {
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);
 
@@ -269,6 +323,10 @@ void BackwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  const float max_state_grad = gradient ? gradient->max_state_grad : 0.0f;
+  health::Record* health_record = health::Active();
 
   // Compute launch configuration for pointwise operations kernel.
   const dim3 blockDim(32, 16);
@@ -276,6 +334,7 @@ void BackwardPass<T>::IterateInternal(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
 
+  HASTE_STATS_BEGIN(pointwise_timer, kGru, kPointwise, stream1);
   if (zoneout_mask) {
     PointwiseOperations<T, true><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -288,7 +347,13 @@ void BackwardPass<T>::IterateInternal(
         dh,
         dp,
         dq,
-        zoneout_mask
+        zoneout_mask,
+        dUs,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step
     );
   } else {
     PointwiseOperations<T, false><<<gridDim, blockDim, 0, stream1>>>(
@@ -302,12 +367,21 @@ void BackwardPass<T>::IterateInternal(
         dh,
         dp,
         dq,
-        nullptr
+        nullptr,
+        dUs,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step
     );
   }
+  HASTE_STATS_END(pointwise_timer);
   cudaEventRecord(event, stream1);
 
   cublasSetStream(blas_handle,  stream1);
+  HASTE_PROBE_GEMM(kGru, kRecurrentGemm, hidden_size, batch_size, hidden_size * 3);
+  HASTE_STATS_BEGIN(dh_timer, kGru, kRecurrentGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size, batch_size, hidden_size * 3,
@@ -316,6 +390,7 @@ void BackwardPass<T>::IterateInternal(
       dq, hidden_size * 3,
       &beta_sum,
       dh, hidden_size);
+  HASTE_STATS_END(dh_timer);
 }
 
 template<typename T>
@@ -337,7 +412,19 @@ void BackwardPass<T>::Run(
     T* dh,
     T* dp,
     T* dq,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const BackwardOptions<T>& options) {
+  HASTE_PROBE_RUN(kGru, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const int conditioning_size = options.conditioning_size;
+  const T* U_t = options.U_t;
+  const T* s = options.s;
+  T* dU = options.dU;
+  T* ds = options.ds;
+  T* tmp_dUs = options.tmp_dUs;
+  const block_sparse::Mask<T>* mask = options.mask;
+  const dropout::Variational* dropout = options.dropout;
+  const gradient::Options* gradient = options.gradient;
+
   const blas<void>::enable_tensor_cores scoped0(data_->blas_handle);
   const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
 
@@ -356,8 +443,26 @@ void BackwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
+  ClearParameter(stream1, gradient, input_size * hidden_size * 3, dW);
+  ClearParameter(stream1, gradient, hidden_size * hidden_size * 3, dR);
+  ClearParameter(stream1, gradient, hidden_size * 3, dbx);
+  ClearParameter(stream1, gradient, hidden_size * 3, dbr);
+  ClearParameter(stream1, gradient, conditioning_size * hidden_size * 3, dU);
+
   const int NH = batch_size * hidden_size;
+  T* dUs = conditioning_size ? tmp_dUs : nullptr;
+  if (dUs)
+    cudaMemsetAsync(dUs, 0, NH * 3 * sizeof(T), stream1);
+
   for (int i = steps - 1; i >= 0; --i) {
+    HASTE_PROBE_STEP(kGru, batch_size, input_size, hidden_size, i);
     IterateInternal(
         R_t,
         h + i * NH,
@@ -368,7 +473,11 @@ void BackwardPass<T>::Run(
         dh,
         dp + i * NH * 3,
         dq + i * NH * 3,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr );
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        dUs,
+        dropout,
+        gradient,
+        i);
   }
 
   // Wait for pointwise operations to complete since there's a
@@ -376,6 +485,8 @@ void BackwardPass<T>::Run(
   cudaStreamWaitEvent(stream2, event, 0);
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kGru, kInputGemm, input_size, batch_size * steps, hidden_size * 3);
+  HASTE_STATS_BEGIN(dx_timer, kGru, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, batch_size * steps, hidden_size * 3,
@@ -384,26 +495,93 @@ void BackwardPass<T>::Run(
       dp, hidden_size * 3,
       &beta_assign,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
+
+  // dx is with respect to the input before dropout. `dbx` and `dbr` are final now that
+  // the pointwise operations are, so their norms are taken in the same pass.
+  HASTE_STATS_BEGIN(finish_timer, kGru, kPointwise, stream2);
+  FinishInputGradient(
+      stream2, dropout, gradient, steps, batch_size, input_size, dx, hidden_size * 3, dbx, dbr);
+  HASTE_STATS_END(finish_timer);
 
   cublasSetStream(blas_handle, stream2);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_T,
-      hidden_size * 3, hidden_size, batch_size * steps,
-      &alpha,
-      dq, hidden_size * 3,
-      h, hidden_size,
-      &beta_sum,
-      dR, hidden_size * 3);
+  HASTE_PROBE_GEMM(kGru, kReduction, hidden_size * 3, hidden_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dR_timer, kGru, kReduction, stream2);
+  if (mask) {
+    mask->AccumulateGradient(blas_handle, stream2, batch_size * steps, hidden_size, 3, dq, h, dR);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 3, hidden_size, batch_size * steps,
+        &alpha,
+        dq, hidden_size * 3,
+        h, hidden_size,
+        &beta_sum,
+        dR, hidden_size * 3);
+  }
+  HASTE_STATS_END(dR_timer);
 
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 3, input_size, batch_size * steps,
-      &alpha,
-      dp, hidden_size * 3,
-      x_t, batch_size * steps,
-      &beta_sum,
-      dW, hidden_size * 3);
+  HASTE_PROBE_GEMM(kGru, kReduction, hidden_size * 3, input_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dW_timer, kGru, kReduction, stream1);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // `x_t` is the transpose of `x` before dropout; the mask is applied as it's loaded.
+    InputMaskedGemm(stream1, false,
+        hidden_size * 3, input_size, batch_size * steps,
+        dp, hidden_size * 3,
+        x_t, batch_size * steps,
+        beta_sum,
+        dW, hidden_size * 3,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, input_size, batch_size * steps,
+        &alpha,
+        dp, hidden_size * 3,
+        x_t, batch_size * steps,
+        &beta_sum,
+        dW, hidden_size * 3);
+  }
+  HASTE_STATS_END(dW_timer);
+
+  if (dUs) {
+    HASTE_PROBE_GEMM(kGru, kReduction, hidden_size * 3, conditioning_size, batch_size);
+    HASTE_STATS_BEGIN(dU_timer, kGru, kReduction, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 3, conditioning_size, batch_size,
+        &alpha,
+        dUs, hidden_size * 3,
+        s, conditioning_size,
+        &beta_sum,
+        dU, hidden_size * 3);
+    HASTE_STATS_END(dU_timer);
+
+    HASTE_PROBE_GEMM(kGru, kInputGemm, conditioning_size, batch_size, hidden_size * 3);
+    HASTE_STATS_BEGIN(ds_timer, kGru, kInputGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        conditioning_size, batch_size, hidden_size * 3,
+        &alpha,
+        U_t, conditioning_size,
+        dUs, hidden_size * 3,
+        &beta_assign,
+        ds, conditioning_size);
+    HASTE_STATS_END(ds_timer);
+  }
+
+  // The GEMM outputs are reduced in passes of their own since cuBLAS has no epilogue for
+  // them. Wait for the ones on stream2.
+  if (gradient && gradient->accumulator) {
+    cudaEventRecord(event, stream2);
+    cudaStreamWaitEvent(stream1, event, 0);
+    HASTE_STATS_BEGIN(norm_timer, kGru, kReduction, stream1);
+    AccumulateSquares(stream1, gradient, kParameters, input_size * hidden_size * 3, dW);
+    AccumulateSquares(stream1, gradient, kParameters, hidden_size * hidden_size * 3, dR);
+    AccumulateSquares(stream1, gradient, kParameters, conditioning_size * hidden_size * 3, dU);
+    HASTE_STATS_END(norm_timer);
+  }
 
   cublasSetStream(blas_handle, save_stream);
 }
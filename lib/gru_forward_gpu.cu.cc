@@ -19,11 +19,18 @@
 
 #include "blas.h"
 #include "device_assert.h"
+#include "dropout_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool Training, bool ApplyZoneout>
 __global__
 void PointwiseOperations(const int batch_dim,
@@ -36,7 +43,13 @@ void PointwiseOperations(const int batch_dim,
                          T* h_out,
                          T* v,
                          const T zoneout_prob,
-                         const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* extra,              // Extra gate pre-activations (may be null)
+                         T* y_out,                    // Output with dropout applied (may be null)
+                         const unsigned long long seed,
+                         const float output_prob,
+                         Record* health,              // Non-finite value record (may be null)
+                         const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -58,9 +71,21 @@ void PointwiseOperations(const int batch_dim,
   const int br_idx = row + 1 * hidden_dim;
   const int bg_idx = row + 2 * hidden_dim;
 
-  const T z = sigmoid(Wx[z_idx] + Rh[z_idx] + bx[bz_idx] + br[bz_idx]);
-  const T r = sigmoid(Wx[r_idx] + Rh[r_idx] + bx[br_idx] + br[br_idx]);
-  const T g = tanh   (Wx[g_idx] + r * (Rh[g_idx] + br[bg_idx]) + bx[bg_idx]);
+  // Extra terms (conditioning or an external gate input) enter on the input side,
+  // exactly as if they had been concatenated onto `x`. The branch is uniform across
+  // the whole launch.
+  T Wx_z = Wx[z_idx];
+  T Wx_r = Wx[r_idx];
+  T Wx_g = Wx[g_idx];
+  if (extra) {
+    Wx_z += extra[z_idx];
+    Wx_r += extra[r_idx];
+    Wx_g += extra[g_idx];
+  }
+
+  const T z = sigmoid(Wx_z + Rh[z_idx] + bx[bz_idx] + br[bz_idx]);
+  const T r = sigmoid(Wx_r + Rh[r_idx] + bx[br_idx] + br[br_idx]);
+  const T g = tanh   (Wx_g + r * (Rh[g_idx] + br[bg_idx]) + bx[bg_idx]);
 
   // Store internal activations if we're eventually going to backprop.
   if (Training) {
@@ -82,6 +107,12 @@ void PointwiseOperations(const int batch_dim,
   }
 
   h_out[output_idx] = cur_h_value;
+  Check(health, kState, step, col, cur_h_value);
+
+  // Output dropout only changes what the next layer sees, not the recurrence. The branch
+  // is uniform across the whole launch.
+  if (y_out)
+    y_out[output_idx] = cur_h_value * Scale<T>(seed, kOutputMask, output_idx, output_prob);
 }
 
 #if defined(__CUDA_ARCH__) && (__CUDA_ARCH__ < 700)
@@ -97,7 +128,13 @@ void PointwiseOperations(const int batch_dim,
                          half* h_out,
                          half* v,
                          const half zoneout_prob,
-                         const half* zoneout_mask) {
+                         const half* zoneout_mask,
+                         const half* extra,
+                         half* y_out,
+                         const unsigned long long seed,
+                         const float output_prob,
+                         Record* health,
+                         const int step) {
   device_assert_fail("FP16 is not supported on compute capability < 7.0.");
 }
 #endif
@@ -169,7 +206,9 @@ void ForwardPass<T>::Iterate(
     T* tmp_Wx,   // [N,H*3]
     T* tmp_Rh,   // [N,H*3]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask,   // Zoneout mask [N,H]
+    const T* gate_input) {   // External gate pre-activations [N,H*3] or null
+  HASTE_PROBE_ITERATE(kGru, data_->batch_size, data_->input_size, data_->hidden_size);
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -186,6 +225,8 @@ void ForwardPass<T>::Iterate(
   cublasGetStream(blas_handle, &save_stream);
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kGru, kInputGemm, hidden_size * 3, batch_size, input_size);
+  HASTE_STATS_BEGIN(tmp_Wx_timer, kGru, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 3, batch_size, input_size,
@@ -194,6 +235,7 @@ void ForwardPass<T>::Iterate(
       x, input_size,
       &beta,
       tmp_Wx, hidden_size * 3);
+  HASTE_STATS_END(tmp_Wx_timer);
   cudaEventRecord(event, stream2);
 
   IterateInternal(
@@ -206,7 +248,12 @@ void ForwardPass<T>::Iterate(
       tmp_Wx,
       tmp_Rh,
       zoneout_prob,
-      zoneout_mask);
+      zoneout_mask,
+      gate_input,
+      nullptr,
+      nullptr,
+      nullptr,
+      0);
 
   cublasSetStream(blas_handle, save_stream);
 }
@@ -222,7 +269,12 @@ void ForwardPass<T>::IterateInternal(
     T* tmp_Wx,   // [N,H*3]
     T* tmp_Rh,   // [N,H*3]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const T* extra, // Extra gate pre-activations [N,H*3] or null
+    const block_sparse::Mask<T>* mask, // Block mask over R or null
+    const dropout::Variational* dropout, // Dropout or null
+    T* y_out, // Output with dropout applied [N,H] or null
+    const int step) {
   // Constants for GEMM
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
@@ -233,16 +285,26 @@ void ForwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  health::Record* health_record = health::Active();
 
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 3, batch_size, hidden_size,
-      &alpha,
-      R, hidden_size * 3,
-      h, hidden_size,
-      &beta,
-      tmp_Rh, hidden_size * 3);
+  HASTE_PROBE_GEMM(kGru, kRecurrentGemm, hidden_size * 3, batch_size, hidden_size);
+  HASTE_STATS_BEGIN(tmp_Rh_timer, kGru, kRecurrentGemm, stream1);
+  if (mask) {
+    mask->Multiply(stream1, batch_size, hidden_size, 3, R, h, tmp_Rh);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, batch_size, hidden_size,
+        &alpha,
+        R, hidden_size * 3,
+        h, hidden_size,
+        &beta,
+        tmp_Rh, hidden_size * 3);
+  }
+  HASTE_STATS_END(tmp_Rh_timer);
 
   // Compute launch configuration for pointwise operations kernel.
   const dim3 blockDim(32, 16);
@@ -252,6 +314,7 @@ void ForwardPass<T>::IterateInternal(
 
   cudaStreamWaitEvent(stream1, event, 0);
 
+  HASTE_STATS_BEGIN(pointwise_timer, kGru, kPointwise, stream1);
   if (training) {
     if (zoneout_prob && zoneout_mask) {
       PointwiseOperations<T, true, true><<<gridDim, blockDim, 0, stream1>>>(
@@ -265,7 +328,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           v,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, true, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -278,7 +347,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           v,
           0.0f,
-          nullptr);
+          nullptr,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   } else {
     if (zoneout_prob && zoneout_mask) {
@@ -293,7 +368,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           nullptr,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, false, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -306,9 +387,16 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           nullptr,
           0.0f,
-          nullptr);
+          nullptr,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   }
+  HASTE_STATS_END(pointwise_timer);
 }
 
 template<typename T>
@@ -324,7 +412,17 @@ void ForwardPass<T>::Run(
     T* tmp_Wx,   // [N,H*3]
     T* tmp_Rh,   // [N,H*3]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const ForwardOptions<T>& options) {
+  HASTE_PROBE_RUN(kGru, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const int conditioning_size = options.conditioning_size;
+  const T* U = options.U;
+  const T* s = options.s;
+  T* tmp_Us = options.tmp_Us;
+  const block_sparse::Mask<T>* mask = options.mask;
+  const dropout::Variational* dropout = options.dropout;
+  T* y = options.y;
+
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -341,19 +439,60 @@ void ForwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream2);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 3, steps * batch_size, input_size,
-      &alpha,
-      W, hidden_size * 3,
-      x, input_size,
-      &beta,
-      tmp_Wx, hidden_size * 3);
+  HASTE_PROBE_GEMM(kGru, kInputGemm, hidden_size * 3, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(tmp_Wx_timer, kGru, kInputGemm, stream2);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // The input mask varies along both N and C, so it can't be folded into `W`. It's
+    // applied to `x` as the GEMM loads it instead.
+    InputMaskedGemm(stream2, true,
+        hidden_size * 3, steps * batch_size, input_size,
+        W, hidden_size * 3,
+        x, input_size,
+        beta,
+        tmp_Wx, hidden_size * 3,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, steps * batch_size, input_size,
+        &alpha,
+        W, hidden_size * 3,
+        x, input_size,
+        &beta,
+        tmp_Wx, hidden_size * 3);
+  }
+  HASTE_STATS_END(tmp_Wx_timer);
+
+  // The conditioning term is the same at every time step so it's computed once here
+  // instead of being folded into the input GEMM.
+  const T* Us = nullptr;
+  if (conditioning_size) {
+    HASTE_PROBE_GEMM(kGru, kInputGemm, hidden_size * 3, batch_size, conditioning_size);
+    HASTE_STATS_BEGIN(tmp_Us_timer, kGru, kInputGemm, stream2);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, batch_size, conditioning_size,
+        &alpha,
+        U, hidden_size * 3,
+        s, conditioning_size,
+        &beta,
+        tmp_Us, hidden_size * 3);
+    HASTE_STATS_END(tmp_Us_timer);
+    Us = tmp_Us;
+  }
   cudaEventRecord(event, stream2);
 
   const int NH = batch_size * hidden_size;
   for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kGru, batch_size, input_size, hidden_size, i);
     IterateInternal(
         R,
         bx,
@@ -364,7 +503,12 @@ void ForwardPass<T>::Run(
         tmp_Wx + i * NH * 3,
         tmp_Rh,
         zoneout_prob,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        Us,
+        mask,
+        dropout,
+        dropout && dropout->output_prob > 0.0f ? y + i * NH : nullptr,
+        i);
   }
 
   cublasSetStream(blas_handle, save_stream);
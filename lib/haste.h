@@ -25,10 +25,21 @@
 //     H = hidden size
 // and the rightmost dimension changes the fastest.
 
+#include "haste/block_sparse.h"
+#include "haste/cell.h"
+#include "haste/data_parallel.h"
+#include "haste/dropout.h"
+#include "haste/gradient.h"
 #include "haste/gru.h"
+#include "haste/health.h"
 #include "haste/indrnn.h"
+#include "haste/latency_controlled_lstm.h"
 #include "haste/layer_norm.h"
 #include "haste/layer_norm_gru.h"
 #include "haste/layer_norm_indrnn.h"
 #include "haste/layer_norm_lstm.h"
 #include "haste/lstm.h"
+#include "haste/model_file.h"
+#include "haste/prefix_tree.h"
+#include "haste/reversible_gru.h"
+#include "haste/stats.h"
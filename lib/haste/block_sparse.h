@@ -0,0 +1,151 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace block_sparse {
+
+// Gradual magnitude pruning schedule (Zhu & Gupta, 2017). The target sparsity rises from
+// `initial_sparsity` at `begin_step` to `final_sparsity` at `end_step` along a cubic
+// curve, so most blocks are removed early while the network can still recover, and the
+// mask is updated every `frequency` training steps in between. A `frequency` of 0 or less
+// (the value of a zero-initialized schedule) updates the mask only at `end_step`.
+struct PruningSchedule {
+  float initial_sparsity;
+  float final_sparsity;
+  int begin_step;
+  int end_step;
+  int frequency;
+
+  // `true` if the mask should be updated at training step `step`.
+  bool ShouldPrune(const int step) const {
+    if (step < begin_step || step > end_step)
+      return false;
+    if (step == end_step)
+      return true;
+    return frequency > 0 && (step - begin_step) % frequency == 0;
+  }
+
+  // The fraction of blocks that should be dead at training step `step`.
+  float Sparsity(const int step) const {
+    if (step <= begin_step)
+      return initial_sparsity;
+    if (step >= end_step)
+      return final_sparsity;
+    const float remaining = 1.0f - float(step - begin_step) / float(end_step - begin_step);
+    return final_sparsity + (initial_sparsity - final_sparsity) * remaining * remaining * remaining;
+  }
+};
+
+// A block mask over the recurrent weight matrix `R` of an LSTM or GRU, for training
+// block-sparse layers. `R` is [H,H*G] (G = 4 for an LSTM, 3 for a GRU) and is divided into
+// [H/B,H*G/B] blocks of BxB weights that are either live or dead. Passing a mask to
+// `lstm::ForwardPass::Run` / `gru::ForwardPass::Run` computes the recurrent projection
+// from the live blocks only, and passing it to the corresponding `BackwardPass::Run`
+// accumulates `dR` for the live blocks only; dead blocks of `dR` are not written.
+//
+// The engines assume that dead blocks of `R` are zero, which `Prune` and `Apply`
+// guarantee. Optimizers with momentum or weight decay may revive them, so call `Apply`
+// after every optimizer step. A mask may be shared by the forward and backward passes
+// of a layer but must not be used by two backward passes at the same time.
+template<typename T>
+class Mask {
+  public:
+    // hidden_size: the dimension H of the layer's hidden state.
+    // gate_count: G, the number of gates of the layer (4 for an LSTM, 3 for a GRU).
+    // block_size: B, the edge length of each block. Must divide `hidden_size` and be at
+    //     most 32.
+    // All blocks start out live.
+    Mask(const int hidden_size, const int gate_count, const int block_size);
+
+    // Releases internal resources.
+    ~Mask();
+
+    int block_size() const;
+    int hidden_size() const;
+    int gate_count() const;
+    // The number of blocks along the H and H*G dimensions of `R`.
+    int block_rows() const;
+    int block_cols() const;
+    // The number of live blocks.
+    int live_blocks() const;
+
+    // Replaces the mask, e.g. when restoring a checkpoint. Blocks the host.
+    //
+    // mask: [H/B,H*G/B] host array, nonzero for live blocks.
+    void Set(const uint8_t* mask);
+
+    // Copies the mask to `mask`, a [H/B,H*G/B] host array.
+    void Get(uint8_t* mask) const;
+
+    // Zeros the dead blocks of `R` on `stream`.
+    void Apply(const cudaStream_t& stream, T* R) const;
+
+    // Kills the `sparsity` fraction of blocks of `R` with the smallest Frobenius norm and
+    // zeros them. Dead blocks have zero norm, so blocks stay dead as the sparsity grows.
+    // Blocks the host until the block norms computed on `stream` are available.
+    void Prune(const cudaStream_t& stream, T* R, const float sparsity);
+
+    // Calls `Prune` with the schedule's target sparsity if `schedule` says the mask is due
+    // for an update at training step `step`. Returns `true` if the mask changed.
+    bool Step(
+        const cudaStream_t& stream,
+        T* R,
+        const PruningSchedule& schedule,
+        const int step);
+
+    // Engine entry points. `hidden_size` and `gate_count` are the engine's own and must
+    // match the ones the mask was created with.
+
+    // out = R·h from the live blocks of `R`, on `stream`.
+    // R: [H,H*G], h: [N,H], out: [N,H*G].
+    void Multiply(
+        const cudaStream_t& stream,
+        const int batch_size,
+        const int hidden_size,
+        const int gate_count,
+        const T* R,
+        const T* h,
+        T* out) const;
+
+    // dR += dv·h^T for the live blocks of `dR`. `blas_handle` is bound to `stream`.
+    // dv: [count,H*G], h: [count,H], dR: [H,H*G].
+    void AccumulateGradient(
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream,
+        const int count,
+        const int hidden_size,
+        const int gate_count,
+        const T* dv,
+        const T* h,
+        T* dR) const;
+
+  private:
+    // Rebuilds the live block lists from the host mask and uploads them.
+    void Upload();
+
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace block_sparse
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,210 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
+namespace cell {
+
+// Recurrent layers built from a cell definition. A cell is a policy class that describes
+// one unit of the layer; `ForwardPass<Cell, T>` and `BackwardPass<Cell, T>` supply
+// everything else the same way the built-in LSTM does: the input projections for all
+// steps in one GEMM, one recurrent GEMM and one fused pointwise kernel per step, bias
+// gradients reduced in the pointwise kernel, and `dW`, `dR`, `dx` in batched GEMMs
+// after the recurrence. The gate pre-activations of a G-gate cell are
+//
+//   pre = Wx + Rh + b      W: [C,H*G], R: [H,H*G], b: [H*G]
+//
+// with the gates of a unit laid out H apart, as in the built-in layers. A cell provides
+//
+//   struct MyCell {
+//     static constexpr int kGates = G;
+//     static constexpr bool kHasCell = ...;  // whether the layer carries a cell state `c`
+//
+//     // pre: [G] pre-activations. act: [G] receives whatever `Backward` needs, usually
+//     // the activated gates; it is kept in `v` between the passes. h, c: the previous
+//     // state on entry and the new state on exit (`c` is 0 and ignored if !kHasCell).
+//     template<typename T>
+//     __device__ static void Forward(const T* pre, T* act, T& h, T& c);
+//
+//     // act: as written by `Forward`. h_prev, c_prev: the previous state. c: the new
+//     // cell state. dh, dc: the gradients with respect to the new state on entry, and
+//     // with respect to the previous state on exit, leaving out the path through `R`
+//     // which the engine adds. dpre: [G] receives the gradients of the pre-activations.
+//     // A cell whose update only sees `h_prev` through `R` ignores it and sets `dh` to 0.
+//     template<typename T>
+//     __device__ static void Backward(
+//         const T* act, const T h_prev, const T c_prev, const T c,
+//         T& dh, T& dc, T* dpre);
+//   };
+//
+// and the engines for it are instantiated in a CUDA translation unit that includes
+// "cell_ops.h" (see lib/cell_gpu.cu.cc for the built-in cells below). Both functions run
+// once per unit per step and are inlined into the pointwise kernels, so a cell costs
+// nothing beyond its own arithmetic. validation/cell.cc checks the engines and `Cifg`
+// against a host reference.
+
+// LSTM with hard sigmoid (clamp(0.2x + 0.5, 0, 1)) and hard tanh (clamp(x, -1, 1)) in
+// place of every activation, for models that are later quantized. Gates are [i,g,f,o].
+struct HardLstm;
+
+// Coupled input-forget gate LSTM: the input gate is 1 - f, so only three gates [f,g,o]
+// are computed and the weights shrink by a quarter.
+struct Cifg;
+
+template<typename Cell, typename T>
+class ForwardPass {
+  public:
+    // training: `true` if the caller intends to perform a backward pass to compute gradients.
+    // batch_size: the number of training/inference inputs provided in each tensor.
+    // input_size: the dimension of each input vector.
+    // hidden_size: the expected dimension of each output vector.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
+    ForwardPass(
+        const bool training,
+        const int batch_size,
+        const int input_size,
+        const int hidden_size,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
+    ~ForwardPass();
+
+    // Runs the layer over all time steps.
+    //
+    // steps: the number of iterations to run (i.e. T).
+    // W: [C,H*G] the input weight matrix.
+    // R: [H,H*G] the recurrent weight matrix.
+    // b: [H*G] the bias vector.
+    // x: [T,N,C] the input sequence.
+    // h: [T+1,N,H] the hidden state vectors across all time steps. The t=0'th vector should
+    //     be set to the desired initial hidden state (typically zeros). The rest of the
+    //     vectors will be set by this function.
+    // c: [T+1,N,H] the cell state vectors, laid out like `h`, if `Cell::kHasCell`. May be
+    //     null otherwise.
+    // v: [T,N,H*G] if `training` is `false`, this is scratch space and should not be used
+    //     by the caller. If `training` is `true`, this parameter will contain what the
+    //     cell keeps for the backward pass and must be provided as-is to
+    //     `BackwardPass::Run`.
+    // tmp_Rh: [N,H*G] additional temporary work space. The caller should not use the
+    //     contents of this vector.
+    void Run(
+        const int steps,
+        const T* W,
+        const T* R,
+        const T* b,
+        const T* x,
+        T* h,
+        T* c,
+        T* v,
+        T* tmp_Rh);
+
+  private:
+    struct private_data;
+    private_data* data_;
+};
+
+template<typename Cell, typename T>
+class BackwardPass {
+  public:
+    // batch_size: the number of training inputs provided in each tensor.
+    // input_size: the dimension of each input vector.
+    // hidden_size: the expected dimension of each output vector.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
+    BackwardPass(
+        const int batch_size,
+        const int input_size,
+        const int hidden_size,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
+    ~BackwardPass();
+
+    // Runs the backward pass over all time steps.
+    //
+    // steps: the number of iterations to run (i.e. T).
+    // W_t: [H*G,C] the transpose of the input weight matrix.
+    // R_t: [H*G,H] the transpose of the recurrent weight matrix.
+    // b: [H*G] the bias vector.
+    // x_t: [C,T,N] the transpose of the input sequence.
+    // h: [T+1,N,H] the hidden states produced by `ForwardPass::Run`.
+    // c: [T+1,N,H] the cell states produced by `ForwardPass::Run`, or null if
+    //     `!Cell::kHasCell`.
+    // dh_new: [T+1,N,H] the gradient of the loss with respect to `h`. `dh_new[0]` is
+    //     not used.
+    // dc_new: [T+1,N,H] the gradient of the loss with respect to `c`. May be null.
+    // dx: [T,N,C] the gradient of the loss with respect to the input.
+    // dW: [C,H*G] the gradient of the loss with respect to the input weight matrix.
+    // dR: [H,H*G] the gradient of the loss with respect to the recurrent weight matrix.
+    // db: [H*G] the gradient of the loss with respect to the bias vector.
+    // dh: [N,H] NOTE: this is an input and output parameter. Should be initialized to zeros.
+    //     After the backward pass, this vector will contain the gradient of the loss with
+    //     respect to the initial hidden state.
+    // dc: [N,H] the same as `dh` for the cell state if `Cell::kHasCell`. May be null
+    //     otherwise.
+    // v: [T,N,H*G] the same tensor that was passed to `ForwardPass::Run`. Its contents are
+    //     overwritten.
+    // gradient: (optional) per-step clamping of `dh` and `dc`, and an accumulator for the
+    //     sums of squares of `dW`, `dR`, `db`, and `dx` (see `gradient::Options`).
+    void Run(
+        const int steps,
+        const T* W_t,
+        const T* R_t,
+        const T* b,
+        const T* x_t,
+        const T* h,
+        const T* c,
+        const T* dh_new,
+        const T* dc_new,
+        T* dx,
+        T* dW,
+        T* dR,
+        T* db,
+        T* dh,
+        T* dc,
+        T* v,
+        const gradient::Options* gradient = nullptr);
+
+  private:
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace cell
+}  // namespace v0
+}  // namespace haste
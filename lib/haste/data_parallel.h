@@ -0,0 +1,62 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cuda_runtime_api.h>
+#include <vector>
+
+namespace haste {
+namespace v0 {
+namespace data_parallel {
+
+// Sums gradient buffers across the GPUs of a single machine with a ring all-reduce over
+// peer-to-peer copies. This is meant for data-parallel training where each GPU holds a
+// replica of the layer, runs `ForwardPass::Run` and `BackwardPass::Run` on its shard of
+// the batch, and needs the summed `dW`, `dR`, and `db` before the optimizer step. No
+// network stack or communication library is involved.
+//
+// Since `BackwardPass` accumulates into `dW`, `dR`, and `db`, allocating all of a layer's
+// gradients from one contiguous region lets a single `Run` call reduce all of them.
+template<typename T>
+class AllReduce {
+  public:
+    // devices: the CUDA device ordinals taking part in the reduction, one replica each.
+    //     Peer access is enabled between neighbouring devices where the hardware allows it.
+    // size: the number of elements in each buffer passed to `Run`.
+    AllReduce(const std::vector<int>& devices, const int size);
+
+    // Releases internal resources.
+    // Blocks until all reductions have completed executing on the GPUs.
+    ~AllReduce();
+
+    // Replaces each buffer with the elementwise sum of all buffers.
+    //
+    // buffers: one [size] buffer per device, in the same order as `devices`.
+    // streams: one stream per device, in the same order as `devices`. The reduction starts
+    //     after the work already queued on every stream (e.g. the gradient computation) and
+    //     work queued afterwards sees the reduced result. Passing streams other than the
+    //     ones running the next layer's backward pass lets the reduction of this layer's
+    //     gradients overlap with that computation.
+    void Run(const std::vector<T*>& buffers, const std::vector<cudaStream_t>& streams);
+
+  private:
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace data_parallel
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,43 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+namespace haste {
+namespace v0 {
+namespace dropout {
+
+// Variational dropout (Gal & Ghahramani, 2016) on the input and output of a layer. Each
+// sequence in the batch draws one mask over its input features and one over its output
+// units, and every time step of the sequence uses the same masks. The engines generate
+// the masks from `seed` as they go, so the forward and backward passes agree without
+// the masks ever being stored; use a different seed for every training step. Kept values
+// are scaled by 1/(1-prob), so inference runs without dropout.
+//
+// The input mask is applied to `x` as the input GEMMs load it, so the dropped-out input
+// isn't stored either. Output dropout writes its own copy `y` of the output because the
+// recurrence and the backward pass need `h` as it is; in a stack of layers, input dropout
+// on the next layer has the same effect without that copy.
+struct Variational {
+  // Probability of dropping each input feature of a sequence, in [0,1).
+  float input_prob;
+  // Probability of dropping each output unit of a sequence, in [0,1).
+  float output_prob;
+  unsigned long long seed;
+};
+
+}  // namespace dropout
+}  // namespace v0
+}  // namespace haste
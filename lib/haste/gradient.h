@@ -0,0 +1,71 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace gradient {
+
+// The L2 norms of the gradients accumulated by an `Accumulator`.
+struct Norms {
+  // Over every parameter gradient (`dW`, `dR`, the biases, and `dU` if present).
+  float parameters;
+  // Over every input gradient `dx`.
+  float inputs;
+};
+
+// Collects sums of squares of gradients on the device as `BackwardPass::Run` produces
+// them. Several layers can share one accumulator to get the global norm for clipping.
+class Accumulator {
+  public:
+    Accumulator();
+    ~Accumulator();
+
+    // Clears the sums on `stream`.
+    void Reset(const cudaStream_t& stream = 0);
+
+    // Returns the norms accumulated since the last `Reset`. Blocks until work already
+    // queued on `stream` has finished, so pass the stream the engines were synchronized with.
+    Norms Query(const cudaStream_t& stream = 0) const;
+
+    // [2] device array: the sums of squares of the parameter and input gradients. Can be
+    // read directly by a clipping kernel to avoid blocking the host.
+    float* data() const;
+
+  private:
+    float* sums_;
+};
+
+// Per-call gradient options for `BackwardPass::Run`.
+struct Options {
+  // If positive, every element of the state gradients `dh` (and `dc` for LSTMs) is
+  // clamped to [-max_state_grad, max_state_grad] at each step as it enters the pointwise
+  // kernel, before it is propagated any further back in time. NaN and ±Inf elements are
+  // left as they are so that `accumulator` and `health` checks still see them.
+  float max_state_grad;
+  // If not null, receives the sums of squares of the gradients this call writes. `Run`
+  // then overwrites the parameter gradients it reports instead of accumulating into them,
+  // so each call adds exactly its own gradients and nothing is counted twice. Use one
+  // set of parameter gradient buffers per call (or sum them afterwards) when several
+  // calls contribute to the same parameters.
+  Accumulator* accumulator;
+};
+
+}  // namespace gradient
+}  // namespace v0
+}  // namespace haste
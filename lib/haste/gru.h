@@ -20,8 +20,82 @@
 
 namespace haste {
 namespace v0 {
+
+namespace block_sparse {
+template<typename T> class Mask;
+}  // namespace block_sparse
+
+namespace dropout {
+struct Variational;
+}  // namespace dropout
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
 namespace gru {
 
+// Optional inputs of `ForwardPass::Run`. A default-constructed value disables all of them,
+// so callers only set the members they need.
+//
+// conditioning_size: the dimension S of a per-sequence conditioning vector (e.g. a
+//     speaker embedding), or 0 to disable conditioning. The product `s·U` is computed
+//     once and added on the input side of the gates at every time step, which is
+//     equivalent to concatenating `s` onto each `x` without the T-1 redundant products.
+// U: [S,H*3] the conditioning weight matrix.
+// s: [N,S] the conditioning vector of each sequence in the batch.
+// tmp_Us: [N,H*3] additional temporary work space that receives `s·U`. The caller
+//     should not use the contents of this vector.
+// mask: (optional) a block mask over `R` for block-sparse training. If specified, the
+//     recurrent projection is computed from the live blocks of `R` only, which must be
+//     the only nonzero ones (see `block_sparse::Mask`).
+// dropout: (optional) variational dropout on the input and output of the layer (see
+//     `dropout::Variational`). Only pass it during training.
+// y: [T,N,H] receives `h[1:]` with output dropout applied if `dropout->output_prob` is
+//     nonzero; it is then the output of the layer while `h` remains its state.
+template<typename T>
+struct ForwardOptions {
+  int conditioning_size = 0;
+  const T* U = nullptr;
+  const T* s = nullptr;
+  T* tmp_Us = nullptr;
+  const block_sparse::Mask<T>* mask = nullptr;
+  const dropout::Variational* dropout = nullptr;
+  T* y = nullptr;
+};
+
+// Optional inputs of `BackwardPass::Run`. A default-constructed value disables all of them,
+// so callers only set the members they need.
+//
+// conditioning_size: the dimension S of the per-sequence conditioning vector passed to
+//     `ForwardPass::Run`, or 0 if conditioning was disabled.
+// U_t: [H*3,S] the transpose of the conditioning weight matrix.
+// s: [N,S] the conditioning vectors passed to `ForwardPass::Run`.
+// dU: [S,H*3] the gradient of the conditioning weight matrix with respect to the loss.
+// ds: [N,S] the gradient of the conditioning vectors with respect to the loss.
+// tmp_dUs: [N,H*3] additional temporary work space. The caller should not use the
+//     contents of this vector.
+// mask: (optional) the block mask passed to `ForwardPass::Run`. If specified, `dR` is
+//     only accumulated for the live blocks and its dead blocks are left untouched.
+// dropout: (optional) the dropout passed to `ForwardPass::Run`. With input dropout,
+//     `x_t` is the transpose of `x` before dropout and `dx` is the gradient with respect
+//     to it. With output dropout, `dh_new[1:]` is the gradient with respect to `y`, so
+//     any gradient with respect to the final state `h[T]` should be passed in `dh`.
+// gradient: (optional) per-step clamping of `dh`, and an accumulator for the sums of
+//     squares of `dW`, `dR`, `dbx`, `dbr`, `dU`, and `dx` (see `gradient::Options`).
+template<typename T>
+struct BackwardOptions {
+  int conditioning_size = 0;
+  const T* U_t = nullptr;
+  const T* s = nullptr;
+  T* dU = nullptr;
+  T* ds = nullptr;
+  T* tmp_dUs = nullptr;
+  const block_sparse::Mask<T>* mask = nullptr;
+  const dropout::Variational* dropout = nullptr;
+  const gradient::Options* gradient = nullptr;
+};
+
 template<typename T>
 class ForwardPass {
   public:
@@ -30,6 +104,10 @@ class ForwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     ForwardPass(
         const bool training,
         const int batch_size,
@@ -39,7 +117,8 @@ class ForwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~ForwardPass();
 
     // Performs one forward iteration of the GRU cell.
@@ -69,6 +148,11 @@ class ForwardPass {
     // zoneout_mask: [N,H] may be null to disable zoneout. This is a random binary mask
     //     following a Bernoulli(1-zoneout_prob) distribution. A different mask is typically
     //     used for each iteration.
+    // gate_input: [N,H*3] may be null. Additional input-side gate pre-activations for this
+    //     iteration, added to `Wx` in the pointwise kernel (e.g. an attention context that
+    //     has already been projected by the caller). This lets the caller feed a per-step
+    //     external input without concatenating it onto `x`, and issue its projection GEMM
+    //     asynchronously. Like `x`, it must be ready before this call.
     void Iterate(
         const T* W,
         const T* R,
@@ -81,8 +165,15 @@ class ForwardPass {
         T* tmp_Wx,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const T* gate_input = nullptr);
 
+    // Runs the GRU over all time steps. The arguments are the same as for `Iterate` with
+    // an additional leading time dimension on `x`, `v`, `tmp_Wx`, and `zoneout_mask`, and
+    // `h` holding all T+1 hidden states, plus:
+    //
+    // options: (optional) conditioning, a block mask over `R`, and variational dropout (see
+    //     `ForwardOptions`).
     void Run(
         const int steps,
         const T* W,
@@ -95,7 +186,8 @@ class ForwardPass {
         T* tmp_Wx,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const ForwardOptions<T>& options = ForwardOptions<T>());
 
   private:
     void IterateInternal(
@@ -108,7 +200,12 @@ class ForwardPass {
         T* tmp_Wx,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const T* Us,
+        const block_sparse::Mask<T>* mask,
+        const dropout::Variational* dropout,
+        T* y_out,
+        const int step);
 
     struct private_data;
     private_data* data_;
@@ -121,6 +218,10 @@ class BackwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     BackwardPass(
         const int batch_size,
         const int input_size,
@@ -129,7 +230,8 @@ class BackwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~BackwardPass();
 
     // Performs one backward iteration of the GRU cell.
@@ -161,9 +263,10 @@ class BackwardPass {
     //     for the T-1'th iteration and the same pointer should be passed in for each
     //     iteration. After a complete backward pass, this vector will contain the gradient
     //     of the initial hidden state with respect to the loss.
-    // dp: [N,H*3] additional temporary work space required for this iteration. The caller
-    //     should not use the contents of this vector. A new memory region must be provided
-    //     for each iteration.
+    // dp: [N,H*3] additional temporary work space required for this iteration. A new memory
+    //     region must be provided for each iteration. After this call it holds the gradient
+    //     of the loss with respect to the input-side gate pre-activations, which is also the
+    //     gradient with respect to `gate_input` if one was provided to the forward iteration.
     // dq: [N,H*3] additional temporary work space required for this iteration. The caller
     //     should not use the contents of this vector. A new memory region must be provided
     //     for each iteration.
@@ -188,6 +291,11 @@ class BackwardPass {
         T* dq,
         const T* zoneout_mask);
 
+    // Runs the GRU backward pass over all time steps. The arguments are the same as for
+    // `Iterate` with an additional leading time dimension, plus:
+    //
+    // options: (optional) the conditioning, block mask, and dropout used in the forward pass,
+    //     and per-call gradient options (see `BackwardOptions`).
     void Run(
         const int steps,
         const T* W_t,
@@ -206,7 +314,8 @@ class BackwardPass {
         T* dh,
         T* dp,
         T* dq,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const BackwardOptions<T>& options = BackwardOptions<T>());
 
   private:
     void IterateInternal(
@@ -219,7 +328,11 @@ class BackwardPass {
         T* dh,
         T* dp,
         T* dq,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        T* dUs,
+        const dropout::Variational* dropout,
+        const gradient::Options* gradient,
+        const int step);
 
     struct private_data;
     private_data* data_;
@@ -0,0 +1,102 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace health {
+
+// Non-finite value detection fused into the pointwise kernels of the LSTM, GRU, IndRNN,
+// and layer-normalized engines. While a `Scope` is alive on a thread, every `Run` and
+// `Iterate` issued from that thread checks the states it writes in the forward pass and
+// the state gradients it carries from step to step in the backward pass, which are
+// already in registers, so the check costs no extra memory traffic. Only a failing
+// check writes to the monitor.
+//
+//   health::Monitor monitor;
+//   {
+//     health::Scope scope(&monitor);
+//     forward.Run(...);
+//   }
+//   if (!monitor.Query(stream).ok()) ...
+
+// What became non-finite.
+enum Kind : int {
+  kState = 1,     // a hidden state `h`
+  kCell = 2,      // an LSTM cell state `c`
+  kGradient = 4,  // a state gradient `dh` or `dc` in a backward pass
+};
+
+struct Report {
+  // Bitwise OR of `Kind`, 0 if every checked value was finite.
+  int kinds;
+  // Where the first non-finite `h` or `c` appeared: the earliest time step and the lowest
+  // batch entry at that step, or -1. `Iterate` counts as step 0.
+  int step;
+  int batch;
+  // Where the first non-finite gradient appeared in the order the backward pass visits
+  // time steps, i.e. the latest step, or -1. Earlier steps are usually just downstream.
+  int gradient_step;
+  int gradient_batch;
+
+  bool ok() const { return kinds == 0; }
+};
+
+// Device-side accumulator written by the kernels. The keys are (step << 32) | batch,
+// ordered so that the smallest key is the first offending value.
+struct Record {
+  int kinds;
+  unsigned long long state;
+  unsigned long long gradient;
+};
+
+class Monitor {
+  public:
+    Monitor();
+    ~Monitor();
+
+    // Clears the monitor on `stream`.
+    void Reset(const cudaStream_t& stream = 0);
+
+    // Returns what was seen since the last `Reset`. Blocks until work already queued on
+    // `stream` has finished, so pass the stream the engines were synchronized with.
+    Report Query(const cudaStream_t& stream = 0) const;
+
+    Record* record() const;
+
+  private:
+    Record* record_;
+};
+
+// Makes `monitor` the one that engines on this thread report to until the scope ends.
+// Scopes nest; null disables checking within the scope.
+class Scope {
+  public:
+    explicit Scope(Monitor* monitor);
+    ~Scope();
+
+  private:
+    Record* previous_;
+};
+
+// The record of the innermost `Scope` on this thread, or null if there is none.
+Record* Active();
+
+}  // namespace health
+}  // namespace v0
+}  // namespace haste
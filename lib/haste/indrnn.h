@@ -20,6 +20,15 @@
 
 namespace haste {
 namespace v0 {
+
+namespace dropout {
+struct Variational;
+}  // namespace dropout
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
 namespace indrnn {
 
 template<typename T>
@@ -44,7 +53,9 @@ class ForwardPass {
         T* h,
         T* workspace,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const dropout::Variational* dropout = nullptr,
+        T* y = nullptr);
 
   private:
     struct private_data;
@@ -77,7 +88,9 @@ class BackwardPass {
         T* db,
         T* dh,
         T* workspace,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const dropout::Variational* dropout = nullptr,
+        const gradient::Options* gradient = nullptr);
 
   private:
     struct private_data;
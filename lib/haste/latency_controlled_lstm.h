@@ -0,0 +1,154 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace latency_controlled_lstm {
+
+// Analytic cost of processing one full chunk, counting GEMM FLOPs only (the pointwise
+// work is proportional to the recurrent GEMMs and much smaller).
+struct ChunkCost {
+  // Worst-case algorithmic latency in time steps: the first frame of a chunk is emitted
+  // once the whole chunk and its right context have arrived.
+  int latency_steps;
+  // Input projections of both directions. Each frame is projected exactly once, so this
+  // is the same as for a full-sequence bidirectional layer.
+  double projection_flops;
+  // Forward direction over the chunk frames.
+  double forward_flops;
+  // Backward direction over the chunk frames and the right context.
+  double backward_flops;
+  // The part of `backward_flops` spent on the right context, whose outputs are discarded.
+  double recompute_flops;
+
+  double TotalFlops() const {
+    return projection_flops + forward_flops + backward_flops;
+  }
+
+  // Extra work relative to a full-sequence bidirectional layer.
+  double Overhead() const {
+    return recompute_flops / (TotalFlops() - recompute_flops);
+  }
+};
+
+// Inference-only bidirectional LSTM for streaming input under a fixed latency budget
+// (latency-controlled BLSTM). The input is consumed in chunks of `chunk_size` steps. The
+// forward direction carries its state from one chunk to the next as usual. The backward
+// direction can't see the future, so it is restarted from a zero state for every chunk
+// and run over the chunk plus the `right_context` steps that follow it; only its outputs
+// for the chunk are kept.
+//
+// Input projections (`W·x`) of both directions are computed once per step as frames
+// arrive and kept until they are no longer needed, so right-context frames are projected
+// once even though the backward direction runs over them twice. Only the recurrence over
+// the right context is recomputed (see `Cost`).
+//
+// Weights have the same layout as `lstm::ForwardPass`; `_fw` and `_bw` name the forward
+// and backward direction. Outputs are [T,N,H*2] with the forward direction's hidden state
+// in the first half of each vector and the backward direction's in the second.
+template<typename T>
+class ForwardPass {
+  public:
+    // batch_size: the number of streams processed together.
+    // input_size: the dimension of each input vector.
+    // hidden_size: the dimension of each direction's output vector.
+    // chunk_size: the number of steps emitted by each backward recurrence.
+    // right_context: the number of future steps the backward direction looks at beyond
+    //     the end of each chunk (0 for a unidirectional-latency backward direction).
+    // max_steps: the largest `steps` that will be passed to `Run`.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. `Run` and `Flush` wait for work already queued on `stream` and
+    //     work queued on `stream` afterwards sees their outputs.
+    ForwardPass(
+        const int batch_size,
+        const int input_size,
+        const int hidden_size,
+        const int chunk_size,
+        const int right_context,
+        const int max_steps,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all work has completed executing on the GPU.
+    ~ForwardPass();
+
+    // Starts a new sequence: discards buffered steps and resets the forward direction's
+    // state to zeros.
+    void Reset();
+
+    // Appends `steps` input steps and emits the output of every chunk that now has its
+    // full right context. Returns the number of output steps written to `y`; this is
+    // always a multiple of `chunk_size` and is known on the host without synchronizing.
+    //
+    // steps: 0 <= steps <= max_steps; the number of newly arrived steps.
+    // W_fw, W_bw: [C,H*4] the input weight matrices.
+    // R_fw, R_bw: [H,H*4] the recurrent weight matrices.
+    // b_fw, b_bw: [H*4] the bias vectors.
+    // x: [steps,N,C] the new input steps.
+    // y: [steps+chunk_size-1,N,H*2] receives the outputs, in order, continuing where the
+    //     previous call left off.
+    // zoneout_prob: the zoneout probability used in training, or 0.
+    int Run(
+        const int steps,
+        const T* W_fw,
+        const T* R_fw,
+        const T* b_fw,
+        const T* W_bw,
+        const T* R_bw,
+        const T* b_bw,
+        const T* x,
+        T* y,
+        const float zoneout_prob = 0.0f);
+
+    // Emits the outputs of all buffered steps at the end of the sequence, with whatever
+    // right context is left. Returns the number of output steps written to `y`, which
+    // must have room for `chunk_size + right_context - 1` steps. The layer is ready for a
+    // new sequence afterwards.
+    int Flush(
+        const T* R_fw,
+        const T* b_fw,
+        const T* R_bw,
+        const T* b_bw,
+        T* y,
+        const float zoneout_prob = 0.0f);
+
+    // Analytic per-chunk cost of this configuration.
+    ChunkCost Cost() const;
+
+  private:
+    void Process(
+        const int steps,
+        const int window,
+        const T* R_fw,
+        const T* b_fw,
+        const T* R_bw,
+        const T* b_bw,
+        T* y,
+        const float zoneout_prob);
+
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace latency_controlled_lstm
+}  // namespace v0
+}  // namespace haste
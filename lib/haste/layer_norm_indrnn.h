@@ -20,6 +20,15 @@
 
 namespace haste {
 namespace v0 {
+
+namespace dropout {
+struct Variational;
+}  // namespace dropout
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
 namespace layer_norm_indrnn {
 
 template<typename T>
@@ -46,7 +55,9 @@ class ForwardPass {
         T* act_Wx,
         layer_norm::ForwardPass<T>& layer_norm1,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const dropout::Variational* dropout = nullptr,
+        T* y = nullptr);
 
   private:
     struct private_data;
@@ -80,7 +91,9 @@ class BackwardPass {
         T* dh,
         T* workspace,
         layer_norm::BackwardPass<T>& layer_norm1,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const dropout::Variational* dropout = nullptr,
+        const gradient::Options* gradient = nullptr);
 
   private:
     struct private_data;
@@ -20,6 +20,15 @@
 
 namespace haste {
 namespace v0 {
+
+namespace dropout {
+struct Variational;
+}  // namespace dropout
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
 namespace layer_norm_lstm {
 
 template<typename T>
@@ -30,6 +39,10 @@ class ForwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     ForwardPass(
         const bool training,
         const int batch_size,
@@ -39,7 +52,8 @@ class ForwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~ForwardPass();
 
     // Runs the LSTM over all time steps. This method is faster than using a per-step
@@ -72,6 +86,18 @@ class ForwardPass {
     // zoneout_mask: [T,N,H] may be null to disable zoneout. This is a random binary mask
     //     following a Bernoulli(1-zoneout_prob) distribution. A different mask is typically
     //     used for each iteration.
+    // conditioning_size: (optional) the dimension S of a per-sequence conditioning vector
+    //     (e.g. a speaker embedding), or 0 to disable conditioning. The product `s·U` is
+    //     computed once and added to the normalized gate pre-activations of every time step,
+    //     acting as a per-sequence bias.
+    // U: [S,H*4] the conditioning weight matrix.
+    // s: [N,S] the conditioning vector of each sequence in the batch.
+    // tmp_Us: [N,H*4] additional temporary work space that receives `s·U`. The caller
+    //     should not use the contents of this vector.
+    // dropout: (optional) variational dropout on the input and output of the layer (see
+    //     `dropout::Variational`). Only pass it during training.
+    // y: [T,N,H] receives `h[1:]` with output dropout applied if `dropout->output_prob` is
+    //     nonzero; it is then the output of the layer while `h` remains its state.
     void Run(
         const int steps,
         const T* W,
@@ -89,7 +115,13 @@ class ForwardPass {
         layer_norm::ForwardPass<T>& layer_norm3,
         T* act_c_norm,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const int conditioning_size = 0,
+        const T* U = nullptr,
+        const T* s = nullptr,
+        T* tmp_Us = nullptr,
+        const dropout::Variational* dropout = nullptr,
+        T* y = nullptr);
 
   private:
     void IterateInternal(
@@ -106,7 +138,11 @@ class ForwardPass {
         layer_norm::ForwardPass<T>& layer_norm3,
         T* act_c_norm,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const T* Us,
+        const dropout::Variational* dropout,
+        T* y_out,
+        const int step);
 
     struct private_data;
     private_data* data_;
@@ -119,6 +155,10 @@ class BackwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     BackwardPass(
         const int batch_size,
         const int input_size,
@@ -127,7 +167,8 @@ class BackwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~BackwardPass();
 
     // Runs the LSTM backward pass over all time steps. This method is faster than using a
@@ -157,6 +198,21 @@ class BackwardPass {
     // v: [T,N,H*4] the same tensor that was passed to `ForwardPass::Run`.
     // zoneout_mask: [T,N,H] may be null if zoneout was disabled in the forward pass. This
     //     vector must be the same as the one provided during the forward pass.
+    // conditioning_size: (optional) the dimension S of the per-sequence conditioning vector
+    //     passed to `ForwardPass::Run`, or 0 if conditioning was disabled.
+    // U_t: [H*4,S] the transpose of the conditioning weight matrix.
+    // s: [N,S] the conditioning vectors passed to `ForwardPass::Run`.
+    // dU: [S,H*4] the gradient of the loss with respect to the conditioning weight matrix.
+    // ds: [N,S] the gradient of the loss with respect to the conditioning vectors.
+    // tmp_dUs: [N,H*4] additional temporary work space. The caller should not use the
+    //     contents of this vector.
+    // dropout: (optional) the dropout passed to `ForwardPass::Run`. With input dropout,
+    //     `x_t` is the transpose of `x` before dropout and `dx` is the gradient with respect
+    //     to it. With output dropout, `dh_new[1:]` is the gradient with respect to `y`, so
+    //     any gradient with respect to the final state `h[T]` should be passed in `dh`.
+    // gradient: (optional) per-step clamping of `dh` and `dc`, and an accumulator for the
+    //     sums of squares of `dW`, `dR`, `db`, `dU`, and `dx` (see `gradient::Options`).
+    //     The layer normalization gains are not included.
     void Run(
         const int steps,
         const T* W_t,
@@ -180,7 +236,15 @@ class BackwardPass {
         layer_norm::BackwardPass<T>& layer_norm2,
         layer_norm::BackwardPass<T>& layer_norm3,
         T* act_c_norm,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const int conditioning_size = 0,
+        const T* U_t = nullptr,
+        const T* s = nullptr,
+        T* dU = nullptr,
+        T* ds = nullptr,
+        T* tmp_dUs = nullptr,
+        const dropout::Variational* dropout = nullptr,
+        const gradient::Options* gradient = nullptr);
 
   private:
     void IterateInternal(
@@ -197,7 +261,11 @@ class BackwardPass {
         layer_norm::BackwardPass<T>& layer_norm2,
         layer_norm::BackwardPass<T>& layer_norm3,
         T* act_c_norm,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        T* dUs,
+        const dropout::Variational* dropout,
+        const gradient::Options* gradient,
+        const int step);
     struct private_data;
     private_data* data_;
 };
@@ -20,8 +20,82 @@
 
 namespace haste {
 namespace v0 {
+
+namespace block_sparse {
+template<typename T> class Mask;
+}  // namespace block_sparse
+
+namespace dropout {
+struct Variational;
+}  // namespace dropout
+
+namespace gradient {
+struct Options;
+}  // namespace gradient
+
 namespace lstm {
 
+// Optional inputs of `ForwardPass::Run`. A default-constructed value disables all of them,
+// so callers only set the members they need.
+//
+// conditioning_size: (optional) the dimension S of a per-sequence conditioning vector
+//     (e.g. a speaker embedding), or 0 to disable conditioning. The product `s·U` is
+//     computed once and added to the gate pre-activations of every time step, which is
+//     equivalent to concatenating `s` onto each `x` without the T-1 redundant products.
+// U: [S,H*4] the conditioning weight matrix.
+// s: [N,S] the conditioning vector of each sequence in the batch.
+// tmp_Us: [N,H*4] additional temporary work space that receives `s·U`. The caller
+//     should not use the contents of this vector.
+// mask: (optional) a block mask over `R` for block-sparse training. If specified, the
+//     recurrent projection is computed from the live blocks of `R` only, which must be
+//     the only nonzero ones (see `block_sparse::Mask`).
+// dropout: (optional) variational dropout on the input and output of the layer (see
+//     `dropout::Variational`). Only pass it during training.
+// y: [T,N,H] receives `h[1:]` with output dropout applied if `dropout->output_prob` is
+//     nonzero; it is then the output of the layer while `h` remains its state.
+template<typename T>
+struct ForwardOptions {
+  int conditioning_size = 0;
+  const T* U = nullptr;
+  const T* s = nullptr;
+  T* tmp_Us = nullptr;
+  const block_sparse::Mask<T>* mask = nullptr;
+  const dropout::Variational* dropout = nullptr;
+  T* y = nullptr;
+};
+
+// Optional inputs of `BackwardPass::Run`. A default-constructed value disables all of them,
+// so callers only set the members they need.
+//
+// conditioning_size: (optional) the dimension S of the per-sequence conditioning vector
+//     passed to `ForwardPass::Run`, or 0 if conditioning was disabled.
+// U_t: [H*4,S] the transpose of the conditioning weight matrix.
+// s: [N,S] the conditioning vectors passed to `ForwardPass::Run`.
+// dU: [S,H*4] the gradient of the loss with respect to the conditioning weight matrix.
+// ds: [N,S] the gradient of the loss with respect to the conditioning vectors.
+// tmp_dUs: [N,H*4] additional temporary work space. The caller should not use the
+//     contents of this vector.
+// mask: (optional) the block mask passed to `ForwardPass::Run`. If specified, `dR` is
+//     only accumulated for the live blocks and its dead blocks are left untouched.
+// dropout: (optional) the dropout passed to `ForwardPass::Run`. With input dropout,
+//     `x_t` is the transpose of `x` before dropout and `dx` is the gradient with respect
+//     to it. With output dropout, `dh_new[1:]` is the gradient with respect to `y`, so
+//     any gradient with respect to the final state `h[T]` should be passed in `dh`.
+// gradient: (optional) per-step clamping of `dh` and `dc`, and an accumulator for the
+//     sums of squares of `dW`, `dR`, `db`, `dU`, and `dx` (see `gradient::Options`).
+template<typename T>
+struct BackwardOptions {
+  int conditioning_size = 0;
+  const T* U_t = nullptr;
+  const T* s = nullptr;
+  T* dU = nullptr;
+  T* ds = nullptr;
+  T* tmp_dUs = nullptr;
+  const block_sparse::Mask<T>* mask = nullptr;
+  const dropout::Variational* dropout = nullptr;
+  const gradient::Options* gradient = nullptr;
+};
+
 template<typename T>
 class ForwardPass {
   public:
@@ -30,6 +104,10 @@ class ForwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     ForwardPass(
         const bool training,
         const int batch_size,
@@ -39,7 +117,8 @@ class ForwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~ForwardPass();
 
     // Performs one forward iteration of the LSTM cell.
@@ -67,9 +146,16 @@ class ForwardPass {
     // zoneout_prob: 0.0 <= zoneout_prob <= 1.0; specifies the probability of a hidden
     //     activation being randomly zoned out. If zoneout was used during training, this
     //     parameter must also be specified during inference with the same value.
-    // zoneout_mask: [N,H] may be null to disable zoneout. This is a random binary mask
-    //     following a Bernoulli(1-zoneout_prob) distribution. A different mask is typically
-    //     used for each iteration.
+    // zoneout_mask: [N,H] may be null to disable zoneout in training mode. This is a random
+    //     binary mask following a Bernoulli(1-zoneout_prob) distribution. A different mask is
+    //     typically used for each iteration. It is ignored in inference mode, where a nonzero
+    //     `zoneout_prob` alone selects the expected-value blend.
+    // gate_input: [N,H*4] may be null. Additional gate pre-activations for this iteration,
+    //     summed with `Wx + Rh + b` in the pointwise kernel (e.g. an attention context that
+    //     has already been projected by the caller). This lets the caller feed a per-step
+    //     external input without concatenating it onto `x`, and issue its projection GEMM
+    //     on its own stream while the previous step is still running. It must be ready
+    //     by the time work submitted to `stream` at this call is.
     void Iterate(
         const cudaStream_t& stream,
         const T* W,
@@ -83,7 +169,8 @@ class ForwardPass {
         T* v,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const T* gate_input = nullptr);
 
     // Runs the LSTM over all time steps. This method is faster than using a per-step
     // `Iterate` but requires that the entire input sequence be available upfront. In some
@@ -112,9 +199,12 @@ class ForwardPass {
     // zoneout_prob: 0.0 <= zoneout_prob <= 1.0; specifies the probability of a hidden
     //     activation being randomly zoned out. If zoneout was used during training, this
     //     parameter must also be specified during inference with the same value.
-    // zoneout_mask: [T,N,H] may be null to disable zoneout. This is a random binary mask
-    //     following a Bernoulli(1-zoneout_prob) distribution. A different mask is typically
-    //     used for each iteration.
+    // zoneout_mask: [T,N,H] may be null to disable zoneout in training mode. This is a random
+    //     binary mask following a Bernoulli(1-zoneout_prob) distribution. A different mask is
+    //     typically used for each iteration. It is ignored in inference mode, where a nonzero
+    //     `zoneout_prob` alone selects the expected-value blend.
+    // options: (optional) conditioning, a block mask over `R`, and variational dropout (see
+    //     `ForwardOptions`).
     void Run(
         const int steps,
         const T* W,
@@ -126,7 +216,34 @@ class ForwardPass {
         T* v,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const ForwardOptions<T>& options = ForwardOptions<T>());
+
+    // Runs the LSTM over all time steps starting from input projections that the caller
+    // has already computed. The arguments are the same as for `Run`, except:
+    //
+    // v: [T,N,H*4] on input, the products `W·x` for every time step. In inference mode
+    //     (`training == false`) this vector is left unchanged, so overlapping windows of a
+    //     stream (e.g. the right context of a chunked bidirectional layer) can be run
+    //     again without recomputing their projections. In training mode it is overwritten
+    //     with the same intermediate activations that `Run` produces.
+    // reverse: if `true`, the t'th iteration consumes `v[T-1-t]` (and `zoneout_mask[t]`),
+    //     i.e. the sequence is processed back to front without reordering `v`. `h[t+1]`
+    //     and `c[t+1]` are always the states after the t'th iteration.
+    //
+    // Unlike `Run`, work queued on the constructor's `stream` after this call returns waits
+    // for it to finish, so one engine can be reused for many sequences.
+    void RunProjected(
+        const int steps,
+        const T* R,
+        const T* b,
+        T* h,
+        T* c,
+        T* v,
+        T* tmp_Rh,
+        const float zoneout_prob,
+        const T* zoneout_mask,
+        const bool reverse = false);
 
   private:
     void IterateInternal(
@@ -139,7 +256,12 @@ class ForwardPass {
         T* v,
         T* tmp_Rh,
         const float zoneout_prob,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const T* extra,
+        const block_sparse::Mask<T>* mask,
+        const dropout::Variational* dropout,
+        T* y_out,
+        const int step);
 
     struct private_data;
     private_data* data_;
@@ -152,6 +274,10 @@ class BackwardPass {
     // input_size: the dimension of each input vector.
     // hidden_size: the expected dimension of each output vector.
     // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
     BackwardPass(
         const int batch_size,
         const int input_size,
@@ -160,7 +286,8 @@ class BackwardPass {
         const cudaStream_t& stream = 0);
 
     // Releases internal resources.
-    // Blocks until all iterations have completed executing on the GPU.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
     ~BackwardPass();
 
     // Performs one backward iteration of the LSTM cell.
@@ -195,7 +322,9 @@ class BackwardPass {
     //     iteration. After a complete backward pass, this vector will contain the gradient
     //     of the loss with respect to the initial cell state.
     // v: [N,H*4] the same tensor that was passed to `ForwardPass::Iterate` on its corresponding
-    //     iteration.
+    //     iteration. After this call it holds the gradient of the loss with respect to the
+    //     gate pre-activations, which is also the gradient with respect to `gate_input` if
+    //     one was provided to the forward iteration.
     // zoneout_mask: [N,H] may be null if zoneout was disabled in the forward pass. This vector
     //     must be the same as the one provided during the corresponding forward iteration.
     void Iterate(
@@ -245,6 +374,8 @@ class BackwardPass {
     // v: [T,N,H*4] the same tensor that was passed to `ForwardPass::Run`.
     // zoneout_mask: [T,N,H] may be null if zoneout was disabled in the forward pass. This
     //     vector must be the same as the one provided during the forward pass.
+    // options: (optional) the conditioning, block mask, and dropout used in the forward pass,
+    //     and per-call gradient options (see `BackwardOptions`).
     void Run(
         const int steps,
         const T* W_t,
@@ -262,7 +393,8 @@ class BackwardPass {
         T* dh,
         T* dc,
         T* v,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        const BackwardOptions<T>& options = BackwardOptions<T>());
 
   private:
     void IterateInternal(
@@ -275,7 +407,11 @@ class BackwardPass {
         T* dh,
         T* dc,
         T* v,
-        const T* zoneout_mask);
+        const T* zoneout_mask,
+        T* dUs,
+        const dropout::Variational* dropout,
+        const gradient::Options* gradient,
+        const int step);
     struct private_data;
     private_data* data_;
 };
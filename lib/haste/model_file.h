@@ -0,0 +1,120 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace haste {
+namespace v0 {
+namespace model_file {
+
+// A model file holds the weights of a stack of Haste layers in exactly the layout that
+// the `ForwardPass` / `BackwardPass` classes consume (e.g. `[C,H*4]` for an LSTM kernel),
+// so a loader never has to parse, transpose, or reorder anything. The file consists of
+// a fixed-size header, a tensor index, and the tensor data. Every tensor starts on a
+// `kAlignment`-byte boundary so that it can be used directly from a memory mapping or
+// handed to `cudaMemcpy` without an intermediate copy. Header and index integers are
+// encoded little-endian. Tensor data is stored little-endian as well and is used in
+// place, so `Writer::Save` and `Reader::Open` fail on big-endian hosts.
+//
+// Unlike the rest of the API, pointers in this namespace refer to host memory.
+
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kAlignment = 64;
+
+enum class DataType : uint32_t {
+  kHalf = 1,
+  kFloat = 2,
+  kDouble = 3,
+};
+
+// Returns the size in bytes of a single element of type `dtype`, or 0 if unknown.
+size_t SizeOf(DataType dtype);
+
+struct TensorInfo {
+  int layer;                   // index of the layer in the stack (0 is the bottom layer)
+  std::string layer_type;      // e.g. "lstm", "gru", "layer_norm_lstm"
+  std::string name;            // e.g. "kernel", "recurrent_kernel", "bias"
+  DataType dtype;
+  std::vector<int64_t> shape;
+  const void* data;            // `size` bytes, aligned to `kAlignment`
+  size_t size;
+};
+
+class Writer {
+  public:
+    // Adds a tensor to the model. `data` must contain `shape.product() * SizeOf(dtype)`
+    // bytes and must remain valid until `Save` returns.
+    void Add(
+        const int layer,
+        const std::string& layer_type,
+        const std::string& name,
+        const DataType dtype,
+        const std::vector<int64_t>& shape,
+        const void* data);
+
+    // Writes all tensors added so far to `path`. Returns `false` on I/O failure, if a
+    // shape has a negative dimension or a byte size that does not fit in 64 bits, or on
+    // a big-endian host.
+    bool Save(const std::string& path) const;
+
+  private:
+    std::vector<TensorInfo> tensors_;
+};
+
+class Reader {
+  public:
+    Reader();
+
+    // Unmaps the file. Pointers returned by `tensors` and `Find` become invalid.
+    ~Reader();
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // Maps `path` read-only into memory and validates its header and index. The pages
+    // are shared with every other process that maps the same file, so loading the same
+    // model in several workers costs one copy of the weights in the page cache. Returns
+    // `false` if the file cannot be opened or is not a valid model file of a supported
+    // version; `error` then describes why.
+    bool Open(const std::string& path);
+
+    void Close();
+
+    uint32_t version() const { return version_; }
+    const std::string& error() const { return error_; }
+    const std::vector<TensorInfo>& tensors() const { return tensors_; }
+
+    // Returns the tensor called `name` in layer `layer` or null if there is none.
+    const TensorInfo* Find(const int layer, const std::string& name) const;
+
+  private:
+    bool Fail(const std::string& message);
+
+    void* base_;
+    size_t length_;
+    bool mapped_;
+    uint32_t version_;
+    std::string error_;
+    std::vector<TensorInfo> tensors_;
+};
+
+}  // namespace model_file
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,110 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace prefix_tree {
+
+// Runs an LSTM or GRU over every node of a prefix tree (trie) of token sequences, e.g.
+// the hypotheses of an N-best list or lattice being rescored with an RNN language model.
+// Each node is the step that extends its parent's prefix by one token, so each unique
+// prefix is evaluated exactly once no matter how many hypotheses share it. Consecutive
+// nodes at the same depth are independent and are batched into a single engine step.
+//
+// The tree is described by `parent`, a host array with one entry per node giving the
+// index of its parent node, or -1 for nodes that extend the empty prefix (whose previous
+// state is the initial state). Every node must come after its parent. Numbering the nodes
+// level by level (breadth first) makes every level a single step, so the number of
+// sequential steps is the depth of the tree; other numberings take one step per run of
+// consecutive nodes at the same depth.
+//
+// The outputs are the states after every node, [nodes,H]. The final state of a
+// hypothesis is the state of its last node. To score hypotheses, apply the output layer
+// to the initial state and to all node states at once and pick, for each node, the
+// log-probability of its token under its parent's (or the initial) distribution; the
+// score of a hypothesis is the sum along its path.
+template<typename T>
+class ForwardPass {
+  public:
+    // input_size: the dimension of each input (token embedding) vector.
+    // hidden_size: the dimension of each state vector.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs.
+    //     `RunLstm` and `RunGru` wait for work already queued on `stream` and work queued
+    //     on `stream` afterwards sees their outputs.
+    ForwardPass(
+        const int input_size,
+        const int hidden_size,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all work has completed executing on the GPU.
+    ~ForwardPass();
+
+    // Runs an LSTM over the tree. Weights are the same as for `lstm::ForwardPass`.
+    //
+    // nodes: the number of nodes in the tree.
+    // parent: [nodes] host array of parent indices, as described above.
+    // x: [nodes,C] the input of each node (the embedding of the token it appends).
+    // h0: [H] the initial hidden state, or null for zeros.
+    // c0: [H] the initial cell state, or null for zeros.
+    // h: [nodes,H] receives the hidden state after each node.
+    // c: [nodes,H] receives the cell state after each node.
+    //
+    // Returns `false` without queuing any work if `parent` has an entry that is less than
+    // -1 or not less than its own index.
+    bool RunLstm(
+        const int nodes,
+        const int* parent,
+        const T* W,
+        const T* R,
+        const T* b,
+        const T* x,
+        const T* h0,
+        const T* c0,
+        T* h,
+        T* c);
+
+    // Runs a GRU over the tree. Weights are the same as for `gru::ForwardPass`; the other
+    // arguments are the same as for `RunLstm`.
+    bool RunGru(
+        const int nodes,
+        const int* parent,
+        const T* W,
+        const T* R,
+        const T* bx,
+        const T* br,
+        const T* x,
+        const T* h0,
+        T* h);
+
+  private:
+    // Splits the nodes into runs at the same depth and uploads `parent`. Returns the
+    // number of runs, or -1 if `parent` is invalid.
+    int Schedule(const int nodes, const int* parent);
+
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace prefix_tree
+}  // namespace v0
+}  // namespace haste
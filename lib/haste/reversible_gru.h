@@ -0,0 +1,178 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+namespace haste {
+namespace v0 {
+namespace reversible_gru {
+
+// A reversible GRU in the style of RevGRU (MacKay et al., 2018). The hidden state is
+// split into two halves of size K = H/2 that are updated in turn, each by a GRU cell
+// whose gates see the input and the *other* half:
+//
+//   h1[t] = z1 * h1[t-1] + (1 - z1) * g1      (gates from x[t] and h2[t-1])
+//   h2[t] = z2 * h2[t-1] + (1 - z2) * g2      (gates from x[t] and h1[t])
+//
+// so each half can be recomputed from the later state by running its update backwards.
+// To make that inversion bit-exact, states are kept on a fixed-point grid (exactly
+// representable as T), `z` is quantized to a multiple of 1/256, and the low bits that
+// the multiplication by `z` shifts out are stored as one byte per unit and step. The
+// backward pass starts from the final state and reconstructs every earlier state on the
+// fly, so training needs [T,N,H] bytes of remainders instead of the [T,N,H*4] activations
+// and [T+1,N,H] states a GRU keeps; all other buffers are independent of T. Gradients
+// treat the quantization as the identity.
+//
+// Bit-exact recomputation also requires the forward and backward pass to run the same
+// GEMMs on identically aligned operands, so the input projections are computed one step
+// at a time and both passes take their scratch space from a `workspace` buffer that must
+// be allocated the same way for both (e.g. directly with `cudaMalloc`). Both passes also
+// run their GEMMs with the default math mode and without a cuBLAS workspace, so that
+// cuBLAS picks the same kernels although the passes use different streams. With cuBLAS
+// older than 11.4, which can't disable the workspace per handle, set
+// `CUBLAS_WORKSPACE_CONFIG=:4096:8` in the environment instead. The backward pass leaves
+// the reconstructed initial state in `workspace`, so the round trip can be checked against
+// `h[0]` (see `validation/reversible_gru.cc`).
+//
+// W: [C,H*3] the input weight matrix. Columns are [z1,r1,g1,z2,r2,g2], K each.
+// R: [K,H*3] the recurrent weight matrix; the first H*3/2 columns map h2 to the gates of
+//     h1 and the rest map h1 to the gates of h2.
+// bx: [H*3] the bias for the input weight matrix, in the same column order.
+// br: [H*3] the bias for the recurrent weight matrix, in the same column order.
+template<typename T>
+class ForwardPass {
+  public:
+    // training: `true` if the caller intends to perform a backward pass to compute gradients.
+    // batch_size: the number of training/inference inputs provided in each tensor.
+    // input_size: the dimension of each input vector.
+    // hidden_size: the expected dimension of each output vector. Must be even.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
+    ForwardPass(
+        const bool training,
+        const int batch_size,
+        const int input_size,
+        const int hidden_size,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
+    ~ForwardPass();
+
+    // Runs the reversible GRU over all time steps.
+    //
+    // steps: the number of iterations to run (i.e. T).
+    // x: [T,N,C] the input sequence.
+    // h: [T+1,N,H] the hidden state vectors across all time steps. The t=0'th vector should
+    //     be set to the desired initial hidden state (typically zeros); it is saturated to
+    //     [-1,1] and rounded to the fixed-point grid in place. The rest of the vectors
+    //     will be set by this function and form the output of the layer. Only the last one
+    //     is needed by the backward pass.
+    // remainder: [T,N,H] if `training` is `true`, receives the bits needed to invert each
+    //     step and must be provided as-is to `BackwardPass::Run`. May be null otherwise.
+    // workspace: [N,H*6] temporary work space. The caller should not use its contents.
+    void Run(
+        const int steps,
+        const T* W,
+        const T* R,
+        const T* bx,
+        const T* br,
+        const T* x,
+        T* h,
+        uint8_t* remainder,
+        T* workspace);
+
+  private:
+    struct private_data;
+    private_data* data_;
+};
+
+template<typename T>
+class BackwardPass {
+  public:
+    // batch_size: the number of training inputs provided in each tensor.
+    // input_size: the dimension of each input vector.
+    // hidden_size: the expected dimension of each output vector. Must be even.
+    // blas_handle: an initialized cuBLAS handle (see `cublasCreate`).
+    // stream: (optional) the CUDA stream that produces the inputs and consumes the outputs
+    //     of this layer. If specified, `Run` waits for work already queued on `stream` before
+    //     it starts and work queued on `stream` after this object is destroyed waits for `Run`
+    //     to finish, so the host never has to block.
+    BackwardPass(
+        const int batch_size,
+        const int input_size,
+        const int hidden_size,
+        const cublasHandle_t& blas_handle,
+        const cudaStream_t& stream = 0);
+
+    // Releases internal resources.
+    // Blocks until all iterations have completed executing on the GPU unless a `stream`
+    // was provided to the constructor, in which case `stream` waits for them instead.
+    ~BackwardPass();
+
+    // Runs the reversible GRU backward pass over all time steps, reconstructing the hidden
+    // states from the last one. Unlike `gru::BackwardPass`, the weights and inputs are
+    // passed in their forward layout since the forward computation is repeated.
+    //
+    // W, R, bx, br, x: the same tensors that were passed to `ForwardPass::Run`.
+    // h: [N,H] the final hidden state, `h[T]` from `ForwardPass::Run`.
+    // remainder: [T,N,H] the remainders produced by `ForwardPass::Run`.
+    // dh_new: [T+1,N,H] the gradient of the loss with respect to `h`. `dh_new[0]` is not used.
+    // dx: [T,N,C] the gradient of the loss with respect to the input.
+    // dW: [C,H*3] the gradient of the loss with respect to the input weight matrix.
+    // dR: [K,H*3] the gradient of the loss with respect to the recurrent weight matrix.
+    // dbx: [H*3] the gradient of the loss with respect to the input bias.
+    // dbr: [H*3] the gradient of the loss with respect to the recurrent bias.
+    // dh: [N,H] NOTE: this is an input and output parameter. Should be initialized to zeros.
+    //     After the backward pass, this vector will contain the gradient of the loss with
+    //     respect to the initial hidden state.
+    // workspace: [N,H*11] temporary work space. The caller should not use its contents.
+    //     After the backward pass, its first [N,H] elements hold the reconstructed initial
+    //     hidden state.
+    void Run(
+        const int steps,
+        const T* W,
+        const T* R,
+        const T* bx,
+        const T* br,
+        const T* x,
+        const T* h,
+        const uint8_t* remainder,
+        const T* dh_new,
+        T* dx,
+        T* dW,
+        T* dR,
+        T* dbx,
+        T* dbr,
+        T* dh,
+        T* workspace);
+
+  private:
+    struct private_data;
+    private_data* data_;
+};
+
+}  // namespace reversible_gru
+}  // namespace v0
+}  // namespace haste
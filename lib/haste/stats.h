@@ -0,0 +1,94 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace haste {
+namespace v0 {
+namespace stats {
+
+// Per-phase GPU time and call counts for every engine in the library, accumulated over
+// the whole process. Collection is compiled in only when the library is built with
+// `HASTE_ENABLE_STATS` defined (e.g. `make HASTE_ENABLE_STATS=1`); otherwise the engines
+// contain no instrumentation at all and `GetStats` always returns zeros.
+//
+// When enabled, each phase brackets its kernels with a pair of CUDA events on the stream
+// that runs them. Events are resolved lazily so `Run` never blocks the host on their
+// account. Setting the `HASTE_TRACE` environment variable to a file name additionally
+// writes every timed phase to that file as a Chrome trace (chrome://tracing) when the
+// process exits, with one track per host thread.
+
+enum class Layer : int {
+  kLstm,
+  kGru,
+  kIndrnn,
+  kLayerNorm,
+  kLayerNormLstm,
+  kLayerNormGru,
+  kLayerNormIndrnn,
+  kReversibleGru,
+  kCell,
+  kCount
+};
+
+enum class Phase : int {
+  kInputGemm,       // Wx in the forward pass, dx in the backward pass
+  kRecurrentGemm,   // Rh in the forward pass, dh through R in the backward pass
+  kPointwise,       // activations and state updates (and bias gradients)
+  kLayerNorm,       // layer normalization kernels, forward and backward
+  kReduction,       // dW and dR: gradients reduced over the batch and time steps
+  kCount
+};
+
+struct PhaseStats {
+  uint64_t calls;
+  double time_ms;
+};
+
+struct Stats {
+  PhaseStats phase[static_cast<int>(Layer::kCount)][static_cast<int>(Phase::kCount)];
+
+  // Device memory allocated internally by Haste (e.g. `data_parallel::AllReduce` scratch
+  // space). The engines themselves take all of their memory from the caller.
+  uint64_t bytes_allocated;
+
+  const PhaseStats& operator()(Layer layer, Phase phase) const {
+    return this->phase[static_cast<int>(layer)][static_cast<int>(phase)];
+  }
+};
+
+// Returns true if the library was built with `HASTE_ENABLE_STATS`.
+bool Enabled();
+
+// Returns the statistics accumulated since the start of the process or the last call to
+// `ResetStats`. Blocks until all timed GPU work queued so far has finished.
+Stats GetStats();
+
+// Clears all accumulated statistics and any trace events that have not been written yet.
+void ResetStats();
+
+// Writes the trace events collected so far as a Chrome trace JSON file. Events are only
+// collected when `HASTE_TRACE` is set. Returns `false` on I/O failure.
+bool WriteTrace(const std::string& path);
+
+const char* LayerName(Layer layer);
+const char* PhaseName(Phase phase);
+
+}  // namespace stats
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,88 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cuda_runtime_api.h>
+
+#include "haste/health.h"
+
+namespace {
+
+using haste::v0::health::Record;
+
+const Record kClear = { 0, ~0ull, ~0ull };
+
+thread_local Record* g_active = nullptr;
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace health {
+
+Monitor::Monitor() {
+  cudaMalloc(&record_, sizeof(Record));
+  cudaMemcpy(record_, &kClear, sizeof(Record), cudaMemcpyHostToDevice);
+}
+
+Monitor::~Monitor() {
+  cudaFree(record_);
+}
+
+void Monitor::Reset(const cudaStream_t& stream) {
+  // `kClear` is static, so the copy doesn't have to complete before we return.
+  cudaMemcpyAsync(record_, &kClear, sizeof(Record), cudaMemcpyHostToDevice, stream);
+}
+
+Report Monitor::Query(const cudaStream_t& stream) const {
+  Record record;
+  cudaMemcpyAsync(&record, record_, sizeof(Record), cudaMemcpyDeviceToHost, stream);
+  cudaStreamSynchronize(stream);
+
+  Report report;
+  report.kinds = record.kinds;
+  report.step = -1;
+  report.batch = -1;
+  report.gradient_step = -1;
+  report.gradient_batch = -1;
+  if (record.state != ~0ull) {
+    report.step = static_cast<int>(record.state >> 32);
+    report.batch = static_cast<int>(record.state & 0xffffffffull);
+  }
+  if (record.gradient != ~0ull) {
+    report.gradient_step = 0x7fffffff - static_cast<int>(record.gradient >> 32);
+    report.gradient_batch = static_cast<int>(record.gradient & 0xffffffffull);
+  }
+  return report;
+}
+
+Record* Monitor::record() const {
+  return record_;
+}
+
+Scope::Scope(Monitor* monitor) : previous_(g_active) {
+  g_active = monitor ? monitor->record() : nullptr;
+}
+
+Scope::~Scope() {
+  g_active = previous_;
+}
+
+Record* Active() {
+  return g_active;
+}
+
+}  // namespace health
+}  // namespace v0
+}  // namespace haste
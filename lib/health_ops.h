@@ -0,0 +1,59 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cuda_fp16.h>
+
+#include "haste/health.h"
+
+namespace haste {
+namespace v0 {
+namespace health {
+namespace internal {
+
+using health::Record;
+using health::Kind;
+using health::kState;
+using health::kCell;
+using health::kGradient;
+
+__device__ __forceinline__ bool IsFinite(const float x) { return isfinite(x); }
+__device__ __forceinline__ bool IsFinite(const double x) { return isfinite(x); }
+__device__ __forceinline__ bool IsFinite(const half x) { return isfinite(static_cast<float>(x)); }
+
+// Flags `record` if `x` isn't finite. `record` is the same for the whole launch, so when
+// checking is disabled the branch costs nothing but the test. `kind` is a constant at
+// every call site.
+template<typename T>
+__device__ __forceinline__
+void Check(Record* record, const Kind kind, const int step, const int batch, const T x) {
+  if (record && !IsFinite(x)) {
+    atomicOr(&record->kinds, kind);
+    // Backward passes visit time steps in reverse, so their key counts steps down.
+    if (kind == kGradient) {
+      const unsigned long long key = static_cast<unsigned long long>(0x7fffffff - step) << 32;
+      atomicMin(&record->gradient, key | static_cast<unsigned int>(batch));
+    } else {
+      const unsigned long long key = static_cast<unsigned long long>(step) << 32;
+      atomicMin(&record->state, key | static_cast<unsigned int>(batch));
+    }
+  }
+}
+
+}  // namespace internal
+}  // namespace health
+}  // namespace v0
+}  // namespace haste
@@ -17,11 +17,20 @@
 #include <cuda_runtime_api.h>
 
 #include "blas.h"
+#include "dropout_ops.h"
+#include "gradient_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::gradient::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool ApplyZoneout>
 __global__
 void IndrnnBwdOps(
@@ -36,7 +45,11 @@ void IndrnnBwdOps(
     T* db_out,
     T* dh_inout,
     T* dk_out,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const unsigned long long seed,
+    const float output_prob,
+    const float max_state_grad,
+    Record* health) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -51,8 +64,16 @@ void IndrnnBwdOps(
   T du_sum = static_cast<T>(0.0);
   T db_sum = static_cast<T>(0.0);
 
+  // With output dropout, `dh_new` is the gradient with respect to the dropped output. The
+  // mask is shared by every time step of a sequence so it's only computed once.
+  const T dh_scale = output_prob > 0.0f
+      ? Scale<T>(seed, kOutputMask, idx, output_prob)
+      : static_cast<T>(1.0);
+
   for (int i = (steps - 1) * NH; i >= 0; i -= NH) {
-    T dh_total = dh_new[idx + i] + dh_inout_idx;
+    T dh_total = dh_new[idx + i] * dh_scale + dh_inout_idx;
+    Check(health, kGradient, i / NH, col, dh_total);
+    dh_total = ClampState(dh_total, max_state_grad);
     T dh = static_cast<T>(0.0);
     if (ApplyZoneout) {
       const T mask = zoneout_mask[idx + i];
@@ -86,6 +107,7 @@ struct BackwardPass<T>::private_data {
   int hidden_size;
   cublasHandle_t blas_handle;
   cudaStream_t stream;
+  cudaEvent_t event;
   cudaStream_t sync_stream;
 };
 
@@ -102,19 +124,18 @@ BackwardPass<T>::BackwardPass(
   data_->blas_handle = blas_handle;
   data_->sync_stream = stream;
   cudaStreamCreate(&data_->stream);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
 }
 
 template<typename T>
 BackwardPass<T>::~BackwardPass() {
   if (data_->sync_stream) {
-    cudaEvent_t event;
-    cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
-    cudaEventRecord(event, data_->stream);
-    cudaStreamWaitEvent(data_->sync_stream, event, 0);
-    cudaEventDestroy(event);
+    cudaEventRecord(data_->event, data_->stream);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
   } else {
     cudaStreamSynchronize(data_->stream);
   }
+  cudaEventDestroy(data_->event);
   cudaStreamDestroy(data_->stream);
   delete data_;
 }
@@ -134,7 +155,10 @@ void BackwardPass<T>::Run(
     T* db,
     T* dh,
     T* workspace,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const dropout::Variational* dropout,
+    const gradient::Options* gradient) {
+  HASTE_PROBE_RUN(kIndrnn, data_->batch_size, data_->input_size, data_->hidden_size, steps);
   const T alpha = static_cast<T>(1.0);
   const T beta = static_cast<T>(0.0);
 
@@ -151,6 +175,15 @@ void BackwardPass<T>::Run(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
   const int NH = batch_size * hidden_size;
+  const float max_state_grad = gradient ? gradient->max_state_grad : 0.0f;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  health::Record* health_record = health::Active();
+
+  ClearParameter(stream, gradient, hidden_size, du);
+  ClearParameter(stream, gradient, hidden_size, db);
+
+  HASTE_STATS_BEGIN(pointwise_timer, kIndrnn, kPointwise, stream);
   if (zoneout_mask) {
     IndrnnBwdOps<T, true><<<gridDim, blockDim, 0, stream>>>(
         steps,
@@ -164,7 +197,11 @@ void BackwardPass<T>::Run(
         db,
         dh,
         workspace,
-        zoneout_mask);
+        zoneout_mask,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record);
   } else {
     IndrnnBwdOps<T, false><<<gridDim, blockDim, 0, stream>>>(
         steps,
@@ -178,22 +215,49 @@ void BackwardPass<T>::Run(
         db,
         dh,
         workspace,
-        nullptr);
+        nullptr,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record);
   }
+  HASTE_STATS_END(pointwise_timer);
 
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream, data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size, input_size, batch_size * steps,
-      &alpha,
-      workspace, hidden_size,
-      x_t, batch_size * steps,
-      &beta,
-      dW, hidden_size);
+  HASTE_PROBE_GEMM(kIndrnn, kReduction, hidden_size, input_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dW_timer, kIndrnn, kReduction, stream);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // `x_t` is the transpose of `x` before dropout; the mask is applied as it's loaded.
+    InputMaskedGemm(stream, false,
+        hidden_size, input_size, batch_size * steps,
+        workspace, hidden_size,
+        x_t, batch_size * steps,
+        beta,
+        dW, hidden_size,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size, input_size, batch_size * steps,
+        &alpha,
+        workspace, hidden_size,
+        x_t, batch_size * steps,
+        &beta,
+        dW, hidden_size);
+  }
+  HASTE_STATS_END(dW_timer);
 
+  HASTE_PROBE_GEMM(kIndrnn, kInputGemm, input_size, steps * batch_size, hidden_size);
+  HASTE_STATS_BEGIN(dx_timer, kIndrnn, kInputGemm, stream);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, steps * batch_size, hidden_size,
@@ -202,6 +266,20 @@ void BackwardPass<T>::Run(
       workspace, hidden_size,
       &beta,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
+
+  // dx is with respect to the input before dropout. `du` and `db` are final now that the
+  // pointwise operations are, so their norms are taken in the same pass.
+  HASTE_STATS_BEGIN(finish_timer, kIndrnn, kPointwise, stream);
+  FinishInputGradient(
+      stream, dropout, gradient, steps, batch_size, input_size, dx, hidden_size, du, db);
+  HASTE_STATS_END(finish_timer);
+
+  if (gradient && gradient->accumulator) {
+    HASTE_STATS_BEGIN(norm_timer, kIndrnn, kReduction, stream);
+    AccumulateSquares(stream, gradient, kParameters, input_size * hidden_size, dW);
+    HASTE_STATS_END(norm_timer);
+  }
 
   cublasSetStream(blas_handle, save_stream);
 }
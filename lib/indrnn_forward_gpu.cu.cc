@@ -17,11 +17,18 @@
 #include <cuda_runtime_api.h>
 
 #include "blas.h"
+#include "dropout_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool Training, bool ApplyZoneout>
 __global__
 void IndrnnFwdOps(
@@ -34,7 +41,11 @@ void IndrnnFwdOps(
     const T* h,
     T* h_out,
     const float zoneout_prob,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    T* y_out,
+    const unsigned long long seed,
+    const float output_prob,
+    Record* health) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -46,6 +57,10 @@ void IndrnnFwdOps(
   const T u_row = u[row];
   const T b_row = b[row];
 
+  // The output mask is shared by every time step of a sequence so it's only computed once.
+  // The branch is uniform across the whole launch.
+  const T y_scale = y_out ? Scale<T>(seed, kOutputMask, idx, output_prob) : static_cast<T>(0.0);
+
   for (int i = 0; i < steps * NH; i += NH) {
     const T a = Wx[idx + i] + u_row * h[idx + i] + b_row;
     T cur_h_value = tanh(a);
@@ -59,6 +74,11 @@ void IndrnnFwdOps(
     }
 
     h_out[idx + i] = cur_h_value;
+    Check(health, kState, i / NH, col, cur_h_value);
+
+    // Output dropout only changes what the next layer sees, not the recurrence.
+    if (y_out)
+      y_out[idx + i] = cur_h_value * y_scale;
   }
 }
 
@@ -76,6 +96,7 @@ struct ForwardPass<T>::private_data {
   int hidden_size;
   cublasHandle_t blas_handle;
   cudaStream_t stream;
+  cudaEvent_t event;
   cudaStream_t sync_stream;
 };
 
@@ -94,19 +115,18 @@ ForwardPass<T>::ForwardPass(
   data_->blas_handle = blas_handle;
   data_->sync_stream = stream;
   cudaStreamCreate(&data_->stream);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
 }
 
 template<typename T>
 ForwardPass<T>::~ForwardPass() {
   if (data_->sync_stream) {
-    cudaEvent_t event;
-    cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
-    cudaEventRecord(event, data_->stream);
-    cudaStreamWaitEvent(data_->sync_stream, event, 0);
-    cudaEventDestroy(event);
+    cudaEventRecord(data_->event, data_->stream);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
   } else {
     cudaStreamSynchronize(data_->stream);
   }
+  cudaEventDestroy(data_->event);
   cudaStreamDestroy(data_->stream);
   delete data_;
 }
@@ -121,7 +141,10 @@ void ForwardPass<T>::Run(
     T* h,
     T* workspace,
     const float zoneout_prob,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const dropout::Variational* dropout,
+    T* y) {
+  HASTE_PROBE_RUN(kIndrnn, data_->batch_size, data_->input_size, data_->hidden_size, steps);
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -137,21 +160,47 @@ void ForwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream, data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size, steps * batch_size, input_size,
-      &alpha,
-      W, hidden_size,
-      x, input_size,
-      &beta,
-      workspace, hidden_size);
+  HASTE_PROBE_GEMM(kIndrnn, kInputGemm, hidden_size, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(Wx_timer, kIndrnn, kInputGemm, stream);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // The input mask varies along both N and C, so it can't be folded into `W`. It's
+    // applied to `x` as the GEMM loads it instead.
+    InputMaskedGemm(stream, true,
+        hidden_size, steps * batch_size, input_size,
+        W, hidden_size,
+        x, input_size,
+        beta,
+        workspace, hidden_size,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size, steps * batch_size, input_size,
+        &alpha,
+        W, hidden_size,
+        x, input_size,
+        &beta,
+        workspace, hidden_size);
+  }
+  HASTE_STATS_END(Wx_timer);
 
   const dim3 blockDim(64, 16);
   const dim3 gridDim(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
   const int NH = batch_size * hidden_size;
+  health::Record* health_record = health::Active();
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  T* y_out = dropout && dropout->output_prob > 0.0f ? y : nullptr;
+  HASTE_STATS_BEGIN(pointwise_timer, kIndrnn, kPointwise, stream);
   if (training) {
     if (zoneout_prob && zoneout_mask) {
       IndrnnFwdOps<T, true, true><<<gridDim, blockDim, 0, stream>>>(
@@ -164,7 +213,11 @@ void ForwardPass<T>::Run(
           h,
           h + NH,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          y_out,
+          seed,
+          output_prob,
+          health_record);
     } else {
       IndrnnFwdOps<T, true, false><<<gridDim, blockDim, 0, stream>>>(
           steps,
@@ -176,7 +229,11 @@ void ForwardPass<T>::Run(
           h,
           h + NH,
           0.0f,
-          nullptr);
+          nullptr,
+          y_out,
+          seed,
+          output_prob,
+          health_record);
     }
   } else {
     if (zoneout_prob && zoneout_mask) {
@@ -190,7 +247,11 @@ void ForwardPass<T>::Run(
           h,
           h + NH,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          y_out,
+          seed,
+          output_prob,
+          health_record);
     } else {
       IndrnnFwdOps<T, false, false><<<gridDim, blockDim, 0, stream>>>(
           steps,
@@ -202,9 +263,14 @@ void ForwardPass<T>::Run(
           h,
           h + NH,
           0.0f,
-          nullptr);
+          nullptr,
+          y_out,
+          seed,
+          output_prob,
+          health_record);
     }
   }
+  HASTE_STATS_END(pointwise_timer);
 
   cublasSetStream(blas_handle, save_stream);
 }
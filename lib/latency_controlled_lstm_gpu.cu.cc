@@ -0,0 +1,337 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cassert>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+#include "blas.h"
+#include "haste.h"
+#include "phase_timer.h"
+#include "probes.h"
+
+namespace {
+
+// Writes the outputs of `steps` chunk frames as [steps,N,H*2]. The forward direction ran
+// over the chunk in order; the backward direction ran over `window` frames back to front,
+// so frame `t` is its `window-1-t`'th iteration.
+template<typename T>
+__global__
+void Interleave(
+    const int steps,
+    const int window,
+    const int batch_size,
+    const int hidden_size,
+    const T* h_fw,  // [steps+1,N,H]
+    const T* h_bw,  // [window+1,N,H]
+    T* y) {         // [steps,N,H*2]
+  const int NH = batch_size * hidden_size;
+  const int size = steps * NH;
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    const int t = i / NH;
+    const int r = i - t * NH;
+    const int n = r / hidden_size;
+    const int j = r - n * hidden_size;
+    T* out = y + (t * batch_size + n) * hidden_size * 2;
+    out[j] = h_fw[NH + i];
+    out[hidden_size + j] = h_bw[(window - t) * NH + r];
+  }
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace latency_controlled_lstm {
+
+template<typename T>
+struct ForwardPass<T>::private_data {
+  int batch_size;
+  int input_size;
+  int hidden_size;
+  int chunk_size;
+  int right_context;
+  int max_steps;
+  int capacity;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream;
+  cudaStream_t stream_bw;  // runs the backward direction alongside `stream`
+  cudaEvent_t event;
+  lstm::ForwardPass<T>* forward;
+  lstm::ForwardPass<T>* backward;
+  T* buffer;
+  T* proj_fw;    // [capacity,N,H*4] input projections of buffered steps, in time order
+  T* proj_bw;    // [capacity,N,H*4]
+  T* h_fw;       // [chunk+right+1,N,H], h_fw[0] carries over between chunks
+  T* c_fw;
+  T* h_bw;       // [chunk+right+1,N,H], restarted from zeros for every chunk
+  T* c_bw;
+  T* tmp_Rh_fw;  // [N,H*4]
+  T* tmp_Rh_bw;  // [N,H*4]
+  int start;     // index of the oldest buffered step in `proj_fw` / `proj_bw`
+  int pending;   // number of buffered steps that haven't been emitted yet
+};
+
+template<typename T>
+ForwardPass<T>::ForwardPass(
+    const int batch_size,
+    const int input_size,
+    const int hidden_size,
+    const int chunk_size,
+    const int right_context,
+    const int max_steps,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  assert(chunk_size > 0 && right_context >= 0 && max_steps > 0);
+  data_->batch_size = batch_size;
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->chunk_size = chunk_size;
+  data_->right_context = right_context;
+  data_->max_steps = max_steps;
+  data_->blas_handle = blas_handle;
+  data_->stream = stream;
+
+  // At most `chunk_size + right_context - 1` steps stay buffered between calls. Twice that
+  // plus `max_steps` of room means the buffered steps only need to be moved back to the
+  // front once every few calls, and never onto themselves.
+  const int window = chunk_size + right_context;
+  const size_t NH = static_cast<size_t>(batch_size) * hidden_size;
+  data_->capacity = 2 * window + max_steps;
+  const size_t proj_size = data_->capacity * NH * 4;
+  const size_t state_size = (window + 1) * NH;
+  const size_t size = 2 * proj_size + 4 * state_size + 2 * NH * 4;
+  cudaMalloc(&data_->buffer, size * sizeof(T));
+  HASTE_STATS_ALLOCATION(size * sizeof(T));
+
+  data_->proj_fw = data_->buffer;
+  data_->proj_bw = data_->proj_fw + proj_size;
+  data_->h_fw = data_->proj_bw + proj_size;
+  data_->c_fw = data_->h_fw + state_size;
+  data_->h_bw = data_->c_fw + state_size;
+  data_->c_bw = data_->h_bw + state_size;
+  data_->tmp_Rh_fw = data_->c_bw + state_size;
+  data_->tmp_Rh_bw = data_->tmp_Rh_fw + NH * 4;
+
+  cudaStreamCreate(&data_->stream_bw);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
+  data_->forward = new lstm::ForwardPass<T>(
+      false, batch_size, input_size, hidden_size, blas_handle, data_->stream);
+  data_->backward = new lstm::ForwardPass<T>(
+      false, batch_size, input_size, hidden_size, blas_handle, data_->stream_bw);
+
+  Reset();
+}
+
+template<typename T>
+ForwardPass<T>::~ForwardPass() {
+  delete data_->backward;
+  delete data_->forward;
+  cudaStreamSynchronize(data_->stream_bw);
+  cudaStreamSynchronize(data_->stream);
+  cudaEventDestroy(data_->event);
+  cudaStreamDestroy(data_->stream_bw);
+  cudaFree(data_->buffer);
+  delete data_;
+}
+
+template<typename T>
+void ForwardPass<T>::Reset() {
+  const size_t NH = static_cast<size_t>(data_->batch_size) * data_->hidden_size;
+  data_->start = 0;
+  data_->pending = 0;
+  cudaMemsetAsync(data_->h_fw, 0, NH * sizeof(T), data_->stream);
+  cudaMemsetAsync(data_->c_fw, 0, NH * sizeof(T), data_->stream);
+}
+
+template<typename T>
+int ForwardPass<T>::Run(
+    const int steps,
+    const T* W_fw,  // [C,H*4]
+    const T* R_fw,  // [H,H*4]
+    const T* b_fw,  // [H*4]
+    const T* W_bw,  // [C,H*4]
+    const T* R_bw,  // [H,H*4]
+    const T* b_bw,  // [H*4]
+    const T* x,     // [steps,N,C]
+    T* y,           // [steps+chunk_size-1,N,H*2]
+    const float zoneout_prob) {
+  static const T alpha = static_cast<T>(1.0);
+  static const T beta = static_cast<T>(0.0);
+
+  assert(steps >= 0 && steps <= data_->max_steps);
+
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const int chunk_size = data_->chunk_size;
+  const int window = chunk_size + data_->right_context;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+  const cudaStream_t stream = data_->stream;
+  const size_t NH = static_cast<size_t>(batch_size) * hidden_size;
+
+  if (data_->start + data_->pending + steps > data_->capacity) {
+    const size_t bytes = data_->pending * NH * 4 * sizeof(T);
+    const size_t offset = data_->start * NH * 4;
+    cudaMemcpyAsync(data_->proj_fw, data_->proj_fw + offset, bytes, cudaMemcpyDeviceToDevice, stream);
+    cudaMemcpyAsync(data_->proj_bw, data_->proj_bw + offset, bytes, cudaMemcpyDeviceToDevice, stream);
+    data_->start = 0;
+  }
+
+  if (steps) {
+    const blas<void>::set_pointer_mode scoped1(blas_handle);
+    cudaStream_t save_stream;
+    cublasGetStream(blas_handle, &save_stream);
+    cublasSetStream(blas_handle, stream);
+
+    const size_t offset = (data_->start + data_->pending) * NH * 4;
+    HASTE_PROBE_GEMM(kLstm, kInputGemm, hidden_size * 4, steps * batch_size, input_size);
+    HASTE_STATS_BEGIN(proj_fw_timer, kLstm, kInputGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, steps * batch_size, input_size,
+        &alpha,
+        W_fw, hidden_size * 4,
+        x, input_size,
+        &beta,
+        data_->proj_fw + offset, hidden_size * 4);
+    HASTE_STATS_END(proj_fw_timer);
+
+    HASTE_PROBE_GEMM(kLstm, kInputGemm, hidden_size * 4, steps * batch_size, input_size);
+    HASTE_STATS_BEGIN(proj_bw_timer, kLstm, kInputGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, steps * batch_size, input_size,
+        &alpha,
+        W_bw, hidden_size * 4,
+        x, input_size,
+        &beta,
+        data_->proj_bw + offset, hidden_size * 4);
+    HASTE_STATS_END(proj_bw_timer);
+
+    cublasSetStream(blas_handle, save_stream);
+    data_->pending += steps;
+  }
+
+  int emitted = 0;
+  while (data_->pending >= window) {
+    Process(chunk_size, window, R_fw, b_fw, R_bw, b_bw, y + emitted * NH * 2, zoneout_prob);
+    emitted += chunk_size;
+  }
+  return emitted;
+}
+
+template<typename T>
+int ForwardPass<T>::Flush(
+    const T* R_fw,
+    const T* b_fw,
+    const T* R_bw,
+    const T* b_bw,
+    T* y,
+    const float zoneout_prob) {
+  const int steps = data_->pending;
+  if (steps)
+    Process(steps, steps, R_fw, b_fw, R_bw, b_bw, y, zoneout_prob);
+  Reset();
+  return steps;
+}
+
+// Emits the oldest `steps` buffered steps, running the backward direction over the
+// oldest `window` buffered steps.
+template<typename T>
+void ForwardPass<T>::Process(
+    const int steps,
+    const int window,
+    const T* R_fw,
+    const T* b_fw,
+    const T* R_bw,
+    const T* b_bw,
+    T* y,
+    const float zoneout_prob) {
+  const int batch_size = data_->batch_size;
+  const int hidden_size = data_->hidden_size;
+  const cudaStream_t stream = data_->stream;
+  const size_t NH = static_cast<size_t>(batch_size) * hidden_size;
+  const size_t offset = data_->start * NH * 4;
+
+  cudaMemsetAsync(data_->h_bw, 0, NH * sizeof(T), stream);
+  cudaMemsetAsync(data_->c_bw, 0, NH * sizeof(T), stream);
+
+  // The two directions are independent. The backward one runs behind `stream_bw` so it
+  // doesn't queue up behind the forward one, and `stream` waits for it afterwards.
+  cudaEventRecord(data_->event, stream);
+  cudaStreamWaitEvent(data_->stream_bw, data_->event, 0);
+
+  data_->forward->RunProjected(
+      steps,
+      R_fw,
+      b_fw,
+      data_->h_fw,
+      data_->c_fw,
+      data_->proj_fw + offset,
+      data_->tmp_Rh_fw,
+      zoneout_prob,
+      nullptr);
+  data_->backward->RunProjected(
+      window,
+      R_bw,
+      b_bw,
+      data_->h_bw,
+      data_->c_bw,
+      data_->proj_bw + offset,
+      data_->tmp_Rh_bw,
+      zoneout_prob,
+      nullptr,
+      true);
+
+  cudaEventRecord(data_->event, data_->stream_bw);
+  cudaStreamWaitEvent(stream, data_->event, 0);
+
+  const int threads = 256;
+  const int blocks = (steps * NH + threads - 1) / threads;
+  Interleave<T><<<blocks, threads, 0, stream>>>(
+      steps, window, batch_size, hidden_size, data_->h_fw, data_->h_bw, y);
+
+  // The forward direction's last state is the initial state of the next chunk.
+  cudaMemcpyAsync(data_->h_fw, data_->h_fw + steps * NH, NH * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+  cudaMemcpyAsync(data_->c_fw, data_->c_fw + steps * NH, NH * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+
+  data_->start += steps;
+  data_->pending -= steps;
+}
+
+template<typename T>
+ChunkCost ForwardPass<T>::Cost() const {
+  const double N = data_->batch_size;
+  const double C = data_->input_size;
+  const double H = data_->hidden_size;
+  const int chunk_size = data_->chunk_size;
+  const int right_context = data_->right_context;
+
+  ChunkCost cost;
+  cost.latency_steps = chunk_size + right_context;
+  cost.projection_flops = 2 * 2.0 * N * C * H * 4 * chunk_size;
+  cost.forward_flops = 2.0 * N * H * H * 4 * chunk_size;
+  cost.backward_flops = 2.0 * N * H * H * 4 * (chunk_size + right_context);
+  cost.recompute_flops = 2.0 * N * H * H * 4 * right_context;
+  return cost;
+}
+
+template class ForwardPass<float>;
+template class ForwardPass<double>;
+
+}  // namespace latency_controlled_lstm
+}  // namespace v0
+}  // namespace haste
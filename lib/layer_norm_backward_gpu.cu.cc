@@ -17,6 +17,7 @@
 
 #include "haste.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
 
 namespace {
 
@@ -137,6 +138,7 @@ void BackwardPass<T>::RunPartial(
   gridDim.x = (minibatch + blockDim.x - 1) / blockDim.x;
   const int shared_mem_size = sizeof(T) * blockDim.x * blockDim.y * 3;
 
+  HASTE_STATS_BEGIN_SHARED(layer_norm_timer, kLayerNorm, stream);
   if (beta_ && dbeta_) {
     LayerNormGrad<T, true><<<gridDim, blockDim, shared_mem_size, stream>>>(
         minibatch,
@@ -160,6 +162,7 @@ void BackwardPass<T>::RunPartial(
         dx,
         cache_ + (partial_ - minibatch) * 2);
   }
+  HASTE_STATS_END(layer_norm_timer);
 
   partial_ -= minibatch;
 }
@@ -16,6 +16,7 @@
 #include <cassert>
 
 #include "haste.h"
+#include "phase_timer.h"
 
 namespace {
 
@@ -126,6 +127,7 @@ void ForwardPass<T>::RunPartial(
   gridDim.x = (minibatch + blockDim.x - 1) / blockDim.x;
   const int shared_mem_size = sizeof(T) * blockDim.x * blockDim.y;
 
+  HASTE_STATS_BEGIN_SHARED(layer_norm_timer, kLayerNorm, stream);
   if (beta_) {
     LayerNorm<T, true><<<gridDim, blockDim, shared_mem_size, stream>>>(
         minibatch,
@@ -145,6 +147,7 @@ void ForwardPass<T>::RunPartial(
         y,
         cache_ + partial_ * 2);
   }
+  HASTE_STATS_END(layer_norm_timer);
 
   partial_ += minibatch;
 }
@@ -17,11 +17,18 @@
 #include <cuda_runtime_api.h>
 
 #include "blas.h"
+#include "dropout_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool Training, bool ApplyZoneout>
 __global__
 void PointwiseOperations(const int batch_dim,
@@ -34,7 +41,13 @@ void PointwiseOperations(const int batch_dim,
                          T* h_out,
                          T* v,
                          const float zoneout_prob,
-                         const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* Us,              // Per-sequence conditioning (may be null)
+                         T* y_out,                 // Output with dropout applied (may be null)
+                         const unsigned long long seed,
+                         const float output_prob,
+                         Record* health,           // Non-finite value record (may be null)
+                         const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -56,9 +69,20 @@ void PointwiseOperations(const int batch_dim,
   const int br_idx = row + 1 * hidden_dim;
   const int bg_idx = row + 2 * hidden_dim;
 
-  const T z = sigmoid(Wx[z_idx] + Rh[z_idx] + bx[bz_idx] + br[bz_idx]);
-  const T r = sigmoid(Wx[r_idx] + Rh[r_idx] + bx[br_idx] + br[br_idx]);
-  const T g = tanh   (Wx[g_idx] + r * (Rh[g_idx] + br[bg_idx]) + bx[bg_idx]);
+  // The conditioning term enters on the input side after normalization, like a
+  // per-sequence bias. The branch is uniform across the whole launch.
+  T Wx_z = Wx[z_idx];
+  T Wx_r = Wx[r_idx];
+  T Wx_g = Wx[g_idx];
+  if (Us) {
+    Wx_z += Us[z_idx];
+    Wx_r += Us[r_idx];
+    Wx_g += Us[g_idx];
+  }
+
+  const T z = sigmoid(Wx_z + Rh[z_idx] + bx[bz_idx] + br[bz_idx]);
+  const T r = sigmoid(Wx_r + Rh[r_idx] + bx[br_idx] + br[br_idx]);
+  const T g = tanh   (Wx_g + r * (Rh[g_idx] + br[bg_idx]) + bx[bg_idx]);
 
   // Store internal activations if we're eventually going to backprop.
   if (Training) {
@@ -80,6 +104,12 @@ void PointwiseOperations(const int batch_dim,
   }
 
   h_out[output_idx] = cur_h_value;
+  Check(health, kState, step, col, cur_h_value);
+
+  // Output dropout only changes what the next layer sees, not the recurrence. The branch
+  // is uniform across the whole launch.
+  if (y_out)
+    y_out[output_idx] = cur_h_value * Scale<T>(seed, kOutputMask, output_idx, output_prob);
 }
 
 }  // anonymous namespace
@@ -149,7 +179,11 @@ void ForwardPass<T>::IterateInternal(
     layer_norm::ForwardPass<T>& layer_norm2,
     T* tmp_Rh_norm,
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const T* Us, // Conditioning term (s·U) [N,H*3] or null
+    const dropout::Variational* dropout, // Dropout or null
+    T* y_out, // Output with dropout applied [N,H] or null
+    const int step) {
   // Constants for GEMM
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
@@ -160,8 +194,13 @@ void ForwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  health::Record* health_record = health::Active();
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
 
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kLayerNormGru, kRecurrentGemm, hidden_size * 3, batch_size, hidden_size);
+  HASTE_STATS_BEGIN(act_Rh_timer, kLayerNormGru, kRecurrentGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 3, batch_size, hidden_size,
@@ -170,6 +209,7 @@ void ForwardPass<T>::IterateInternal(
       h, hidden_size,
       &beta,
       act_Rh, hidden_size * 3);
+  HASTE_STATS_END(act_Rh_timer);
   layer_norm2.RunPartial(stream1, batch_size, act_Rh, tmp_Rh_norm);
 
   // Compute launch configuration for pointwise operations kernel.
@@ -180,6 +220,7 @@ void ForwardPass<T>::IterateInternal(
 
   cudaStreamWaitEvent(stream1, event, 0);
 
+  HASTE_STATS_BEGIN(pointwise_timer, kLayerNormGru, kPointwise, stream1);
   if (training) {
     if (zoneout_prob && zoneout_mask) {
       PointwiseOperations<T, true, true><<<gridDim, blockDim, 0, stream1>>>(
@@ -193,7 +234,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           v,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          Us,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, true, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -206,7 +253,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           v,
           0.0f,
-          nullptr);
+          nullptr,
+          Us,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   } else {
     if (zoneout_prob && zoneout_mask) {
@@ -221,7 +274,13 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           nullptr,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          Us,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, false, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -234,9 +293,16 @@ void ForwardPass<T>::IterateInternal(
           h_out,
           nullptr,
           0.0f,
-          nullptr);
+          nullptr,
+          Us,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   }
+  HASTE_STATS_END(pointwise_timer);
 }
 
 template<typename T>
@@ -256,7 +322,15 @@ void ForwardPass<T>::Run(
     layer_norm::ForwardPass<T>& layer_norm2,
     T* tmp_Rh_norm,
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const int conditioning_size,
+    const T* U,  // [S,H*3]
+    const T* s,  // [N,S]
+    T* tmp_Us,   // [N,H*3]
+    const dropout::Variational* dropout, // Dropout or null
+    T* y) {      // Output with dropout applied [T,N,H]
+  HASTE_STATS_LAYER(kLayerNormGru);
+  HASTE_PROBE_RUN(kLayerNormGru, data_->batch_size, data_->input_size, data_->hidden_size, steps);
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -272,20 +346,61 @@ void ForwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream2);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 3, steps * batch_size, input_size,
-      &alpha,
-      W, hidden_size * 3,
-      x, input_size,
-      &beta,
-      act_Wx, hidden_size * 3);
+  HASTE_PROBE_GEMM(kLayerNormGru, kInputGemm, hidden_size * 3, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(act_Wx_timer, kLayerNormGru, kInputGemm, stream2);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // The input mask varies along both N and C, so it can't be folded into `W`. It's
+    // applied to `x` as the GEMM loads it instead.
+    InputMaskedGemm(stream2, true,
+        hidden_size * 3, steps * batch_size, input_size,
+        W, hidden_size * 3,
+        x, input_size,
+        beta,
+        act_Wx, hidden_size * 3,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, steps * batch_size, input_size,
+        &alpha,
+        W, hidden_size * 3,
+        x, input_size,
+        &beta,
+        act_Wx, hidden_size * 3);
+  }
+  HASTE_STATS_END(act_Wx_timer);
   layer_norm1.Run(stream2, act_Wx, tmp_Wx_norm);
+
+  // The conditioning term is the same at every time step so it's computed once here
+  // instead of being folded into the input GEMM.
+  const T* Us = nullptr;
+  if (conditioning_size) {
+    HASTE_PROBE_GEMM(kLayerNormGru, kInputGemm, hidden_size * 3, batch_size, conditioning_size);
+    HASTE_STATS_BEGIN(tmp_Us_timer, kLayerNormGru, kInputGemm, stream2);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, batch_size, conditioning_size,
+        &alpha,
+        U, hidden_size * 3,
+        s, conditioning_size,
+        &beta,
+        tmp_Us, hidden_size * 3);
+    HASTE_STATS_END(tmp_Us_timer);
+    Us = tmp_Us;
+  }
   cudaEventRecord(event, stream2);
 
   const int NH = batch_size * hidden_size;
   for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kLayerNormGru, batch_size, input_size, hidden_size, i);
     IterateInternal(
         R,
         bx,
@@ -298,7 +413,11 @@ void ForwardPass<T>::Run(
         layer_norm2,
         tmp_Rh_norm,
         zoneout_prob,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        Us,
+        dropout,
+        dropout && dropout->output_prob > 0.0f ? y + i * NH : nullptr,
+        i);
   }
 
   cublasSetStream(blas_handle, save_stream);
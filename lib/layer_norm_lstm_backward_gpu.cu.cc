@@ -19,11 +19,20 @@
 #include <vector>
 
 #include "blas.h"
+#include "dropout_ops.h"
+#include "gradient_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::gradient::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool ApplyZoneout>
 __global__
 void ComputeOutputGrad(
@@ -34,7 +43,12 @@ void ComputeOutputGrad(
     T* dh_inout,
     T* dlayer_norm,
     T* v,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const unsigned long long seed,
+    const float output_prob,
+    const float max_state_grad,
+    Record* health,
+    const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -45,7 +59,14 @@ void ComputeOutputGrad(
   const int stride4_base_idx = col * (hidden_size * 4) + row;
   const int o_idx = stride4_base_idx + 3 * hidden_size;
 
-  T dh_total = dh_new[base_idx] + dh_inout[base_idx];
+  T dh_out = dh_new[base_idx];
+  // With output dropout, `dh_new` is the gradient with respect to the dropped output. The
+  // branch is uniform across the whole launch.
+  if (output_prob > 0.0f)
+    dh_out *= Scale<T>(seed, kOutputMask, base_idx, output_prob);
+  T dh_total = dh_out + dh_inout[base_idx];
+  Check(health, kGradient, step, col, dh_total);
+  dh_total = ClampState(dh_total, max_state_grad);
   if (ApplyZoneout) {
     const T mask = zoneout_mask[base_idx];
     dh_inout[base_idx] = (static_cast<T>(1.0) - mask) * dh_total;
@@ -74,7 +95,11 @@ void PointwiseOperations(const int batch_dim,
                          const T* dlayer_norm,
                          T* db_out,
                          T* dc_inout,
-                         T* dv_out) {
+                         T* dv_out,
+                         T* dUs_inout,    // Conditioning gradient accumulator (may be null)
+                         const float max_state_grad,
+                         Record* health,  // Non-finite value record (may be null)
+                         const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -93,7 +118,9 @@ void PointwiseOperations(const int batch_dim,
   const T f = v[f_idx];
   const T o = v[o_idx];
 
-  const T dc_total = dc_new[base_idx] + dc_inout[base_idx] + dlayer_norm[base_idx];
+  T dc_total = dc_new[base_idx] + dc_inout[base_idx] + dlayer_norm[base_idx];
+  Check(health, kGradient, step, col, dc_total);
+  dc_total = ClampState(dc_total, max_state_grad);
   const T df = c[base_idx] * dc_total;
   const T dc = f * dc_total;
   const T di = g * dc_total;
@@ -115,6 +142,15 @@ void PointwiseOperations(const int batch_dim,
   dv_out[g_idx] = dv_g;
   dv_out[f_idx] = dv_f;
   dv_out[o_idx] = dv_o;
+
+  // Each element is owned by a single thread and time steps run in sequence on one
+  // stream, so the accumulation needs no atomics.
+  if (dUs_inout) {
+    dUs_inout[i_idx] += dv_i;
+    dUs_inout[g_idx] += dv_g;
+    dUs_inout[f_idx] += dv_f;
+    dUs_inout[o_idx] += dv_o;
+  }
 }
 
 }  // anonymous namespace
@@ -188,7 +224,11 @@ void BackwardPass<T>::IterateInternal(
     layer_norm::BackwardPass<T>& layer_norm2,
     layer_norm::BackwardPass<T>& layer_norm3,
     T* act_c_norm,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    T* dUs,           // [N,H*4]
+    const dropout::Variational* dropout,
+    const gradient::Options* gradient,
+    const int step) {
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
 
@@ -197,6 +237,10 @@ void BackwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  const float max_state_grad = gradient ? gradient->max_state_grad : 0.0f;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  health::Record* health_record = health::Active();
 
   // Compute launch configuration for pointwise operations kernel.
   const dim3 blockDim(64, 16);
@@ -204,6 +248,7 @@ void BackwardPass<T>::IterateInternal(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
 
+  HASTE_STATS_BEGIN(output_grad_timer, kLayerNormLstm, kPointwise, stream1);
   if (zoneout_mask) {
     ComputeOutputGrad<T, true><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -213,7 +258,12 @@ void BackwardPass<T>::IterateInternal(
         dh,
         act_c_norm,
         v,
-        zoneout_mask);
+        zoneout_mask,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step);
   } else {
     ComputeOutputGrad<T, false><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -223,9 +273,16 @@ void BackwardPass<T>::IterateInternal(
         dh,
         act_c_norm,
         v,
-        nullptr);
+        nullptr,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step);
   }
+  HASTE_STATS_END(output_grad_timer);
   layer_norm3.RunPartial(stream1, batch_size, act_c_norm, act_c_norm);
+  HASTE_STATS_BEGIN(pointwise_timer, kLayerNormLstm, kPointwise, stream1);
   PointwiseOperations<T><<<gridDim, blockDim, 0, stream1>>>(
       batch_size,
       hidden_size,
@@ -235,13 +292,20 @@ void BackwardPass<T>::IterateInternal(
       act_c_norm,
       db,
       dc,
-      v);
+      v,
+      dUs,
+      max_state_grad,
+      health_record,
+      step);
+  HASTE_STATS_END(pointwise_timer);
 
   // Signal completion of pointwise operations for data-dependent streams.
   cudaEventRecord(event, stream1);
 
   cublasSetStream(blas_handle, stream1);
   layer_norm2.RunPartial(stream1, batch_size, v, act_Rh);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kRecurrentGemm, hidden_size, batch_size, hidden_size * 4);
+  HASTE_STATS_BEGIN(dh_timer, kLayerNormLstm, kRecurrentGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size, batch_size, hidden_size * 4,
@@ -250,6 +314,7 @@ void BackwardPass<T>::IterateInternal(
       act_Rh, hidden_size * 4,
       &beta_sum,
       dh, hidden_size);
+  HASTE_STATS_END(dh_timer);
 }
 
 template<typename T>
@@ -276,7 +341,17 @@ void BackwardPass<T>::Run(
     layer_norm::BackwardPass<T>& layer_norm2,
     layer_norm::BackwardPass<T>& layer_norm3,
     T* act_c_norm,
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const int conditioning_size,
+    const T* U_t,     // [H*4,S]
+    const T* s,       // [N,S]
+    T* dU,            // [S,H*4]
+    T* ds,            // [N,S]
+    T* tmp_dUs,       // [N,H*4]
+    const dropout::Variational* dropout,
+    const gradient::Options* gradient) {
+  HASTE_STATS_LAYER(kLayerNormLstm);
+  HASTE_PROBE_RUN(kLayerNormLstm, data_->batch_size, data_->input_size, data_->hidden_size, steps);
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
   const T beta_assign = static_cast<T>(0.0);
@@ -295,8 +370,26 @@ void BackwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[2], data_->event, 0);
+  }
+
+  ClearParameter(stream1, gradient, input_size * hidden_size * 4, dW);
+  ClearParameter(stream1, gradient, hidden_size * hidden_size * 4, dR);
+  ClearParameter(stream1, gradient, hidden_size * 4, db);
+  ClearParameter(stream1, gradient, conditioning_size * hidden_size * 4, dU);
+
   const int NH = batch_size * hidden_size;
+  T* dUs = conditioning_size ? tmp_dUs : nullptr;
+  if (dUs)
+    cudaMemsetAsync(dUs, 0, NH * 4 * sizeof(T), stream1);
+
   for (int i = steps - 1; i >= 0; --i) {
+    HASTE_PROBE_STEP(kLayerNormLstm, batch_size, input_size, hidden_size, i);
     IterateInternal(
         R_t,
         c + i * NH,
@@ -311,24 +404,44 @@ void BackwardPass<T>::Run(
         layer_norm2,
         layer_norm3,
         act_c_norm + i * NH,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        dUs,
+        dropout,
+        gradient,
+        i);
   }
   cudaEventRecord(event, stream1);
 
   cudaStreamWaitEvent(stream2, event, 0);
   layer_norm1.Run(stream2, act_Wx_norm, act_Wx);
   cublasSetStream(blas_handle, stream2);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 4, input_size, batch_size * steps,
-      &alpha,
-      act_Wx, hidden_size * 4,
-      x_t, batch_size * steps,
-      &beta_sum,
-      dW, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kReduction, hidden_size * 4, input_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dW_timer, kLayerNormLstm, kReduction, stream2);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // `x_t` is the transpose of `x` before dropout; the mask is applied as it's loaded.
+    InputMaskedGemm(stream2, false,
+        hidden_size * 4, input_size, batch_size * steps,
+        act_Wx, hidden_size * 4,
+        x_t, batch_size * steps,
+        beta_sum,
+        dW, hidden_size * 4,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, input_size, batch_size * steps,
+        &alpha,
+        act_Wx, hidden_size * 4,
+        x_t, batch_size * steps,
+        &beta_sum,
+        dW, hidden_size * 4);
+  }
+  HASTE_STATS_END(dW_timer);
 
   cudaStreamWaitEvent(stream3, event, 0);
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kReduction, hidden_size * 4, hidden_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dR_timer, kLayerNormLstm, kReduction, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_T,
       hidden_size * 4, hidden_size, batch_size * steps,
@@ -337,8 +450,37 @@ void BackwardPass<T>::Run(
       h, hidden_size,
       &beta_sum,
       dR, hidden_size * 4);
+  HASTE_STATS_END(dR_timer);
+
+  if (dUs) {
+    HASTE_PROBE_GEMM(kLayerNormLstm, kReduction, hidden_size * 4, conditioning_size, batch_size);
+    HASTE_STATS_BEGIN(dU_timer, kLayerNormLstm, kReduction, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 4, conditioning_size, batch_size,
+        &alpha,
+        dUs, hidden_size * 4,
+        s, conditioning_size,
+        &beta_sum,
+        dU, hidden_size * 4);
+    HASTE_STATS_END(dU_timer);
+
+    HASTE_PROBE_GEMM(kLayerNormLstm, kInputGemm, conditioning_size, batch_size, hidden_size * 4);
+    HASTE_STATS_BEGIN(ds_timer, kLayerNormLstm, kInputGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        conditioning_size, batch_size, hidden_size * 4,
+        &alpha,
+        U_t, conditioning_size,
+        dUs, hidden_size * 4,
+        &beta_assign,
+        ds, conditioning_size);
+    HASTE_STATS_END(ds_timer);
+  }
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kInputGemm, input_size, steps * batch_size, hidden_size * 4);
+  HASTE_STATS_BEGIN(dx_timer, kLayerNormLstm, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, steps * batch_size, hidden_size * 4,
@@ -347,6 +489,26 @@ void BackwardPass<T>::Run(
       act_Wx, hidden_size * 4,
       &beta_assign,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
+
+  // dx is with respect to the input before dropout. `db` is final now that the pointwise
+  // operations are, so its norm is taken in the same pass.
+  HASTE_STATS_BEGIN(finish_timer, kLayerNormLstm, kPointwise, stream2);
+  FinishInputGradient(
+      stream2, dropout, gradient, steps, batch_size, input_size, dx, hidden_size * 4, db);
+  HASTE_STATS_END(finish_timer);
+
+  // The GEMM outputs are reduced in passes of their own since cuBLAS has no epilogue for
+  // them. Wait for the ones on stream2.
+  if (gradient && gradient->accumulator) {
+    cudaEventRecord(event, stream2);
+    cudaStreamWaitEvent(stream1, event, 0);
+    HASTE_STATS_BEGIN(norm_timer, kLayerNormLstm, kReduction, stream1);
+    AccumulateSquares(stream1, gradient, kParameters, input_size * hidden_size * 4, dW);
+    AccumulateSquares(stream1, gradient, kParameters, hidden_size * hidden_size * 4, dR);
+    AccumulateSquares(stream1, gradient, kParameters, conditioning_size * hidden_size * 4, dU);
+    HASTE_STATS_END(norm_timer);
+  }
 
   cublasSetStream(blas_handle, save_stream);
 }
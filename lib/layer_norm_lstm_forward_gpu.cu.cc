@@ -17,11 +17,18 @@
 #include <cuda_runtime_api.h>
 
 #include "blas.h"
+#include "dropout_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::health::internal;
+
 // `c` and `c_out` may be aliased.
 template<typename T, bool Training>
 __global__
@@ -33,7 +40,10 @@ void ComputeCellState(
     const T* b,   // Bias for gates
     const T* c,   // Input cell state
     T* c_out,     // Output cell state
-    T* v_out) {   // Output vector v (Wx + Rh + b)
+    T* v_out,     // Output vector v (Wx + Rh + b)
+    const T* Us,    // Per-sequence conditioning (may be null)
+    Record* health, // Non-finite value record (may be null)
+    const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -52,10 +62,23 @@ void ComputeCellState(
   const int f_idx = weight_idx + 2 * hidden_size;
   const int o_idx = weight_idx + 3 * hidden_size;
 
-  const T i = sigmoid(Wx[i_idx] + Rh[i_idx] + b[row + 0 * hidden_size]);
-  const T g = tanh   (Wx[g_idx] + Rh[g_idx] + b[row + 1 * hidden_size]);
-  const T f = sigmoid(Wx[f_idx] + Rh[f_idx] + b[row + 2 * hidden_size]);
-  const T o = sigmoid(Wx[o_idx] + Rh[o_idx] + b[row + 3 * hidden_size]);
+  T i_pre = Wx[i_idx] + Rh[i_idx] + b[row + 0 * hidden_size];
+  T g_pre = Wx[g_idx] + Rh[g_idx] + b[row + 1 * hidden_size];
+  T f_pre = Wx[f_idx] + Rh[f_idx] + b[row + 2 * hidden_size];
+  T o_pre = Wx[o_idx] + Rh[o_idx] + b[row + 3 * hidden_size];
+
+  // Added after normalization, like a per-sequence bias. Uniform across the launch.
+  if (Us) {
+    i_pre += Us[i_idx];
+    g_pre += Us[g_idx];
+    f_pre += Us[f_idx];
+    o_pre += Us[o_idx];
+  }
+
+  const T i = sigmoid(i_pre);
+  const T g = tanh   (g_pre);
+  const T f = sigmoid(f_pre);
+  const T o = sigmoid(o_pre);
 
   // Compile-time constant branch should be eliminated by compiler so we have
   // straight-through code.
@@ -68,7 +91,9 @@ void ComputeCellState(
     v_out[o_idx] = o;
   }
 
-  c_out[output_idx] = (f * c[output_idx]) + (i * g);
+  const T cur_c_value = (f * c[output_idx]) + (i * g);
+  c_out[output_idx] = cur_c_value;
+  Check(health, kCell, step, col, cur_c_value);
 }
 
 // `h` and `h_out` may be aliased.
@@ -82,7 +107,12 @@ void ComputeCellOutput(
     const T* v,
     T* h_out,     // Output recurrent state
     const float zoneout_prob,
-    const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+    const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+    T* y_out,                 // Output with dropout applied (may be null)
+    const unsigned long long seed,
+    const float output_prob,
+    Record* health,           // Non-finite value record (may be null)
+    const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -106,6 +136,12 @@ void ComputeCellOutput(
   }
 
   h_out[output_idx] = cur_h_value;
+  Check(health, kState, step, col, cur_h_value);
+
+  // Output dropout only changes what the next layer sees, not the recurrence. The branch
+  // is uniform across the whole launch.
+  if (y_out)
+    y_out[output_idx] = cur_h_value * Scale<T>(seed, kOutputMask, output_idx, output_prob);
 }
 
 }  // anonymous namespace
@@ -177,7 +213,11 @@ void ForwardPass<T>::IterateInternal(
     layer_norm::ForwardPass<T>& layer_norm3,
     T* act_c_norm,
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const T* Us, // Conditioning term (s·U) [N,H*4] or null
+    const dropout::Variational* dropout, // Dropout or null
+    T* y_out, // Output with dropout applied [N,H] or null
+    const int step) {
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -187,8 +227,13 @@ void ForwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  health::Record* health_record = health::Active();
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
 
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kRecurrentGemm, hidden_size * 4, batch_size, hidden_size);
+  HASTE_STATS_BEGIN(act_Rh_timer, kLayerNormLstm, kRecurrentGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 4, batch_size, hidden_size,
@@ -197,6 +242,7 @@ void ForwardPass<T>::IterateInternal(
       h, hidden_size,
       &beta,
       act_Rh, hidden_size * 4);
+  HASTE_STATS_END(act_Rh_timer);
   layer_norm2.RunPartial(stream1, batch_size, act_Rh, tmp_Rh);
   cudaStreamWaitEvent(stream1, event, 0);
 
@@ -206,6 +252,7 @@ void ForwardPass<T>::IterateInternal(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
 
+  HASTE_STATS_BEGIN(cell_timer, kLayerNormLstm, kPointwise, stream1);
   if (training) {
     ComputeCellState<T, true><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -215,8 +262,13 @@ void ForwardPass<T>::IterateInternal(
         b,
         c,
         c_out,
-        v);
+        v,
+        Us,
+        health_record,
+        step);
+    HASTE_STATS_END(cell_timer);
     layer_norm3.RunPartial(stream1, batch_size, c_out, act_c_norm);
+    HASTE_STATS_BEGIN(output_timer, kLayerNormLstm, kPointwise, stream1);
     if (zoneout_prob && zoneout_mask) {
       ComputeCellOutput<T, true, true><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -226,7 +278,12 @@ void ForwardPass<T>::IterateInternal(
           v,
           h_out,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       ComputeCellOutput<T, true, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -236,8 +293,14 @@ void ForwardPass<T>::IterateInternal(
           v,
           h_out,
           0.0f,
-          nullptr);
+          nullptr,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
+    HASTE_STATS_END(output_timer);
   } else {
     ComputeCellState<T, false><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -247,8 +310,13 @@ void ForwardPass<T>::IterateInternal(
         b,
         c,
         c_out,
-        v);
+        v,
+        Us,
+        health_record,
+        step);
+    HASTE_STATS_END(cell_timer);
     layer_norm3.RunPartial(stream1, batch_size, c_out, act_c_norm);
+    HASTE_STATS_BEGIN(output_timer, kLayerNormLstm, kPointwise, stream1);
     if (zoneout_prob && zoneout_mask) {
       ComputeCellOutput<T, false, true><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -258,7 +326,12 @@ void ForwardPass<T>::IterateInternal(
           v,
           h_out,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       ComputeCellOutput<T, false, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -268,8 +341,14 @@ void ForwardPass<T>::IterateInternal(
           v,
           h_out,
           0.0f,
-          nullptr);
+          nullptr,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
+    HASTE_STATS_END(output_timer);
   }
 }
 
@@ -291,7 +370,15 @@ void ForwardPass<T>::Run(
     layer_norm::ForwardPass<T>& layer_norm3,
     T* act_c_norm,
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [T,N,H]
+    const T* zoneout_mask, // Zoneout mask [T,N,H]
+    const int conditioning_size,
+    const T* U,  // Conditioning weight matrix [S,H*4]
+    const T* s,  // Conditioning vectors [N,S]
+    T* tmp_Us,   // Temporary storage for s·U [N,H*4]
+    const dropout::Variational* dropout, // Dropout or null
+    T* y) {      // Output with dropout applied [T,N,H]
+  HASTE_STATS_LAYER(kLayerNormLstm);
+  HASTE_PROBE_RUN(kLayerNormLstm, data_->batch_size, data_->input_size, data_->hidden_size, steps);
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -306,18 +393,59 @@ void ForwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 4, steps * batch_size, input_size,
-      &alpha,
-      W, hidden_size * 4,
-      x, input_size,
-      &beta,
-      act_Wx, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLayerNormLstm, kInputGemm, hidden_size * 4, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(act_Wx_timer, kLayerNormLstm, kInputGemm, stream1);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // The input mask varies along both N and C, so it can't be folded into `W`. It's
+    // applied to `x` as the GEMM loads it instead.
+    InputMaskedGemm(stream1, true,
+        hidden_size * 4, steps * batch_size, input_size,
+        W, hidden_size * 4,
+        x, input_size,
+        beta,
+        act_Wx, hidden_size * 4,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, steps * batch_size, input_size,
+        &alpha,
+        W, hidden_size * 4,
+        x, input_size,
+        &beta,
+        act_Wx, hidden_size * 4);
+  }
+  HASTE_STATS_END(act_Wx_timer);
   layer_norm1.Run(stream1, act_Wx, act_Wx_norm);
 
+  // The conditioning term is the same at every time step so it's computed once here
+  // instead of being folded into the input GEMM.
+  const T* Us = nullptr;
+  if (conditioning_size) {
+    HASTE_PROBE_GEMM(kLayerNormLstm, kInputGemm, hidden_size * 4, batch_size, conditioning_size);
+    HASTE_STATS_BEGIN(tmp_Us_timer, kLayerNormLstm, kInputGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, batch_size, conditioning_size,
+        &alpha,
+        U, hidden_size * 4,
+        s, conditioning_size,
+        &beta,
+        tmp_Us, hidden_size * 4);
+    HASTE_STATS_END(tmp_Us_timer);
+    Us = tmp_Us;
+  }
+
   for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kLayerNormLstm, batch_size, input_size, hidden_size, i);
     const int NH = batch_size * hidden_size;
     IterateInternal(
         R,
@@ -333,7 +461,11 @@ void ForwardPass<T>::Run(
         layer_norm3,
         act_c_norm + i * NH,
         zoneout_prob,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        Us,
+        dropout,
+        dropout && dropout->output_prob > 0.0f ? y + i * NH : nullptr,
+        i);
   }
 
   cublasSetStream(blas_handle, save_stream);
@@ -19,11 +19,20 @@
 #include <vector>
 
 #include "blas.h"
+#include "dropout_ops.h"
+#include "gradient_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::gradient::internal;
+using namespace haste::v0::health::internal;
+
 template<typename T, bool ApplyZoneout>
 __global__
 void PointwiseOperations(const int batch_dim,
@@ -37,7 +46,13 @@ void PointwiseOperations(const int batch_dim,
                          T* dh_inout,
                          T* dc_inout,
                          T* dv_out,
-                         const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+                         T* dUs_inout,             // Conditioning gradient accumulator (may be null)
+                         const unsigned long long seed,
+                         const float output_prob,
+                         const float max_state_grad,
+                         Record* health,           // Non-finite value record (may be null)
+                         const int step) {
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
 
@@ -47,7 +62,16 @@ void PointwiseOperations(const int batch_dim,
   const int base_idx = col * hidden_dim + row;
 
         T dc_total = dc_new[base_idx] + dc_inout[base_idx];
-        T dh_total = dh_new[base_idx] + dh_inout[base_idx];
+        T dh_out = dh_new[base_idx];
+  // With output dropout, `dh_new` is the gradient with respect to the dropped output. The
+  // branch is uniform across the whole launch.
+  if (output_prob > 0.0f)
+    dh_out *= Scale<T>(seed, kOutputMask, base_idx, output_prob);
+        T dh_total = dh_out + dh_inout[base_idx];
+  Check(health, kGradient, step, col, dh_total);
+  Check(health, kGradient, step, col, dc_total);
+  dh_total = ClampState(dh_total, max_state_grad);
+  dc_total = ClampState(dc_total, max_state_grad);
   const T c_tanh = tanh(c_new[base_idx]);
 
   const int stride4_base_idx = col * (hidden_dim * 4) + row;
@@ -93,6 +117,15 @@ void PointwiseOperations(const int batch_dim,
   dv_out[g_idx] = dv_g;
   dv_out[f_idx] = dv_f;
   dv_out[o_idx] = dv_o;
+
+  // Each element is owned by a single thread and time steps run in sequence on one
+  // stream, so the accumulation needs no atomics.
+  if (dUs_inout) {
+    dUs_inout[i_idx] += dv_i;
+    dUs_inout[g_idx] += dv_g;
+    dUs_inout[f_idx] += dv_f;
+    dUs_inout[o_idx] += dv_o;
+  }
 }
 
 }  // anonymous namespace
@@ -109,6 +142,7 @@ struct BackwardPass<T>::private_data {
   cublasHandle_t blas_handle;
   cudaStream_t stream[3];
   cudaEvent_t event;
+  cudaStream_t sync_stream;
 };
 
 template<typename T>
@@ -122,6 +156,7 @@ BackwardPass<T>::BackwardPass(
   data_->input_size = input_size;
   data_->hidden_size = hidden_size;
   data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
   cudaStreamCreate(&data_->stream[0]);
   cudaStreamCreate(&data_->stream[1]);
   cudaStreamCreate(&data_->stream[2]);
@@ -130,9 +165,18 @@ BackwardPass<T>::BackwardPass(
 
 template<typename T>
 BackwardPass<T>::~BackwardPass() {
-  cudaStreamSynchronize(data_->stream[2]);
-  cudaStreamSynchronize(data_->stream[1]);
-  cudaStreamSynchronize(data_->stream[0]);
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream[2]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+    cudaEventRecord(data_->event, data_->stream[1]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+    cudaEventRecord(data_->event, data_->stream[0]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream[2]);
+    cudaStreamSynchronize(data_->stream[1]);
+    cudaStreamSynchronize(data_->stream[0]);
+  }
   cudaEventDestroy(data_->event);
   cudaStreamDestroy(data_->stream[2]);
   cudaStreamDestroy(data_->stream[1]);
@@ -160,6 +204,7 @@ void BackwardPass<T>::Iterate(
     T* dc,            // [N,H]
     T* v,             // [N,H*4]
     const T* zoneout_mask) {
+  HASTE_PROBE_ITERATE(kLstm, data_->batch_size, data_->input_size, data_->hidden_size);
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
   const T beta_assign = static_cast<T>(0.0);
@@ -194,7 +239,11 @@ void BackwardPass<T>::Iterate(
       dh,
       dc,
       v,
-      zoneout_mask);
+      zoneout_mask,
+      nullptr,
+      nullptr,
+      nullptr,
+      0);
 
   // Wait for pointwise operations to complete since there's a
   // data dependency between its output (`v`) and the following matmuls.
@@ -202,6 +251,8 @@ void BackwardPass<T>::Iterate(
   cudaStreamWaitEvent(stream3, event, 0);
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kLstm, kInputGemm, input_size, batch_size, hidden_size * 4);
+  HASTE_STATS_BEGIN(dx_timer, kLstm, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, batch_size, hidden_size * 4,
@@ -210,6 +261,7 @@ void BackwardPass<T>::Iterate(
       v, hidden_size * 4,
       &beta_assign,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
 
   // We can get away with only waiting for the `dx` and `dh` outputs and
   // let the `dR` and `dW` matrices complete whenever they complete. It's
@@ -221,6 +273,8 @@ void BackwardPass<T>::Iterate(
   }
 
   cublasSetStream(blas_handle, stream3);
+  HASTE_PROBE_GEMM(kLstm, kReduction, hidden_size * 4, hidden_size, batch_size);
+  HASTE_STATS_BEGIN(dR_timer, kLstm, kReduction, stream3);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_T,
       hidden_size * 4, hidden_size, batch_size,
@@ -229,8 +283,11 @@ void BackwardPass<T>::Iterate(
       h, hidden_size,
       &beta_sum,
       dR, hidden_size * 4);
+  HASTE_STATS_END(dR_timer);
 
   cublasSetStream(blas_handle, stream3);
+  HASTE_PROBE_GEMM(kLstm, kReduction, hidden_size * 4, input_size, batch_size);
+  HASTE_STATS_BEGIN(dW_timer, kLstm, kReduction, stream3);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 4, input_size, batch_size,
@@ -239,6 +296,7 @@ void BackwardPass<T>::Iterate(
       x_t, batch_size,
       &beta_sum,
       dW, hidden_size * 4);
+  HASTE_STATS_END(dW_timer);
 
   cublasSetStream(blas_handle, save_stream);
 }
@@ -254,7 +312,11 @@ void BackwardPass<T>::IterateInternal(
     T* dh,            // [N,H]
     T* dc,            // [N,H]
     T* v,             // [N,H*4]
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    T* dUs,           // [N,H*4]
+    const dropout::Variational* dropout,
+    const gradient::Options* gradient,
+    const int step) {
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
 
@@ -263,6 +325,10 @@ void BackwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  const float max_state_grad = gradient ? gradient->max_state_grad : 0.0f;
+  health::Record* health_record = health::Active();
 
   // Compute launch configuration for pointwise operations kernel.
   const dim3 blockDim(64, 16);
@@ -270,6 +336,7 @@ void BackwardPass<T>::IterateInternal(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
 
+  HASTE_STATS_BEGIN(pointwise_timer, kLstm, kPointwise, stream1);
   if (zoneout_mask) {
     PointwiseOperations<T, true><<<gridDim, blockDim, 0, stream1>>>(
         batch_size,
@@ -283,7 +350,13 @@ void BackwardPass<T>::IterateInternal(
         dh,
         dc,
         v,
-        zoneout_mask
+        zoneout_mask,
+        dUs,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step
     );
   } else {
     PointwiseOperations<T, false><<<gridDim, blockDim, 0, stream1>>>(
@@ -298,14 +371,23 @@ void BackwardPass<T>::IterateInternal(
         dh,
         dc,
         v,
-        nullptr
+        nullptr,
+        dUs,
+        seed,
+        output_prob,
+        max_state_grad,
+        health_record,
+        step
     );
   }
+  HASTE_STATS_END(pointwise_timer);
 
   // Signal completion of pointwise operations for data-dependent streams.
   cudaEventRecord(event, stream1);
 
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kLstm, kRecurrentGemm, hidden_size, batch_size, hidden_size * 4);
+  HASTE_STATS_BEGIN(dh_timer, kLstm, kRecurrentGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size, batch_size, hidden_size * 4,
@@ -314,6 +396,7 @@ void BackwardPass<T>::IterateInternal(
       v, hidden_size * 4,
       &beta_sum,
       dh, hidden_size);
+  HASTE_STATS_END(dh_timer);
 }
 
 template<typename T>
@@ -334,7 +417,19 @@ void BackwardPass<T>::Run(
     T* dh,            // [N,H]
     T* dc,            // [N,H]
     T* v,            // [T,N,H*4]
-    const T* zoneout_mask) {
+    const T* zoneout_mask,
+    const BackwardOptions<T>& options) {
+  HASTE_PROBE_RUN(kLstm, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const int conditioning_size = options.conditioning_size;
+  const T* U_t = options.U_t;
+  const T* s = options.s;
+  T* dU = options.dU;
+  T* ds = options.ds;
+  T* tmp_dUs = options.tmp_dUs;
+  const block_sparse::Mask<T>* mask = options.mask;
+  const dropout::Variational* dropout = options.dropout;
+  const gradient::Options* gradient = options.gradient;
+
   const T alpha = static_cast<T>(1.0);
   const T beta_sum = static_cast<T>(1.0);  // Accumulate into output matrix!
   const T beta_assign = static_cast<T>(0.0);
@@ -353,8 +448,26 @@ void BackwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[2], data_->event, 0);
+  }
+
+  ClearParameter(stream1, gradient, input_size * hidden_size * 4, dW);
+  ClearParameter(stream1, gradient, hidden_size * hidden_size * 4, dR);
+  ClearParameter(stream1, gradient, hidden_size * 4, db);
+  ClearParameter(stream1, gradient, conditioning_size * hidden_size * 4, dU);
+
   const int NH = batch_size * hidden_size;
+  T* dUs = conditioning_size ? tmp_dUs : nullptr;
+  if (dUs)
+    cudaMemsetAsync(dUs, 0, NH * 4 * sizeof(T), stream1);
+
   for (int i = steps - 1; i >= 0; --i) {
+    HASTE_PROBE_STEP(kLstm, batch_size, input_size, hidden_size, i);
     IterateInternal(
         R_t,
         c + i * NH,
@@ -365,33 +478,60 @@ void BackwardPass<T>::Run(
         dh,
         dc,
         v + i * NH * 4,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        dUs,
+        dropout,
+        gradient,
+        i);
   }
   cudaEventRecord(event, stream1);
 
   cudaStreamWaitEvent(stream2, event, 0);
   cublasSetStream(blas_handle, stream2);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 4, input_size, batch_size * steps,
-      &alpha,
-      v, hidden_size * 4,
-      x_t, batch_size * steps,
-      &beta_sum,
-      dW, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLstm, kReduction, hidden_size * 4, input_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dW_timer, kLstm, kReduction, stream2);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // `x_t` is the transpose of `x` before dropout; the mask is applied as it's loaded.
+    InputMaskedGemm(stream2, false,
+        hidden_size * 4, input_size, batch_size * steps,
+        v, hidden_size * 4,
+        x_t, batch_size * steps,
+        beta_sum,
+        dW, hidden_size * 4,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, input_size, batch_size * steps,
+        &alpha,
+        v, hidden_size * 4,
+        x_t, batch_size * steps,
+        &beta_sum,
+        dW, hidden_size * 4);
+  }
+  HASTE_STATS_END(dW_timer);
 
   cudaStreamWaitEvent(stream3, event, 0);
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_T,
-      hidden_size * 4, hidden_size, batch_size * steps,
-      &alpha,
-      v, hidden_size * 4,
-      h, hidden_size,
-      &beta_sum,
-      dR, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLstm, kReduction, hidden_size * 4, hidden_size, batch_size * steps);
+  HASTE_STATS_BEGIN(dR_timer, kLstm, kReduction, stream1);
+  if (mask) {
+    mask->AccumulateGradient(blas_handle, stream1, batch_size * steps, hidden_size, 4, v, h, dR);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 4, hidden_size, batch_size * steps,
+        &alpha,
+        v, hidden_size * 4,
+        h, hidden_size,
+        &beta_sum,
+        dR, hidden_size * 4);
+  }
+  HASTE_STATS_END(dR_timer);
 
   cublasSetStream(blas_handle, stream1);
+  HASTE_PROBE_GEMM(kLstm, kInputGemm, input_size, steps * batch_size, hidden_size * 4);
+  HASTE_STATS_BEGIN(dx_timer, kLstm, kInputGemm, stream1);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       input_size, steps * batch_size, hidden_size * 4,
@@ -400,6 +540,52 @@ void BackwardPass<T>::Run(
       v, hidden_size * 4,
       &beta_assign,
       dx, input_size);
+  HASTE_STATS_END(dx_timer);
+
+  // dx is with respect to the input before dropout. `db` is final now that the pointwise
+  // operations are, so its norm is taken in the same pass.
+  HASTE_STATS_BEGIN(finish_timer, kLstm, kPointwise, stream1);
+  FinishInputGradient(
+      stream1, dropout, gradient, steps, batch_size, input_size, dx, hidden_size * 4, db);
+  HASTE_STATS_END(finish_timer);
+
+  if (dUs) {
+    HASTE_PROBE_GEMM(kLstm, kReduction, hidden_size * 4, conditioning_size, batch_size);
+    HASTE_STATS_BEGIN(dU_timer, kLstm, kReduction, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 4, conditioning_size, batch_size,
+        &alpha,
+        dUs, hidden_size * 4,
+        s, conditioning_size,
+        &beta_sum,
+        dU, hidden_size * 4);
+    HASTE_STATS_END(dU_timer);
+
+    HASTE_PROBE_GEMM(kLstm, kInputGemm, conditioning_size, batch_size, hidden_size * 4);
+    HASTE_STATS_BEGIN(ds_timer, kLstm, kInputGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        conditioning_size, batch_size, hidden_size * 4,
+        &alpha,
+        U_t, conditioning_size,
+        dUs, hidden_size * 4,
+        &beta_assign,
+        ds, conditioning_size);
+    HASTE_STATS_END(ds_timer);
+  }
+
+  // The GEMM outputs are reduced in passes of their own since cuBLAS has no epilogue for
+  // them. Wait for the ones on stream2.
+  if (gradient && gradient->accumulator) {
+    cudaEventRecord(event, stream2);
+    cudaStreamWaitEvent(stream1, event, 0);
+    HASTE_STATS_BEGIN(norm_timer, kLstm, kReduction, stream1);
+    AccumulateSquares(stream1, gradient, kParameters, input_size * hidden_size * 4, dW);
+    AccumulateSquares(stream1, gradient, kParameters, hidden_size * hidden_size * 4, dR);
+    AccumulateSquares(stream1, gradient, kParameters, conditioning_size * hidden_size * 4, dU);
+    HASTE_STATS_END(norm_timer);
+  }
 
   cublasSetStream(blas_handle, save_stream);
 }
@@ -17,11 +17,18 @@
 #include <cuda_runtime_api.h>
 
 #include "blas.h"
+#include "dropout_ops.h"
 #include "haste.h"
+#include "health_ops.h"
 #include "inline_ops.h"
+#include "phase_timer.h"
+#include "probes.h"
 
 namespace {
 
+using namespace haste::v0::dropout::internal;
+using namespace haste::v0::health::internal;
+
 // `h` and `h_out` may be aliased.
 // `c` and `c_out` may be aliased.
 template<typename T, bool Training, bool ApplyZoneout>
@@ -37,7 +44,13 @@ void PointwiseOperations(const int batch_dim,
                          T* c_out,     // Output cell state
                          T* v_out,     // Output vector v (Wx + Rh + b) (only used if Training==true)
                          const float zoneout_prob,
-                         const T* zoneout_mask) {  // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* zoneout_mask,    // Zoneout mask (only used if ApplyZoneout==true)
+                         const T* extra,              // Extra gate pre-activations (may be null)
+                         T* y_out,                    // Output with dropout applied (may be null)
+                         const unsigned long long seed,
+                         const float output_prob,
+                         Record* health,              // Non-finite value record (may be null)
+                         const int step) {
   // We're in column-major order here, so increase x => increase row.
   const int row = blockDim.x * blockIdx.x + threadIdx.x;
   const int col = blockDim.y * blockIdx.y + threadIdx.y;
@@ -57,10 +70,23 @@ void PointwiseOperations(const int batch_dim,
   const int f_idx = weight_idx + 2 * hidden_dim;
   const int o_idx = weight_idx + 3 * hidden_dim;
 
-  const T i = sigmoid(Wx[i_idx] + Rh[i_idx] + b[row + 0 * hidden_dim]);
-  const T g = tanh   (Wx[g_idx] + Rh[g_idx] + b[row + 1 * hidden_dim]);
-  const T f = sigmoid(Wx[f_idx] + Rh[f_idx] + b[row + 2 * hidden_dim]);
-  const T o = sigmoid(Wx[o_idx] + Rh[o_idx] + b[row + 3 * hidden_dim]);
+  T i_pre = Wx[i_idx] + Rh[i_idx] + b[row + 0 * hidden_dim];
+  T g_pre = Wx[g_idx] + Rh[g_idx] + b[row + 1 * hidden_dim];
+  T f_pre = Wx[f_idx] + Rh[f_idx] + b[row + 2 * hidden_dim];
+  T o_pre = Wx[o_idx] + Rh[o_idx] + b[row + 3 * hidden_dim];
+
+  // Uniform across the whole launch, so the branch doesn't diverge.
+  if (extra) {
+    i_pre += extra[i_idx];
+    g_pre += extra[g_idx];
+    f_pre += extra[f_idx];
+    o_pre += extra[o_idx];
+  }
+
+  const T i = sigmoid(i_pre);
+  const T g = tanh   (g_pre);
+  const T f = sigmoid(f_pre);
+  const T o = sigmoid(o_pre);
 
   // Compile-time constant branch should be eliminated by compiler so we have
   // straight-through code.
@@ -84,6 +110,13 @@ void PointwiseOperations(const int batch_dim,
 
   c_out[output_idx] = cur_c_value;
   h_out[output_idx] = cur_h_value;
+  Check(health, kCell, step, col, cur_c_value);
+  Check(health, kState, step, col, cur_h_value);
+
+  // Output dropout only changes what the next layer sees, not the recurrence. The branch
+  // is uniform across the whole launch.
+  if (y_out)
+    y_out[output_idx] = cur_h_value * Scale<T>(seed, kOutputMask, output_idx, output_prob);
 }
 
 }  // anonymous namespace
@@ -103,6 +136,7 @@ struct ForwardPass<T>::private_data {
   cudaEvent_t event;
   cudaEvent_t ready_event;
   cudaEvent_t finished_event;
+  cudaStream_t sync_stream;
 };
 
 template<typename T>
@@ -118,6 +152,7 @@ ForwardPass<T>::ForwardPass(
   data_->input_size = input_size;
   data_->hidden_size = hidden_size;
   data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
   cudaStreamCreate(&data_->stream[0]);
   cudaStreamCreate(&data_->stream[1]);
   cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
@@ -127,8 +162,15 @@ ForwardPass<T>::ForwardPass(
 
 template<typename T>
 ForwardPass<T>::~ForwardPass() {
-  cudaStreamSynchronize(data_->stream[1]);
-  cudaStreamSynchronize(data_->stream[0]);
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream[1]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+    cudaEventRecord(data_->event, data_->stream[0]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream[1]);
+    cudaStreamSynchronize(data_->stream[0]);
+  }
   cudaEventDestroy(data_->finished_event);
   cudaEventDestroy(data_->ready_event);
   cudaEventDestroy(data_->event);
@@ -151,7 +193,9 @@ void ForwardPass<T>::Iterate(
     T* v,        // Output vector (Wx + Rh + b) [N,H*4]
     T* tmp_Rh,   // Temporary storage for Rh vector [N,H*4]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask,   // Zoneout mask [N,H]
+    const T* gate_input) {   // External gate pre-activations [N,H*4] or null
+  HASTE_PROBE_ITERATE(kLstm, data_->batch_size, data_->input_size, data_->hidden_size);
   // Constants for GEMM
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
@@ -176,6 +220,8 @@ void ForwardPass<T>::Iterate(
   }
 
   cublasSetStream(blas_handle, stream2);
+  HASTE_PROBE_GEMM(kLstm, kInputGemm, hidden_size * 4, batch_size, input_size);
+  HASTE_STATS_BEGIN(v_timer, kLstm, kInputGemm, stream2);
   blas<T>::gemm(blas_handle,
       CUBLAS_OP_N, CUBLAS_OP_N,
       hidden_size * 4, batch_size, input_size,
@@ -184,6 +230,7 @@ void ForwardPass<T>::Iterate(
       x, input_size,
       &beta,
       v, hidden_size * 4);
+  HASTE_STATS_END(v_timer);
   cudaEventRecord(event, stream2);
 
   IterateInternal(
@@ -196,7 +243,12 @@ void ForwardPass<T>::Iterate(
       v,
       tmp_Rh,
       zoneout_prob,
-      zoneout_mask);
+      zoneout_mask,
+      gate_input,
+      nullptr,
+      nullptr,
+      nullptr,
+      0);
 
   // Make sure outputs have settled.
   if (stream) {
@@ -218,7 +270,12 @@ void ForwardPass<T>::IterateInternal(
     T* v,        // Output vector (Wx + Rh + b) [N,H*4]
     T* tmp_Rh,   // Temporary storage for Rh vector [N,H*4]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [N,H]
+    const T* zoneout_mask, // Zoneout mask [N,H]
+    const T* extra, // Extra gate pre-activations [N,H*4] or null
+    const block_sparse::Mask<T>* mask, // Block mask over R or null
+    const dropout::Variational* dropout, // Dropout or null
+    T* y_out, // Output with dropout applied [N,H] or null
+    const int step) {
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -228,16 +285,26 @@ void ForwardPass<T>::IterateInternal(
   const cublasHandle_t blas_handle = data_->blas_handle;
   const cudaStream_t stream1 = data_->stream[0];
   const cudaEvent_t event = data_->event;
+  const unsigned long long seed = dropout ? dropout->seed : 0;
+  const float output_prob = dropout ? dropout->output_prob : 0.0f;
+  health::Record* health_record = health::Active();
 
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 4, batch_size, hidden_size,
-      &alpha,
-      R, hidden_size * 4,
-      h, hidden_size,
-      &beta,
-      tmp_Rh, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLstm, kRecurrentGemm, hidden_size * 4, batch_size, hidden_size);
+  HASTE_STATS_BEGIN(tmp_Rh_timer, kLstm, kRecurrentGemm, stream1);
+  if (mask) {
+    mask->Multiply(stream1, batch_size, hidden_size, 4, R, h, tmp_Rh);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, batch_size, hidden_size,
+        &alpha,
+        R, hidden_size * 4,
+        h, hidden_size,
+        &beta,
+        tmp_Rh, hidden_size * 4);
+  }
+  HASTE_STATS_END(tmp_Rh_timer);
 
   cudaStreamWaitEvent(stream1, event, 0);
 
@@ -247,6 +314,7 @@ void ForwardPass<T>::IterateInternal(
       (hidden_size + blockDim.x - 1) / blockDim.x,
       (batch_size + blockDim.y - 1) / blockDim.y);
 
+  HASTE_STATS_BEGIN(pointwise_timer, kLstm, kPointwise, stream1);
   if (training) {
     if (zoneout_prob && zoneout_mask) {
       PointwiseOperations<T, true, true><<<gridDim, blockDim, 0, stream1>>>(
@@ -261,7 +329,13 @@ void ForwardPass<T>::IterateInternal(
           c_out,
           v,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, true, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -275,10 +349,16 @@ void ForwardPass<T>::IterateInternal(
           c_out,
           v,
           0.0f,
-          nullptr);
+          nullptr,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   } else {
-    if (zoneout_prob && zoneout_mask) {
+    if (zoneout_prob) {
       PointwiseOperations<T, false, true><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
           hidden_size,
@@ -291,7 +371,13 @@ void ForwardPass<T>::IterateInternal(
           c_out,
           nullptr,
           zoneout_prob,
-          zoneout_mask);
+          zoneout_mask,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     } else {
       PointwiseOperations<T, false, false><<<gridDim, blockDim, 0, stream1>>>(
           batch_size,
@@ -305,9 +391,16 @@ void ForwardPass<T>::IterateInternal(
           c_out,
           nullptr,
           0.0f,
-          nullptr);
+          nullptr,
+          extra,
+          y_out,
+          seed,
+          output_prob,
+          health_record,
+          step);
     }
   }
+  HASTE_STATS_END(pointwise_timer);
 }
 
 template<typename T>
@@ -322,7 +415,17 @@ void ForwardPass<T>::Run(
     T* v,        // Output vector (Wx + Rh + b) [T,N,H*4]
     T* tmp_Rh,   // Temporary storage for Rh vector [N,H*4]
     const float zoneout_prob,
-    const T* zoneout_mask) { // Zoneout mask [T,N,H]
+    const T* zoneout_mask, // Zoneout mask [T,N,H]
+    const ForwardOptions<T>& options) {
+  HASTE_PROBE_RUN(kLstm, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const int conditioning_size = options.conditioning_size;
+  const T* U = options.U;
+  const T* s = options.s;
+  T* tmp_Us = options.tmp_Us;
+  const block_sparse::Mask<T>* mask = options.mask;
+  const dropout::Variational* dropout = options.dropout;
+  T* y = options.y;
+
   static const T alpha = static_cast<T>(1.0);
   static const T beta = static_cast<T>(0.0);
 
@@ -337,17 +440,58 @@ void ForwardPass<T>::Run(
   cudaStream_t save_stream;
   cublasGetStream(blas_handle, &save_stream);
 
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
   cublasSetStream(blas_handle, stream1);
-  blas<T>::gemm(blas_handle,
-      CUBLAS_OP_N, CUBLAS_OP_N,
-      hidden_size * 4, steps * batch_size, input_size,
-      &alpha,
-      W, hidden_size * 4,
-      x, input_size,
-      &beta,
-      v, hidden_size * 4);
+  HASTE_PROBE_GEMM(kLstm, kInputGemm, hidden_size * 4, steps * batch_size, input_size);
+  HASTE_STATS_BEGIN(v_timer, kLstm, kInputGemm, stream1);
+  if (dropout && dropout->input_prob > 0.0f) {
+    // The input mask varies along both N and C, so it can't be folded into `W`. It's
+    // applied to `x` as the GEMM loads it instead.
+    InputMaskedGemm(stream1, true,
+        hidden_size * 4, steps * batch_size, input_size,
+        W, hidden_size * 4,
+        x, input_size,
+        beta,
+        v, hidden_size * 4,
+        batch_size, input_size, dropout->seed, dropout->input_prob);
+  } else {
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, steps * batch_size, input_size,
+        &alpha,
+        W, hidden_size * 4,
+        x, input_size,
+        &beta,
+        v, hidden_size * 4);
+  }
+  HASTE_STATS_END(v_timer);
+
+  // The conditioning term is the same at every time step so it's computed once here
+  // instead of being folded into the input GEMM.
+  const T* Us = nullptr;
+  if (conditioning_size) {
+    HASTE_PROBE_GEMM(kLstm, kInputGemm, hidden_size * 4, batch_size, conditioning_size);
+    HASTE_STATS_BEGIN(tmp_Us_timer, kLstm, kInputGemm, stream1);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 4, batch_size, conditioning_size,
+        &alpha,
+        U, hidden_size * 4,
+        s, conditioning_size,
+        &beta,
+        tmp_Us, hidden_size * 4);
+    HASTE_STATS_END(tmp_Us_timer);
+    Us = tmp_Us;
+  }
 
   for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kLstm, batch_size, input_size, hidden_size, i);
     const int NH = batch_size * hidden_size;
     IterateInternal(
         R,
@@ -359,7 +503,73 @@ void ForwardPass<T>::Run(
         v + i * NH * 4,
         tmp_Rh,
         zoneout_prob,
-        zoneout_mask ? zoneout_mask + i * NH : nullptr);
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        Us,
+        mask,
+        dropout,
+        dropout && dropout->output_prob > 0.0f ? y + i * NH : nullptr,
+        i);
+  }
+
+  cublasSetStream(blas_handle, save_stream);
+}
+
+template<typename T>
+void ForwardPass<T>::RunProjected(
+    const int steps,
+    const T* R,  // Weight matrix for recurrent state (Rh) [H,H*4]
+    const T* b,  // Bias for gates (Wx + Rh + b) [H*4]
+    T* h,        // Recurrent state [T+1,N,H]
+    T* c,        // Cell state [T+1,N,H]
+    T* v,        // Input projections (Wx) on input, output vector (Wx + Rh + b) [T,N,H*4]
+    T* tmp_Rh,   // Temporary storage for Rh vector [N,H*4]
+    const float zoneout_prob,
+    const T* zoneout_mask, // Zoneout mask [T,N,H]
+    const bool reverse) {
+  HASTE_PROBE_RUN(kLstm, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
+
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+
+  cudaStream_t save_stream;
+  cublasGetStream(blas_handle, &save_stream);
+
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream[0], data_->event, 0);
+    cudaStreamWaitEvent(data_->stream[1], data_->event, 0);
+  }
+
+  for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kLstm, batch_size, input_size, hidden_size, i);
+    const int NH = batch_size * hidden_size;
+    const int t = reverse ? steps - 1 - i : i;
+    IterateInternal(
+        R,
+        b,
+        h + i * NH,
+        c + i * NH,
+        h + (i + 1) * NH,
+        c + (i + 1) * NH,
+        v + t * NH * 4,
+        tmp_Rh,
+        zoneout_prob,
+        zoneout_mask ? zoneout_mask + i * NH : nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        i);
+  }
+
+  // Make sure outputs have settled.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream[0]);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
   }
 
   cublasSetStream(blas_handle, save_stream);
@@ -0,0 +1,400 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "haste/model_file.h"
+
+namespace {
+
+using haste::v0::model_file::DataType;
+using haste::v0::model_file::kAlignment;
+
+static constexpr char kMagic[8] = { 'H', 'A', 'S', 'T', 'E', 'M', 'D', 'L' };
+
+// The file header. Encoded as these fields in order, little-endian, in exactly 64 bytes.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t tensor_count;
+  uint64_t index_offset;
+  uint64_t index_size;
+  uint64_t data_offset;
+  uint8_t reserved[24];
+};
+
+// An index entry. Encoded as these fields in order, little-endian, in exactly 40 bytes
+// and followed by `rank` int64 dimensions, then
+// `type_length` bytes of layer type, then `name_length` bytes of name, and finally
+// zero padding up to the next multiple of 8 bytes.
+struct IndexEntry {
+  uint32_t layer;
+  uint32_t dtype;
+  uint32_t rank;
+  uint32_t type_length;
+  uint32_t name_length;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+static constexpr uint64_t kHeaderSize = 64;
+static constexpr uint64_t kEntrySize = 40;
+
+bool IsLittleEndian() {
+  const uint16_t probe = 1;
+  uint8_t first;
+  memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+void Store32(char* p, const uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    p[i] = static_cast<char>(value >> (8 * i));
+}
+
+void Store64(char* p, const uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    p[i] = static_cast<char>(value >> (8 * i));
+}
+
+uint32_t Load32(const char* p) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  return value;
+}
+
+uint64_t Load64(const char* p) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i)
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  return value;
+}
+
+void EncodeHeader(const FileHeader& header, char* p) {
+  memset(p, 0, kHeaderSize);
+  memcpy(p, header.magic, sizeof(header.magic));
+  Store32(p + 8, header.version);
+  Store32(p + 12, header.tensor_count);
+  Store64(p + 16, header.index_offset);
+  Store64(p + 24, header.index_size);
+  Store64(p + 32, header.data_offset);
+}
+
+FileHeader DecodeHeader(const char* p) {
+  FileHeader header = {};
+  memcpy(header.magic, p, sizeof(header.magic));
+  header.version = Load32(p + 8);
+  header.tensor_count = Load32(p + 12);
+  header.index_offset = Load64(p + 16);
+  header.index_size = Load64(p + 24);
+  header.data_offset = Load64(p + 32);
+  return header;
+}
+
+void EncodeEntry(const IndexEntry& entry, char* p) {
+  Store32(p, entry.layer);
+  Store32(p + 4, entry.dtype);
+  Store32(p + 8, entry.rank);
+  Store32(p + 12, entry.type_length);
+  Store32(p + 16, entry.name_length);
+  Store32(p + 20, entry.reserved);
+  Store64(p + 24, entry.offset);
+  Store64(p + 32, entry.size);
+}
+
+IndexEntry DecodeEntry(const char* p) {
+  IndexEntry entry;
+  entry.layer = Load32(p);
+  entry.dtype = Load32(p + 4);
+  entry.rank = Load32(p + 8);
+  entry.type_length = Load32(p + 12);
+  entry.name_length = Load32(p + 16);
+  entry.reserved = Load32(p + 20);
+  entry.offset = Load64(p + 24);
+  entry.size = Load64(p + 32);
+  return entry;
+}
+
+uint64_t RoundUp(const uint64_t value, const uint64_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+uint64_t EntrySize(const uint64_t rank, const uint64_t type_length, const uint64_t name_length) {
+  return RoundUp(kEntrySize + rank * sizeof(int64_t) + type_length + name_length, 8);
+}
+
+// Computes the byte size of a tensor. Returns `false` if a dimension is negative or the
+// size does not fit in 64 bits.
+bool ByteSize(const DataType dtype, const std::vector<int64_t>& shape, uint64_t* size) {
+  uint64_t total = haste::v0::model_file::SizeOf(dtype);
+  for (const auto dim : shape) {
+    if (dim < 0)
+      return false;
+    const uint64_t extent = static_cast<uint64_t>(dim);
+    if (extent != 0 && total > UINT64_MAX / extent)
+      return false;
+    total *= extent;
+  }
+  *size = total;
+  return true;
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace model_file {
+
+size_t SizeOf(DataType dtype) {
+  switch (dtype) {
+    case DataType::kHalf:
+      return 2;
+    case DataType::kFloat:
+      return 4;
+    case DataType::kDouble:
+      return 8;
+  }
+  return 0;
+}
+
+void Writer::Add(
+    const int layer,
+    const std::string& layer_type,
+    const std::string& name,
+    const DataType dtype,
+    const std::vector<int64_t>& shape,
+    const void* data) {
+  // Invalid shapes are reported by `Save`.
+  uint64_t size = 0;
+  ByteSize(dtype, shape, &size);
+  tensors_.push_back({ layer, layer_type, name, dtype, shape, data, static_cast<size_t>(size) });
+}
+
+bool Writer::Save(const std::string& path) const {
+  if (!IsLittleEndian())
+    return false;
+
+  uint64_t index_size = 0;
+  for (const auto& tensor : tensors_) {
+    uint64_t size;
+    if (!ByteSize(tensor.dtype, tensor.shape, &size))
+      return false;
+    index_size += EntrySize(tensor.shape.size(), tensor.layer_type.size(), tensor.name.size());
+  }
+
+  FileHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.tensor_count = static_cast<uint32_t>(tensors_.size());
+  header.index_offset = kHeaderSize;
+  header.index_size = index_size;
+  header.data_offset = RoundUp(header.index_offset + index_size, kAlignment);
+
+  std::vector<char> index(index_size, 0);
+  char* cursor = index.data();
+  uint64_t offset = header.data_offset;
+  for (const auto& tensor : tensors_) {
+    IndexEntry entry = {};
+    entry.layer = static_cast<uint32_t>(tensor.layer);
+    entry.dtype = static_cast<uint32_t>(tensor.dtype);
+    entry.rank = static_cast<uint32_t>(tensor.shape.size());
+    entry.type_length = static_cast<uint32_t>(tensor.layer_type.size());
+    entry.name_length = static_cast<uint32_t>(tensor.name.size());
+    entry.offset = offset;
+    entry.size = tensor.size;
+
+    EncodeEntry(entry, cursor);
+    char* p = cursor + kEntrySize;
+    for (const auto dim : tensor.shape) {
+      Store64(p, static_cast<uint64_t>(dim));
+      p += sizeof(int64_t);
+    }
+    memcpy(p, tensor.layer_type.data(), tensor.layer_type.size());
+    p += tensor.layer_type.size();
+    memcpy(p, tensor.name.data(), tensor.name.size());
+
+    cursor += EntrySize(entry.rank, entry.type_length, entry.name_length);
+    offset = RoundUp(offset + tensor.size, kAlignment);
+  }
+
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  static const char zeros[kAlignment] = {};
+  char encoded_header[kHeaderSize];
+  EncodeHeader(header, encoded_header);
+  bool ok = fwrite(encoded_header, 1, kHeaderSize, fp) == kHeaderSize;
+  ok = ok && fwrite(index.data(), 1, index.size(), fp) == index.size();
+  uint64_t position = header.index_offset + index_size;
+  for (const auto& tensor : tensors_) {
+    const uint64_t padding = RoundUp(position, kAlignment) - position;
+    ok = ok && fwrite(zeros, 1, padding, fp) == padding;
+    ok = ok && fwrite(tensor.data, 1, tensor.size, fp) == tensor.size;
+    position += padding + tensor.size;
+  }
+  return (fclose(fp) == 0) && ok;
+}
+
+Reader::Reader() : base_(nullptr), length_(0), mapped_(false), version_(0) {}
+
+Reader::~Reader() {
+  Close();
+}
+
+bool Reader::Open(const std::string& path) {
+  Close();
+  error_.clear();
+  if (!IsLittleEndian())
+    return Fail("model files cannot be used in place on a big-endian host");
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return Fail("unable to open " + path);
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return Fail("unable to determine size of " + path);
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping)
+    return Fail("unable to map " + path);
+  base_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!base_)
+    return Fail("unable to map " + path);
+  length_ = static_cast<size_t>(size.QuadPart);
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return Fail("unable to open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return Fail("unable to determine size of " + path);
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return Fail("unable to map " + path);
+  base_ = base;
+  length_ = static_cast<size_t>(st.st_size);
+#endif
+  mapped_ = true;
+
+  const char* bytes = static_cast<const char*>(base_);
+  if (length_ < kHeaderSize)
+    return Fail("file is too small to be a model file");
+
+  const FileHeader header = DecodeHeader(bytes);
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+    return Fail("not a haste model file");
+  if (header.version == 0 || header.version > kVersion)
+    return Fail("unsupported model file version " + std::to_string(header.version));
+  if (header.index_offset > length_ || header.index_size > length_ - header.index_offset)
+    return Fail("index is out of bounds");
+
+  const char* cursor = bytes + header.index_offset;
+  const char* index_end = cursor + header.index_size;
+  for (uint32_t i = 0; i < header.tensor_count; ++i) {
+    if (static_cast<uint64_t>(index_end - cursor) < kEntrySize)
+      return Fail("truncated index");
+    const IndexEntry entry = DecodeEntry(cursor);
+
+    const uint64_t entry_size = EntrySize(entry.rank, entry.type_length, entry.name_length);
+    if (static_cast<uint64_t>(index_end - cursor) < entry_size)
+      return Fail("truncated index");
+
+    TensorInfo tensor;
+    const char* p = cursor + kEntrySize;
+    tensor.layer = static_cast<int>(entry.layer);
+    tensor.dtype = static_cast<DataType>(entry.dtype);
+    tensor.shape.resize(entry.rank);
+    for (auto& dim : tensor.shape) {
+      dim = static_cast<int64_t>(Load64(p));
+      p += sizeof(int64_t);
+    }
+    tensor.layer_type.assign(p, entry.type_length);
+    p += entry.type_length;
+    tensor.name.assign(p, entry.name_length);
+
+    if (SizeOf(tensor.dtype) == 0)
+      return Fail("tensor " + tensor.name + " has an unknown data type");
+    uint64_t size;
+    if (!ByteSize(tensor.dtype, tensor.shape, &size))
+      return Fail("tensor " + tensor.name + " has a negative or oversized shape");
+    if (entry.size != size)
+      return Fail("tensor " + tensor.name + " size does not match its shape");
+    if (entry.offset % kAlignment != 0)
+      return Fail("tensor " + tensor.name + " is not aligned");
+    if (entry.offset > length_ || entry.size > length_ - entry.offset)
+      return Fail("tensor " + tensor.name + " is out of bounds");
+
+    tensor.data = bytes + entry.offset;
+    tensor.size = entry.size;
+    tensors_.push_back(tensor);
+    cursor += entry_size;
+  }
+
+  version_ = header.version;
+  return true;
+}
+
+void Reader::Close() {
+  if (mapped_) {
+#ifdef _WIN32
+    UnmapViewOfFile(base_);
+#else
+    munmap(base_, length_);
+#endif
+  }
+  base_ = nullptr;
+  length_ = 0;
+  mapped_ = false;
+  version_ = 0;
+  tensors_.clear();
+}
+
+const TensorInfo* Reader::Find(const int layer, const std::string& name) const {
+  for (const auto& tensor : tensors_)
+    if (tensor.layer == layer && tensor.name == name)
+      return &tensor;
+  return nullptr;
+}
+
+bool Reader::Fail(const std::string& message) {
+  Close();
+  error_ = message;
+  return false;
+}
+
+}  // namespace model_file
+}  // namespace v0
+}  // namespace haste
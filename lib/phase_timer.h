@@ -0,0 +1,97 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cuda_runtime_api.h>
+
+#include "haste/stats.h"
+
+// Instrumentation hooks for `haste/stats.h`. Without `HASTE_ENABLE_STATS` every macro
+// below expands to nothing, so the engines compile exactly as if they weren't there.
+//
+//   HASTE_STATS_BEGIN(timer, kLstm, kInputGemm, stream);
+//   blas<T>::gemm(...);
+//   HASTE_STATS_END(timer);
+
+#ifdef HASTE_ENABLE_STATS
+
+namespace haste {
+namespace v0 {
+namespace stats {
+namespace internal {
+
+// Records a pair of timing events around work queued on `stream`.
+class PhaseTimer {
+  public:
+    PhaseTimer(Layer layer, Phase phase, cudaStream_t stream);
+
+    // Attributes the phase to the layer of the innermost enclosing `LayerScope` on this
+    // thread, or to `Layer::kLayerNorm` if there is none. Used by building blocks such as
+    // `layer_norm::ForwardPass` that are shared between layers.
+    PhaseTimer(Phase phase, cudaStream_t stream);
+
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    void Stop();
+
+  private:
+    Layer layer_;
+    Phase phase_;
+    cudaStream_t stream_;
+    cudaEvent_t start_;
+    bool running_;
+};
+
+class LayerScope {
+  public:
+    explicit LayerScope(Layer layer);
+    ~LayerScope();
+
+  private:
+    Layer saved_;
+};
+
+void RecordAllocation(size_t bytes);
+
+}  // namespace internal
+}  // namespace stats
+}  // namespace v0
+}  // namespace haste
+
+#define HASTE_STATS_BEGIN(timer, layer, phase, stream) \
+    haste::v0::stats::internal::PhaseTimer timer( \
+        haste::v0::stats::Layer::layer, haste::v0::stats::Phase::phase, stream)
+#define HASTE_STATS_BEGIN_SHARED(timer, phase, stream) \
+    haste::v0::stats::internal::PhaseTimer timer(haste::v0::stats::Phase::phase, stream)
+#define HASTE_STATS_END(timer) timer.Stop()
+#define HASTE_STATS_LAYER(layer) \
+    const haste::v0::stats::internal::LayerScope haste_stats_layer_scope( \
+        haste::v0::stats::Layer::layer)
+#define HASTE_STATS_ALLOCATION(bytes) haste::v0::stats::internal::RecordAllocation(bytes)
+
+#else
+
+#define HASTE_STATS_BEGIN(timer, layer, phase, stream)
+#define HASTE_STATS_BEGIN_SHARED(timer, phase, stream)
+#define HASTE_STATS_END(timer)
+#define HASTE_STATS_LAYER(layer)
+#define HASTE_STATS_ALLOCATION(bytes)
+
+#endif
@@ -0,0 +1,289 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <algorithm>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+#include <vector>
+
+#include "haste.h"
+#include "phase_timer.h"
+
+namespace {
+
+// Copies the state of each node's parent (or `root` for children of the root) into
+// consecutive rows of `out`. A null `root` stands for zeros.
+template<typename T>
+__global__
+void GatherParents(
+    const int count,
+    const int hidden_size,
+    const int* parent,  // [count]
+    const T* root,      // [H] or null
+    const T* states,    // [nodes,H]
+    T* out) {           // [count,H]
+  const int size = count * hidden_size;
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    const int node = i / hidden_size;
+    const int j = i - node * hidden_size;
+    const int p = parent[node];
+    if (p >= 0)
+      out[i] = states[p * hidden_size + j];
+    else
+      out[i] = root ? root[j] : static_cast<T>(0.0);
+  }
+}
+
+template<typename T>
+void Gather(
+    const int count,
+    const int hidden_size,
+    const int* parent,
+    const T* root,
+    const T* states,
+    T* out,
+    const cudaStream_t& stream) {
+  const int threads = 256;
+  const int blocks = (count * hidden_size + threads - 1) / threads;
+  GatherParents<T><<<blocks, threads, 0, stream>>>(count, hidden_size, parent, root, states, out);
+}
+
+// Copies the inputs of the nodes of one run into the first rows of `x_level` and zeros
+// the padding rows, whose states are computed and then discarded.
+template<typename T>
+void StageRun(
+    const int width,
+    const int max_width,
+    const int input_size,
+    const int hidden_size,
+    const T* x,
+    T* x_level,
+    T* h_level,
+    T* c_level,
+    const cudaStream_t& stream) {
+  const size_t C = input_size;
+  const size_t H = hidden_size;
+  const size_t padding = max_width - width;
+  cudaMemcpyAsync(x_level, x, width * C * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+  if (!padding)
+    return;
+  cudaMemsetAsync(x_level + width * C, 0, padding * C * sizeof(T), stream);
+  cudaMemsetAsync(h_level + width * H, 0, padding * H * sizeof(T), stream);
+  if (c_level)
+    cudaMemsetAsync(c_level + width * H, 0, padding * H * sizeof(T), stream);
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace prefix_tree {
+
+template<typename T>
+struct ForwardPass<T>::private_data {
+  int input_size;
+  int hidden_size;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream;
+  std::vector<int> level_start;  // first node of each run, plus `nodes` at the end
+  int max_width;
+  int* parent;                   // [nodes] device copy of the caller's `parent`
+  int parent_capacity;
+  T* workspace;                  // per-run inputs, states, and engine scratch
+  size_t workspace_capacity;
+};
+
+template<typename T>
+ForwardPass<T>::ForwardPass(
+    const int input_size,
+    const int hidden_size,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->blas_handle = blas_handle;
+  data_->stream = stream;
+  data_->max_width = 0;
+  data_->parent = nullptr;
+  data_->parent_capacity = 0;
+  data_->workspace = nullptr;
+  data_->workspace_capacity = 0;
+}
+
+template<typename T>
+ForwardPass<T>::~ForwardPass() {
+  cudaStreamSynchronize(data_->stream);
+  cudaFree(data_->workspace);
+  cudaFree(data_->parent);
+  delete data_;
+}
+
+template<typename T>
+int ForwardPass<T>::Schedule(const int nodes, const int* parent) {
+  std::vector<int>& level_start = data_->level_start;
+  std::vector<int> depth(nodes);
+  level_start.clear();
+  data_->max_width = 0;
+  for (int i = 0; i < nodes; ++i) {
+    // Parents must already be evaluated, which also keeps `depth` in bounds.
+    if (parent[i] < -1 || parent[i] >= i)
+      return -1;
+    depth[i] = parent[i] < 0 ? 0 : depth[parent[i]] + 1;
+    if (!i || depth[i] != depth[i - 1])
+      level_start.push_back(i);
+  }
+  level_start.push_back(nodes);
+  for (size_t l = 0; l + 1 < level_start.size(); ++l)
+    data_->max_width = std::max(data_->max_width, level_start[l + 1] - level_start[l]);
+
+  // The engines run every step at width W = `max_width`, padding narrower runs: inputs
+  // [W,C], previous and new hidden and cell states [2,W,H] each, plus the engines' `v`
+  // [W,H*4], `tmp_Wx` [W,H*3] (GRU only), and `tmp_Rh` [W,H*4].
+  const size_t workspace_size = static_cast<size_t>(data_->max_width) *
+      (data_->input_size + data_->hidden_size * (2 + 2 + 4 + 3 + 4));
+  if (workspace_size > data_->workspace_capacity) {
+    cudaFree(data_->workspace);
+    cudaMalloc(&data_->workspace, workspace_size * sizeof(T));
+    HASTE_STATS_ALLOCATION(workspace_size * sizeof(T));
+    data_->workspace_capacity = workspace_size;
+  }
+  if (nodes > data_->parent_capacity) {
+    cudaFree(data_->parent);
+    cudaMalloc(&data_->parent, nodes * sizeof(int));
+    HASTE_STATS_ALLOCATION(nodes * sizeof(int));
+    data_->parent_capacity = nodes;
+  }
+  cudaMemcpyAsync(data_->parent, parent, nodes * sizeof(int), cudaMemcpyHostToDevice, data_->stream);
+  return level_start.size() - 1;
+}
+
+template<typename T>
+bool ForwardPass<T>::RunLstm(
+    const int nodes,
+    const int* parent,  // [nodes] host
+    const T* W,         // [C,H*4]
+    const T* R,         // [H,H*4]
+    const T* b,         // [H*4]
+    const T* x,         // [nodes,C]
+    const T* h0,        // [H] or null
+    const T* c0,        // [H] or null
+    T* h,               // [nodes,H]
+    T* c) {             // [nodes,H]
+  if (!nodes)
+    return true;
+
+  const int levels = Schedule(nodes, parent);
+  if (levels < 0)
+    return false;
+
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const int max_width = data_->max_width;
+  const cudaStream_t stream = data_->stream;
+  const size_t H = hidden_size;
+
+  T* x_level = data_->workspace;
+  T* h_level = x_level + max_width * static_cast<size_t>(input_size);
+  T* c_level = h_level + 2 * max_width * H;
+  T* v = c_level + 2 * max_width * H;
+  T* tmp_Rh = v + max_width * H * 4;
+
+  // One engine for every step; creating it sets up streams and events.
+  lstm::ForwardPass<T> forward(false, max_width, input_size, hidden_size, data_->blas_handle, stream);
+  for (int l = 0; l < levels; ++l) {
+    const int first = data_->level_start[l];
+    const int width = data_->level_start[l + 1] - first;
+    StageRun<T>(width, max_width, input_size, hidden_size, x + first * input_size, x_level, h_level, c_level, stream);
+    Gather(width, hidden_size, data_->parent + first, h0, h, h_level, stream);
+    Gather(width, hidden_size, data_->parent + first, c0, c, c_level, stream);
+    forward.Run(
+        1,
+        W,
+        R,
+        b,
+        x_level,
+        h_level,
+        c_level,
+        v,
+        tmp_Rh,
+        0.0f,
+        nullptr);
+    cudaMemcpyAsync(h + first * H, h_level + max_width * H, width * H * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+    cudaMemcpyAsync(c + first * H, c_level + max_width * H, width * H * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+  }
+  return true;
+}
+
+template<typename T>
+bool ForwardPass<T>::RunGru(
+    const int nodes,
+    const int* parent,  // [nodes] host
+    const T* W,         // [C,H*3]
+    const T* R,         // [H,H*3]
+    const T* bx,        // [H*3]
+    const T* br,        // [H*3]
+    const T* x,         // [nodes,C]
+    const T* h0,        // [H] or null
+    T* h) {             // [nodes,H]
+  if (!nodes)
+    return true;
+
+  const int levels = Schedule(nodes, parent);
+  if (levels < 0)
+    return false;
+
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const int max_width = data_->max_width;
+  const cudaStream_t stream = data_->stream;
+  const size_t H = hidden_size;
+
+  T* x_level = data_->workspace;
+  T* h_level = x_level + max_width * static_cast<size_t>(input_size);
+  T* v = h_level + 4 * max_width * H;
+  T* tmp_Wx = v + max_width * H * 4;
+  T* tmp_Rh = tmp_Wx + max_width * H * 3;
+
+  // One engine for every step; creating it sets up streams and events.
+  gru::ForwardPass<T> forward(false, max_width, input_size, hidden_size, data_->blas_handle, stream);
+  for (int l = 0; l < levels; ++l) {
+    const int first = data_->level_start[l];
+    const int width = data_->level_start[l + 1] - first;
+    StageRun<T>(width, max_width, input_size, hidden_size, x + first * input_size, x_level, h_level, nullptr, stream);
+    Gather(width, hidden_size, data_->parent + first, h0, h, h_level, stream);
+    forward.Run(
+        1,
+        W,
+        R,
+        bx,
+        br,
+        x_level,
+        h_level,
+        v,
+        tmp_Wx,
+        tmp_Rh,
+        0.0f,
+        nullptr);
+    cudaMemcpyAsync(h + first * H, h_level + max_width * H, width * H * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+  }
+  return true;
+}
+
+template class ForwardPass<float>;
+template class ForwardPass<double>;
+
+}  // namespace prefix_tree
+}  // namespace v0
+}  // namespace haste
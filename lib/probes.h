@@ -0,0 +1,98 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include "haste/stats.h"
+
+// Static user-level tracepoints (USDT) for tracing the engines in production with
+// eBPF or SystemTap, e.g.
+//
+//   bpftrace -e 'usdt:./libhaste_tf.so:haste:run__entry { @[arg0, arg1, arg3] = count(); }'
+//
+// An unattached probe is a single `nop` in the instruction stream, so the probes are
+// always compiled in when `<sys/sdt.h>` is available. Define `HASTE_DISABLE_PROBES` to
+// leave them out regardless.
+//
+// Provider `haste`, probes and arguments:
+//   run__entry, run__return           layer, N, C, H, steps
+//   iterate__entry, iterate__return   layer, N, C, H, 1
+//   step__entry, step__return         layer, N, C, H, step index
+//   gemm                              layer, phase, M, N, K
+//
+// `layer` and `phase` are the integer values of `haste::v0::stats::Layer` and
+// `haste::v0::stats::Phase`. Backward passes fire the same probes as forward passes;
+// tell them apart by the address of the probe site or by nesting under the caller.
+
+#if !defined(HASTE_DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HASTE_HAVE_PROBES
+#endif
+#endif
+
+#ifdef HASTE_HAVE_PROBES
+
+namespace haste {
+namespace v0 {
+namespace probes {
+
+#define HASTE_DEFINE_PROBE_SCOPE(Name, entry, exit) \
+  class Name { \
+    public: \
+      Name(int layer, int N, int C, int H, int step) \
+          : layer_(layer), N_(N), C_(C), H_(H), step_(step) { \
+        DTRACE_PROBE5(haste, entry, layer_, N_, C_, H_, step_); \
+      } \
+      ~Name() { \
+        DTRACE_PROBE5(haste, exit, layer_, N_, C_, H_, step_); \
+      } \
+    private: \
+      int layer_, N_, C_, H_, step_; \
+  }
+
+HASTE_DEFINE_PROBE_SCOPE(RunScope, run__entry, run__return);
+HASTE_DEFINE_PROBE_SCOPE(IterateScope, iterate__entry, iterate__return);
+HASTE_DEFINE_PROBE_SCOPE(StepScope, step__entry, step__return);
+
+#undef HASTE_DEFINE_PROBE_SCOPE
+
+}  // namespace probes
+}  // namespace v0
+}  // namespace haste
+
+#define HASTE_PROBE_RUN(layer, N, C, H, steps) \
+    const haste::v0::probes::RunScope haste_probe_run( \
+        static_cast<int>(haste::v0::stats::Layer::layer), N, C, H, steps)
+#define HASTE_PROBE_ITERATE(layer, N, C, H) \
+    const haste::v0::probes::IterateScope haste_probe_iterate( \
+        static_cast<int>(haste::v0::stats::Layer::layer), N, C, H, 1)
+#define HASTE_PROBE_STEP(layer, N, C, H, step) \
+    const haste::v0::probes::StepScope haste_probe_step( \
+        static_cast<int>(haste::v0::stats::Layer::layer), N, C, H, step)
+#define HASTE_PROBE_GEMM(layer, phase, M, N, K) \
+    DTRACE_PROBE5(haste, gemm, \
+        static_cast<int>(haste::v0::stats::Layer::layer), \
+        static_cast<int>(haste::v0::stats::Phase::phase), \
+        static_cast<int>(M), static_cast<int>(N), static_cast<int>(K))
+
+#else
+
+#define HASTE_PROBE_RUN(layer, N, C, H, steps)
+#define HASTE_PROBE_ITERATE(layer, N, C, H)
+#define HASTE_PROBE_STEP(layer, N, C, H, step)
+#define HASTE_PROBE_GEMM(layer, phase, M, N, K)
+
+#endif
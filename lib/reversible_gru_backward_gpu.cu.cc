@@ -0,0 +1,313 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cassert>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+#include "blas.h"
+#include "haste.h"
+#include "phase_timer.h"
+#include "probes.h"
+#include "reversible_ops.h"
+
+namespace {
+
+using namespace haste::v0::reversible_gru::internal;
+
+// Reconstructs one half of the previous hidden state in place in `h_state` and computes
+// the gradients of that half's update.
+template<typename T>
+__global__
+void ReversibleGruBwdOps(
+    const int batch_size,
+    const int hidden_size,
+    const int half,
+    const T* Wx,                 // [N,H*3]
+    const T* Rh,                 // [N,H*3/2]
+    const T* bx,                 // [H*3]
+    const T* br,                 // [H*3]
+    const uint8_t* remainder,    // [N,H]
+    const T* dh_new,             // [N,H]
+    T* h_state,                  // [N,H]
+    T* dh_inout,                 // [N,H]
+    T* dbx_out,                  // [H*3]
+    T* dbr_out,                  // [H*3]
+    T* dp_out,                   // [N,H*3]
+    T* dq_out) {                 // [N,H*3/2]
+  const int half_size = hidden_size / 2;
+  const int row = blockDim.x * blockIdx.x + threadIdx.x;
+  const int col = blockDim.y * blockIdx.y + threadIdx.y;
+
+  if (row >= half_size || col >= batch_size)
+    return;
+
+  const Gates<T> gates = ComputeGates(hidden_size, half, row, col, Wx, Rh, bx, br);
+
+  // h_prev = (2^kForgetBits * (h - u) + remainder) / m, where the division is exact.
+  const int idx = col * hidden_size + half * half_size + row;
+  const long long kept = ToFixed(h_state[idx]) - gates.u;
+  const long long product = kept * (1 << kForgetBits) + remainder[idx];
+  const T h_prev = FromFixed<T>(product / gates.m);
+  h_state[idx] = h_prev;
+
+  const T one = static_cast<T>(1.0);
+  const T z = static_cast<T>(gates.m) / static_cast<T>(1 << kForgetBits);
+  const T dh_total = dh_new[idx] + dh_inout[idx];
+  const T dg = dh_total * (one - z) * d_tanh(gates.g);
+  const T dz = dh_total * (h_prev - gates.g) * d_sigmoid(gates.z);
+  const T dr = dg * gates.Rh_g * d_sigmoid(gates.r);
+  dh_inout[idx] = dh_total * z;
+
+  const int b_idx = half * half_size * 3 + row;
+  const int dp_idx = col * hidden_size * 3 + b_idx;
+  const int dq_idx = col * half_size * 3 + row;
+
+  dp_out[dp_idx + 0 * half_size] = dz;
+  dp_out[dp_idx + 1 * half_size] = dr;
+  dp_out[dp_idx + 2 * half_size] = dg;
+
+  dq_out[dq_idx + 0 * half_size] = dz;
+  dq_out[dq_idx + 1 * half_size] = dr;
+  dq_out[dq_idx + 2 * half_size] = dg * gates.r;
+
+  atomicAdd(&dbx_out[b_idx + 0 * half_size], dz);
+  atomicAdd(&dbx_out[b_idx + 1 * half_size], dr);
+  atomicAdd(&dbx_out[b_idx + 2 * half_size], dg);
+
+  atomicAdd(&dbr_out[b_idx + 0 * half_size], dz);
+  atomicAdd(&dbr_out[b_idx + 1 * half_size], dr);
+  atomicAdd(&dbr_out[b_idx + 2 * half_size], dg * gates.r);
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace reversible_gru {
+
+template<typename T>
+struct BackwardPass<T>::private_data {
+  int batch_size;
+  int input_size;
+  int hidden_size;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream;
+  cudaEvent_t event;
+  cudaStream_t sync_stream;
+};
+
+template<typename T>
+BackwardPass<T>::BackwardPass(
+    const int batch_size,
+    const int input_size,
+    const int hidden_size,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  assert(hidden_size % 2 == 0);
+  data_->batch_size = batch_size;
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
+  cudaStreamCreate(&data_->stream);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
+}
+
+template<typename T>
+BackwardPass<T>::~BackwardPass() {
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream);
+  }
+  cudaEventDestroy(data_->event);
+  cudaStreamDestroy(data_->stream);
+  delete data_;
+}
+
+template<typename T>
+void BackwardPass<T>::Run(
+    const int steps,
+    const T* W,                // [C,H*3]
+    const T* R,                // [H/2,H*3]
+    const T* bx,               // [H*3]
+    const T* br,               // [H*3]
+    const T* x,                // [T,N,C]
+    const T* h,                // [N,H]
+    const uint8_t* remainder,  // [T,N,H]
+    const T* dh_new,           // [T+1,N,H]
+    T* dx,                     // [T,N,C]
+    T* dW,                     // [C,H*3]
+    T* dR,                     // [H/2,H*3]
+    T* dbx,                    // [H*3]
+    T* dbr,                    // [H*3]
+    T* dh,                     // [N,H]
+    T* workspace) {            // [N,H*11]
+  HASTE_PROBE_RUN(kReversibleGru, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  const T alpha = static_cast<T>(1.0);
+  const T beta_sum = static_cast<T>(1.0);
+  const T beta_assign = static_cast<T>(0.0);
+
+  const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
+
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const int half_size = hidden_size / 2;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+  const cudaStream_t stream = data_->stream;
+
+  // Same layout as the forward pass up to `tmp_Rh` so that the recomputed GEMMs see
+  // identically aligned operands.
+  const int NH = batch_size * hidden_size;
+  T* h_state = workspace;
+  T* tmp_Wx = h_state + NH;
+  T* tmp_Rh = tmp_Wx + NH * 3;
+  T* dp = workspace + NH * 6;
+  T* dq = dp + NH * 3;
+
+  cudaStream_t save_stream;
+  cublasGetStream(blas_handle, &save_stream);
+
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream, data_->event, 0);
+  }
+
+  cudaMemcpyAsync(h_state, h, NH * sizeof(T), cudaMemcpyDeviceToDevice, stream);
+
+  const dim3 blockDim(64, 16);
+  const dim3 gridDim(
+      (half_size + blockDim.x - 1) / blockDim.x,
+      (batch_size + blockDim.y - 1) / blockDim.y);
+
+  cublasSetStream(blas_handle, stream);
+  const blas<void>::set_default_math scoped2(blas_handle);
+  DisableBlasWorkspace(blas_handle);
+  for (int i = steps - 1; i >= 0; --i) {
+    HASTE_PROBE_STEP(kReversibleGru, batch_size, input_size, hidden_size, i);
+    const T* x_i = x + i * batch_size * input_size;
+
+    HASTE_PROBE_GEMM(kReversibleGru, kInputGemm, hidden_size * 3, batch_size, input_size);
+    HASTE_STATS_BEGIN(tmp_Wx_timer, kReversibleGru, kInputGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, batch_size, input_size,
+        &alpha,
+        W, hidden_size * 3,
+        x_i, input_size,
+        &beta_assign,
+        tmp_Wx, hidden_size * 3);
+    HASTE_STATS_END(tmp_Wx_timer);
+
+    // Undo the forward updates in reverse order: the second half was computed from the
+    // first half's new state, the first half from the second half's previous state.
+    for (int half = 1; half >= 0; --half) {
+      const int other = 1 - half;
+      const T* R_half = R + half * half_size * 3;
+
+      HASTE_PROBE_GEMM(kReversibleGru, kRecurrentGemm, half_size * 3, batch_size, half_size);
+      HASTE_STATS_BEGIN(tmp_Rh_timer, kReversibleGru, kRecurrentGemm, stream);
+      blas<T>::gemm(blas_handle,
+          CUBLAS_OP_N, CUBLAS_OP_N,
+          half_size * 3, batch_size, half_size,
+          &alpha,
+          R_half, hidden_size * 3,
+          h_state + other * half_size, hidden_size,
+          &beta_assign,
+          tmp_Rh, half_size * 3);
+      HASTE_STATS_END(tmp_Rh_timer);
+
+      HASTE_STATS_BEGIN(pointwise_timer, kReversibleGru, kPointwise, stream);
+      ReversibleGruBwdOps<T><<<gridDim, blockDim, 0, stream>>>(
+          batch_size,
+          hidden_size,
+          half,
+          tmp_Wx,
+          tmp_Rh,
+          bx,
+          br,
+          remainder + i * NH,
+          dh_new + (i + 1) * NH,
+          h_state,
+          dh,
+          dbx,
+          dbr,
+          dp,
+          dq);
+      HASTE_STATS_END(pointwise_timer);
+
+      HASTE_PROBE_GEMM(kReversibleGru, kReduction, half_size * 3, half_size, batch_size);
+      HASTE_STATS_BEGIN(dR_timer, kReversibleGru, kReduction, stream);
+      blas<T>::gemm(blas_handle,
+          CUBLAS_OP_N, CUBLAS_OP_T,
+          half_size * 3, half_size, batch_size,
+          &alpha,
+          dq, half_size * 3,
+          h_state + other * half_size, hidden_size,
+          &beta_sum,
+          dR + half * half_size * 3, hidden_size * 3);
+      HASTE_STATS_END(dR_timer);
+
+      HASTE_PROBE_GEMM(kReversibleGru, kRecurrentGemm, half_size, batch_size, half_size * 3);
+      HASTE_STATS_BEGIN(dh_timer, kReversibleGru, kRecurrentGemm, stream);
+      blas<T>::gemm(blas_handle,
+          CUBLAS_OP_T, CUBLAS_OP_N,
+          half_size, batch_size, half_size * 3,
+          &alpha,
+          R_half, hidden_size * 3,
+          dq, half_size * 3,
+          &beta_sum,
+          dh + other * half_size, hidden_size);
+      HASTE_STATS_END(dh_timer);
+    }
+
+    HASTE_PROBE_GEMM(kReversibleGru, kReduction, hidden_size * 3, input_size, batch_size);
+    HASTE_STATS_BEGIN(dW_timer, kReversibleGru, kReduction, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_T,
+        hidden_size * 3, input_size, batch_size,
+        &alpha,
+        dp, hidden_size * 3,
+        x_i, input_size,
+        &beta_sum,
+        dW, hidden_size * 3);
+    HASTE_STATS_END(dW_timer);
+
+    HASTE_PROBE_GEMM(kReversibleGru, kInputGemm, input_size, batch_size, hidden_size * 3);
+    HASTE_STATS_BEGIN(dx_timer, kReversibleGru, kInputGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_T, CUBLAS_OP_N,
+        input_size, batch_size, hidden_size * 3,
+        &alpha,
+        W, hidden_size * 3,
+        dp, hidden_size * 3,
+        &beta_assign,
+        dx + i * batch_size * input_size, input_size);
+    HASTE_STATS_END(dx_timer);
+  }
+
+  cublasSetStream(blas_handle, save_stream);
+}
+
+template class BackwardPass<float>;
+template class BackwardPass<double>;
+
+}  // namespace reversible_gru
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,246 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <cassert>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+
+#include "blas.h"
+#include "haste.h"
+#include "phase_timer.h"
+#include "probes.h"
+#include "reversible_ops.h"
+
+namespace {
+
+using namespace haste::v0::reversible_gru::internal;
+
+// Rounds the initial state onto the fixed-point grid, saturating it to [-1,1] first since
+// the grid only represents states in that range exactly.
+template<typename T>
+__global__
+void Quantize(const int size, T* h, T* h_state) {
+  for (int i = blockDim.x * blockIdx.x + threadIdx.x; i < size; i += blockDim.x * gridDim.x) {
+    const T clamped = h[i] > static_cast<T>(1.0) ? static_cast<T>(1.0)
+        : (h[i] < static_cast<T>(-1.0) ? static_cast<T>(-1.0) : h[i]);
+    const T value = FromFixed<T>(ToFixed(clamped));
+    h[i] = value;
+    h_state[i] = value;
+  }
+}
+
+// Updates one half of the hidden state in place in `h_state` and copies it to `h_out`.
+template<typename T, bool Training>
+__global__
+void ReversibleGruFwdOps(
+    const int batch_size,
+    const int hidden_size,
+    const int half,
+    const T* Wx,           // [N,H*3]
+    const T* Rh,           // [N,H*3/2]
+    const T* bx,           // [H*3]
+    const T* br,           // [H*3]
+    T* h_state,            // [N,H]
+    T* h_out,              // [N,H]
+    uint8_t* remainder) {  // [N,H]
+  const int half_size = hidden_size / 2;
+  const int row = blockDim.x * blockIdx.x + threadIdx.x;
+  const int col = blockDim.y * blockIdx.y + threadIdx.y;
+
+  if (row >= half_size || col >= batch_size)
+    return;
+
+  const Gates<T> gates = ComputeGates(hidden_size, half, row, col, Wx, Rh, bx, br);
+
+  // h = m * h / 2^kForgetBits + u, keeping the bits shifted out of the product.
+  const int idx = col * hidden_size + half * half_size + row;
+  const long long product = ToFixed(h_state[idx]) * gates.m;
+  const long long kept = product >> kForgetBits;
+  if (Training)
+    remainder[idx] = static_cast<uint8_t>(product - kept * (1 << kForgetBits));
+
+  const T value = FromFixed<T>(kept + gates.u);
+  h_state[idx] = value;
+  h_out[idx] = value;
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace reversible_gru {
+
+template<typename T>
+struct ForwardPass<T>::private_data {
+  bool training;
+  int batch_size;
+  int input_size;
+  int hidden_size;
+  cublasHandle_t blas_handle;
+  cudaStream_t stream;
+  cudaEvent_t event;
+  cudaStream_t sync_stream;
+};
+
+template<typename T>
+ForwardPass<T>::ForwardPass(
+    const bool training,
+    const int batch_size,
+    const int input_size,
+    const int hidden_size,
+    const cublasHandle_t& blas_handle,
+    const cudaStream_t& stream) : data_(new private_data) {
+  assert(hidden_size % 2 == 0);
+  data_->training = training;
+  data_->batch_size = batch_size;
+  data_->input_size = input_size;
+  data_->hidden_size = hidden_size;
+  data_->blas_handle = blas_handle;
+  data_->sync_stream = stream;
+  cudaStreamCreate(&data_->stream);
+  cudaEventCreateWithFlags(&data_->event, cudaEventDisableTiming);
+}
+
+template<typename T>
+ForwardPass<T>::~ForwardPass() {
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->stream);
+    cudaStreamWaitEvent(data_->sync_stream, data_->event, 0);
+  } else {
+    cudaStreamSynchronize(data_->stream);
+  }
+  cudaEventDestroy(data_->event);
+  cudaStreamDestroy(data_->stream);
+  delete data_;
+}
+
+template<typename T>
+void ForwardPass<T>::Run(
+    const int steps,
+    const T* W,             // [C,H*3]
+    const T* R,             // [H/2,H*3]
+    const T* bx,            // [H*3]
+    const T* br,            // [H*3]
+    const T* x,             // [T,N,C]
+    T* h,                   // [T+1,N,H]
+    uint8_t* remainder,     // [T,N,H]
+    T* workspace) {         // [N,H*6]
+  HASTE_PROBE_RUN(kReversibleGru, data_->batch_size, data_->input_size, data_->hidden_size, steps);
+  static const T alpha = static_cast<T>(1.0);
+  static const T beta = static_cast<T>(0.0);
+
+  const blas<void>::set_pointer_mode scoped1(data_->blas_handle);
+
+  const bool training = data_->training;
+  const int batch_size = data_->batch_size;
+  const int input_size = data_->input_size;
+  const int hidden_size = data_->hidden_size;
+  const int half_size = hidden_size / 2;
+  const cublasHandle_t blas_handle = data_->blas_handle;
+  const cudaStream_t stream = data_->stream;
+
+  // The backward pass lays out the start of its workspace the same way.
+  const int NH = batch_size * hidden_size;
+  T* h_state = workspace;
+  T* tmp_Wx = h_state + NH;
+  T* tmp_Rh = tmp_Wx + NH * 3;
+
+  cudaStream_t save_stream;
+  cublasGetStream(blas_handle, &save_stream);
+
+  // Make sure inputs produced on the caller's stream are ready before we use them.
+  if (data_->sync_stream) {
+    cudaEventRecord(data_->event, data_->sync_stream);
+    cudaStreamWaitEvent(data_->stream, data_->event, 0);
+  }
+
+  Quantize<T><<<(NH + 255) / 256, 256, 0, stream>>>(NH, h, h_state);
+
+  const dim3 blockDim(64, 16);
+  const dim3 gridDim(
+      (half_size + blockDim.x - 1) / blockDim.x,
+      (batch_size + blockDim.y - 1) / blockDim.y);
+
+  cublasSetStream(blas_handle, stream);
+  const blas<void>::set_default_math scoped2(blas_handle);
+  DisableBlasWorkspace(blas_handle);
+  for (int i = 0; i < steps; ++i) {
+    HASTE_PROBE_STEP(kReversibleGru, batch_size, input_size, hidden_size, i);
+    HASTE_PROBE_GEMM(kReversibleGru, kInputGemm, hidden_size * 3, batch_size, input_size);
+    HASTE_STATS_BEGIN(tmp_Wx_timer, kReversibleGru, kInputGemm, stream);
+    blas<T>::gemm(blas_handle,
+        CUBLAS_OP_N, CUBLAS_OP_N,
+        hidden_size * 3, batch_size, input_size,
+        &alpha,
+        W, hidden_size * 3,
+        x + i * batch_size * input_size, input_size,
+        &beta,
+        tmp_Wx, hidden_size * 3);
+    HASTE_STATS_END(tmp_Wx_timer);
+
+    // The first half sees the second half's previous state, the second half sees the
+    // first half's new state.
+    for (int half = 0; half < 2; ++half) {
+      HASTE_PROBE_GEMM(kReversibleGru, kRecurrentGemm, half_size * 3, batch_size, half_size);
+      HASTE_STATS_BEGIN(tmp_Rh_timer, kReversibleGru, kRecurrentGemm, stream);
+      blas<T>::gemm(blas_handle,
+          CUBLAS_OP_N, CUBLAS_OP_N,
+          half_size * 3, batch_size, half_size,
+          &alpha,
+          R + half * half_size * 3, hidden_size * 3,
+          h_state + (1 - half) * half_size, hidden_size,
+          &beta,
+          tmp_Rh, half_size * 3);
+      HASTE_STATS_END(tmp_Rh_timer);
+
+      HASTE_STATS_BEGIN(pointwise_timer, kReversibleGru, kPointwise, stream);
+      if (training) {
+        ReversibleGruFwdOps<T, true><<<gridDim, blockDim, 0, stream>>>(
+            batch_size,
+            hidden_size,
+            half,
+            tmp_Wx,
+            tmp_Rh,
+            bx,
+            br,
+            h_state,
+            h + (i + 1) * NH,
+            remainder + i * NH);
+      } else {
+        ReversibleGruFwdOps<T, false><<<gridDim, blockDim, 0, stream>>>(
+            batch_size,
+            hidden_size,
+            half,
+            tmp_Wx,
+            tmp_Rh,
+            bx,
+            br,
+            h_state,
+            h + (i + 1) * NH,
+            nullptr);
+      }
+      HASTE_STATS_END(pointwise_timer);
+    }
+  }
+
+  cublasSetStream(blas_handle, save_stream);
+}
+
+template class ForwardPass<float>;
+template class ForwardPass<double>;
+
+}  // namespace reversible_gru
+}  // namespace v0
+}  // namespace haste
@@ -0,0 +1,115 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#pragma once
+
+#include <cublas_v2.h>
+
+#include "inline_ops.h"
+
+// Fixed-point helpers shared by the reversible GRU forward and backward passes. Both
+// passes must compute bit-identical gate values from identical inputs, so everything
+// that feeds the state update goes through these functions, with explicitly rounded
+// arithmetic so that the compiler can't contract it differently in the two kernels.
+
+namespace haste {
+namespace v0 {
+namespace reversible_gru {
+namespace internal {
+
+// States are multiples of 2^-kFractionBits. With |h| <= 1 they need at most 24
+// significant bits, so they are stored exactly in a float.
+constexpr int kFractionBits = 23;
+// Update gates are rounded to multiples of 2^-kForgetBits. This is also the number of
+// bits per unit and step that each update shifts out and the backward pass needs back.
+constexpr int kForgetBits = 8;
+
+__device__ __forceinline__ float add_rn(const float a, const float b) { return __fadd_rn(a, b); }
+__device__ __forceinline__ double add_rn(const double a, const double b) { return __dadd_rn(a, b); }
+__device__ __forceinline__ float mul_rn(const float a, const float b) { return __fmul_rn(a, b); }
+__device__ __forceinline__ double mul_rn(const double a, const double b) { return __dmul_rn(a, b); }
+
+// cuBLAS may pick a different GEMM kernel depending on the workspace it has for the
+// current stream, and the two passes run on different streams. Without a workspace the
+// choice only depends on the problem, so the backward pass recomputes the same products.
+// Lasts until the next `cublasSetStream`, which restores the default workspace. Older
+// cuBLAS versions need `CUBLAS_WORKSPACE_CONFIG=:4096:8` in the environment instead.
+inline void DisableBlasWorkspace(const cublasHandle_t handle) {
+#if CUBLAS_VER_MAJOR > 11 || (CUBLAS_VER_MAJOR == 11 && CUBLAS_VER_MINOR >= 4)
+  cublasSetWorkspace(handle, nullptr, 0);
+#endif
+}
+
+template<typename T>
+__device__ __forceinline__
+long long ToFixed(const T x) {
+  return llrint(static_cast<double>(x) * (1ll << kFractionBits));
+}
+
+template<typename T>
+__device__ __forceinline__
+T FromFixed(const long long x) {
+  return static_cast<T>(static_cast<double>(x) / (1ll << kFractionBits));
+}
+
+template<typename T>
+struct Gates {
+  T z;         // update gate before quantization
+  T r;         // reset gate
+  T g;         // candidate state
+  T Rh_g;      // recurrent term of the candidate (including its bias) before the reset gate
+  int m;       // quantized update gate, z ~= m / 2^kForgetBits with 1 <= m <= 2^kForgetBits
+  long long u; // (1 - m / 2^kForgetBits) * g in fixed point
+};
+
+// Gate values of hidden unit `row` of one half for batch entry `col`.
+// Wx: [N,H*3] this step's input projections, Rh: [N,H*3/2] this half's recurrent term.
+template<typename T>
+__device__ __forceinline__
+Gates<T> ComputeGates(
+    const int hidden_size,
+    const int half,
+    const int row,
+    const int col,
+    const T* Wx,
+    const T* Rh,
+    const T* bx,
+    const T* br) {
+  const int half_size = hidden_size / 2;
+  const int b_idx = half * half_size * 3 + row;
+  const int Wx_idx = col * hidden_size * 3 + b_idx;
+  const int Rh_idx = col * half_size * 3 + row;
+
+  const int z = 0 * half_size;
+  const int r = 1 * half_size;
+  const int g = 2 * half_size;
+
+  Gates<T> gates;
+  gates.z = sigmoid(add_rn(add_rn(Wx[Wx_idx + z], bx[b_idx + z]), add_rn(Rh[Rh_idx + z], br[b_idx + z])));
+  gates.r = sigmoid(add_rn(add_rn(Wx[Wx_idx + r], bx[b_idx + r]), add_rn(Rh[Rh_idx + r], br[b_idx + r])));
+  gates.Rh_g = add_rn(Rh[Rh_idx + g], br[b_idx + g]);
+  gates.g = tanh(add_rn(add_rn(Wx[Wx_idx + g], bx[b_idx + g]), mul_rn(gates.r, gates.Rh_g)));
+
+  const int one = 1 << kForgetBits;
+  gates.m = min(one, max(1, static_cast<int>(rint(mul_rn(gates.z, static_cast<T>(one))))));
+  const T one_minus_z = static_cast<T>(one - gates.m) / static_cast<T>(one);
+  gates.u = ToFixed(mul_rn(one_minus_z, gates.g));
+  return gates;
+}
+
+}  // namespace internal
+}  // namespace reversible_gru
+}  // namespace v0
+}  // namespace haste
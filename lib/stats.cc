@@ -0,0 +1,335 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "haste/stats.h"
+#include "phase_timer.h"
+
+#ifdef HASTE_ENABLE_STATS
+
+namespace {
+
+using haste::v0::stats::Layer;
+using haste::v0::stats::Phase;
+using haste::v0::stats::Stats;
+
+// Outstanding timings are resolved without blocking once this many have piled up.
+static constexpr size_t kMaxPending = 4096;
+
+struct Record {
+  Layer layer;
+  Phase phase;
+  int device;
+  int thread;
+  cudaEvent_t start;
+  cudaEvent_t stop;
+};
+
+struct TraceEvent {
+  Layer layer;
+  Phase phase;
+  int device;
+  int thread;
+  double begin_us;
+  double duration_us;
+};
+
+struct State {
+  std::mutex mutex;
+  Stats totals;
+  std::vector<Record> pending;
+  std::vector<cudaEvent_t> free_events;
+  std::map<int, cudaEvent_t> origin;  // per-device time zero of the trace
+  bool tracing;
+  std::vector<TraceEvent> trace;
+};
+
+std::atomic<int> g_next_thread(0);
+thread_local int g_thread = g_next_thread++;
+thread_local Layer g_layer = Layer::kLayerNorm;
+
+void WriteTraceAtExit();
+
+// Never destroyed: engines may still be torn down by other static destructors.
+State& GetState() {
+  static State* state = [] {
+    State* s = new State();
+    memset(&s->totals, 0, sizeof(s->totals));
+    const char* path = getenv("HASTE_TRACE");
+    s->tracing = path && *path;
+    if (s->tracing)
+      atexit(WriteTraceAtExit);
+    return s;
+  }();
+  return *state;
+}
+
+// Must be called with `state.mutex` held.
+cudaEvent_t NewEvent(State& state) {
+  if (state.free_events.empty()) {
+    cudaEvent_t event;
+    cudaEventCreate(&event);
+    return event;
+  }
+  cudaEvent_t event = state.free_events.back();
+  state.free_events.pop_back();
+  return event;
+}
+
+// Folds completed timings into the totals. With `wait` set, blocks until every pending
+// timing has completed. Must be called with `state.mutex` held.
+void Resolve(State& state, bool wait) {
+  size_t kept = 0;
+  for (size_t i = 0; i < state.pending.size(); ++i) {
+    const Record& record = state.pending[i];
+    if (wait)
+      cudaEventSynchronize(record.stop);
+    else if (cudaEventQuery(record.stop) != cudaSuccess) {
+      state.pending[kept++] = record;
+      continue;
+    }
+
+    float ms = 0.0f;
+    cudaEventElapsedTime(&ms, record.start, record.stop);
+    auto& phase = state.totals.phase[static_cast<int>(record.layer)][static_cast<int>(record.phase)];
+    phase.calls += 1;
+    phase.time_ms += ms;
+
+    if (state.tracing) {
+      float begin_ms = 0.0f;
+      cudaEventElapsedTime(&begin_ms, state.origin[record.device], record.start);
+      state.trace.push_back({
+          record.layer,
+          record.phase,
+          record.device,
+          record.thread,
+          begin_ms * 1000.0,
+          ms * 1000.0 });
+    }
+
+    state.free_events.push_back(record.start);
+    state.free_events.push_back(record.stop);
+  }
+  state.pending.resize(kept);
+}
+
+bool WriteTraceLocked(State& state, const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp)
+    return false;
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < state.trace.size(); ++i) {
+    const TraceEvent& event = state.trace[i];
+    fprintf(fp, "%s{\"name\":\"%s/%s\",\"cat\":\"haste\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f}\n",
+        i ? "," : "",
+        haste::v0::stats::LayerName(event.layer),
+        haste::v0::stats::PhaseName(event.phase),
+        event.device,
+        event.thread,
+        event.begin_us,
+        event.duration_us);
+  }
+  fprintf(fp, "]}\n");
+  return fclose(fp) == 0;
+}
+
+void WriteTraceAtExit() {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  Resolve(state, true);
+  WriteTraceLocked(state, getenv("HASTE_TRACE"));
+}
+
+}  // anonymous namespace
+
+namespace haste {
+namespace v0 {
+namespace stats {
+namespace internal {
+
+PhaseTimer::PhaseTimer(Layer layer, Phase phase, cudaStream_t stream)
+    : layer_(layer), phase_(phase), stream_(stream), running_(true) {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  start_ = NewEvent(state);
+  if (state.tracing) {
+    int device = 0;
+    cudaGetDevice(&device);
+    if (!state.origin.count(device)) {
+      cudaEvent_t origin = NewEvent(state);
+      cudaEventRecord(origin, stream);
+      state.origin[device] = origin;
+    }
+  }
+  cudaEventRecord(start_, stream);
+}
+
+PhaseTimer::PhaseTimer(Phase phase, cudaStream_t stream)
+    : PhaseTimer(g_layer, phase, stream) {
+}
+
+PhaseTimer::~PhaseTimer() {
+  Stop();
+}
+
+void PhaseTimer::Stop() {
+  if (!running_)
+    return;
+  running_ = false;
+
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  int device = 0;
+  cudaGetDevice(&device);
+  cudaEvent_t stop = NewEvent(state);
+  cudaEventRecord(stop, stream_);
+  state.pending.push_back({ layer_, phase_, device, g_thread, start_, stop });
+  if (state.pending.size() >= kMaxPending)
+    Resolve(state, false);
+}
+
+LayerScope::LayerScope(Layer layer) : saved_(g_layer) {
+  g_layer = layer;
+}
+
+LayerScope::~LayerScope() {
+  g_layer = saved_;
+}
+
+void RecordAllocation(size_t bytes) {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.totals.bytes_allocated += bytes;
+}
+
+}  // namespace internal
+
+bool Enabled() {
+  return true;
+}
+
+Stats GetStats() {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  Resolve(state, true);
+  return state.totals;
+}
+
+void ResetStats() {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  Resolve(state, true);
+  memset(&state.totals, 0, sizeof(state.totals));
+  state.trace.clear();
+}
+
+bool WriteTrace(const std::string& path) {
+  State& state = GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  Resolve(state, true);
+  return WriteTraceLocked(state, path);
+}
+
+}  // namespace stats
+}  // namespace v0
+}  // namespace haste
+
+#else  // HASTE_ENABLE_STATS
+
+namespace haste {
+namespace v0 {
+namespace stats {
+
+bool Enabled() {
+  return false;
+}
+
+Stats GetStats() {
+  Stats stats;
+  memset(&stats, 0, sizeof(stats));
+  return stats;
+}
+
+void ResetStats() {
+}
+
+bool WriteTrace(const std::string& /* path */) {
+  return false;
+}
+
+}  // namespace stats
+}  // namespace v0
+}  // namespace haste
+
+#endif  // HASTE_ENABLE_STATS
+
+namespace haste {
+namespace v0 {
+namespace stats {
+
+const char* LayerName(Layer layer) {
+  switch (layer) {
+    case Layer::kLstm:
+      return "lstm";
+    case Layer::kGru:
+      return "gru";
+    case Layer::kIndrnn:
+      return "indrnn";
+    case Layer::kLayerNorm:
+      return "layer_norm";
+    case Layer::kLayerNormLstm:
+      return "layer_norm_lstm";
+    case Layer::kLayerNormGru:
+      return "layer_norm_gru";
+    case Layer::kLayerNormIndrnn:
+      return "layer_norm_indrnn";
+    case Layer::kReversibleGru:
+      return "reversible_gru";
+    case Layer::kCell:
+      return "cell";
+    default:
+      return "unknown";
+  }
+}
+
+const char* PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::kInputGemm:
+      return "input_gemm";
+    case Phase::kRecurrentGemm:
+      return "recurrent_gemm";
+    case Phase::kPointwise:
+      return "pointwise";
+    case Phase::kLayerNorm:
+      return "layer_norm";
+    case Phase::kReduction:
+      return "reduction";
+    default:
+      return "unknown";
+  }
+}
+
+}  // namespace stats
+}  // namespace v0
+}  // namespace haste
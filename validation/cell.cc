@@ -0,0 +1,361 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+// Checks `cell::ForwardPass<Cifg>` and `cell::BackwardPass<Cifg>` against a host reference
+// in double precision, and the reference backward pass against central differences of
+// the loss sum(dh_new * h) + sum(dc_new * c). The gradients of the initial state are
+// where a cell that doesn't zero its direct `dh` (the path through `R` is added by the
+// engine) or that hands the wrong `dc` to the previous step shows up.
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+#include <functional>
+#include <unsupported/Eigen/CXX11/Tensor>
+
+#include "../examples/device_ptr.h"
+#include "haste.h"
+
+using haste::v0::cell::BackwardPass;
+using haste::v0::cell::Cifg;
+using haste::v0::cell::ForwardPass;
+
+using Tensor1 = Eigen::Tensor<double, 1>;
+using Tensor2 = Eigen::Tensor<double, 2>;
+using Tensor3 = Eigen::Tensor<double, 3>;
+
+constexpr int BATCH_SIZE = 4;
+constexpr int SEQUENCE_LEN = 6;
+constexpr int HIDDEN_DIMS = 8;
+constexpr int INPUT_DIMS = 5;
+constexpr int GATES = 3;  // [f,g,o], each HIDDEN_DIMS apart.
+
+double sigmoid(const double x) {
+  return 1.0 / (1.0 + std::exp(-x));
+}
+
+// h, c: (H,N,T+1) with the initial state in [:,:,0]. act: (H*G,N,T).
+void ReferenceForward(
+    const Tensor2& W,
+    const Tensor2& R,
+    const Tensor1& b,
+    const Tensor3& x,
+    Tensor3& h,
+    Tensor3& c,
+    Tensor3& act) {
+  const int H = HIDDEN_DIMS;
+  for (int t = 0; t < SEQUENCE_LEN; ++t) {
+    for (int n = 0; n < BATCH_SIZE; ++n) {
+      double pre[HIDDEN_DIMS * GATES];
+      for (int j = 0; j < H * GATES; ++j) {
+        pre[j] = b(j);
+        for (int k = 0; k < INPUT_DIMS; ++k)
+          pre[j] += W(j, k) * x(k, n, t);
+        for (int k = 0; k < H; ++k)
+          pre[j] += R(j, k) * h(k, n, t);
+      }
+      for (int u = 0; u < H; ++u) {
+        const double f = sigmoid(pre[u]);
+        const double g = std::tanh(pre[H + u]);
+        const double o = sigmoid(pre[2 * H + u]);
+        act(u, n, t) = f;
+        act(H + u, n, t) = g;
+        act(2 * H + u, n, t) = o;
+        c(u, n, t + 1) = f * c(u, n, t) + (1.0 - f) * g;
+        h(u, n, t + 1) = o * std::tanh(c(u, n, t + 1));
+      }
+    }
+  }
+}
+
+struct Gradients {
+  Tensor3 dx{INPUT_DIMS, BATCH_SIZE, SEQUENCE_LEN};
+  Tensor2 dW{HIDDEN_DIMS * GATES, INPUT_DIMS};
+  Tensor2 dR{HIDDEN_DIMS * GATES, HIDDEN_DIMS};
+  Tensor1 db{HIDDEN_DIMS * GATES};
+  Tensor2 dh{HIDDEN_DIMS, BATCH_SIZE};
+  Tensor2 dc{HIDDEN_DIMS, BATCH_SIZE};
+};
+
+void ReferenceBackward(
+    const Tensor2& W,
+    const Tensor2& R,
+    const Tensor3& x,
+    const Tensor3& h,
+    const Tensor3& c,
+    const Tensor3& act,
+    const Tensor3& dh_new,
+    const Tensor3& dc_new,
+    Gradients& grad) {
+  const int H = HIDDEN_DIMS;
+  grad.dx.setZero();
+  grad.dW.setZero();
+  grad.dR.setZero();
+  grad.db.setZero();
+  grad.dh.setZero();
+  grad.dc.setZero();
+
+  for (int t = SEQUENCE_LEN - 1; t >= 0; --t) {
+    for (int n = 0; n < BATCH_SIZE; ++n) {
+      double dpre[HIDDEN_DIMS * GATES];
+      for (int u = 0; u < H; ++u) {
+        const double f = act(u, n, t);
+        const double g = act(H + u, n, t);
+        const double o = act(2 * H + u, n, t);
+        const double c_tanh = std::tanh(c(u, n, t + 1));
+        const double dh = dh_new(u, n, t + 1) + grad.dh(u, n);
+        const double dc = grad.dc(u, n) + dc_new(u, n, t + 1) + dh * o * (1.0 - c_tanh * c_tanh);
+        dpre[u] = dc * (c(u, n, t) - g) * f * (1.0 - f);
+        dpre[H + u] = dc * (1.0 - f) * (1.0 - g * g);
+        dpre[2 * H + u] = dh * c_tanh * o * (1.0 - o);
+        grad.dc(u, n) = dc * f;
+      }
+      for (int k = 0; k < H; ++k) {
+        grad.dh(k, n) = 0.0;
+        for (int j = 0; j < H * GATES; ++j)
+          grad.dh(k, n) += R(j, k) * dpre[j];
+      }
+      for (int j = 0; j < H * GATES; ++j) {
+        grad.db(j) += dpre[j];
+        for (int k = 0; k < INPUT_DIMS; ++k) {
+          grad.dW(j, k) += x(k, n, t) * dpre[j];
+          grad.dx(k, n, t) += W(j, k) * dpre[j];
+        }
+        for (int k = 0; k < H; ++k)
+          grad.dR(j, k) += h(k, n, t) * dpre[j];
+      }
+    }
+  }
+}
+
+// Largest absolute difference, relative to the largest expected magnitude when that is
+// above 1.
+template<typename TensorT>
+double MaxError(const TensorT& actual, const TensorT& expected) {
+  double error = 0.0;
+  double scale = 1.0;
+  for (int i = 0; i < expected.size(); ++i) {
+    error = std::max(error, std::abs(actual.data()[i] - expected.data()[i]));
+    scale = std::max(scale, std::abs(expected.data()[i]));
+  }
+  return error / scale;
+}
+
+// Central differences of `loss` with respect to every element of `param`.
+template<typename TensorT>
+TensorT NumericalGradient(TensorT& param, const std::function<double()>& loss) {
+  constexpr double kEpsilon = 1e-6;
+  TensorT grad(param.dimensions());
+  for (int i = 0; i < param.size(); ++i) {
+    const double saved = param.data()[i];
+    param.data()[i] = saved + kEpsilon;
+    const double loss_plus = loss();
+    param.data()[i] = saved - kEpsilon;
+    const double loss_minus = loss();
+    param.data()[i] = saved;
+    grad.data()[i] = (loss_plus - loss_minus) / (2.0 * kEpsilon);
+  }
+  return grad;
+}
+
+template<typename TensorT>
+int Report(const char* what, const TensorT& actual, const TensorT& expected, const double tolerance) {
+  const double error = MaxError(actual, expected);
+  const bool ok = error <= tolerance;
+  printf("%s: %s (max error %g)\n", what, ok ? "ok" : "FAIL", error);
+  return !ok;
+}
+
+int main() {
+  srand(time(0));
+
+  const int H = HIDDEN_DIMS;
+  const int NH = BATCH_SIZE * H;
+
+  cublasHandle_t blas_handle;
+  cublasCreate(&blas_handle);
+
+  Tensor2 W(H * GATES, INPUT_DIMS);
+  Tensor2 R(H * GATES, H);
+  Tensor1 b(H * GATES);
+  Tensor3 x(INPUT_DIMS, BATCH_SIZE, SEQUENCE_LEN);
+  Tensor3 h(H, BATCH_SIZE, SEQUENCE_LEN + 1);
+  Tensor3 c(H, BATCH_SIZE, SEQUENCE_LEN + 1);
+  Tensor3 act(H * GATES, BATCH_SIZE, SEQUENCE_LEN);
+  Tensor3 dh_new(H, BATCH_SIZE, SEQUENCE_LEN + 1);
+  Tensor3 dc_new(H, BATCH_SIZE, SEQUENCE_LEN + 1);
+
+  W.setRandom();
+  R.setRandom();
+  b.setRandom();
+  x.setRandom();
+  dh_new.setRandom();
+  dc_new.setRandom();
+  W = W - 0.5;
+  R = R - 0.5;
+  b = b - 0.5;
+  x = x * 2.0 - 1.0;
+  h.setZero();
+  c.setZero();
+  {
+    Tensor2 h0(H, BATCH_SIZE);
+    Tensor2 c0(H, BATCH_SIZE);
+    h0.setRandom();
+    c0.setRandom();
+    h.chip(0, 2) = h0 * 2.0 - 1.0;
+    c.chip(0, 2) = c0 * 2.0 - 1.0;
+  }
+
+  // Engine forward pass.
+  device_ptr<Tensor2> W_dev(W);
+  device_ptr<Tensor2> R_dev(R);
+  device_ptr<Tensor1> b_dev(b);
+  device_ptr<Tensor3> x_dev(x);
+  device_ptr<Tensor3> h_dev(h);
+  device_ptr<Tensor3> c_dev(c);
+  device_ptr<Tensor3> v_dev(SEQUENCE_LEN * BATCH_SIZE * H * GATES);
+  device_ptr<Tensor2> tmp_Rh_dev(BATCH_SIZE * H * GATES);
+
+  {
+    ForwardPass<Cifg, double> forward(
+        true,  // training
+        BATCH_SIZE,
+        INPUT_DIMS,
+        H,
+        blas_handle);
+
+    forward.Run(
+        SEQUENCE_LEN,
+        W_dev.data,
+        R_dev.data,
+        b_dev.data,
+        x_dev.data,
+        h_dev.data,
+        c_dev.data,
+        v_dev.data,
+        tmp_Rh_dev.data);
+  }
+
+  Tensor3 h_engine(h.dimensions());
+  Tensor3 c_engine(c.dimensions());
+  h_dev.ToHost(h_engine);
+  c_dev.ToHost(c_engine);
+
+  // Engine backward pass.
+  Tensor2 W_t = W.shuffle(Eigen::array<int, 2>{ 1, 0 });
+  Tensor2 R_t = R.shuffle(Eigen::array<int, 2>{ 1, 0 });
+  Tensor3 x_t = x.shuffle(Eigen::array<int, 3>{ 1, 2, 0 });
+
+  device_ptr<Tensor2> W_t_dev(W_t);
+  device_ptr<Tensor2> R_t_dev(R_t);
+  device_ptr<Tensor3> x_t_dev(x_t);
+  device_ptr<Tensor3> dh_new_dev(dh_new);
+  device_ptr<Tensor3> dc_new_dev(dc_new);
+  device_ptr<Tensor3> dx_dev(SEQUENCE_LEN * BATCH_SIZE * INPUT_DIMS);
+  device_ptr<Tensor2> dW_dev(INPUT_DIMS * H * GATES);
+  device_ptr<Tensor2> dR_dev(H * H * GATES);
+  device_ptr<Tensor1> db_dev(H * GATES);
+  device_ptr<Tensor2> dh_dev(NH);
+  device_ptr<Tensor2> dc_dev(NH);
+  dh_dev.zero();
+  dc_dev.zero();
+
+  {
+    BackwardPass<Cifg, double> backward(
+        BATCH_SIZE,
+        INPUT_DIMS,
+        H,
+        blas_handle);
+
+    backward.Run(
+        SEQUENCE_LEN,
+        W_t_dev.data,
+        R_t_dev.data,
+        b_dev.data,
+        x_t_dev.data,
+        h_dev.data,
+        c_dev.data,
+        dh_new_dev.data,
+        dc_new_dev.data,
+        dx_dev.data,
+        dW_dev.data,
+        dR_dev.data,
+        db_dev.data,
+        dh_dev.data,
+        dc_dev.data,
+        v_dev.data);
+  }
+
+  Gradients engine;
+  dx_dev.ToHost(engine.dx);
+  dW_dev.ToHost(engine.dW);
+  dR_dev.ToHost(engine.dR);
+  db_dev.ToHost(engine.db);
+  dh_dev.ToHost(engine.dh);
+  dc_dev.ToHost(engine.dc);
+
+  // Host reference.
+  ReferenceForward(W, R, b, x, h, c, act);
+  Gradients reference;
+  ReferenceBackward(W, R, x, h, c, act, dh_new, dc_new, reference);
+
+  const double kEngineTolerance = 1e-9;
+  int failures = 0;
+  failures += Report("forward h matches the reference", h_engine, h, kEngineTolerance);
+  failures += Report("forward c matches the reference", c_engine, c, kEngineTolerance);
+  failures += Report("dx matches the reference", engine.dx, reference.dx, kEngineTolerance);
+  failures += Report("dW matches the reference", engine.dW, reference.dW, kEngineTolerance);
+  failures += Report("dR matches the reference", engine.dR, reference.dR, kEngineTolerance);
+  failures += Report("db matches the reference", engine.db, reference.db, kEngineTolerance);
+  failures += Report("dh (initial state, only through R) matches the reference", engine.dh, reference.dh, kEngineTolerance);
+  failures += Report("dc (initial state, handed back through f) matches the reference", engine.dc, reference.dc, kEngineTolerance);
+
+  // Check the reference itself so that the comparison above isn't circular.
+  Tensor2 h0 = h.chip(0, 2);
+  Tensor2 c0 = c.chip(0, 2);
+  auto loss = [&]() {
+    Tensor3 h_tmp(h.dimensions());
+    Tensor3 c_tmp(c.dimensions());
+    Tensor3 act_tmp(act.dimensions());
+    h_tmp.chip(0, 2) = h0;
+    c_tmp.chip(0, 2) = c0;
+    ReferenceForward(W, R, b, x, h_tmp, c_tmp, act_tmp);
+    double total = 0.0;
+    for (int t = 1; t <= SEQUENCE_LEN; ++t) {
+      for (int n = 0; n < BATCH_SIZE; ++n) {
+        for (int u = 0; u < H; ++u)
+          total += dh_new(u, n, t) * h_tmp(u, n, t) + dc_new(u, n, t) * c_tmp(u, n, t);
+      }
+    }
+    return total;
+  };
+
+  const double kNumericalTolerance = 1e-6;
+  failures += Report("reference dx matches central differences", reference.dx, NumericalGradient(x, loss), kNumericalTolerance);
+  failures += Report("reference dW matches central differences", reference.dW, NumericalGradient(W, loss), kNumericalTolerance);
+  failures += Report("reference dR matches central differences", reference.dR, NumericalGradient(R, loss), kNumericalTolerance);
+  failures += Report("reference db matches central differences", reference.db, NumericalGradient(b, loss), kNumericalTolerance);
+  failures += Report("reference dh matches central differences", reference.dh, NumericalGradient(h0, loss), kNumericalTolerance);
+  failures += Report("reference dc matches central differences", reference.dc, NumericalGradient(c0, loss), kNumericalTolerance);
+
+  cublasDestroy(blas_handle);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
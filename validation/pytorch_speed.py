@@ -1,20 +1,234 @@
+# Copyright 2020 LMNT, Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+
+"""
+Splits the time of a haste_pytorch layer call into engine time and wrapper
+overhead, and compares both against `torch.nn.LSTM` / `torch.nn.GRU` on the
+same device.
+
+The engine is whatever the layer dispatches to: the CUDA op on GPU, or the
+TorchScript-style reference loop (`LSTMScript` etc.) on CPU. Everything else in
+`forward` (permutes, `.contiguous()` copies, zoneout masks, weight dropout,
+state handling) is counted as wrapper overhead. On CPU, backward goes through
+autograd over the reference loop, so it is reported as a whole.
+
+Engine calls are bracketed by device synchronization to attribute their time,
+which removes some of the overlap an unprofiled run would get on GPU.
+"""
+
+import argparse
 import torch
+import torch.nn as nn
+import torch.nn.functional as F
 import haste_pytorch as haste
 
-from time import time
+from time import perf_counter
+
+
+# layer name: (haste class, haste module, CPU engine function, torch reference)
+RNN_MAP = {
+    'lstm': (haste.LSTM, haste.lstm, 'LSTMScript', nn.LSTM),
+    'gru': (haste.GRU, haste.gru, 'GRUScript', nn.GRU),
+    'indrnn': (haste.IndRNN, haste.indrnn, 'IndRNNScript', None),
+    'layer_norm_lstm': (haste.LayerNormLSTM, haste.layer_norm_lstm, 'LayerNormLSTMScript', nn.LSTM),
+    'layer_norm_gru': (haste.LayerNormGRU, haste.layer_norm_gru, 'LayerNormGRUScript', nn.GRU),
+    'layer_norm_indrnn': (haste.LayerNormIndRNN, haste.layer_norm_indrnn, 'LayerNormIndRNNScript', None),
+}
+
+
+def sync(device):
+  if device.type == 'cuda':
+    torch.cuda.synchronize(device)
+
+
+class EngineTimer:
+  """Accumulates the wall time spent inside a layer module's engine entry points."""
+
+  def __init__(self, device):
+    self.device = device
+    self.reset()
+
+  def reset(self):
+    self.forward = 0.0
+    self.backward = 0.0
+
+  def wrap(self, fn, phase):
+    def timed(*args, **kwargs):
+      sync(self.device)
+      start = perf_counter()
+      result = fn(*args, **kwargs)
+      sync(self.device)
+      setattr(self, phase, getattr(self, phase) + perf_counter() - start)
+      return result
+    return timed
+
+
+class TimedLibrary:
+  """Stands in for `haste_pytorch_lib` and times every `*_forward` / `*_backward` call."""
+
+  def __init__(self, lib, timer):
+    self._lib = lib
+    self._timer = timer
+
+  def __getattr__(self, name):
+    fn = getattr(self._lib, name)
+    return self._timer.wrap(fn, 'backward' if name.endswith('_backward') else 'forward')
+
+
+class patch_engine:
+  """Routes a layer module's engine calls through `timer` while active."""
+
+  def __init__(self, module, script_name, timer):
+    self.module = module
+    self.script_name = script_name
+    self.timer = timer
+
+  def __enter__(self):
+    self.lib = self.module.LIB
+    self.script = getattr(self.module, self.script_name)
+    self.module.LIB = TimedLibrary(self.lib, self.timer)
+    setattr(self.module, self.script_name, self.timer.wrap(self.script, 'forward'))
+
+  def __exit__(self, *exc):
+    self.module.LIB = self.lib
+    setattr(self.module, self.script_name, self.script)
+
+
+def time_call(fn, device, iterations):
+  """Average wall time of `fn` in milliseconds, after one warm-up call."""
+  fn()
+  sync(device)
+  start = perf_counter()
+  for _ in range(iterations):
+    fn()
+  sync(device)
+  return (perf_counter() - start) * 1000.0 / iterations
+
+
+def time_layer(rnn, x, device, iterations):
+  """Average forward and backward wall time of `rnn` in milliseconds."""
+  forward = 0.0
+  backward = 0.0
+  for i in range(iterations + 1):
+    sync(device)
+    start = perf_counter()
+    y, _ = rnn(x)
+    sync(device)
+    middle = perf_counter()
+    y.backward(torch.ones_like(y))
+    sync(device)
+    end = perf_counter()
+    if i:  # the first iteration is a warm-up
+      forward += middle - start
+      backward += end - middle
+  return forward * 1000.0 / iterations, backward * 1000.0 / iterations
+
+
+def wrapper_components(rnn, x, device, iterations):
+  """Times the pieces of `forward` that run outside the engine, one at a time."""
+  components = {}
+  components['permute'] = time_call(lambda: rnn._permute(x).contiguous(), device, iterations)
+  if rnn.zoneout:
+    components['zoneout'] = time_call(lambda: rnn._get_zoneout_mask(x), device, iterations)
+  if getattr(rnn, 'dropout', 0.0):
+    components['dropout'] = time_call(
+        lambda: F.dropout(rnn.recurrent_kernel, rnn.dropout, True).contiguous(), device, iterations)
+  return components
+
+
+def run(name, args, device):
+  rnn_class, module, script_name, reference_class = RNN_MAP[name]
+
+  kwargs = { 'batch_first': args.batch_first, 'zoneout': args.zoneout }
+  if args.dropout and rnn_class not in (haste.IndRNN, haste.LayerNormIndRNN):
+    kwargs['dropout'] = args.dropout
+  rnn = rnn_class(args.input_size, args.hidden_size, **kwargs).to(device)
+  rnn.train()
+
+  shape = [args.time_steps, args.batch_size, args.input_size]
+  if args.batch_first:
+    shape[0], shape[1] = shape[1], shape[0]
+  x = torch.rand(shape, device=device, requires_grad=True)
+
+  timer = EngineTimer(device)
+  with patch_engine(module, script_name, timer):
+    time_layer(rnn, x, device, 1)
+    timer.reset()
+    forward, backward = time_layer(rnn, x, device, args.iterations)
+  engine_forward = timer.forward * 1000.0 / args.iterations
+  engine_backward = timer.backward * 1000.0 / args.iterations
+
+  # Unpatched, for the numbers a user would actually see.
+  plain_forward, plain_backward = time_layer(rnn, x, device, args.iterations)
+  components = wrapper_components(rnn, x, device, args.iterations)
+
+  reference_forward = reference_backward = float('nan')
+  if reference_class is not None:
+    reference = reference_class(args.input_size, args.hidden_size, batch_first=args.batch_first).to(device)
+    reference.train()
+    reference_forward, reference_backward = time_layer(reference, x, device, args.iterations)
+
+  wrapper = forward - engine_forward
+  accounted = sum(components.values())
+  print(f'[{name}]')
+  print(f'  forward          {plain_forward:9.3f} ms')
+  print(f'    engine         {engine_forward:9.3f} ms  ({engine_forward / forward * 100:5.1f}%)')
+  print(f'    wrapper        {wrapper:9.3f} ms  ({wrapper / forward * 100:5.1f}%)')
+  for component, ms in components.items():
+    print(f'      {component:<12} {ms:9.3f} ms')
+  print(f'      {"other":<12} {max(wrapper - accounted, 0.0):9.3f} ms')
+  print(f'  backward         {plain_backward:9.3f} ms')
+  if device.type == 'cuda':
+    autograd = backward - engine_backward
+    print(f'    engine         {engine_backward:9.3f} ms  ({engine_backward / backward * 100:5.1f}%)')
+    print(f'    autograd       {autograd:9.3f} ms  ({autograd / backward * 100:5.1f}%)')
+  if reference_class is not None:
+    print(f'  torch.nn.{reference_class.__name__:<8} {reference_forward:9.3f} ms forward, {reference_backward:9.3f} ms backward')
+    print(f'  haste / torch    {plain_forward / reference_forward:9.2f}x forward, {plain_backward / reference_backward:9.2f}x backward')
+  print('')
+
 
+def main(args):
+  device = torch.device(args.device)
+  if args.threads:
+    torch.set_num_threads(args.threads)
 
-seq_len = 2500
-batch_size = 64
-input_size = 256
-hidden_size = 4096
+  print(f'# device={device} threads={torch.get_num_threads()} N={args.batch_size} '
+        f'C={args.input_size} H={args.hidden_size} T={args.time_steps} '
+        f'zoneout={args.zoneout} dropout={args.dropout} batch_first={args.batch_first}')
+  print('')
+  names = list(RNN_MAP.keys()) if args.rnn_type == 'all' else [args.rnn_type]
+  for name in names:
+    run(name, args, device)
 
-rnn = haste.IndRNN(input_size, hidden_size).cuda()
 
-x = torch.rand(seq_len, batch_size, input_size).cuda()
-start = time()
-for _ in range(10):
-  y, _ = rnn(x)
-  y.backward(torch.ones_like(y))
-end = time()
-print(f'{end-start}')
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument(
+      'rnn_type',
+      nargs='?',
+      default='all',
+      choices=list(RNN_MAP.keys()) + ['all'])
+  parser.add_argument('--device', default='cpu', help='cpu or cuda[:N] (default: cpu)')
+  parser.add_argument('--threads', type=int, default=0, help='torch intra-op threads (default: torch default)')
+  parser.add_argument('-N', '--batch_size', type=int, default=32)
+  parser.add_argument('-C', '--input_size', type=int, default=128)
+  parser.add_argument('-H', '--hidden_size', type=int, default=256)
+  parser.add_argument('-T', '--time_steps', type=int, default=100)
+  parser.add_argument('-i', '--iterations', type=int, default=10)
+  parser.add_argument('--zoneout', type=float, default=0.0)
+  parser.add_argument('--dropout', type=float, default=0.0)
+  parser.add_argument('--batch_first', action='store_true')
+  main(parser.parse_args())
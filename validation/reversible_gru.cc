@@ -0,0 +1,203 @@
+// Copyright 2020 LMNT, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ==============================================================================
+
+// Checks that the reversible GRU backward pass reconstructs the initial hidden state
+// bit-exactly from the final one. The two passes run on different streams, which is
+// where cuBLAS is allowed to pick different GEMM kernels, and the initial state has
+// elements outside [-1,1] so that the saturation in `ForwardPass::Run` is exercised too.
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cublas_v2.h>
+#include <cuda_runtime_api.h>
+#include <unsupported/Eigen/CXX11/Tensor>
+
+#include "../examples/device_ptr.h"
+#include "haste.h"
+
+using haste::v0::reversible_gru::BackwardPass;
+using haste::v0::reversible_gru::ForwardPass;
+
+using Tensor1 = Eigen::Tensor<float, 1>;
+using Tensor2 = Eigen::Tensor<float, 2>;
+using Tensor3 = Eigen::Tensor<float, 3>;
+using ByteTensor3 = Eigen::Tensor<uint8_t, 3>;
+
+constexpr int BATCH_SIZE = 32;
+constexpr int SEQUENCE_LEN = 500;
+constexpr int HIDDEN_DIMS = 256;
+constexpr int INPUT_DIMS = 128;
+
+int main() {
+  srand(time(0));
+
+  const int NH = BATCH_SIZE * HIDDEN_DIMS;
+
+  cublasHandle_t blas_handle;
+  cublasCreate(&blas_handle);
+
+  cudaStream_t forward_stream;
+  cudaStream_t backward_stream;
+  cudaStreamCreate(&forward_stream);
+  cudaStreamCreate(&backward_stream);
+
+  Tensor2 W(HIDDEN_DIMS * 3, INPUT_DIMS);
+  Tensor2 R(HIDDEN_DIMS * 3, HIDDEN_DIMS / 2);
+  Tensor1 bx(HIDDEN_DIMS * 3);
+  Tensor1 br(HIDDEN_DIMS * 3);
+  Tensor3 x(INPUT_DIMS, BATCH_SIZE, SEQUENCE_LEN);
+  Tensor2 h0(HIDDEN_DIMS, BATCH_SIZE);
+  Tensor3 dh_new(HIDDEN_DIMS, BATCH_SIZE, SEQUENCE_LEN + 1);
+
+  W.setRandom();
+  R.setRandom();
+  bx.setRandom();
+  br.setRandom();
+  x.setRandom();
+  h0.setRandom();
+  dh_new.setRandom();
+  W = W * 0.2f - 0.1f;
+  R = R * 0.2f - 0.1f;
+  h0 = h0 * 3.0f - 1.5f;
+
+  device_ptr<Tensor2> W_dev(W);
+  device_ptr<Tensor2> R_dev(R);
+  device_ptr<Tensor1> bx_dev(bx);
+  device_ptr<Tensor1> br_dev(br);
+  device_ptr<Tensor3> x_dev(x);
+  device_ptr<Tensor3> dh_new_dev(dh_new);
+  device_ptr<Tensor3> h_dev((SEQUENCE_LEN + 1) * NH);
+  device_ptr<ByteTensor3> remainder_dev(SEQUENCE_LEN * NH);
+  device_ptr<Tensor2> workspace_dev(NH * 11);
+
+  cudaMemcpy(h_dev.data, h0.data(), NH * sizeof(float), cudaMemcpyHostToDevice);
+
+  {
+    ForwardPass<float> forward(
+        true,  // training
+        BATCH_SIZE,
+        INPUT_DIMS,
+        HIDDEN_DIMS,
+        blas_handle,
+        forward_stream);
+
+    forward.Run(
+        SEQUENCE_LEN,
+        W_dev.data,
+        R_dev.data,
+        bx_dev.data,
+        br_dev.data,
+        x_dev.data,
+        h_dev.data,
+        remainder_dev.data,
+        workspace_dev.data);
+  }
+  cudaStreamSynchronize(forward_stream);
+
+  Tensor2 h_first(HIDDEN_DIMS, BATCH_SIZE);
+  Tensor2 h_last(HIDDEN_DIMS, BATCH_SIZE);
+  cudaMemcpy(h_first.data(), h_dev.data, NH * sizeof(float), cudaMemcpyDeviceToHost);
+  cudaMemcpy(h_last.data(), h_dev.data + SEQUENCE_LEN * NH, NH * sizeof(float), cudaMemcpyDeviceToHost);
+
+  // Scribble over the workspace so that a reconstruction that never happened can't pass.
+  cudaMemset(workspace_dev.data, 0xff, NH * 11 * sizeof(float));
+
+  device_ptr<Tensor3> dx_dev(SEQUENCE_LEN * BATCH_SIZE * INPUT_DIMS);
+  device_ptr<Tensor2> dW_dev(INPUT_DIMS * HIDDEN_DIMS * 3);
+  device_ptr<Tensor2> dR_dev(HIDDEN_DIMS / 2 * HIDDEN_DIMS * 3);
+  device_ptr<Tensor1> dbx_dev(HIDDEN_DIMS * 3);
+  device_ptr<Tensor1> dbr_dev(HIDDEN_DIMS * 3);
+  device_ptr<Tensor2> dh_dev(NH);
+  dW_dev.zero();
+  dR_dev.zero();
+  dbx_dev.zero();
+  dbr_dev.zero();
+  dh_dev.zero();
+
+  {
+    BackwardPass<float> backward(
+        BATCH_SIZE,
+        INPUT_DIMS,
+        HIDDEN_DIMS,
+        blas_handle,
+        backward_stream);
+
+    backward.Run(
+        SEQUENCE_LEN,
+        W_dev.data,
+        R_dev.data,
+        bx_dev.data,
+        br_dev.data,
+        x_dev.data,
+        h_dev.data + SEQUENCE_LEN * NH,
+        remainder_dev.data,
+        dh_new_dev.data,
+        dx_dev.data,
+        dW_dev.data,
+        dR_dev.data,
+        dbx_dev.data,
+        dbr_dev.data,
+        dh_dev.data,
+        workspace_dev.data);
+  }
+  cudaStreamSynchronize(backward_stream);
+
+  Tensor2 h_reconstructed(HIDDEN_DIMS, BATCH_SIZE);
+  cudaMemcpy(h_reconstructed.data(), workspace_dev.data, NH * sizeof(float), cudaMemcpyDeviceToHost);
+
+  int failures = 0;
+
+  int out_of_range = 0;
+  for (int i = 0; i < NH; ++i) {
+    const float expected = std::min(std::max(h0.data()[i], -1.0f), 1.0f);
+    if (std::abs(h_first.data()[i]) > 1.0f || std::abs(h_first.data()[i] - expected) > 1e-6f)
+      ++out_of_range;
+  }
+  printf("initial state saturated to [-1,1]: %s (%d of %d elements wrong)\n",
+      out_of_range ? "FAIL" : "ok", out_of_range, NH);
+  failures += !!out_of_range;
+
+  int mismatches = 0;
+  float max_error = 0.0f;
+  for (int i = 0; i < NH; ++i) {
+    if (memcmp(&h_reconstructed.data()[i], &h_first.data()[i], sizeof(float))) {
+      ++mismatches;
+      max_error = std::max(max_error, std::abs(h_reconstructed.data()[i] - h_first.data()[i]));
+    }
+  }
+  printf("initial state reconstructed after %d steps: %s (%d of %d elements differ, max error %g)\n",
+      SEQUENCE_LEN, mismatches ? "FAIL" : "ok", mismatches, NH, max_error);
+  failures += !!mismatches;
+
+  // Guard against a degenerate run where the state collapsed and there was nothing to undo.
+  float drift = 0.0f;
+  for (int i = 0; i < NH; ++i)
+    drift = std::max(drift, std::abs(h_last.data()[i] - h_first.data()[i]));
+  printf("final state moved away from the initial state: %s (max difference %g)\n",
+      drift > 0.0f ? "ok" : "FAIL", drift);
+  failures += drift == 0.0f;
+
+  cudaStreamDestroy(forward_stream);
+  cudaStreamDestroy(backward_stream);
+  cublasDestroy(blas_handle);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
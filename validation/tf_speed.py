@@ -0,0 +1,233 @@
+# Copyright 2020 LMNT, Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+
+"""
+TensorFlow counterpart of `pytorch_speed.py`: splits the time of an eager
+haste_tf layer call into engine time (the `haste_*` / `haste_*_grad` ops) and
+wrapper overhead (batch-major transposes, weight transforms, zoneout masks,
+weight dropout, state gathering), and compares against the Keras LSTM / GRU
+layers on the same device.
+
+haste_tf only registers GPU kernels, so this runs on the default GPU. Reading
+back an op's outputs is used to synchronize around it, which removes some of
+the overlap an unprofiled run would get.
+"""
+
+import argparse
+import os
+import tensorflow as tf
+import haste_tf as haste
+
+from time import perf_counter
+
+
+# layer name: (haste class, haste module, Keras reference)
+RNN_MAP = {
+    'lstm': (haste.LSTM, haste.lstm, tf.keras.layers.LSTM),
+    'gru': (haste.GRU, haste.gru, tf.keras.layers.GRU),
+    'indrnn': (haste.IndRNN, haste.indrnn, None),
+    'layer_norm_lstm': (haste.LayerNormLSTM, haste.layer_norm_lstm, tf.keras.layers.LSTM),
+    'layer_norm_gru': (haste.LayerNormGRU, haste.layer_norm_gru, tf.keras.layers.GRU),
+    'layer_norm_indrnn': (haste.LayerNormIndRNN, haste.layer_norm_indrnn, None),
+}
+
+
+def stfu():
+  os.environ['TF_CPP_MIN_LOG_LEVEL'] = '4'
+  tf.compat.v1.logging.set_verbosity(tf.compat.v1.logging.ERROR)
+
+
+def sync(tensors):
+  """Blocks until every tensor in the nested structure `tensors` has been computed."""
+  for tensor in tf.nest.flatten(tensors):
+    if isinstance(tensor, (tf.Tensor, tf.Variable)) and tensor.shape.num_elements():
+      tf.reshape(tensor, [-1])[:1].numpy()
+
+
+class EngineTimer:
+  """Accumulates the wall time spent inside a layer module's haste ops."""
+
+  def __init__(self):
+    self.reset()
+
+  def reset(self):
+    self.forward = 0.0
+    self.backward = 0.0
+
+  def wrap(self, fn, phase):
+    def timed(*args, **kwargs):
+      sync((args, kwargs))
+      start = perf_counter()
+      result = fn(*args, **kwargs)
+      sync(result)
+      setattr(self, phase, getattr(self, phase) + perf_counter() - start)
+      return result
+    return timed
+
+
+class TimedLibrary:
+  """Stands in for the loaded op library and times every `haste_*` op."""
+
+  def __init__(self, lib, timer):
+    self._lib = lib
+    self._timer = timer
+
+  def __getattr__(self, name):
+    fn = getattr(self._lib, name)
+    if not name.startswith('haste_'):
+      return fn
+    return self._timer.wrap(fn, 'backward' if name.endswith('_grad') else 'forward')
+
+
+class patch_engine:
+  """Routes a layer module's op calls (including its registered gradients) through `timer`."""
+
+  def __init__(self, module, timer):
+    self.module = module
+    self.timer = timer
+
+  def __enter__(self):
+    self.lib = self.module.LIB
+    self.module.LIB = TimedLibrary(self.lib, self.timer)
+
+  def __exit__(self, *exc):
+    self.module.LIB = self.lib
+
+
+def time_call(fn, iterations):
+  """Average wall time of `fn` in milliseconds, after one warm-up call."""
+  sync(fn())
+  start = perf_counter()
+  for _ in range(iterations):
+    result = fn()
+  sync(result)
+  return (perf_counter() - start) * 1000.0 / iterations
+
+
+def time_layer(call, variables, x, iterations):
+  """Average forward and backward wall time of `call(x)` in milliseconds."""
+  forward = 0.0
+  backward = 0.0
+  for i in range(iterations + 1):
+    sync(x)
+    start = perf_counter()
+    with tf.GradientTape() as tape:
+      tape.watch(x)
+      y = call(x)
+      sync(y)
+    middle = perf_counter()
+    grads = tape.gradient(y, [x] + variables)
+    sync(grads)
+    end = perf_counter()
+    if i:  # the first iteration is a warm-up
+      forward += middle - start
+      backward += end - middle
+  return forward * 1000.0 / iterations, backward * 1000.0 / iterations
+
+
+def wrapper_components(rnn, x, iterations):
+  """Times the pieces of `__call__` that run outside the haste op, one at a time."""
+  layer = rnn.fw_layer
+  components = {}
+  components['transpose'] = time_call(lambda: tf.transpose(x, [1, 0, 2]), iterations) * 2
+  components['weights'] = time_call(layer.get_weights, iterations)
+  if layer.zoneout:
+    shape = [x.shape[1], x.shape[0], layer.num_units]
+    components['zoneout'] = time_call(
+        lambda: tf.floor(1.0 - layer.zoneout + tf.random.uniform(shape, dtype=layer.dtype)), iterations)
+  if getattr(layer, 'dropout', 0.0):
+    recurrent_kernel = layer.get_weights()['recurrent_kernel']
+    components['dropout'] = time_call(
+        lambda: tf.nn.dropout(recurrent_kernel, rate=layer.dropout), iterations)
+  return components
+
+
+def run(name, args):
+  rnn_class, module, reference_class = RNN_MAP[name]
+
+  kwargs = { 'zoneout': args.zoneout }
+  if args.dropout and rnn_class not in (haste.IndRNN, haste.LayerNormIndRNN):
+    kwargs['dropout'] = args.dropout
+  rnn = rnn_class(args.hidden_size, **kwargs)
+
+  x = tf.random.uniform([args.batch_size, args.time_steps, args.input_size])
+  rnn.build(x.shape)
+  variables = list(rnn.trainable_variables)
+  call = lambda x: rnn(x, training=True)[0]
+
+  timer = EngineTimer()
+  with patch_engine(module, timer):
+    time_layer(call, variables, x, 1)
+    timer.reset()
+    forward, backward = time_layer(call, variables, x, args.iterations)
+  engine_forward = timer.forward * 1000.0 / args.iterations
+  engine_backward = timer.backward * 1000.0 / args.iterations
+
+  # Unpatched, for the numbers a user would actually see.
+  plain_forward, plain_backward = time_layer(call, variables, x, args.iterations)
+  components = wrapper_components(rnn, x, args.iterations)
+
+  if reference_class is not None:
+    reference = reference_class(args.hidden_size, return_sequences=True)
+    reference.build(x.shape)
+    reference_forward, reference_backward = time_layer(
+        lambda x: reference(x, training=True), list(reference.trainable_variables), x, args.iterations)
+
+  wrapper = forward - engine_forward
+  autograd = backward - engine_backward
+  accounted = sum(components.values())
+  print(f'[{name}]')
+  print(f'  forward          {plain_forward:9.3f} ms')
+  print(f'    engine         {engine_forward:9.3f} ms  ({engine_forward / forward * 100:5.1f}%)')
+  print(f'    wrapper        {wrapper:9.3f} ms  ({wrapper / forward * 100:5.1f}%)')
+  for component, ms in components.items():
+    print(f'      {component:<12} {ms:9.3f} ms')
+  print(f'      {"other":<12} {max(wrapper - accounted, 0.0):9.3f} ms')
+  print(f'  backward         {plain_backward:9.3f} ms')
+  print(f'    engine         {engine_backward:9.3f} ms  ({engine_backward / backward * 100:5.1f}%)')
+  print(f'    tape           {autograd:9.3f} ms  ({autograd / backward * 100:5.1f}%)')
+  if reference_class is not None:
+    print(f'  keras.{reference_class.__name__:<10} {reference_forward:9.3f} ms forward, {reference_backward:9.3f} ms backward')
+    print(f'  haste / keras    {plain_forward / reference_forward:9.2f}x forward, {plain_backward / reference_backward:9.2f}x backward')
+  print('')
+
+
+def main(args):
+  tf.compat.v1.enable_eager_execution()
+  stfu()
+
+  print(f'# device={tf.test.gpu_device_name()} N={args.batch_size} C={args.input_size} '
+        f'H={args.hidden_size} T={args.time_steps} zoneout={args.zoneout} dropout={args.dropout}')
+  print('')
+  names = list(RNN_MAP.keys()) if args.rnn_type == 'all' else [args.rnn_type]
+  for name in names:
+    run(name, args)
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument(
+      'rnn_type',
+      nargs='?',
+      default='all',
+      choices=list(RNN_MAP.keys()) + ['all'])
+  parser.add_argument('-N', '--batch_size', type=int, default=32)
+  parser.add_argument('-C', '--input_size', type=int, default=128)
+  parser.add_argument('-H', '--hidden_size', type=int, default=256)
+  parser.add_argument('-T', '--time_steps', type=int, default=100)
+  parser.add_argument('-i', '--iterations', type=int, default=10)
+  parser.add_argument('--zoneout', type=float, default=0.0)
+  parser.add_argument('--dropout', type=float, default=0.0)
+  main(parser.parse_args())